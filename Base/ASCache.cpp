@@ -0,0 +1,250 @@
+#include "Common.h"
+#include "ASCache.h"
+
+#include <filesystem>
+#include <fstream>
+
+// Every cache file starts with this header, followed by the data written by vkCmdCopyAccelerationStructureToMemoryKHR
+struct ASCacheHeader
+{
+    uint32_t Magic = 0x53415256; // "VRAS"
+    uint32_t Version = 1;
+    uint64_t Key = 0;
+    uint64_t DataSize = 0;
+};
+
+// the serialized data has to be placed at 256 byte aligned addresses
+static constexpr vk::DeviceSize SerializedDataAlignment = 256;
+
+static vk::DeviceAddress AlignAddress(vk::DeviceAddress address)
+{
+    return (address + SerializedDataAlignment - 1) & ~(SerializedDataAlignment - 1);
+}
+
+// 64 bit FNV-1a, fast and good enough to tell geometries apart
+static uint64_t HashBytes(const void* data, size_t size, uint64_t hash)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+void ASCache::Create(vr::VulrayDevice* vrDev, vk::Device device, vk::PhysicalDevice physicalDevice, const std::string& directory)
+{
+    mVRDev = vrDev;
+    mDevice = device;
+    mDirectory = directory;
+
+    // [POI]
+    // A BLAS serialized by a different device or driver version can't be used, so their UUIDs are part of every key
+    auto properties = physicalDevice.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceIDProperties>();
+    auto& idProperties = properties.get<vk::PhysicalDeviceIDProperties>();
+
+    mDeviceHash = 0xcbf29ce484222325ull;
+    mDeviceHash = HashBytes(idProperties.deviceUUID.data(), VK_UUID_SIZE, mDeviceHash);
+    mDeviceHash = HashBytes(idProperties.driverUUID.data(), VK_UUID_SIZE, mDeviceHash);
+
+    std::error_code error;
+    std::filesystem::create_directories(mDirectory, error);
+}
+
+void ASCache::Destroy()
+{
+    FinishLoad();
+}
+
+uint64_t ASCache::ComputeKey(const Scene& scene, const Mesh& mesh, vk::BuildAccelerationStructureFlagsKHR flags) const
+{
+    uint64_t hash = mDeviceHash;
+
+    auto flagBits = static_cast<VkBuildAccelerationStructureFlagsKHR>(flags);
+    hash = HashBytes(&flagBits, sizeof(flagBits), hash);
+    hash = HashBytes(&mesh.Transform, sizeof(mesh.Transform), hash);
+
+    for (auto geomRef : mesh.GeometryReferences)
+    {
+        auto& geom = scene.Geometries[geomRef];
+
+        uint64_t counts[2] = {geom.Vertices.size(), geom.Indices.size()};
+        hash = HashBytes(counts, sizeof(counts), hash);
+
+        // only the positions end up in the BLAS, the normals can change without invalidating it
+        for (auto& vertex : geom.Vertices)
+            hash = HashBytes(&vertex.Position, sizeof(vertex.Position), hash);
+        hash = HashBytes(geom.Indices.data(), geom.Indices.size() * sizeof(uint32_t), hash);
+    }
+
+    return hash;
+}
+
+std::string ASCache::GetPath(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.blas", static_cast<unsigned long long>(key));
+    return (std::filesystem::path(mDirectory) / name).string();
+}
+
+bool ASCache::Load(uint64_t key, const vr::BLASHandle& blas, vk::CommandBuffer cmd)
+{
+    std::ifstream file(GetPath(key), std::ios::binary);
+    if (!file)
+        return false;
+
+    ASCacheHeader header = {};
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!file || header.Magic != ASCacheHeader().Magic || header.Version != ASCacheHeader().Version || header.Key != key)
+        return false;
+
+    // the serialized data starts with the driver UUID, the compatibility UUID, the serialized size and the deserialized size
+    constexpr size_t versionSize = 2 * VK_UUID_SIZE;
+    if (header.DataSize < versionSize + 2 * sizeof(uint64_t))
+        return false;
+
+    std::vector<uint8_t> data(header.DataSize);
+    file.read(reinterpret_cast<char*>(data.data()), data.size());
+    if (!file)
+        return false;
+
+    // [POI]
+    // Ask the driver if it can deserialize the data, if not the BLAS is built instead
+    auto versionInfo = vk::AccelerationStructureVersionInfoKHR().setPVersionData(data.data());
+    if (mDevice.getAccelerationStructureCompatibilityKHR(versionInfo) != vk::AccelerationStructureCompatibilityKHR::eCompatible)
+    {
+        std::cout << "AS cache entry " << GetPath(key) << " is incompatible with this driver, rebuilding" << std::endl;
+        return false;
+    }
+
+    uint64_t deserializedSize = 0;
+    memcpy(&deserializedSize, data.data() + versionSize + sizeof(uint64_t), sizeof(uint64_t));
+    if (deserializedSize > blas.Buffer.Size)
+        return false;
+
+    auto& upload = mUploadBuffers.emplace_back(mVRDev->CreateBuffer(
+        data.size() + SerializedDataAlignment,
+        vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer,
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT));
+
+    vk::DeviceAddress srcAddress = AlignAddress(upload.DevAddress);
+    char* mapped = (char*)mVRDev->MapBuffer(upload);
+    memcpy(mapped + (srcAddress - upload.DevAddress), data.data(), data.size());
+    mVRDev->UnmapBuffer(upload);
+
+    // [POI]
+    // Deserializing is a copy, much faster than a build and it doesn't need a scratch buffer
+    auto copyInfo = vk::CopyMemoryToAccelerationStructureInfoKHR()
+                        .setSrc(vk::DeviceOrHostAddressConstKHR(srcAddress))
+                        .setDst(blas.AccelerationStructure)
+                        .setMode(vk::CopyAccelerationStructureModeKHR::eDeserialize);
+    cmd.copyMemoryToAccelerationStructureKHR(copyInfo);
+
+    mLoadedCount++;
+    return true;
+}
+
+void ASCache::FinishLoad()
+{
+    for (auto& buffer : mUploadBuffers)
+        mVRDev->DestroyBuffer(buffer);
+    mUploadBuffers.clear();
+}
+
+void ASCache::Store(const std::vector<uint64_t>& keys, const std::vector<const vr::BLASHandle*>& blases, vk::CommandPool pool, vk::Queue queue)
+{
+    if (blases.empty())
+        return;
+
+    uint32_t count = static_cast<uint32_t>(blases.size());
+
+    std::vector<vk::AccelerationStructureKHR> accelerationStructures;
+    for (auto* blas : blases)
+        accelerationStructures.push_back(blas->AccelerationStructure);
+
+    auto queryPool = mDevice.createQueryPool(vk::QueryPoolCreateInfo()
+                                                 .setQueryType(vk::QueryType::eAccelerationStructureSerializationSizeKHR)
+                                                 .setQueryCount(count));
+
+    auto cmd = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(pool, vk::CommandBufferLevel::ePrimary, 1))[0];
+    auto submitInfo = vk::SubmitInfo().setCommandBufferCount(1).setPCommandBuffers(&cmd);
+
+    // [POI]
+    // First get the serialized sizes, the BLASes have to be built for this
+    cmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+    cmd.resetQueryPool(queryPool, 0, count);
+    cmd.writeAccelerationStructuresPropertiesKHR(accelerationStructures, vk::QueryType::eAccelerationStructureSerializationSizeKHR, queryPool, 0);
+    cmd.end();
+
+    queue.submit(submitInfo, nullptr);
+    queue.waitIdle();
+
+    std::vector<uint64_t> sizes(count);
+    auto _ = mDevice.getQueryPoolResults(queryPool, 0, count, sizes.size() * sizeof(uint64_t), sizes.data(), sizeof(uint64_t),
+                                         vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+
+    mDevice.destroyQueryPool(queryPool);
+
+    // every BLAS gets an aligned range of one readback buffer
+    std::vector<vk::DeviceSize> offsets(count);
+    vk::DeviceSize totalSize = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        offsets[i] = totalSize;
+        totalSize = AlignAddress(totalSize + sizes[i]);
+    }
+
+    auto readback = mVRDev->CreateBuffer(
+        totalSize + SerializedDataAlignment,
+        vk::BufferUsageFlagBits::eStorageBuffer,
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT);
+    vk::DeviceAddress baseAddress = AlignAddress(readback.DevAddress);
+
+    cmd.reset();
+    cmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+    for (uint32_t i = 0; i < count; i++)
+    {
+        auto copyInfo = vk::CopyAccelerationStructureToMemoryInfoKHR()
+                            .setSrc(accelerationStructures[i])
+                            .setDst(vk::DeviceOrHostAddressKHR(baseAddress + offsets[i]))
+                            .setMode(vk::CopyAccelerationStructureModeKHR::eSerialize);
+        cmd.copyAccelerationStructureToMemoryKHR(copyInfo);
+    }
+
+    // make the copies visible to the host
+    auto barrier = vk::MemoryBarrier()
+                       .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR | vk::AccessFlagBits::eTransferWrite)
+                       .setDstAccessMask(vk::AccessFlagBits::eHostRead);
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::PipelineStageFlagBits::eHost,
+                        {}, barrier, nullptr, nullptr);
+    cmd.end();
+
+    queue.submit(submitInfo, nullptr);
+    queue.waitIdle();
+
+    const char* mapped = (const char*)mVRDev->MapBuffer(readback);
+    mapped += baseAddress - readback.DevAddress;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        std::ofstream file(GetPath(keys[i]), std::ios::binary | std::ios::trunc);
+        if (!file)
+        {
+            VULRAY_FLOG_ERROR("Failed to write acceleration structure cache file %s", GetPath(keys[i]).c_str());
+            continue;
+        }
+
+        ASCacheHeader header = {};
+        header.Key = keys[i];
+        header.DataSize = sizes[i];
+
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(mapped + offsets[i], sizes[i]);
+    }
+
+    mVRDev->UnmapBuffer(readback);
+    mVRDev->DestroyBuffer(readback);
+
+    mDevice.freeCommandBuffers(pool, cmd);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "Common.h"
+#include "MeshLoader.h"
+
+// Caches serialized BLASes on disk, so the next run can copy them into place instead of building them
+// The key of a BLAS is a hash of its geometry, its build flags and the device / driver UUIDs,
+// Vulkan checks the compatibility of the serialized data as well, if anything doesn't match the BLAS is built as usual
+class ASCache
+{
+public:
+    void Create(vr::VulrayDevice* vrDev, vk::Device device, vk::PhysicalDevice physicalDevice, const std::string& directory = "ASCache");
+
+    void Destroy();
+
+    // Hashes the vertex positions, indices and transforms of the geometries of the mesh, together with the build flags
+    uint64_t ComputeKey(const Scene& scene, const Mesh& mesh, vk::BuildAccelerationStructureFlagsKHR flags) const;
+
+    // Records the deserialization of a cached BLAS into cmd
+    // returns false if there is no compatible entry, then the BLAS has to be built
+    // the BLAS has to be created with CreateBLAS(...) from the same create info, so it is large enough
+    bool Load(uint64_t key, const vr::BLASHandle& blas, vk::CommandBuffer cmd);
+
+    // Destroys the buffers used by Load(...), call after its command buffer has finished executing
+    void FinishLoad();
+
+    // Serializes built BLASes and writes them to the cache, blocks until the copies are done
+    void Store(const std::vector<uint64_t>& keys, const std::vector<const vr::BLASHandle*>& blases, vk::CommandPool pool, vk::Queue queue);
+
+    uint32_t GetLoadedCount() const { return mLoadedCount; }
+
+private:
+    std::string GetPath(uint64_t key) const;
+
+    vr::VulrayDevice* mVRDev = nullptr;
+    vk::Device mDevice = nullptr;
+
+    std::string mDirectory;
+
+    // hash of the device and driver UUIDs, the base of every key
+    uint64_t mDeviceHash = 0;
+
+    std::vector<vr::AllocatedBuffer> mUploadBuffers;
+    uint32_t mLoadedCount = 0;
+};
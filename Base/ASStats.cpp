@@ -0,0 +1,221 @@
+#include "Common.h"
+#include "ASStats.h"
+
+#include <fstream>
+
+void ASStats::Create(vk::Device device, vk::PhysicalDevice physicalDevice, uint32_t maxTimedBuilds)
+{
+    mDevice = device;
+    mMaxTimedBuilds = maxTimedBuilds;
+    mTimestampPeriod = physicalDevice.getProperties().limits.timestampPeriod;
+
+    mQueryPool = mDevice.createQueryPool(vk::QueryPoolCreateInfo()
+                                             .setQueryType(vk::QueryType::eTimestamp)
+                                             .setQueryCount(maxTimedBuilds * 2));
+}
+
+void ASStats::Destroy()
+{
+    if (mQueryPool)
+        mDevice.destroyQueryPool(mQueryPool);
+    mQueryPool = nullptr;
+}
+
+uint32_t ASStats::AddBLAS(const std::string& name, uint64_t primitiveCount, const vk::AccelerationStructureBuildSizesInfoKHR& sizes)
+{
+    auto& entry = mEntries.emplace_back(Entry{});
+    entry.Name = name;
+    entry.PrimitiveCount = primitiveCount;
+    entry.Size = sizes.accelerationStructureSize;
+    entry.BuildScratchSize = sizes.buildScratchSize;
+    entry.UpdateScratchSize = sizes.updateScratchSize;
+    return static_cast<uint32_t>(mEntries.size() - 1);
+}
+
+uint32_t ASStats::AddBLAS(const std::string& name, const vr::BLASCreateInfo& info, const vr::BLASBuildInfo& buildInfo)
+{
+    uint64_t primitiveCount = 0;
+    for (auto& geom : info.Geometries)
+        primitiveCount += geom.PrimitiveCount;
+    return AddBLAS(name, primitiveCount, buildInfo.BuildSizes);
+}
+
+uint32_t ASStats::AddTLAS(const std::string& name, uint32_t instanceCount, const vr::TLASBuildInfo& buildInfo)
+{
+    uint32_t id = AddBLAS(name, instanceCount, buildInfo.BuildSizes);
+    mEntries[id].TopLevel = true;
+    return id;
+}
+
+void ASStats::SetCompactedSize(uint32_t id, vk::DeviceSize size)
+{
+    mEntries[id].CompactedSize = size;
+}
+
+uint32_t ASStats::BeginBuild(vk::CommandBuffer cmd, const std::vector<uint32_t>& ids)
+{
+    uint32_t build = static_cast<uint32_t>(mBuilds.size());
+    mBuilds.push_back(TimedBuild{ids});
+
+    // builds past the capacity of the query pool are counted but not timed
+    if (build >= mMaxTimedBuilds)
+        return build;
+
+    cmd.resetQueryPool(mQueryPool, build * 2, 2);
+    cmd.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, mQueryPool, build * 2);
+    return build;
+}
+
+void ASStats::EndBuild(vk::CommandBuffer cmd, uint32_t build)
+{
+    if (build >= mMaxTimedBuilds)
+        return;
+
+    cmd.writeTimestamp(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, mQueryPool, build * 2 + 1);
+}
+
+// names are file and node names, only quotes, backslashes and control characters need escaping
+static std::string EscapeJSON(const std::string& text)
+{
+    std::string escaped;
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        if (static_cast<unsigned char>(c) < 0x20)
+            continue;
+        escaped += c;
+    }
+    return escaped;
+}
+
+bool ASStats::WriteJSON(const std::string& path)
+{
+    // [POI]
+    // The timestamps are read without waiting, the builds have finished by the time a sample is done creating its acceleration structures
+    uint32_t timedCount = std::min(static_cast<uint32_t>(mBuilds.size()), mMaxTimedBuilds);
+    std::vector<uint64_t> results(timedCount * 4); // value and availability of both timestamps
+    if (timedCount > 0)
+    {
+        auto _ = mDevice.getQueryPoolResults(mQueryPool, 0, timedCount * 2, results.size() * sizeof(uint64_t), results.data(), sizeof(uint64_t) * 2,
+                                             vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWithAvailability);
+    }
+
+    for (uint32_t i = 0; i < timedCount; i++)
+    {
+        uint64_t* start = &results[i * 4];
+        uint64_t* end = &results[i * 4 + 2];
+        if (!start[1] || !end[1])
+            continue;
+
+        mBuilds[i].Ms = (end[0] - start[0]) * mTimestampPeriod / 1000000.0;
+        if (mBuilds[i].Ids.size() == 1)
+            mEntries[mBuilds[i].Ids[0]].BuildMs = mBuilds[i].Ms;
+    }
+
+    std::ofstream file(path, std::ios::trunc);
+    if (!file)
+    {
+        VULRAY_FLOG_ERROR("Failed to write acceleration structure stats to %s", path.c_str());
+        return false;
+    }
+
+    struct Totals
+    {
+        uint32_t Count = 0;
+        uint64_t Primitives = 0;
+        vk::DeviceSize Size = 0;          // final sizes, compacted if compacted
+        vk::DeviceSize BuildScratchSize = 0;
+        vk::DeviceSize UpdateScratchSize = 0;
+    } blasTotals, tlasTotals;
+
+    auto writeEntry = [&](const Entry& entry, bool last) {
+        vk::DeviceSize finalSize = entry.CompactedSize > 0 ? entry.CompactedSize : entry.Size;
+
+        file << "    {\"name\": \"" << EscapeJSON(entry.Name) << "\""
+             << ", \"" << (entry.TopLevel ? "instances" : "primitives") << "\": " << entry.PrimitiveCount
+             << ", \"size\": " << entry.Size
+             << ", \"buildScratchSize\": " << entry.BuildScratchSize
+             << ", \"updateScratchSize\": " << entry.UpdateScratchSize
+             << ", \"compactedSize\": " << entry.CompactedSize
+             << ", \"" << (entry.TopLevel ? "bytesPerInstance" : "bytesPerPrimitive") << "\": "
+             << (entry.PrimitiveCount > 0 ? static_cast<double>(finalSize) / entry.PrimitiveCount : 0.0)
+             << ", \"buildMs\": ";
+        if (entry.BuildMs >= 0.0)
+            file << entry.BuildMs;
+        else
+            file << "null";
+        file << "}" << (last ? "" : ",") << "\n";
+
+        auto& totals = entry.TopLevel ? tlasTotals : blasTotals;
+        totals.Count++;
+        totals.Primitives += entry.PrimitiveCount;
+        totals.Size += finalSize;
+        totals.BuildScratchSize += entry.BuildScratchSize;
+        totals.UpdateScratchSize += entry.UpdateScratchSize;
+    };
+
+    auto writeEntries = [&](bool topLevel) {
+        std::vector<const Entry*> entries;
+        for (auto& entry : mEntries)
+        {
+            if (entry.TopLevel == topLevel)
+                entries.push_back(&entry);
+        }
+        for (size_t i = 0; i < entries.size(); i++)
+            writeEntry(*entries[i], i + 1 == entries.size());
+    };
+
+    auto writeTotals = [&](const Totals& totals, const char* primitiveName) {
+        file << "{\"count\": " << totals.Count
+             << ", \"" << primitiveName << "\": " << totals.Primitives
+             << ", \"size\": " << totals.Size
+             << ", \"buildScratchSize\": " << totals.BuildScratchSize
+             << ", \"updateScratchSize\": " << totals.UpdateScratchSize
+             << ", \"bytesPerPrimitive\": " << (totals.Primitives > 0 ? static_cast<double>(totals.Size) / totals.Primitives : 0.0) << "}";
+    };
+
+    file << "{\n";
+    file << "  \"sample\": \"" << SAMPLE_NAME << "\",\n";
+    file << "  \"scene\": \"" << EscapeJSON(SceneName) << "\",\n";
+
+    file << "  \"blas\": [\n";
+    writeEntries(false);
+    file << "  ],\n";
+
+    file << "  \"tlas\": [\n";
+    writeEntries(true);
+    file << "  ],\n";
+
+    // every timed build, with the acceleration structures that were built together
+    double totalBuildMs = 0.0;
+    file << "  \"builds\": [\n";
+    for (size_t i = 0; i < mBuilds.size(); i++)
+    {
+        file << "    {\"entries\": [";
+        for (size_t j = 0; j < mBuilds[i].Ids.size(); j++)
+            file << (j > 0 ? ", " : "") << "\"" << EscapeJSON(mEntries[mBuilds[i].Ids[j]].Name) << "\"";
+        file << "], \"gpuMs\": ";
+        if (mBuilds[i].Ms >= 0.0)
+            file << mBuilds[i].Ms;
+        else
+            file << "null";
+        file << "}" << (i + 1 == mBuilds.size() ? "" : ",") << "\n";
+
+        totalBuildMs += std::max(mBuilds[i].Ms, 0.0);
+    }
+    file << "  ],\n";
+
+    file << "  \"totals\": {\n";
+    file << "    \"blas\": ";
+    writeTotals(blasTotals, "primitives");
+    file << ",\n    \"tlas\": ";
+    writeTotals(tlasTotals, "instances");
+    file << ",\n    \"size\": " << blasTotals.Size + tlasTotals.Size;
+    file << ",\n    \"buildMs\": " << totalBuildMs << "\n";
+    file << "  }\n";
+    file << "}\n";
+
+    std::cout << "Wrote acceleration structure stats of " << mEntries.size() << " acceleration structures to " << path << std::endl;
+    return true;
+}
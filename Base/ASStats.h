@@ -0,0 +1,65 @@
+#pragma once
+
+#include "Common.h"
+
+// Collects the memory and build cost of the acceleration structures of a sample and writes them to a JSON file
+// sizes come from the build infos, compacted sizes from compaction queries, build times from timestamps around the builds
+class ASStats
+{
+public:
+    void Create(vk::Device device, vk::PhysicalDevice physicalDevice, uint32_t maxTimedBuilds = 64);
+
+    void Destroy();
+
+    // Name of the scene written to the report, eg. the glb file
+    std::string SceneName;
+
+    // Adds a BLAS, returns its id, primitiveCount is the number of triangles or boxes
+    uint32_t AddBLAS(const std::string& name, uint64_t primitiveCount, const vk::AccelerationStructureBuildSizesInfoKHR& sizes);
+    uint32_t AddBLAS(const std::string& name, const vr::BLASCreateInfo& info, const vr::BLASBuildInfo& buildInfo);
+
+    uint32_t AddTLAS(const std::string& name, uint32_t instanceCount, const vr::TLASBuildInfo& buildInfo);
+
+    void SetCompactedSize(uint32_t id, vk::DeviceSize size);
+
+    // Writes a timestamp before and after the builds of the given acceleration structures, returns the id of the timed build
+    // builds that are recorded together overlap on the GPU, so only a build of a single acceleration structure is a per BLAS time
+    uint32_t BeginBuild(vk::CommandBuffer cmd, const std::vector<uint32_t>& ids);
+    void EndBuild(vk::CommandBuffer cmd, uint32_t build);
+
+    bool IsEmpty() const { return mEntries.empty(); }
+
+    // Reads the timestamps and writes the report, the command buffers with the timed builds have to be finished
+    // can be called again, eg. after a compaction that happens a few frames later
+    bool WriteJSON(const std::string& path = GetDefaultPath());
+
+    // ASStats_<sample name>.json in the working directory
+    static std::string GetDefaultPath() { return std::string("ASStats_") + SAMPLE_NAME + ".json"; }
+
+private:
+    struct Entry
+    {
+        std::string Name;
+        bool TopLevel = false;
+        uint64_t PrimitiveCount = 0; // triangles / boxes of a BLAS, instances of a TLAS
+        vk::DeviceSize Size = 0;
+        vk::DeviceSize BuildScratchSize = 0;
+        vk::DeviceSize UpdateScratchSize = 0;
+        vk::DeviceSize CompactedSize = 0; // 0 if it wasn't compacted
+        double BuildMs = -1.0;            // negative if it wasn't timed on its own
+    };
+
+    struct TimedBuild
+    {
+        std::vector<uint32_t> Ids;
+        double Ms = -1.0;
+    };
+
+    vk::Device mDevice = nullptr;
+    vk::QueryPool mQueryPool = nullptr;
+    uint32_t mMaxTimedBuilds = 0;
+    double mTimestampPeriod = 0.0; // nanoseconds per tick
+
+    std::vector<Entry> mEntries;
+    std::vector<TimedBuild> mBuilds;
+};
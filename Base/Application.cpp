@@ -58,6 +58,10 @@ Application::Application()
 
     // Pick the physical device to use
     builder.PhysicalDeviceFeatures10.samplerAnisotropy = true;
+    // used to synchronize acceleration structure builds on the compute queue with ray tracing on the graphics queue
+    builder.PhysicalDeviceFeatures12.timelineSemaphore = true;
+    // the shaders read vertices and indices through 64 bit device addresses
+    builder.PhysicalDeviceFeatures10.shaderInt64 = true;
     mPhysicalDevice = builder.PickPhysicalDevice(mSurface);
 
     // Create the logical device
@@ -84,6 +88,22 @@ Application::Application()
     poolInfo.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer; // release command buffers back to pool
     mGraphicsPool = mDevice.createCommandPool(poolInfo);
 
+    // [POI]
+    // Use the compute queue for acceleration structure builds if it is from a different family than the graphics queue,
+    // then the builds can run at the same time as the ray tracing of the previous frame
+    if (mQueues.ComputeQueue && mQueues.ComputeIndex != mQueues.GraphicsIndex)
+    {
+        mASBuildQueue = mQueues.ComputeQueue;
+        mASBuildQueueIndex = mQueues.ComputeIndex;
+    }
+    else
+    {
+        mASBuildQueue = mQueues.GraphicsQueue;
+        mASBuildQueueIndex = mQueues.GraphicsIndex;
+    }
+    poolInfo.queueFamilyIndex = mASBuildQueueIndex;
+    mASBuildPool = mDevice.createCommandPool(poolInfo);
+
     mMaxFramesInFlight = static_cast<uint32_t>(mSwapchainResources.SwapchainImageViews.size());
 
     // create command buffers
@@ -98,6 +118,11 @@ Application::Application()
     mRenderSemaphore = mDevice.createSemaphore(semaphoreInfo);
     mPresentSemaphore = mDevice.createSemaphore(semaphoreInfo);
 
+    auto timelineInfo = vk::SemaphoreTypeCreateInfo()
+                            .setSemaphoreType(vk::SemaphoreType::eTimeline)
+                            .setInitialValue(0);
+    mASBuildSemaphore = mDevice.createSemaphore(vk::SemaphoreCreateInfo().setPNext(&timelineInfo));
+
     // Create fences
     vk::FenceCreateInfo fenceInfo = {};
     fenceInfo.flags = vk::FenceCreateFlagBits::eSignaled;
@@ -106,6 +131,11 @@ Application::Application()
     mVRDev = new vr::VulrayDevice(mInstance.InstanceHandle, mDevice, mPhysicalDevice);
 
     mRTRenderCmd = mDevice.allocateCommandBuffers(allocInfo);
+
+    allocInfo.commandPool = mASBuildPool;
+    mASBuildCmd = mDevice.allocateCommandBuffers(allocInfo);
+
+    mASStats.Create(mDevice, mPhysicalDevice);
 }
 
 void Application::Update(vk::CommandBuffer renderCmd)
@@ -153,19 +183,33 @@ void Application::WaitForRendering()
 void Application::Present(vk::CommandBuffer commandBuffer)
 {
 
-    vk::PipelineStageFlags waitStage = vk::PipelineStageFlagBits::eColorAttachmentOutput;
+    // the AS build stage has to stay in the second mask, the queue family acquire in AcquireASBuffers(...) runs in it
+    vk::PipelineStageFlags waitStages[2] = {vk::PipelineStageFlagBits::eColorAttachmentOutput,
+                                            vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR};
+    vk::Semaphore waitSemaphores[2] = {mRenderSemaphore, mASBuildSemaphore};
+    uint64_t waitValues[2] = {0, mASBuildWaitValue}; // the value for the binary semaphore is ignored
+
+    // only wait for the acceleration structure builds if there was a build submitted since the last frame
+    uint32_t waitCount = mASBuildWaitValue > 0 ? 2 : 1;
+
+    auto timelineSubmitInfo = vk::TimelineSemaphoreSubmitInfo()
+                                  .setWaitSemaphoreValueCount(waitCount)
+                                  .setPWaitSemaphoreValues(waitValues);
 
     auto qSubmitInfo = vk::SubmitInfo()
-                           .setPWaitDstStageMask(&waitStage)
+                           .setPNext(&timelineSubmitInfo)
+                           .setPWaitDstStageMask(waitStages)
                            .setCommandBufferCount(1)
                            .setPCommandBuffers(&commandBuffer)
-                           .setWaitSemaphoreCount(1)
-                           .setPWaitSemaphores(&mRenderSemaphore)
+                           .setWaitSemaphoreCount(waitCount)
+                           .setPWaitSemaphores(waitSemaphores)
                            .setSignalSemaphoreCount(1)
                            .setPSignalSemaphores(&mPresentSemaphore);
 
     auto _ = mQueues.GraphicsQueue.submit(1, &qSubmitInfo, mRenderFence);
 
+    mASBuildWaitValue = 0;
+
     auto presentInfo = vk::PresentInfoKHR()
                            .setWaitSemaphoreCount(1)
                            .setPWaitSemaphores(&mPresentSemaphore)
@@ -193,6 +237,111 @@ void Application::Present(vk::CommandBuffer commandBuffer)
     mRTRenderCmdIndex = mRTRenderCmdIndex == 0 ? 1 : 0;
 }
 
+vk::CommandBuffer Application::BeginASBuild(vk::CommandBuffer renderCmd)
+{
+    if (!HasAsyncASBuild())
+        return renderCmd;
+
+    // the build of this frame index was waited on by its render submit two frames ago, so the command buffer can be reused
+    auto buildCmd = mASBuildCmd[mRTRenderCmdIndex];
+    buildCmd.reset();
+    buildCmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+    return buildCmd;
+}
+
+void Application::EndASBuild(vk::CommandBuffer buildCmd, vk::CommandBuffer renderCmd)
+{
+    if (!HasAsyncASBuild())
+    {
+        // [POI]
+        // The builds are in the render command buffer, a barrier before DispatchRays is all that is needed
+        AddASBuildToTraceBarrier(renderCmd);
+        return;
+    }
+
+    buildCmd.end();
+
+    SubmitASBuild(buildCmd);
+    AcquireASBuffers(renderCmd);
+}
+
+void Application::AddASBuildToTraceBarrier(vk::CommandBuffer cmd)
+{
+    auto barrier = vk::MemoryBarrier()
+                       .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR)
+                       .setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR);
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                        {}, barrier, nullptr, nullptr);
+}
+
+uint64_t Application::SubmitASBuild(vk::CommandBuffer buildCmd)
+{
+    mASBuildValue++;
+
+    auto timelineSubmitInfo = vk::TimelineSemaphoreSubmitInfo()
+                                  .setSignalSemaphoreValueCount(1)
+                                  .setPSignalSemaphoreValues(&mASBuildValue);
+
+    auto submitInfo = vk::SubmitInfo()
+                          .setPNext(&timelineSubmitInfo)
+                          .setCommandBufferCount(1)
+                          .setPCommandBuffers(&buildCmd)
+                          .setSignalSemaphoreCount(1)
+                          .setPSignalSemaphores(&mASBuildSemaphore);
+
+    auto _ = mASBuildQueue.submit(1, &submitInfo, nullptr);
+
+    mASBuildWaitValue = mASBuildValue;
+    return mASBuildValue;
+}
+
+void Application::ReleaseASBuffer(vk::CommandBuffer buildCmd, const vr::AllocatedBuffer& buffer)
+{
+    // same queue family, the semaphore takes care of the memory dependency
+    if (!HasAsyncASBuild())
+        return;
+
+    auto release = vk::BufferMemoryBarrier()
+                       .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR)
+                       .setDstAccessMask(vk::AccessFlagBits::eNone)
+                       .setSrcQueueFamilyIndex(mASBuildQueueIndex)
+                       .setDstQueueFamilyIndex(mQueues.GraphicsIndex)
+                       .setBuffer(buffer.Buffer)
+                       .setOffset(0)
+                       .setSize(VK_WHOLE_SIZE);
+
+    buildCmd.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::PipelineStageFlagBits::eBottomOfPipe,
+                             {}, nullptr, release, nullptr);
+
+    mASBuffersToAcquire.push_back(buffer.Buffer);
+}
+
+void Application::AcquireASBuffers(vk::CommandBuffer renderCmd)
+{
+    if (mASBuffersToAcquire.empty())
+        return;
+
+    mASAcquireBarriers.clear();
+    for (auto& buffer : mASBuffersToAcquire)
+    {
+        mASAcquireBarriers.push_back(vk::BufferMemoryBarrier()
+                                     .setSrcAccessMask(vk::AccessFlagBits::eNone)
+                                     .setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR)
+                                     .setSrcQueueFamilyIndex(mASBuildQueueIndex)
+                                     .setDstQueueFamilyIndex(mQueues.GraphicsIndex)
+                                     .setBuffer(buffer)
+                                     .setOffset(0)
+                                     .setSize(VK_WHOLE_SIZE));
+    }
+
+    // the source stage is in the wait mask of the AS build semaphore in Present(...), so the acquire is ordered after the release
+    renderCmd.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                              vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                              {}, nullptr, mASAcquireBarriers, nullptr);
+
+    mASBuffersToAcquire.clear();
+}
+
 void Application::CreateBaseResources()
 {
     // Create an image to render to
@@ -359,6 +508,10 @@ void Application::BlitImage(vk::CommandBuffer renderCmd)
 }
 void Application::Run()
 {
+    // Start() has created and built the acceleration structures by now
+    if (!mASStats.IsEmpty())
+        mASStats.WriteJSON();
+
     while (!glfwWindowShouldClose(mWindow))
     {
         BeginFrame();
@@ -374,6 +527,8 @@ Application::~Application()
     if (mOutputImageBuffer.Image)
         mVRDev->DestroyImage(mOutputImageBuffer);
 
+    mASStats.Destroy();
+
     // Clean up
     delete mVRDev;
 
@@ -385,7 +540,9 @@ Application::~Application()
     mDevice.destroyFence(mRenderFence);
     mDevice.destroySemaphore(mRenderSemaphore);
     mDevice.destroySemaphore(mPresentSemaphore);
+    mDevice.destroySemaphore(mASBuildSemaphore);
     mDevice.destroyCommandPool(mGraphicsPool);
+    mDevice.destroyCommandPool(mASBuildPool);
 
     vr::SwapchainBuilder::DestroySwapchain(mDevice, mSwapchainResources);
     mDevice.destroy();
@@ -2,6 +2,7 @@
 #include <GLFW/glfw3.h>
 #include "SimpleTimer.h"
 #include "Camera.h"
+#include "ASStats.h"
 
 class Application
 {
@@ -30,6 +31,29 @@ public:
 
 	void UpdateCamera();
 
+	// Returns the command buffer to record the acceleration structure builds of this frame into
+	// with an async compute queue it is the AS build command buffer of this frame, otherwise the render command buffer itself
+	vk::CommandBuffer BeginASBuild(vk::CommandBuffer renderCmd);
+
+	// Submits the builds if they were recorded for the async compute queue and makes them visible to the ray tracing shaders
+	// with no async compute queue this only records a barrier, so there are no extra submits or allocations every frame
+	void EndASBuild(vk::CommandBuffer buildCmd, vk::CommandBuffer renderCmd);
+
+	// Makes acceleration structure builds recorded earlier in cmd visible to the ray tracing shaders later in cmd
+	void AddASBuildToTraceBarrier(vk::CommandBuffer cmd);
+
+	// Submits a command buffer with acceleration structure builds to mASBuildQueue and signals mASBuildSemaphore
+	// the next Present(...) waits for the builds before tracing rays, so no waitIdle is needed
+	uint64_t SubmitASBuild(vk::CommandBuffer buildCmd);
+
+	// Records a queue family ownership release of an acceleration structure buffer into the build command buffer
+	// the matching acquire is recorded by AcquireASBuffers(...) in the next render command buffer
+	void ReleaseASBuffer(vk::CommandBuffer buildCmd, const vr::AllocatedBuffer& buffer);
+
+	void AcquireASBuffers(vk::CommandBuffer renderCmd);
+
+	bool HasAsyncASBuild() const { return mASBuildQueueIndex != mQueues.GraphicsIndex; }
+
 private:
 	void HandleResize();
 
@@ -46,6 +70,17 @@ protected:
 
 	vk::CommandPool mGraphicsPool;
 
+	// Acceleration structure builds go to a dedicated compute queue if the device has one, otherwise to the graphics queue
+	vk::Queue mASBuildQueue = nullptr;
+	uint32_t mASBuildQueueIndex = 0;
+	vk::CommandPool mASBuildPool;
+	vk::Semaphore mASBuildSemaphore; // timeline semaphore, incremented with every SubmitASBuild(...)
+	uint64_t mASBuildValue = 0;
+	uint64_t mASBuildWaitValue = 0; // value that the next Present(...) waits for, 0 if there is nothing to wait for
+	std::vector<vk::Buffer> mASBuffersToAcquire;
+	std::vector<vk::BufferMemoryBarrier> mASAcquireBarriers; // reused every frame
+	std::vector<vk::CommandBuffer> mASBuildCmd; // one for every frame in flight, used by BeginASBuild(...)
+
 	vr::AllocatedImage mOutputImageBuffer;
     vr::AccessibleImage mOutputImage;
 
@@ -77,6 +112,9 @@ protected:
 
 	Camera mCamera;
 
+	// Acceleration structures registered here by the sample are written to ASStats_<sample>.json when Run() starts
+	ASStats mASStats;
+
 	glm::dvec2 mMousePos = { 0.0f, 0.0f };
 	glm::dvec2 mMouseDelta = { 0.0f, 0.0f };
 
@@ -0,0 +1,146 @@
+#include "Common.h"
+#include "AssetWatcher.h"
+
+#include <chrono>
+#include <filesystem>
+
+#ifdef __linux__
+    #include <poll.h>
+    #include <sys/inotify.h>
+    #include <unistd.h>
+#endif
+
+// the thread wakes up this often to see if Stop() was called, or to compare the modification time
+static constexpr int PollMs = 250;
+
+// editors write a file in several steps, the load waits until there were no more changes for this long
+static constexpr int SettleMs = 100;
+
+AssetWatcher::~AssetWatcher()
+{
+    Stop();
+}
+
+void AssetWatcher::Start(const std::string& path)
+{
+    Stop();
+    mPath = path;
+
+#ifdef __linux__
+    // the directory is watched instead of the file, a file that is replaced by a rename is a new inode that a watch on the file wouldn't see
+    auto directory = std::filesystem::path(path).parent_path();
+    if (directory.empty())
+        directory = ".";
+
+    mInotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (mInotify >= 0)
+        mWatch = inotify_add_watch(mInotify, directory.string().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (mWatch < 0)
+        std::cout << "AssetWatcher: can't watch " << directory.string() << ", polling the file instead" << std::endl;
+#endif
+
+    mRunning = true;
+    mThread = std::thread(&AssetWatcher::Run, this);
+    std::cout << "AssetWatcher: watching " << path << std::endl;
+}
+
+void AssetWatcher::Stop()
+{
+    mRunning = false;
+    if (mThread.joinable())
+        mThread.join();
+
+#ifdef __linux__
+    // closing the instance removes its watch
+    if (mInotify >= 0)
+        close(mInotify);
+#endif
+    mInotify = -1;
+    mWatch = -1;
+}
+
+bool AssetWatcher::TakeReloadedScene(Scene& outScene)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mHasReloaded)
+        return false;
+
+    outScene = std::move(mReloaded);
+    mReloaded = Scene();
+    mHasReloaded = false;
+    return true;
+}
+
+void AssetWatcher::Run()
+{
+    while (WaitForChange())
+        Load();
+}
+
+bool AssetWatcher::WaitForChange()
+{
+#ifdef __linux__
+    if (mWatch >= 0)
+    {
+        std::string name = std::filesystem::path(mPath).filename().string();
+        alignas(inotify_event) char events[4096];
+
+        bool changed = false;
+        while (mRunning)
+        {
+            pollfd fd = {mInotify, POLLIN, 0};
+            if (poll(&fd, 1, changed ? SettleMs : PollMs) <= 0)
+            {
+                if (changed)
+                    return true;
+                continue;
+            }
+
+            // the events of every file in the directory, only the watched file counts
+            ssize_t size = read(mInotify, events, sizeof(events));
+            for (ssize_t offset = 0; offset < size;)
+            {
+                auto* event = reinterpret_cast<const inotify_event*>(events + offset);
+                if (event->len > 0 && name == event->name)
+                    changed = true;
+                offset += sizeof(inotify_event) + event->len;
+            }
+        }
+        return false;
+    }
+#endif
+
+    std::error_code error;
+    auto lastWrite = std::filesystem::last_write_time(mPath, error);
+    while (mRunning)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(PollMs));
+
+        auto writeTime = std::filesystem::last_write_time(mPath, error);
+        if (!error && writeTime != lastWrite)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(SettleMs));
+            return true;
+        }
+    }
+    return false;
+}
+
+void AssetWatcher::Load()
+{
+    Scene scene = mLoader.LoadGLBMesh(mPath);
+
+    // a file that is still being written doesn't parse, the write that finishes it loads it again
+    if (scene.Meshes.empty())
+    {
+        std::cout << "AssetWatcher: " << mPath << " has no meshes, keeping the scene that was loaded before" << std::endl;
+        return;
+    }
+
+    std::cout << "AssetWatcher: reloaded " << mPath << " in " << mLoader.GetStats().ParseMs + mLoader.GetStats().LoadMs << " ms" << std::endl;
+
+    // a scene that wasn't taken yet is replaced, only the newest version matters
+    std::lock_guard<std::mutex> lock(mMutex);
+    mReloaded = std::move(scene);
+    mHasReloaded = true;
+}
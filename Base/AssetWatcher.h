@@ -0,0 +1,46 @@
+#pragma once
+
+#include "MeshLoader.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// Watches a GLB file and loads it again on a thread of its own whenever it is written, so the frames don't wait for the parsing
+// On Linux the directory of the file is watched with inotify, which also sees editors that write a new file and rename it over the old one,
+// elsewhere the modification time of the file is polled
+class AssetWatcher
+{
+public:
+    ~AssetWatcher();
+
+    void Start(const std::string& path);
+
+    // Joins the thread, a load that is running is finished first
+    void Stop();
+
+    // Moves the scene of the last load that finished into outScene, returns false if there hasn't been one since the last call
+    bool TakeReloadedScene(Scene& outScene);
+
+private:
+    void Run();
+
+    // Blocks until the file was written or Stop() was called, returns false for the latter
+    bool WaitForChange();
+
+    void Load();
+
+    std::string mPath;
+    std::thread mThread;
+    std::atomic<bool> mRunning = false;
+
+    // the loader is only used by the thread, tinygltf isn't shared with the loader of the sample
+    MeshLoader mLoader;
+
+    std::mutex mMutex;
+    Scene mReloaded;
+    bool mHasReloaded = false;
+
+    int mInotify = -1;
+    int mWatch = -1;
+};
@@ -0,0 +1,181 @@
+#include "Common.h"
+#include "BLASGrouping.h"
+
+#include <algorithm>
+
+static float SurfaceArea(const AABB& bounds)
+{
+    if (bounds.IsEmpty())
+        return 0.0f;
+    glm::vec3 d = bounds.Max - bounds.Min;
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// Spreads the lower 10 bits of v so there are 2 zero bits between each of them
+static uint32_t ExpandBits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+static uint32_t MortonCode(const glm::vec3& point, const AABB& sceneBounds)
+{
+    glm::vec3 extent = glm::max(sceneBounds.Max - sceneBounds.Min, glm::vec3(1e-6f));
+    glm::vec3 p = glm::clamp((point - sceneBounds.Min) / extent, 0.0f, 1.0f) * 1023.0f;
+    return (ExpandBits(static_cast<uint32_t>(p.x)) << 2) | (ExpandBits(static_cast<uint32_t>(p.y)) << 1) | ExpandBits(static_cast<uint32_t>(p.z));
+}
+
+static bool IsDynamic(const Scene& scene, const Mesh& mesh)
+{
+    if (mesh.SkinIndex >= 0 || !mesh.MorphWeights.empty())
+        return true;
+    for (auto geomRef : mesh.GeometryReferences)
+    {
+        auto& geom = scene.Geometries[geomRef];
+        if (!geom.Skin.empty() || !geom.MorphTargets.empty())
+            return true;
+    }
+    return false;
+}
+
+// Copy of the geometry in the space of the mesh, so meshes with different transforms can share a BLAS
+static Geometry BakeTransform(const Geometry& geometry, const glm::mat3x4& rowMajorTransform)
+{
+    Geometry result;
+    result.Indices = geometry.Indices;
+    result.Material = geometry.Material;
+    result.MaterialIndex = geometry.MaterialIndex;
+
+    glm::mat3 linear;
+    for (int row = 0; row < 3; row++)
+        for (int col = 0; col < 3; col++)
+            linear[col][row] = rowMajorTransform[row][col];
+    glm::mat3 normalMatrix = glm::transpose(glm::inverse(linear));
+    glm::vec3 translation = glm::vec3(rowMajorTransform[0].w, rowMajorTransform[1].w, rowMajorTransform[2].w);
+
+    result.Vertices.resize(geometry.Vertices.size());
+    for (size_t i = 0; i < geometry.Vertices.size(); i++)
+    {
+        auto& in = geometry.Vertices[i];
+        auto& out = result.Vertices[i];
+        out = in;
+        out.Position = linear * in.Position + translation;
+        glm::vec3 normal = normalMatrix * in.Normal;
+        float length = glm::length(normal);
+        out.Normal = length > 0.0f ? normal / length : in.Normal;
+
+        result.Bounds.Min = glm::min(result.Bounds.Min, out.Position);
+        result.Bounds.Max = glm::max(result.Bounds.Max, out.Position);
+    }
+    return result;
+}
+
+BLASGroupingStats BLASGrouping::Group(Scene& scene, const BLASGroupingSettings& settings, std::vector<uint32_t>* outMeshIndices)
+{
+    BLASGroupingStats stats;
+    stats.MeshesBefore = static_cast<uint32_t>(scene.Meshes.size());
+
+    std::vector<uint32_t> meshIndices(scene.Meshes.size(), UINT32_MAX);
+
+    AABB sceneBounds;
+    for (auto& mesh : scene.Meshes)
+        sceneBounds.Expand(mesh.Bounds);
+    float maxMeshArea = SurfaceArea(sceneBounds) * settings.MaxSceneAreaFraction;
+
+    std::vector<Mesh> result;
+    std::vector<uint32_t> smallMeshes;
+    std::vector<uint32_t> triangleCounts(scene.Meshes.size(), 0);
+    for (uint32_t m = 0; m < scene.Meshes.size(); m++)
+    {
+        auto& mesh = scene.Meshes[m];
+        for (auto geomRef : mesh.GeometryReferences)
+            triangleCounts[m] += static_cast<uint32_t>(scene.Geometries[geomRef].Indices.size() / 3);
+
+        bool small = triangleCounts[m] <= settings.SmallMeshTriangles && SurfaceArea(mesh.Bounds) <= maxMeshArea;
+        if (small && !IsDynamic(scene, mesh) && !mesh.Bounds.IsEmpty())
+            smallMeshes.push_back(m);
+        else
+        {
+            meshIndices[m] = static_cast<uint32_t>(result.size());
+            result.push_back(std::move(mesh)); // large and dynamic meshes keep their BLAS, their order stays the same
+        }
+    }
+
+    // neighbours along the curve are close to each other in space, so a greedy pass over it finds compact groups
+    std::vector<uint32_t> codes(scene.Meshes.size(), 0);
+    for (auto m : smallMeshes)
+        codes[m] = MortonCode((scene.Meshes[m].Bounds.Min + scene.Meshes[m].Bounds.Max) * 0.5f, sceneBounds);
+    std::stable_sort(smallMeshes.begin(), smallMeshes.end(), [&](uint32_t a, uint32_t b) { return codes[a] < codes[b]; });
+
+    std::vector<uint32_t> group;
+    AABB groupBounds;
+    float groupArea = 0.0f;
+    uint32_t groupTriangles = 0;
+
+    auto closeGroup = [&]() {
+        if (group.empty())
+            return;
+
+        if (group.size() == 1)
+        {
+            meshIndices[group[0]] = static_cast<uint32_t>(result.size());
+            result.push_back(std::move(scene.Meshes[group[0]]));
+        }
+        else
+        {
+            Mesh merged;
+            merged.Bounds = groupBounds;
+            for (auto m : group)
+            {
+                auto& mesh = scene.Meshes[m];
+                for (auto geomRef : mesh.GeometryReferences)
+                {
+                    Geometry baked = BakeTransform(scene.Geometries[geomRef], mesh.Transform);
+                    merged.GeometryReferences.push_back(static_cast<uint32_t>(scene.Geometries.size()));
+                    scene.Geometries.push_back(std::move(baked));
+                }
+            }
+            result.push_back(std::move(merged));
+            stats.GroupedMeshes += static_cast<uint32_t>(group.size());
+            stats.Groups++;
+        }
+
+        group.clear();
+        groupBounds = AABB();
+        groupArea = 0.0f;
+        groupTriangles = 0;
+    };
+
+    for (auto m : smallMeshes)
+    {
+        auto& mesh = scene.Meshes[m];
+        AABB bounds = groupBounds;
+        bounds.Expand(mesh.Bounds);
+        float area = groupArea + SurfaceArea(mesh.Bounds);
+
+        bool fits = groupTriangles + triangleCounts[m] <= settings.MaxGroupTriangles &&
+                    SurfaceArea(bounds) <= settings.MaxAreaGrowth * area;
+        if (!group.empty() && !fits)
+        {
+            closeGroup();
+            bounds = mesh.Bounds;
+            area = SurfaceArea(mesh.Bounds);
+        }
+
+        group.push_back(m);
+        groupBounds = bounds;
+        groupArea = area;
+        groupTriangles += triangleCounts[m];
+    }
+    closeGroup();
+
+    // the geometries that were only used by grouped meshes stay in the scene, they aren't referenced anymore so they aren't uploaded
+    scene.Meshes = std::move(result);
+    stats.MeshesAfter = static_cast<uint32_t>(scene.Meshes.size());
+    if (outMeshIndices)
+        *outMeshIndices = std::move(meshIndices);
+    return stats;
+}
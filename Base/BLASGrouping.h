@@ -0,0 +1,37 @@
+#pragma once
+
+#include "MeshLoader.h"
+
+struct BLASGroupingSettings
+{
+    uint32_t SmallMeshTriangles = 4096;  // meshes with more triangles are large and keep a BLAS of their own
+    uint32_t MaxGroupTriangles = 65536;  // a group is closed when the next mesh would take it over this
+    float MaxSceneAreaFraction = 0.01f;  // meshes with bounds larger than this fraction of the scene's surface area are large as well
+
+    // a mesh joins a group only if the surface area of the group's bounds grows to at most this many times
+    // the sum of the surface areas of its meshes, so meshes that are far apart don't end up with a box of empty space around them
+    float MaxAreaGrowth = 2.0f;
+};
+
+// What BLASGrouping::Group(...) did to the scene
+struct BLASGroupingStats
+{
+    uint32_t MeshesBefore = 0;
+    uint32_t MeshesAfter = 0;   // meshes and with that BLASes and TLAS instances after the grouping
+    uint32_t GroupedMeshes = 0; // small static meshes that went into a group
+    uint32_t Groups = 0;        // groups with more than one mesh
+};
+
+// Merges small static meshes that are close to each other into shared BLASes
+// A scene with thousands of tiny meshes would otherwise get thousands of tiny BLASes and a TLAS with an instance for each of them,
+// which costs the rays a TLAS leaf and a BLAS root for every mesh they pass
+class BLASGrouping
+{
+public:
+    // [POI]
+    // The small meshes are sorted along a Morton curve of their centers and grouped greedily in that order,
+    // skinned and morphed meshes are dynamic and stay separate, their BLAS is rebuilt from the deformed vertices
+    // The geometries of a group get a copy with the mesh transform applied to it, the group mesh has the identity transform
+    // outMeshIndices gets the index of every mesh in the grouped scene, UINT32_MAX for the meshes that were merged into a group
+    static BLASGroupingStats Group(Scene& scene, const BLASGroupingSettings& settings = {}, std::vector<uint32_t>* outMeshIndices = nullptr);
+};
@@ -0,0 +1,396 @@
+#include "Common.h"
+#include "BLASPool.h"
+#include "Helpers.h"
+
+#include <algorithm>
+
+// acceleration structures have to be placed at 256 byte aligned offsets in their buffer
+static constexpr vk::DeviceSize ASOffsetAlignment = 256;
+
+void BLASPool::Create(vr::VulrayDevice* vrDev, vk::Device device, vk::PhysicalDevice physicalDevice, vk::DeviceSize blockSize)
+{
+    mVRDev = vrDev;
+    mDevice = device;
+    mBlockSize = blockSize;
+
+    auto properties = physicalDevice.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceAccelerationStructurePropertiesKHR>();
+    mScratchAlignment = properties.get<vk::PhysicalDeviceAccelerationStructurePropertiesKHR>().minAccelerationStructureScratchOffsetAlignment;
+}
+
+void BLASPool::Destroy()
+{
+    FinishBuild();
+
+    for (auto& entry : mEntries)
+        mDevice.destroyAccelerationStructureKHR(entry.Handle.AccelerationStructure);
+    mEntries.clear();
+    mFreeIds.clear();
+
+    for (auto& block : mBlocks)
+        mVRDev->DestroyBuffer(block.Buffer);
+    mBlocks.clear();
+}
+
+void BLASPool::Allocate(std::vector<Block>& blocks, vk::DeviceSize size, Entry& outEntry)
+{
+    // [POI]
+    // The space of freed BLASes is used first, the first range it fits into, the rest of the range stays free
+    // otherwise BLASes are added at the end of a block, or moved all at once by CompactAndDefragment(...)
+    for (uint32_t i = 0; i < blocks.size(); i++)
+    {
+        auto& ranges = blocks[i].FreeRanges;
+        for (size_t r = 0; r < ranges.size(); r++)
+        {
+            auto [start, rangeSize] = ranges[r];
+            vk::DeviceSize offset = AlignUp(start, ASOffsetAlignment);
+            if (offset + size > start + rangeSize)
+                continue;
+
+            outEntry.Block = i;
+            outEntry.Offset = offset;
+            outEntry.Padding = offset - start;
+
+            vk::DeviceSize rest = start + rangeSize - (offset + size);
+            if (rest > 0)
+                ranges[r] = {offset + size, rest};
+            else
+                ranges.erase(ranges.begin() + r);
+            return;
+        }
+    }
+
+    for (uint32_t i = 0; i < blocks.size(); i++)
+    {
+        vk::DeviceSize offset = AlignUp(blocks[i].Used, ASOffsetAlignment);
+        if (offset + size <= blocks[i].Buffer.Size)
+        {
+            outEntry.Block = i;
+            outEntry.Offset = offset;
+            outEntry.Padding = offset - blocks[i].Used;
+            blocks[i].Used = offset + size;
+            return;
+        }
+    }
+
+    // BLASes larger than a block get a block of their own
+    auto& block = blocks.emplace_back(Block{});
+    block.Buffer = mVRDev->CreateBuffer(
+        std::max(mBlockSize, AlignUp(size, ASOffsetAlignment)),
+        vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR,
+        0);
+    block.Used = size;
+
+    outEntry.Block = static_cast<uint32_t>(blocks.size() - 1);
+    outEntry.Offset = 0;
+    outEntry.Padding = 0;
+}
+
+void BLASPool::CreateHandle(const std::vector<Block>& blocks, Entry& entry)
+{
+    auto& block = blocks[entry.Block];
+
+    auto createInfo = vk::AccelerationStructureCreateInfoKHR()
+                          .setBuffer(block.Buffer.Buffer)
+                          .setOffset(entry.Offset)
+                          .setSize(entry.Size)
+                          .setType(vk::AccelerationStructureTypeKHR::eBottomLevel);
+
+    entry.Handle.AccelerationStructure = mDevice.createAccelerationStructureKHR(createInfo);
+
+    // the handle points to the shared buffer, with the address and size of the acceleration structure inside of it
+    entry.Handle.Buffer = block.Buffer;
+    entry.Handle.Buffer.DevAddress = mDevice.getAccelerationStructureAddressKHR(
+        vk::AccelerationStructureDeviceAddressInfoKHR().setAccelerationStructure(entry.Handle.AccelerationStructure));
+    entry.Handle.Buffer.Size = entry.Size;
+}
+
+uint32_t BLASPool::AddEntry()
+{
+    if (mFreeIds.empty())
+    {
+        mEntries.emplace_back();
+        return static_cast<uint32_t>(mEntries.size() - 1);
+    }
+
+    uint32_t id = mFreeIds.back();
+    mFreeIds.pop_back();
+    mEntries[id] = Entry{};
+    return id;
+}
+
+uint32_t BLASPool::CreateBLAS(const vr::BLASCreateInfo& info, const Scene& scene, const Mesh& mesh)
+{
+    uint32_t id = AddEntry();
+    auto& entry = mEntries[id];
+    entry.Flags = info.Flags;
+
+    std::vector<uint32_t> primitiveCounts;
+    for (size_t i = 0; i < info.Geometries.size(); i++)
+    {
+        auto& geomData = info.Geometries[i];
+        auto& geom = scene.Geometries[mesh.GeometryReferences[i]];
+
+        auto triangles = vk::AccelerationStructureGeometryTrianglesDataKHR()
+                             .setVertexFormat(geomData.VertexFormat)
+                             .setVertexData(vk::DeviceOrHostAddressConstKHR(geomData.DataAddresses.VertexDevAddress))
+                             .setVertexStride(geomData.Stride)
+                             .setMaxVertex(static_cast<uint32_t>(geom.Vertices.size()) - 1)
+                             .setIndexType(geomData.IndexFormat)
+                             .setIndexData(vk::DeviceOrHostAddressConstKHR(geomData.DataAddresses.IndexDevAddress))
+                             .setTransformData(vk::DeviceOrHostAddressConstKHR(geomData.DataAddresses.TransformDevAddress));
+
+        entry.Geometries.push_back(vk::AccelerationStructureGeometryKHR()
+                                       .setGeometryType(vk::GeometryTypeKHR::eTriangles)
+                                       .setGeometry(triangles)
+                                       .setFlags(vk::GeometryFlagBitsKHR::eOpaque));
+
+        entry.Ranges.push_back(vk::AccelerationStructureBuildRangeInfoKHR(geomData.PrimitiveCount, 0, 0, 0));
+        primitiveCounts.push_back(geomData.PrimitiveCount);
+        entry.PrimitiveCount += geomData.PrimitiveCount;
+    }
+
+    auto buildInfo = vk::AccelerationStructureBuildGeometryInfoKHR()
+                         .setType(vk::AccelerationStructureTypeKHR::eBottomLevel)
+                         .setFlags(entry.Flags)
+                         .setMode(vk::BuildAccelerationStructureModeKHR::eBuild)
+                         .setGeometries(entry.Geometries);
+
+    auto sizes = mDevice.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, buildInfo, primitiveCounts);
+    entry.Size = sizes.accelerationStructureSize;
+    entry.BuildScratchSize = sizes.buildScratchSize;
+    entry.BuildSizes = sizes;
+
+    Allocate(mBlocks, entry.Size, entry);
+    CreateHandle(mBlocks, entry);
+
+    return id;
+}
+
+void BLASPool::FreeBLAS(uint32_t id)
+{
+    auto& entry = mEntries[id];
+    if (entry.Free)
+        return;
+
+    mDevice.destroyAccelerationStructureKHR(entry.Handle.AccelerationStructure);
+
+    // the padding in front of the BLAS is freed with it, the space up to the BLAS before it is one range
+    auto& ranges = mBlocks[entry.Block].FreeRanges;
+    ranges.emplace_back(entry.Offset - entry.Padding, entry.Padding + entry.Size);
+
+    // neighbouring ranges are merged, so a BLAS that is larger than each of them can still fit
+    std::sort(ranges.begin(), ranges.end());
+    size_t merged = 0;
+    for (size_t r = 1; r < ranges.size(); r++)
+    {
+        if (ranges[merged].first + ranges[merged].second == ranges[r].first)
+            ranges[merged].second += ranges[r].second;
+        else
+            ranges[++merged] = ranges[r];
+    }
+    ranges.resize(merged + 1);
+
+    entry = Entry{};
+    entry.Free = true;
+    mFreeIds.push_back(id);
+}
+
+uint32_t BLASPool::CompactBLAS(uint32_t id, vk::DeviceSize compactedSize, vk::CommandBuffer cmd)
+{
+    uint32_t newId = AddEntry();
+    auto& source = mEntries[id];
+    auto& entry = mEntries[newId];
+
+    // the build sizes stay the ones of the source, GetSize(...) being smaller tells that the BLAS is compacted
+    entry = source;
+    entry.Size = std::min(compactedSize, source.Size);
+    Allocate(mBlocks, entry.Size, entry);
+    CreateHandle(mBlocks, entry);
+
+    cmd.copyAccelerationStructureKHR(vk::CopyAccelerationStructureInfoKHR()
+                                         .setSrc(source.Handle.AccelerationStructure)
+                                         .setDst(entry.Handle.AccelerationStructure)
+                                         .setMode(vk::CopyAccelerationStructureModeKHR::eCompact));
+    return newId;
+}
+
+vk::DeviceSize BLASPool::GetScratchSize(const std::vector<uint32_t>& ids) const
+{
+    // every build gets its own aligned range of the scratch buffer, so they can run at the same time
+    vk::DeviceSize scratchSize = 0;
+    for (auto id : ids)
+        scratchSize = AlignUp(scratchSize + mEntries[id].BuildScratchSize, mScratchAlignment);
+
+    // room to align the start of the buffer
+    return scratchSize + mScratchAlignment;
+}
+
+void BLASPool::Build(const std::vector<uint32_t>& ids, vk::CommandBuffer cmd)
+{
+    if (ids.empty())
+        return;
+
+    mScratchBuffer = mVRDev->CreateBuffer(GetScratchSize(ids), vk::BufferUsageFlagBits::eStorageBuffer, 0);
+    Build(ids, cmd, mScratchBuffer);
+}
+
+void BLASPool::Build(const std::vector<uint32_t>& ids, vk::CommandBuffer cmd, const vr::AllocatedBuffer& scratchBuffer)
+{
+    if (ids.empty())
+        return;
+
+    vk::DeviceAddress scratchAddress = AlignUp(scratchBuffer.DevAddress, mScratchAlignment);
+
+    std::vector<vk::AccelerationStructureBuildGeometryInfoKHR> buildInfos(ids.size());
+    std::vector<const vk::AccelerationStructureBuildRangeInfoKHR*> ranges(ids.size());
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        auto& entry = mEntries[ids[i]];
+        buildInfos[i] = vk::AccelerationStructureBuildGeometryInfoKHR()
+                            .setType(vk::AccelerationStructureTypeKHR::eBottomLevel)
+                            .setFlags(entry.Flags)
+                            .setMode(vk::BuildAccelerationStructureModeKHR::eBuild)
+                            .setDstAccelerationStructure(entry.Handle.AccelerationStructure)
+                            .setGeometries(entry.Geometries)
+                            .setScratchData(vk::DeviceOrHostAddressKHR(scratchAddress));
+        ranges[i] = entry.Ranges.data();
+
+        scratchAddress = AlignUp(scratchAddress + entry.BuildScratchSize, mScratchAlignment);
+    }
+
+    cmd.buildAccelerationStructuresKHR(buildInfos, ranges);
+}
+
+void BLASPool::FinishBuild()
+{
+    if (mScratchBuffer.Buffer)
+        mVRDev->DestroyBuffer(mScratchBuffer);
+    mScratchBuffer = {};
+}
+
+void BLASPool::CompactAndDefragment(vk::CommandPool pool, vk::Queue queue)
+{
+    if (mEntries.empty())
+        return;
+
+    std::vector<uint32_t> compactable;
+    std::vector<vk::AccelerationStructureKHR> compactableHandles;
+    for (uint32_t i = 0; i < mEntries.size(); i++)
+    {
+        if (!mEntries[i].Free && (mEntries[i].Flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction))
+        {
+            compactable.push_back(i);
+            compactableHandles.push_back(mEntries[i].Handle.AccelerationStructure);
+        }
+    }
+
+    auto cmd = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(pool, vk::CommandBufferLevel::ePrimary, 1))[0];
+    auto submitInfo = vk::SubmitInfo().setCommandBufferCount(1).setPCommandBuffers(&cmd);
+
+    // [POI]
+    // First ask for the compacted sizes, the BLASes that weren't built with eAllowCompaction keep their size
+    std::vector<vk::DeviceSize> newSizes(mEntries.size());
+    for (uint32_t i = 0; i < mEntries.size(); i++)
+        newSizes[i] = mEntries[i].Size;
+
+    if (!compactable.empty())
+    {
+        uint32_t count = static_cast<uint32_t>(compactable.size());
+        auto queryPool = mDevice.createQueryPool(vk::QueryPoolCreateInfo()
+                                                     .setQueryType(vk::QueryType::eAccelerationStructureCompactedSizeKHR)
+                                                     .setQueryCount(count));
+
+        cmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+        cmd.resetQueryPool(queryPool, 0, count);
+        cmd.writeAccelerationStructuresPropertiesKHR(compactableHandles, vk::QueryType::eAccelerationStructureCompactedSizeKHR, queryPool, 0);
+        cmd.end();
+
+        queue.submit(submitInfo, nullptr);
+        queue.waitIdle();
+
+        std::vector<uint64_t> compactedSizes(count);
+        auto _ = mDevice.getQueryPoolResults(queryPool, 0, count, compactedSizes.size() * sizeof(uint64_t), compactedSizes.data(), sizeof(uint64_t),
+                                             vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+        mDevice.destroyQueryPool(queryPool);
+
+        for (uint32_t i = 0; i < count; i++)
+            newSizes[compactable[i]] = std::min<vk::DeviceSize>(compactedSizes[i], newSizes[compactable[i]]);
+    }
+
+    // [POI]
+    // Place every BLAS into new blocks with its new size, in order and without gaps, then copy them over
+    // compactable ones are compacted by the copy, the others are cloned, so the old blocks can be freed as a whole
+    std::vector<Block> newBlocks;
+    std::vector<Entry> newEntries(mEntries.size());
+
+    cmd.reset();
+    cmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+    for (uint32_t i = 0; i < mEntries.size(); i++)
+    {
+        auto& oldEntry = mEntries[i];
+        auto& newEntry = newEntries[i];
+
+        // freed ids keep their place, so the ids of the others don't change
+        newEntry = oldEntry;
+        if (oldEntry.Free)
+            continue;
+
+        newEntry.Size = newSizes[i];
+        Allocate(newBlocks, newEntry.Size, newEntry);
+        CreateHandle(newBlocks, newEntry);
+
+        bool compact = (oldEntry.Flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction) ? true : false;
+        cmd.copyAccelerationStructureKHR(vk::CopyAccelerationStructureInfoKHR()
+                                             .setSrc(oldEntry.Handle.AccelerationStructure)
+                                             .setDst(newEntry.Handle.AccelerationStructure)
+                                             .setMode(compact ? vk::CopyAccelerationStructureModeKHR::eCompact : vk::CopyAccelerationStructureModeKHR::eClone));
+    }
+
+    auto barrier = vk::MemoryBarrier()
+                       .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR)
+                       .setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR);
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                        {}, barrier, nullptr, nullptr);
+    cmd.end();
+
+    queue.submit(submitInfo, nullptr);
+    queue.waitIdle();
+
+    mDevice.freeCommandBuffers(pool, cmd);
+
+    for (auto& entry : mEntries)
+        mDevice.destroyAccelerationStructureKHR(entry.Handle.AccelerationStructure);
+    for (auto& block : mBlocks)
+        mVRDev->DestroyBuffer(block.Buffer);
+
+    mEntries = std::move(newEntries);
+    mBlocks = std::move(newBlocks);
+}
+
+BLASPoolStats BLASPool::GetStats() const
+{
+    BLASPoolStats stats = {};
+    stats.BLASCount = static_cast<uint32_t>(mEntries.size() - mFreeIds.size());
+    stats.AllocationCount = static_cast<uint32_t>(mBlocks.size());
+
+    for (auto& block : mBlocks)
+    {
+        stats.AllocatedBytes += block.Buffer.Size;
+        stats.UnusedBytes += block.Buffer.Size - block.Used;
+        for (auto& [offset, size] : block.FreeRanges)
+            stats.UnusedBytes += size;
+    }
+    for (auto& entry : mEntries)
+    {
+        stats.UsedBytes += entry.Size;
+        stats.AlignmentWaste += entry.Padding;
+    }
+    return stats;
+}
+
+void BLASPool::PrintStats(const char* label, const BLASPoolStats& stats)
+{
+    std::cout << "BLAS pool " << label << ": " << stats.BLASCount << " BLASes in " << stats.AllocationCount << " allocations, "
+              << stats.UsedBytes / 1024 << " KB used of " << stats.AllocatedBytes / 1024 << " KB, "
+              << stats.AlignmentWaste / 1024 << " KB alignment waste, " << stats.UnusedBytes / 1024 << " KB unused" << std::endl;
+}
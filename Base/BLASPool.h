@@ -0,0 +1,114 @@
+#pragma once
+
+#include "Common.h"
+#include "MeshLoader.h"
+
+// Memory used by the BLASes of a pool, to see how much the suballocation saves
+struct BLASPoolStats
+{
+    uint32_t BLASCount = 0;
+    uint32_t AllocationCount = 0;      // buffers allocated by the pool, without the pool this would be BLASCount
+    vk::DeviceSize AllocatedBytes = 0; // size of those buffers
+    vk::DeviceSize UsedBytes = 0;      // sum of the BLAS sizes
+    vk::DeviceSize AlignmentWaste = 0; // padding between the BLASes
+    vk::DeviceSize UnusedBytes = 0;    // space at the end of the buffers that is not used yet and space of freed BLASes
+};
+
+// Places BLASes at aligned offsets inside a few large buffers, instead of one allocation per BLAS
+// The BLASes are created and built with the Vulkan functions directly, because CreateBLAS(...) allocates a buffer for every BLAS
+// the handles look like the ones from CreateBLAS(...), so they work with the rest of the code,
+// but they belong to the pool and must not be passed to DestroyBLAS(...)
+class BLASPool
+{
+public:
+    void Create(vr::VulrayDevice* vrDev, vk::Device device, vk::PhysicalDevice physicalDevice, vk::DeviceSize blockSize = 32 * 1024 * 1024);
+
+    void Destroy();
+
+    // Creates a BLAS for a mesh inside one of the pool buffers, returns its id
+    // geometry i of the create info has to belong to mesh.GeometryReferences[i], like the create infos of CopySceneToBuffers(...)
+    uint32_t CreateBLAS(const vr::BLASCreateInfo& info, const Scene& scene, const Mesh& mesh);
+
+    // Destroys a BLAS, its space is reused by the BLASes created after it and its id by CreateBLAS(...)
+    // nothing on the GPU may still use it
+    void FreeBLAS(uint32_t id);
+
+    // Records a compacting copy of a BLAS that was built with eAllowCompaction into a new BLAS of compactedSize, returns the new id
+    // the new BLAS can be used after a barrier, the old one stays until it is freed
+    uint32_t CompactBLAS(uint32_t id, vk::DeviceSize compactedSize, vk::CommandBuffer cmd);
+
+    // Handle of a BLAS, Buffer.DevAddress is the address of the acceleration structure, the buffer itself is shared
+    const vr::BLASHandle& GetHandle(uint32_t id) const { return mEntries[id].Handle; }
+
+    // Number of ids, freed ones included
+    uint32_t GetBLASCount() const { return static_cast<uint32_t>(mEntries.size()); }
+
+    // Sizes queried when the BLAS was created, GetSize(...) is the current size, which is smaller after compaction
+    const vk::AccelerationStructureBuildSizesInfoKHR& GetBuildSizes(uint32_t id) const { return mEntries[id].BuildSizes; }
+    vk::DeviceSize GetSize(uint32_t id) const { return mEntries[id].Size; }
+    uint64_t GetPrimitiveCount(uint32_t id) const { return mEntries[id].PrimitiveCount; }
+
+    // Records the builds of the given BLASes with one scratch buffer, call FinishBuild() after cmd has finished executing
+    void Build(const std::vector<uint32_t>& ids, vk::CommandBuffer cmd);
+
+    // Same as above, but with a scratch buffer owned by the caller, it needs at least GetScratchSize(ids) bytes
+    void Build(const std::vector<uint32_t>& ids, vk::CommandBuffer cmd, const vr::AllocatedBuffer& scratchBuffer);
+
+    vk::DeviceSize GetScratchSize(const std::vector<uint32_t>& ids) const;
+
+    void FinishBuild();
+
+    // Compacts every BLAS that was built with eAllowCompaction and packs all of them tightly into new buffers,
+    // then frees the old buffers, blocks until the copies are done
+    // the handles and addresses change, so the instances that reference them have to be written afterwards
+    void CompactAndDefragment(vk::CommandPool pool, vk::Queue queue);
+
+    BLASPoolStats GetStats() const;
+
+    static void PrintStats(const char* label, const BLASPoolStats& stats);
+
+private:
+    struct Block
+    {
+        vr::AllocatedBuffer Buffer = {};
+        vk::DeviceSize Used = 0;
+        std::vector<std::pair<vk::DeviceSize, vk::DeviceSize>> FreeRanges; // offset and size of the space of freed BLASes below Used
+    };
+
+    struct Entry
+    {
+        vr::BLASHandle Handle = {};
+        uint32_t Block = 0;
+        vk::DeviceSize Offset = 0;
+        vk::DeviceSize Size = 0;
+        vk::DeviceSize Padding = 0; // alignment padding in front of the BLAS
+        vk::DeviceSize BuildScratchSize = 0;
+        vk::AccelerationStructureBuildSizesInfoKHR BuildSizes = {};
+        uint64_t PrimitiveCount = 0;
+        vk::BuildAccelerationStructureFlagsKHR Flags;
+        std::vector<vk::AccelerationStructureGeometryKHR> Geometries;
+        std::vector<vk::AccelerationStructureBuildRangeInfoKHR> Ranges;
+        bool Free = false; // freed by FreeBLAS(...), the id is waiting to be reused
+    };
+
+    // Returns the id of a new empty entry, a freed one if there is one
+    uint32_t AddEntry();
+
+    // Finds space for size bytes in blocks, creates a new block if none has enough left
+    void Allocate(std::vector<Block>& blocks, vk::DeviceSize size, Entry& outEntry);
+
+    // Creates the acceleration structure of an entry at its offset and fills its handle
+    void CreateHandle(const std::vector<Block>& blocks, Entry& entry);
+
+    vr::VulrayDevice* mVRDev = nullptr;
+    vk::Device mDevice = nullptr;
+
+    vk::DeviceSize mBlockSize = 0;
+    vk::DeviceSize mScratchAlignment = 0;
+
+    std::vector<Block> mBlocks;
+    std::vector<Entry> mEntries;
+    std::vector<uint32_t> mFreeIds;
+
+    vr::AllocatedBuffer mScratchBuffer = {};
+};
@@ -0,0 +1,389 @@
+#include "Common.h"
+#include "BufferUploader.h"
+
+#include <algorithm>
+#include <cstring>
+
+// two segments are enough to keep the transfer queue busy while the CPU fills the other one
+static constexpr uint32_t RingSegmentCount = 2;
+
+// the BAR of GPUs without resizable BAR is 256 MB, anything larger is the whole video memory
+static constexpr vk::DeviceSize SmallBARSize = 256ull * 1024 * 1024;
+
+void BufferUploader::Create(vr::VulrayDevice* vrDev, vk::Device device, vk::PhysicalDevice physicalDevice, const vr::CommandQueues& queues,
+                            BufferPlacement placement, vk::DeviceSize ringSize)
+{
+    mVRDev = vrDev;
+    mDevice = device;
+
+    // [POI]
+    // With resizable BAR (or on integrated GPUs) there is a device local and host visible memory type on a large heap,
+    // the CPU can write to video memory directly, which is cheaper than staging and copying
+    auto memoryProperties = physicalDevice.getMemoryProperties();
+    auto barFlags = vk::MemoryPropertyFlagBits::eDeviceLocal | vk::MemoryPropertyFlagBits::eHostVisible;
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+    {
+        auto& type = memoryProperties.memoryTypes[i];
+        if ((type.propertyFlags & barFlags) == barFlags && memoryProperties.memoryHeaps[type.heapIndex].size > SmallBARSize)
+            mResizableBAR = true;
+    }
+
+    if (placement == BufferPlacement::Auto)
+        placement = mResizableBAR ? BufferPlacement::Direct : BufferPlacement::Staged;
+    else if (placement == BufferPlacement::Direct && !mResizableBAR)
+        placement = BufferPlacement::Staged;
+    mPlacement = placement;
+
+    // a dedicated transfer queue runs the copies on the copy engine, next to whatever the graphics queue is doing
+    mGraphicsFamily = queues.GraphicsIndex;
+    if (queues.TransferQueue)
+    {
+        mTransferQueue = queues.TransferQueue;
+        mTransferFamily = queues.TransferIndex;
+    }
+    else
+    {
+        mTransferQueue = queues.GraphicsQueue;
+        mTransferFamily = queues.GraphicsIndex;
+    }
+
+    mRingSize = ringSize;
+    if (mPlacement == BufferPlacement::Staged)
+        CreateRing();
+}
+
+void BufferUploader::CreateRing()
+{
+    if (mRing.Buffer)
+        return;
+
+    mPool = mDevice.createCommandPool(vk::CommandPoolCreateInfo()
+                                          .setFlags(vk::CommandPoolCreateFlagBits::eResetCommandBuffer)
+                                          .setQueueFamilyIndex(mTransferFamily));
+
+    mSegmentSize = mRingSize / RingSegmentCount;
+    mRing = mVRDev->CreateBuffer(mSegmentSize * RingSegmentCount, vk::BufferUsageFlagBits::eTransferSrc,
+                                 VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+    mRingData = (char*)mVRDev->MapBuffer(mRing); // stays mapped until Destroy()
+
+    auto cmds = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(mPool, vk::CommandBufferLevel::ePrimary, RingSegmentCount));
+    mSegments.resize(RingSegmentCount);
+    for (uint32_t i = 0; i < RingSegmentCount; i++)
+    {
+        mSegments[i].Cmd = cmds[i];
+        mSegments[i].Fence = mDevice.createFence(vk::FenceCreateInfo());
+    }
+}
+
+void BufferUploader::Destroy()
+{
+    for (auto& segment : mSegments)
+    {
+        WaitSegment(segment);
+        mDevice.destroyFence(segment.Fence);
+    }
+    mSegments.clear();
+
+    if (mRing.Buffer)
+    {
+        mVRDev->UnmapBuffer(mRing);
+        mVRDev->DestroyBuffer(mRing);
+    }
+    mRing = {};
+    mRingData = nullptr;
+
+    if (mPool)
+        mDevice.destroyCommandPool(mPool);
+    mPool = nullptr;
+
+    for (auto& write : mPendingWrites)
+        mStagingBuffers.push_back(write.Staging);
+    for (auto& staging : mStagingBuffers)
+    {
+        mVRDev->UnmapBuffer(staging);
+        mVRDev->DestroyBuffer(staging);
+    }
+    mPendingWrites.clear();
+    mStagingBuffers.clear();
+    mStagedBuffers.clear();
+    mFallbackBuffers.clear();
+}
+
+vr::AllocatedBuffer BufferUploader::CreateBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage)
+{
+    if (mPlacement == BufferPlacement::Staged)
+        return mVRDev->CreateBuffer(size, usage | vk::BufferUsageFlagBits::eTransferDst, 0);
+
+    // random host access makes VMA prefer host cached system memory over the BAR
+    if (mPlacement == BufferPlacement::HostVisible)
+        return mVRDev->CreateBuffer(size, usage, VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT);
+
+    // [POI]
+    // VMA prefers device local memory for sequential host writes and GPU reads, but that is a preference:
+    // once the BAR is full the buffer can end up in system memory, then it is replaced by a device local buffer that is staged
+    auto buffer = mVRDev->CreateBuffer(size, usage, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+
+    VkMemoryPropertyFlags properties = 0;
+    vmaGetAllocationMemoryProperties(mVRDev->GetAllocator(), buffer.Allocation, &properties);
+    if (properties & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+        return buffer;
+
+    mVRDev->DestroyBuffer(buffer);
+    CreateRing();
+    buffer = mVRDev->CreateBuffer(size, usage | vk::BufferUsageFlagBits::eTransferDst, 0);
+    mFallbackBuffers.push_back(buffer.Buffer);
+    mStats.StagedFallbacks++;
+    return buffer;
+}
+
+bool BufferUploader::IsStaged(const vr::AllocatedBuffer& buffer) const
+{
+    if (mPlacement == BufferPlacement::Staged)
+        return true;
+    return std::find(mFallbackBuffers.begin(), mFallbackBuffers.end(), buffer.Buffer) != mFallbackBuffers.end();
+}
+
+void* BufferUploader::BeginWrite(const vr::AllocatedBuffer& buffer)
+{
+    if (!mTiming)
+    {
+        mTimer.Start();
+        mTiming = true;
+    }
+
+    if (!IsStaged(buffer))
+        return mVRDev->MapBuffer(buffer);
+
+    // the caller writes into the staging buffer and the copy engine reads from it, the data is written once on the CPU
+    // the ring is too small for a whole vertex buffer and is meant for Upload(...), which can be cut into pieces
+    auto& write = mPendingWrites.emplace_back();
+    write.Buffer = buffer.Buffer;
+    write.Staging = mVRDev->CreateBuffer(buffer.Size, vk::BufferUsageFlagBits::eTransferSrc, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+    return mVRDev->MapBuffer(write.Staging);
+}
+
+void BufferUploader::EndWrite(const vr::AllocatedBuffer& buffer)
+{
+    if (!IsStaged(buffer))
+    {
+        if (mPlacement == BufferPlacement::HostVisible)
+            vmaFlushAllocation(mVRDev->GetAllocator(), buffer.Allocation, 0, VK_WHOLE_SIZE); // cached memory may not be coherent
+        mVRDev->UnmapBuffer(buffer);
+        mStats.BytesDirect += buffer.Size;
+        return;
+    }
+
+    auto it = std::find_if(mPendingWrites.begin(), mPendingWrites.end(), [&](const PendingWrite& write) { return write.Buffer == buffer.Buffer; });
+    if (it == mPendingWrites.end())
+    {
+        VULRAY_LOG_ERROR("BufferUploader: EndWrite without BeginWrite");
+        return;
+    }
+
+    if (std::find(mStagedBuffers.begin(), mStagedBuffers.end(), buffer.Buffer) == mStagedBuffers.end())
+        mStagedBuffers.push_back(buffer.Buffer);
+
+    vmaFlushAllocation(mVRDev->GetAllocator(), it->Staging.Allocation, 0, VK_WHOLE_SIZE);
+    GetSegment().Cmd.copyBuffer(it->Staging.Buffer, buffer.Buffer, vk::BufferCopy(0, 0, buffer.Size));
+    mStats.BytesStaged += buffer.Size;
+
+    mStagingBuffers.push_back(it->Staging);
+    mPendingWrites.erase(it);
+}
+
+void BufferUploader::Upload(const vr::AllocatedBuffer& buffer, vk::DeviceSize offset, const void* data, vk::DeviceSize size)
+{
+    if (!mTiming)
+    {
+        mTimer.Start();
+        mTiming = true;
+    }
+
+    if (!IsStaged(buffer))
+    {
+        char* mapped = (char*)mVRDev->MapBuffer(buffer);
+        memcpy(mapped + offset, data, size);
+        if (mPlacement == BufferPlacement::HostVisible)
+            vmaFlushAllocation(mVRDev->GetAllocator(), buffer.Allocation, offset, size);
+        mVRDev->UnmapBuffer(buffer);
+        mStats.BytesDirect += size;
+        return;
+    }
+
+    if (std::find(mStagedBuffers.begin(), mStagedBuffers.end(), buffer.Buffer) == mStagedBuffers.end())
+        mStagedBuffers.push_back(buffer.Buffer);
+
+    // [POI]
+    // The data is cut into pieces that fit into the free space of the current segment, a full segment is submitted
+    // and the next one is reused as soon as its last copies have finished
+    const char* source = (const char*)data;
+    while (size > 0)
+    {
+        RingSegment* segment = &GetSegment();
+        if (segment->Used == mSegmentSize)
+        {
+            SubmitSegment(*segment, false);
+            mCurrentSegment = (mCurrentSegment + 1) % RingSegmentCount;
+            segment = &GetSegment();
+        }
+
+        vk::DeviceSize chunk = std::min(size, mSegmentSize - segment->Used);
+        vk::DeviceSize ringOffset = mCurrentSegment * mSegmentSize + segment->Used;
+
+        memcpy(mRingData + ringOffset, source, chunk);
+        segment->Cmd.copyBuffer(mRing.Buffer, buffer.Buffer, vk::BufferCopy(ringOffset, offset, chunk));
+
+        // the next copy starts aligned, copies from aligned offsets are faster on most copy engines
+        segment->Used = std::min((segment->Used + chunk + 15) & ~vk::DeviceSize(15), mSegmentSize);
+
+        source += chunk;
+        offset += chunk;
+        size -= chunk;
+        mStats.BytesStaged += chunk;
+    }
+}
+
+void BufferUploader::Finish(vk::CommandBuffer cmd)
+{
+    bool crossFamily = mTransferFamily != mGraphicsFamily;
+
+    if (mRing.Buffer)
+    {
+        if (!mPendingWrites.empty())
+            VULRAY_LOG_ERROR("BufferUploader: BeginWrite without EndWrite, the buffer is not uploaded");
+        for (auto& write : mPendingWrites)
+            mStagingBuffers.push_back(write.Staging);
+        mPendingWrites.clear();
+
+        // the release barriers go into the last command buffer, it is submitted after all the copies of the other segments
+        auto& segment = GetSegment();
+        SubmitSegment(segment, crossFamily);
+        mCurrentSegment = (mCurrentSegment + 1) % RingSegmentCount;
+
+        for (auto& s : mSegments)
+            WaitSegment(s);
+
+        for (auto& staging : mStagingBuffers)
+        {
+            mVRDev->UnmapBuffer(staging);
+            mVRDev->DestroyBuffer(staging);
+        }
+        mStagingBuffers.clear();
+    }
+
+    // the fence wait on the host orders the release before the acquire, so no semaphore is needed
+    std::vector<vk::BufferMemoryBarrier> acquireBarriers;
+    if (crossFamily)
+    {
+        for (auto buffer : mStagedBuffers)
+        {
+            acquireBarriers.push_back(vk::BufferMemoryBarrier()
+                                          .setSrcAccessMask({})
+                                          .setDstAccessMask(vk::AccessFlagBits::eShaderRead)
+                                          .setSrcQueueFamilyIndex(mTransferFamily)
+                                          .setDstQueueFamilyIndex(mGraphicsFamily)
+                                          .setBuffer(buffer)
+                                          .setOffset(0)
+                                          .setSize(VK_WHOLE_SIZE));
+        }
+    }
+    mStagedBuffers.clear();
+
+    auto uploadBarrier = vk::MemoryBarrier()
+                             .setSrcAccessMask(vk::AccessFlagBits::eTransferWrite | vk::AccessFlagBits::eHostWrite)
+                             .setDstAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eAccelerationStructureReadKHR);
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer | vk::PipelineStageFlagBits::eHost,
+                        vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR | vk::PipelineStageFlagBits::eRayTracingShaderKHR |
+                            vk::PipelineStageFlagBits::eComputeShader,
+                        {}, uploadBarrier, acquireBarriers, nullptr);
+
+    if (mTiming)
+    {
+        mStats.UploadMs += mTimer.Endd(TimerAccuracy::MilliSec);
+        mTiming = false;
+    }
+}
+
+const char* BufferUploader::GetPlacementName(BufferPlacement placement)
+{
+    switch (placement)
+    {
+    case BufferPlacement::HostVisible:
+        return "host visible";
+    case BufferPlacement::Staged:
+        return "device local, staged";
+    case BufferPlacement::Direct:
+        return "device local, resizable BAR";
+    default:
+        return "auto";
+    }
+}
+
+BufferPlacement BufferUploader::ParsePlacement(const char* name)
+{
+    std::string value = name ? name : "";
+    if (value == "host")
+        return BufferPlacement::HostVisible;
+    if (value == "staged")
+        return BufferPlacement::Staged;
+    if (value == "direct")
+        return BufferPlacement::Direct;
+    return BufferPlacement::Auto;
+}
+
+BufferUploader::RingSegment& BufferUploader::GetSegment()
+{
+    auto& segment = mSegments[mCurrentSegment];
+    if (!segment.Recording)
+    {
+        // the CPU is about to overwrite the segment, its last copies have to be done
+        WaitSegment(segment);
+        segment.Used = 0;
+        segment.Cmd.reset();
+        segment.Cmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+        segment.Recording = true;
+    }
+    return segment;
+}
+
+void BufferUploader::SubmitSegment(RingSegment& segment, bool releaseBuffers)
+{
+    if (releaseBuffers)
+    {
+        // the queue family release, the acquire is recorded by Finish(...) into the command buffer of the graphics queue
+        std::vector<vk::BufferMemoryBarrier> releaseBarriers;
+        for (auto buffer : mStagedBuffers)
+        {
+            releaseBarriers.push_back(vk::BufferMemoryBarrier()
+                                          .setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+                                          .setDstAccessMask({})
+                                          .setSrcQueueFamilyIndex(mTransferFamily)
+                                          .setDstQueueFamilyIndex(mGraphicsFamily)
+                                          .setBuffer(buffer)
+                                          .setOffset(0)
+                                          .setSize(VK_WHOLE_SIZE));
+        }
+        segment.Cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe,
+                                    {}, nullptr, releaseBarriers, nullptr);
+    }
+
+    segment.Cmd.end();
+    segment.Recording = false;
+
+    auto submitInfo = vk::SubmitInfo()
+                          .setCommandBufferCount(1)
+                          .setPCommandBuffers(&segment.Cmd);
+    mTransferQueue.submit(submitInfo, segment.Fence);
+    segment.Pending = true;
+    mStats.Submits++;
+}
+
+void BufferUploader::WaitSegment(RingSegment& segment)
+{
+    if (!segment.Pending)
+        return;
+
+    auto _ = mDevice.waitForFences(segment.Fence, VK_TRUE, UINT64_MAX);
+    mDevice.resetFences(segment.Fence);
+    segment.Pending = false;
+}
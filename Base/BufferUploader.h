@@ -0,0 +1,120 @@
+#pragma once
+
+#include "Common.h"
+
+// Where the buffers that the shaders read every frame are placed, eg. vertices, indices and materials
+enum class BufferPlacement
+{
+    Auto,        // Direct with resizable BAR, Staged without it
+    HostVisible, // host visible system memory that is written directly, on discrete GPUs the shaders read it over PCIe
+    Staged,      // device local memory, written through the staging ring with copies on the transfer queue
+    Direct       // device local and host visible memory (resizable BAR), written directly, a buffer that doesn't get it is Staged
+};
+
+// What the uploader has written since it was created
+struct UploadStats
+{
+    uint64_t BytesStaged = 0;  // copied through the ring
+    uint64_t BytesDirect = 0;  // written straight into mapped buffers
+    uint32_t Submits = 0;      // command buffers submitted to the transfer queue
+    uint32_t StagedFallbacks = 0; // Direct buffers that didn't get device local memory and were staged instead
+    double UploadMs = 0.0;     // CPU time from the first write until Finish(...) returned
+};
+
+// Creates buffers for data the GPU reads every frame and fills them
+// Without resizable BAR the buffers are device local and the data is streamed through a fixed size staging ring:
+// the ring is split into segments, while the copies of one segment run on the transfer queue the next one is filled
+class BufferUploader
+{
+public:
+    void Create(vr::VulrayDevice* vrDev,
+                vk::Device device,
+                vk::PhysicalDevice physicalDevice,
+                const vr::CommandQueues& queues,
+                BufferPlacement placement = BufferPlacement::Auto,
+                vk::DeviceSize ringSize = 32 * 1024 * 1024);
+
+    void Destroy();
+
+    // Creates a buffer that is written with BeginWrite(...) / Upload(...), placed as the placement of the uploader says
+    vr::AllocatedBuffer CreateBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage);
+
+    // Returns memory to write the whole buffer to, the mapped buffer itself if it is host visible,
+    // otherwise a mapped staging buffer that EndWrite(...) copies to the buffer on the transfer queue
+    void* BeginWrite(const vr::AllocatedBuffer& buffer);
+    void EndWrite(const vr::AllocatedBuffer& buffer);
+
+    // Copies data to a range of a buffer created by CreateBuffer(...)
+    void Upload(const vr::AllocatedBuffer& buffer, vk::DeviceSize offset, const void* data, vk::DeviceSize size);
+
+    // [POI]
+    // Submits the copies still in the ring and waits for all of them, then records into cmd what the queue that
+    // uses the buffers needs: the queue family acquire of the buffers if the transfer queue is from another family
+    // and a barrier that makes the data visible to acceleration structure builds and shaders
+    void Finish(vk::CommandBuffer cmd);
+
+    // The placement that is used, Auto is resolved when the uploader is created
+    BufferPlacement GetPlacement() const { return mPlacement; }
+    static const char* GetPlacementName(BufferPlacement placement);
+
+    // "auto", "host", "staged" or "direct", anything else is Auto
+    static BufferPlacement ParsePlacement(const char* name);
+
+    bool HasResizableBAR() const { return mResizableBAR; }
+
+    const UploadStats& GetStats() const { return mStats; }
+
+private:
+    struct RingSegment
+    {
+        vk::CommandBuffer Cmd = nullptr;
+        vk::Fence Fence = nullptr;
+        vk::DeviceSize Used = 0;
+        bool Recording = false;
+        bool Pending = false; // submitted and the fence hasn't been waited for
+    };
+
+    struct PendingWrite
+    {
+        vk::Buffer Buffer = nullptr;
+        vr::AllocatedBuffer Staging = {}; // mapped until Finish(...) has waited for its copy
+    };
+
+    // Creates the ring and the command buffers of its segments, if they don't exist yet
+    void CreateRing();
+
+    // True if the buffer is written through the transfer queue
+    bool IsStaged(const vr::AllocatedBuffer& buffer) const;
+
+    // Returns the segment that is filled now, begins its command buffer if it isn't recording yet
+    RingSegment& GetSegment();
+    void SubmitSegment(RingSegment& segment, bool releaseBuffers);
+    void WaitSegment(RingSegment& segment);
+
+    vr::VulrayDevice* mVRDev = nullptr;
+    vk::Device mDevice = nullptr;
+
+    BufferPlacement mPlacement = BufferPlacement::Auto;
+    bool mResizableBAR = false;
+
+    vk::Queue mTransferQueue = nullptr;
+    uint32_t mTransferFamily = 0;
+    uint32_t mGraphicsFamily = 0;
+    vk::CommandPool mPool = nullptr;
+
+    vk::DeviceSize mRingSize = 0;
+    vr::AllocatedBuffer mRing = {};
+    char* mRingData = nullptr;
+    vk::DeviceSize mSegmentSize = 0;
+    std::vector<RingSegment> mSegments;
+    uint32_t mCurrentSegment = 0;
+
+    std::vector<PendingWrite> mPendingWrites;
+    std::vector<vr::AllocatedBuffer> mStagingBuffers; // of the writes that ended, freed when their copies are done
+    std::vector<vk::Buffer> mStagedBuffers;   // written through the transfer queue, they need the queue family transfer
+    std::vector<vk::Buffer> mFallbackBuffers; // Direct buffers that are staged because they didn't get device local memory
+
+    UploadStats mStats = {};
+    SimpleTimer mTimer;
+    bool mTiming = false;
+};
@@ -0,0 +1,122 @@
+#include "Common.h"
+#include "BuildPolicy.h"
+
+BLASUsage BuildFlagPolicy::GuessUsage(const Scene& scene, const Mesh& mesh)
+{
+    for (auto geomRef : mesh.GeometryReferences)
+    {
+        auto& geom = scene.Geometries[geomRef];
+        if (!geom.Skin.empty() || !geom.MorphTargets.empty())
+            return BLASUsage::Deforming;
+    }
+    return BLASUsage::Static;
+}
+
+vk::BuildAccelerationStructureFlagsKHR BuildFlagPolicy::GetFlagsForUsage(BLASUsage usage)
+{
+    // [POI]
+    // Static BLASes are traced for their whole life, so they get the best trace performance and can be compacted
+    // occasionally changing ones keep the fast trace, but can be updated instead of rebuilt
+    // deforming ones are refit every frame, so a fast build matters more than the quality of the tree
+    switch (usage)
+    {
+    case BLASUsage::Occasional:
+        return vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
+    case BLASUsage::Deforming:
+        return vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
+    case BLASUsage::Static:
+    default:
+        return vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace | vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction;
+    }
+}
+
+const char* BuildFlagPolicy::GetUsageName(BLASUsage usage)
+{
+    switch (usage)
+    {
+    case BLASUsage::Occasional:
+        return "occasional";
+    case BLASUsage::Deforming:
+        return "deforming";
+    case BLASUsage::Static:
+    default:
+        return "static";
+    }
+}
+
+uint32_t BuildFlagPolicy::Register(const std::string& name, BLASUsage initialUsage)
+{
+    auto& entry = mEntries.emplace_back(Entry{});
+    entry.Name = name;
+    entry.Usage = initialUsage;
+
+    std::cout << "BuildPolicy: '" << name << "' starts as " << GetUsageName(initialUsage)
+              << ", flags " << vk::to_string(GetFlagsForUsage(initialUsage)) << std::endl;
+
+    return static_cast<uint32_t>(mEntries.size() - 1);
+}
+
+void BuildFlagPolicy::RecordChange(uint32_t id)
+{
+    mEntries[id].Changes++;
+}
+
+void BuildFlagPolicy::RecordBuildTime(uint32_t id, double ms)
+{
+    mEntries[id].BuildMs += ms;
+    mEntries[id].BuildCount++;
+}
+
+void BuildFlagPolicy::RecordTraceTime(double ms)
+{
+    mTraceMs += ms;
+    mTraceCount++;
+}
+
+bool BuildFlagPolicy::EndFrame(std::vector<uint32_t>& outChanged)
+{
+    outChanged.clear();
+
+    if (++mWindowFrame < Settings.WindowFrames)
+        return false;
+
+    double traceMs = mTraceCount > 0 ? mTraceMs / mTraceCount : 0.0;
+
+    for (uint32_t id = 0; id < mEntries.size(); id++)
+    {
+        auto& entry = mEntries[id];
+        float rate = static_cast<float>(entry.Changes) / mWindowFrame;
+
+        entry.QuietWindows = entry.Changes == 0 ? entry.QuietWindows + 1 : 0;
+
+        BLASUsage usage = entry.Usage;
+        if (rate >= Settings.DeformingRate)
+            usage = BLASUsage::Deforming;
+        else if (entry.Changes > 0)
+            usage = BLASUsage::Occasional;
+        else if (entry.QuietWindows >= Settings.StaticWindows)
+            usage = BLASUsage::Static;
+
+        if (usage != entry.Usage)
+        {
+            double buildMs = entry.BuildCount > 0 ? entry.BuildMs / entry.BuildCount : 0.0;
+
+            std::cout << "BuildPolicy: '" << entry.Name << "' " << GetUsageName(entry.Usage) << " -> " << GetUsageName(usage)
+                      << ", " << rate << " changes per frame, build " << buildMs << " ms, trace " << traceMs << " ms"
+                      << ", flags " << vk::to_string(GetFlagsForUsage(usage)) << std::endl;
+
+            entry.Usage = usage;
+            outChanged.push_back(id);
+        }
+
+        entry.Changes = 0;
+        entry.BuildMs = 0.0;
+        entry.BuildCount = 0;
+    }
+
+    mWindowFrame = 0;
+    mTraceMs = 0.0;
+    mTraceCount = 0;
+
+    return !outChanged.empty();
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "Common.h"
+#include "MeshLoader.h"
+
+// How often the geometry of a BLAS changes
+enum class BLASUsage
+{
+    Static,     // built once, eg. level geometry
+    Occasional, // changes every now and then, eg. destructible objects
+    Deforming   // changes (almost) every frame, eg. skinned characters
+};
+
+struct BuildPolicySettings
+{
+    // number of frames the change rate is measured over, a BLAS is reclassified at the end of every window
+    uint32_t WindowFrames = 120;
+
+    // changes per frame at and above which a BLAS counts as deforming
+    float DeformingRate = 0.5f;
+
+    // a BLAS has to stay unchanged for this many windows before it counts as static again,
+    // so a short pause doesn't throw away the update flags
+    uint32_t StaticWindows = 4;
+};
+
+// Picks the build flags of every BLAS from how often it changes instead of hard coding them
+// every BLAS starts with a guess, eg. from GuessUsage(...), and is reclassified from the changes observed at runtime
+class BuildFlagPolicy
+{
+public:
+    BuildPolicySettings Settings;
+
+    // Skinned and morphed meshes are deforming, everything else is static until it changes
+    static BLASUsage GuessUsage(const Scene& scene, const Mesh& mesh);
+
+    static vk::BuildAccelerationStructureFlagsKHR GetFlagsForUsage(BLASUsage usage);
+
+    static const char* GetUsageName(BLASUsage usage);
+
+    // Registers a BLAS, returns the id used by the other functions, name is only used for the log
+    uint32_t Register(const std::string& name, BLASUsage initialUsage);
+
+    BLASUsage GetUsage(uint32_t id) const { return mEntries[id].Usage; }
+
+    vk::BuildAccelerationStructureFlagsKHR GetFlags(uint32_t id) const { return GetFlagsForUsage(mEntries[id].Usage); }
+
+    // Call whenever the geometry of a BLAS changed this frame, no matter if it was updated or rebuilt
+    void RecordChange(uint32_t id);
+
+    // GPU time of the builds / updates of a BLAS and of tracing rays, eg. from a GPUTimer, only used for the log
+    void RecordBuildTime(uint32_t id, double ms);
+    void RecordTraceTime(double ms);
+
+    // Call once per frame, reclassifies the BLASes at the end of a window
+    // returns true and writes the ids of the BLASes whose flags changed to outChanged,
+    // those have to be recreated with GetFlags(id) for the new flags to take effect
+    bool EndFrame(std::vector<uint32_t>& outChanged);
+
+private:
+    struct Entry
+    {
+        std::string Name;
+        BLASUsage Usage = BLASUsage::Static;
+        uint32_t Changes = 0;      // changes in the current window
+        uint32_t QuietWindows = 0; // windows in a row without a change
+        double BuildMs = 0.0;
+        uint32_t BuildCount = 0;
+    };
+
+    std::vector<Entry> mEntries;
+
+    uint32_t mWindowFrame = 0;
+    double mTraceMs = 0.0;
+    uint32_t mTraceCount = 0;
+};
@@ -0,0 +1,90 @@
+#include "Common.h"
+#include "Culling.h"
+#include "ParallelFor.h"
+
+void InstanceCuller::Update(Camera& camera)
+{
+    mCameraPosition = camera.Position;
+
+    // [POI]
+    // The frustum planes can be read straight from the rows of the view projection matrix (Gribb / Hartmann)
+    glm::mat4 viewProj = camera.GetProjectionMatrix() * camera.GetViewMatrix();
+    glm::mat4 rows = glm::transpose(viewProj);
+
+    mPlanes[0] = rows[3] + rows[0]; // left
+    mPlanes[1] = rows[3] - rows[0]; // right
+    mPlanes[2] = rows[3] + rows[1]; // bottom
+    mPlanes[3] = rows[3] - rows[1]; // top
+
+    for (auto& plane : mPlanes)
+        plane /= glm::length(glm::vec3(plane));
+}
+
+bool InstanceCuller::IsVisible(const AABB& objectBounds, const vk::TransformMatrixKHR& transform) const
+{
+    if (objectBounds.IsEmpty())
+        return false;
+
+    glm::mat3x4 rowMajor;
+    memcpy(&rowMajor, &transform, sizeof(rowMajor));
+    AABB bounds = objectBounds.Transformed(rowMajor);
+
+    if (Settings.MaxDistance > 0.0f)
+    {
+        // distance from the camera to the closest point of the box
+        glm::vec3 closest = glm::clamp(mCameraPosition, bounds.Min, bounds.Max);
+        glm::vec3 toBox = closest - mCameraPosition;
+        if (glm::dot(toBox, toBox) > Settings.MaxDistance * Settings.MaxDistance)
+            return false;
+    }
+
+    if (Settings.FrustumCulling)
+    {
+        glm::vec3 center = (bounds.Min + bounds.Max) * 0.5f;
+        glm::vec3 extents = (bounds.Max - bounds.Min) * 0.5f;
+
+        for (auto& plane : mPlanes)
+        {
+            glm::vec3 normal = glm::vec3(plane);
+            float distance = glm::dot(normal, center) + plane.w;
+            float radius = glm::dot(glm::abs(normal), extents);
+
+            // the whole box is on the outer side of the inflated plane
+            if (distance + radius < -Settings.FrustumMargin)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void InstanceCuller::Cull(const vk::AccelerationStructureInstanceKHR* instances,
+                          const uint32_t* boundsIndices,
+                          const AABB* bounds,
+                          uint32_t count,
+                          std::vector<uint32_t>& outVisible,
+                          ParallelFor* workers)
+{
+    mVisible.resize(count);
+
+    auto cullRange = [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            const AABB& instanceBounds = bounds[boundsIndices ? boundsIndices[i] : i];
+            mVisible[i] = IsVisible(instanceBounds, instances[i].transform) ? 1 : 0;
+        }
+    };
+
+    if (workers)
+        workers->Run(count, 16384, cullRange);
+    else
+        cullRange(0, count);
+
+    // compacting is a single pass over a byte array, not worth splitting
+    outVisible.clear();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (mVisible[i])
+            outVisible.push_back(i);
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "Common.h"
+#include "MeshLoader.h"
+
+class ParallelFor;
+
+struct CullSettings
+{
+    // instances whose bounds are further away from the camera than this are dropped, 0 disables distance culling
+    float MaxDistance = 0.0f;
+
+    // drops instances outside of the view frustum, only correct if nothing but primary rays is traced,
+    // reflections and shadow rays can hit instances that are behind the camera
+    bool FrustumCulling = false;
+
+    // the frustum planes are pushed outwards by this distance, so instances at the border of the screen don't pop in
+    float FrustumMargin = 2.0f;
+};
+
+// Finds the TLAS instances that are close enough to the camera / inside the view frustum
+// so only those are built into the TLAS, which makes the TLAS build cheaper in huge open scenes
+class InstanceCuller
+{
+public:
+    CullSettings Settings;
+
+    // Takes the position and the frustum planes of the camera, call every frame before culling
+    void Update(Camera& camera);
+
+    // objectBounds are the bounds of the BLAS of the instance, eg. Mesh::Bounds
+    bool IsVisible(const AABB& objectBounds, const vk::TransformMatrixKHR& transform) const;
+
+    // Writes the indices of the visible instances to outVisible, in the same order as the instances
+    // the bounds of instance i are bounds[boundsIndices[i]], or bounds[i] if boundsIndices is null
+    void Cull(const vk::AccelerationStructureInstanceKHR* instances,
+              const uint32_t* boundsIndices,
+              const AABB* bounds,
+              uint32_t count,
+              std::vector<uint32_t>& outVisible,
+              ParallelFor* workers = nullptr);
+
+    // The state of the last Update(...), for culling somewhere else, eg. in a compute shader
+    const glm::vec4* GetPlanes() const { return mPlanes; }
+    const glm::vec3& GetCameraPosition() const { return mCameraPosition; }
+    bool IsEnabled() const { return Settings.MaxDistance > 0.0f || Settings.FrustumCulling; }
+
+private:
+    glm::vec3 mCameraPosition = glm::vec3(0.0f);
+
+    // left, right, bottom, top, normals point inside, there is no near and far plane, MaxDistance does that job
+    glm::vec4 mPlanes[4] = {};
+
+    std::vector<uint8_t> mVisible; // visibility of every instance, written in parallel and compacted afterwards
+};
@@ -0,0 +1,203 @@
+#include "Common.h"
+#include "Deformer.h"
+#include "Helpers.h"
+
+// has to match the layout in Deformation.hlsl
+struct DeformerPushConstants
+{
+    vk::DeviceAddress RestVertices;
+    vk::DeviceAddress SkinVertices;
+    vk::DeviceAddress MorphDeltas;
+    vk::DeviceAddress MorphWeights;
+    vk::DeviceAddress JointMatrices;
+    vk::DeviceAddress OutVertices;
+    uint32_t VertexCount;
+    uint32_t TargetCount;
+    uint32_t JointCount;
+    uint32_t Padding;
+};
+
+static constexpr uint32_t DeformerGroupSize = 64; // numthreads in Deformation.hlsl
+
+void Deformer::Create(vr::VulrayDevice* vrDev,
+                      vk::Device device,
+                      ShaderCompiler& compiler,
+                      const Geometry& geom,
+                      uint32_t jointCount,
+                      uint32_t framesInFlight,
+                      vk::CommandBuffer uploadCmd)
+{
+    mVRDev = vrDev;
+    mDevice = device;
+    VertexCount = static_cast<uint32_t>(geom.Vertices.size());
+    mTargetCount = static_cast<uint32_t>(geom.MorphTargets.size());
+    mJointCount = geom.Skin.empty() ? 0 : jointCount;
+
+    // pack the morph targets in the same layout as the vertices, so the shader can use the same stride
+    std::vector<Vertex> morphDeltas(mTargetCount * VertexCount);
+    for (uint32_t t = 0; t < mTargetCount; t++)
+    {
+        for (uint32_t v = 0; v < VertexCount; v++)
+        {
+            morphDeltas[t * VertexCount + v].Position = geom.MorphTargets[t].PositionDeltas[v];
+            morphDeltas[t * VertexCount + v].Normal = geom.MorphTargets[t].NormalDeltas[v];
+        }
+    }
+
+    vk::DeviceSize restSize = VertexCount * sizeof(Vertex);
+    vk::DeviceSize skinSize = mJointCount > 0 ? VertexCount * sizeof(SkinVertex) : 0;
+    vk::DeviceSize morphSize = morphDeltas.size() * sizeof(Vertex);
+
+    auto deviceUsage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst;
+
+    // [POI]
+    // All the inputs are read every frame, so they are placed in device local memory and uploaded once through a staging buffer
+    mRestBuffer = mVRDev->CreateBuffer(restSize, deviceUsage, 0);
+    if (skinSize > 0)
+        mSkinBuffer = mVRDev->CreateBuffer(skinSize, deviceUsage, 0);
+    if (morphSize > 0)
+        mMorphBuffer = mVRDev->CreateBuffer(morphSize, deviceUsage, 0);
+
+    // The output is written by the compute shader and read by the BLAS build and the closest hit shaders
+    OutputBuffer = mVRDev->CreateBuffer(
+        restSize,
+        vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer,
+        0);
+
+    mStagingBuffer = mVRDev->CreateBuffer(
+        restSize + skinSize + morphSize,
+        vk::BufferUsageFlagBits::eTransferSrc,
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+
+    char* staging = (char*)mVRDev->MapBuffer(mStagingBuffer);
+    memcpy(staging, geom.Vertices.data(), restSize);
+    if (skinSize > 0)
+        memcpy(staging + restSize, geom.Skin.data(), skinSize);
+    if (morphSize > 0)
+        memcpy(staging + restSize + skinSize, morphDeltas.data(), morphSize);
+    mVRDev->UnmapBuffer(mStagingBuffer);
+
+    uploadCmd.copyBuffer(mStagingBuffer.Buffer, mRestBuffer.Buffer, vk::BufferCopy(0, 0, restSize));
+    if (skinSize > 0)
+        uploadCmd.copyBuffer(mStagingBuffer.Buffer, mSkinBuffer.Buffer, vk::BufferCopy(restSize, 0, skinSize));
+    if (morphSize > 0)
+        uploadCmd.copyBuffer(mStagingBuffer.Buffer, mMorphBuffer.Buffer, vk::BufferCopy(restSize + skinSize, 0, morphSize));
+
+    // make the copies visible to the compute shader
+    auto uploadBarrier = vk::MemoryBarrier()
+                             .setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+                             .setDstAccessMask(vk::AccessFlagBits::eShaderRead);
+    uploadCmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader,
+                              {}, uploadBarrier, nullptr, nullptr);
+
+    // Per frame data, weights first and then the joints, every frame gets its own slice
+    mJointOffset = AlignUp(std::max(mTargetCount, 1u) * sizeof(float), 16);
+    mFrameStride = AlignUp(mJointOffset + std::max(mJointCount, 1u) * sizeof(vk::TransformMatrixKHR), 256);
+
+    mFrameBuffer = mVRDev->CreateBuffer(
+        mFrameStride * framesInFlight,
+        vk::BufferUsageFlagBits::eStorageBuffer,
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+    mFrameData = (char*)mVRDev->MapBuffer(mFrameBuffer); // stays mapped until Destroy()
+    memset(mFrameData, 0, mFrameStride * framesInFlight);
+
+    // Create the compute pipeline, all buffers are passed as device addresses in push constants
+    auto pushConstantRange = vk::PushConstantRange()
+                                 .setStageFlags(vk::ShaderStageFlagBits::eCompute)
+                                 .setOffset(0)
+                                 .setSize(sizeof(DeformerPushConstants));
+
+    mPipelineLayout = mDevice.createPipelineLayout(vk::PipelineLayoutCreateInfo().setPushConstantRanges(pushConstantRange));
+
+    auto spv = compiler.CompileSPIRVFromFile("Shaders/Deformation/Deformation.hlsl", L"cs_6_5");
+    auto shaderModule = mVRDev->CreateShaderFromSPV(spv);
+
+    auto stageInfo = vk::PipelineShaderStageCreateInfo()
+                         .setStage(vk::ShaderStageFlagBits::eCompute)
+                         .setModule(shaderModule.Module)
+                         .setPName("main");
+
+    mPipeline = mDevice.createComputePipeline(nullptr, vk::ComputePipelineCreateInfo().setStage(stageInfo).setLayout(mPipelineLayout)).value;
+
+    mDevice.destroyShaderModule(shaderModule.Module);
+}
+
+void Deformer::FinishUpload()
+{
+    if (mStagingBuffer.Buffer)
+        mVRDev->DestroyBuffer(mStagingBuffer);
+    mStagingBuffer = {};
+}
+
+void Deformer::SetMorphWeights(const std::vector<float>& weights, uint32_t frameIndex)
+{
+    uint32_t count = std::min(static_cast<uint32_t>(weights.size()), mTargetCount);
+    memcpy(mFrameData + mFrameStride * frameIndex, weights.data(), count * sizeof(float));
+}
+
+void Deformer::SetJointMatrices(const std::vector<glm::mat4>& jointMatrices, uint32_t frameIndex)
+{
+    char* joints = mFrameData + mFrameStride * frameIndex + mJointOffset;
+    uint32_t count = std::min(static_cast<uint32_t>(jointMatrices.size()), mJointCount);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        // same conversion as the mesh transforms in the MeshLoader, row major 3x4
+        glm::mat3x4 rowMajor = glm::rowMajor4(jointMatrices[i]);
+        memcpy(joints + i * sizeof(vk::TransformMatrixKHR), &rowMajor, sizeof(vk::TransformMatrixKHR));
+    }
+}
+
+void Deformer::Deform(vk::CommandBuffer cmd, uint32_t frameIndex)
+{
+    // The previous frame may still be building / tracing with the output buffer, wait for it before overwriting
+    // an execution dependency is enough for a write after read hazard
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR | vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                        vk::PipelineStageFlagBits::eComputeShader,
+                        {}, nullptr, nullptr, nullptr);
+
+    vk::DeviceAddress frameAddress = mFrameBuffer.DevAddress + mFrameStride * frameIndex;
+
+    DeformerPushConstants pc = {};
+    pc.RestVertices = mRestBuffer.DevAddress;
+    pc.SkinVertices = mSkinBuffer.DevAddress;
+    pc.MorphDeltas = mMorphBuffer.DevAddress;
+    pc.MorphWeights = frameAddress;
+    pc.JointMatrices = frameAddress + mJointOffset;
+    pc.OutVertices = OutputBuffer.DevAddress;
+    pc.VertexCount = VertexCount;
+    pc.TargetCount = mTargetCount;
+    pc.JointCount = mJointCount;
+
+    cmd.bindPipeline(vk::PipelineBindPoint::eCompute, mPipeline);
+    cmd.pushConstants(mPipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(DeformerPushConstants), &pc);
+    cmd.dispatch((VertexCount + DeformerGroupSize - 1) / DeformerGroupSize, 1, 1);
+
+    // [POI]
+    // Acceleration structure builds read their vertex input with shader read access in the build stage
+    auto buildBarrier = vk::MemoryBarrier()
+                            .setSrcAccessMask(vk::AccessFlagBits::eShaderWrite)
+                            .setDstAccessMask(vk::AccessFlagBits::eShaderRead);
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                        vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR | vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                        {}, buildBarrier, nullptr, nullptr);
+}
+
+void Deformer::Destroy()
+{
+    FinishUpload();
+
+    if (mFrameData)
+        mVRDev->UnmapBuffer(mFrameBuffer);
+    mFrameData = nullptr;
+
+    mVRDev->DestroyBuffer(mFrameBuffer);
+    mVRDev->DestroyBuffer(mRestBuffer);
+    if (mSkinBuffer.Buffer)
+        mVRDev->DestroyBuffer(mSkinBuffer);
+    if (mMorphBuffer.Buffer)
+        mVRDev->DestroyBuffer(mMorphBuffer);
+    mVRDev->DestroyBuffer(OutputBuffer);
+
+    mDevice.destroyPipeline(mPipeline);
+    mDevice.destroyPipelineLayout(mPipelineLayout);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Common.h"
+#include "MeshLoader.h"
+#include "ShaderCompiler.h"
+
+// Deforms the vertices of a geometry on the GPU with morph targets and linear blend skinning
+// The deformed vertices are written to a device local buffer, which is used as the vertex input of BLAS builds / updates
+// so the CPU only writes the morph weights and joint matrices every frame, not the vertices
+class Deformer
+{
+public:
+    // Records the upload of the rest pose, skin and morph targets into uploadCmd
+    // framesInFlight is the number of copies of the per frame data, so it can be written while older frames are still in flight
+    void Create(vr::VulrayDevice* vrDev,
+                vk::Device device,
+                ShaderCompiler& compiler,
+                const Geometry& geom,
+                uint32_t jointCount,
+                uint32_t framesInFlight,
+                vk::CommandBuffer uploadCmd);
+
+    // Destroys the staging buffer, call after the upload command buffer has finished executing
+    void FinishUpload();
+
+    void Destroy();
+
+    // The per frame data can only be written for a frame that is not in flight
+    void SetMorphWeights(const std::vector<float>& weights, uint32_t frameIndex);
+
+    // joint matrices have to include the inverse bind matrices of the skin
+    void SetJointMatrices(const std::vector<glm::mat4>& jointMatrices, uint32_t frameIndex);
+
+    // Records the deformation and a barrier so the output can be read by acceleration structure builds
+    void Deform(vk::CommandBuffer cmd, uint32_t frameIndex);
+
+    // Deformed vertices, same layout as the Vertex struct
+    vr::AllocatedBuffer OutputBuffer = {};
+
+    uint32_t VertexCount = 0;
+
+private:
+    vr::VulrayDevice* mVRDev = nullptr;
+    vk::Device mDevice = nullptr;
+
+    vk::Pipeline mPipeline = nullptr;
+    vk::PipelineLayout mPipelineLayout = nullptr;
+
+    vr::AllocatedBuffer mRestBuffer = {};
+    vr::AllocatedBuffer mSkinBuffer = {};
+    vr::AllocatedBuffer mMorphBuffer = {};
+    vr::AllocatedBuffer mStagingBuffer = {};
+
+    // morph weights and joint matrices for every frame in flight, persistently mapped
+    vr::AllocatedBuffer mFrameBuffer = {};
+    char* mFrameData = nullptr;
+    vk::DeviceSize mFrameStride = 0;
+    vk::DeviceSize mJointOffset = 0;
+
+    uint32_t mTargetCount = 0;
+    uint32_t mJointCount = 0;
+};
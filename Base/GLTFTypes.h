@@ -131,4 +131,63 @@ vk::Format ConvertToVkFormat(uint32_t components, uint32_t type)
             return vk::Format::eR64G64B64A64Sfloat;
     }
     return vk::Format::eUndefined;
-}
\ No newline at end of file
+}
+
+// Reads a single component of an accessor element and converts it to T
+// normalized integers are mapped to [0, 1] or [-1, 1] as defined by the gltf spec
+template<typename T>
+T ReadComponent(const uint8_t* data, uint32_t componentType, bool normalized)
+{
+    switch (componentType)
+    {
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+        return normalized ? T(*data / 255.0f) : T(*data);
+    case TINYGLTF_COMPONENT_TYPE_BYTE:
+        return normalized ? T(std::max(*reinterpret_cast<const int8_t*>(data) / 127.0f, -1.0f)) : T(*reinterpret_cast<const int8_t*>(data));
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+        return normalized ? T(*reinterpret_cast<const uint16_t*>(data) / 65535.0f) : T(*reinterpret_cast<const uint16_t*>(data));
+    case TINYGLTF_COMPONENT_TYPE_SHORT:
+        return normalized ? T(std::max(*reinterpret_cast<const int16_t*>(data) / 32767.0f, -1.0f)) : T(*reinterpret_cast<const int16_t*>(data));
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+        return T(*reinterpret_cast<const uint32_t*>(data));
+    case TINYGLTF_COMPONENT_TYPE_INT:
+        return T(*reinterpret_cast<const int32_t*>(data));
+    case TINYGLTF_COMPONENT_TYPE_FLOAT:
+        return T(*reinterpret_cast<const float*>(data));
+    case TINYGLTF_COMPONENT_TYPE_DOUBLE:
+        return T(*reinterpret_cast<const double*>(data));
+    }
+    return T(0);
+}
+
+// Reads all the elements of an accessor into outData, T is a glm vector or matrix type
+// Unlike the position / normal loading this respects the byte stride of the buffer view and the accessor offset
+// Accessors without a buffer view are zero initialized, as required by the gltf spec
+template<typename T, typename Allocator>
+void ReadAccessor(const tinygltf::Model& model, const tinygltf::Accessor& accessor, std::vector<T, Allocator>& outData)
+{
+    using ComponentType = typename T::value_type;
+    constexpr uint32_t outComponents = sizeof(T) / sizeof(ComponentType);
+
+    outData.assign(accessor.count, T(0));
+
+    if (accessor.bufferView == -1)
+        return;
+
+    auto& view = model.bufferViews[accessor.bufferView];
+    auto& buffer = model.buffers[view.buffer];
+
+    auto components = GetComponentsFromTinyGLTFType(accessor.type);
+    auto size = GetSizeFromType(accessor.componentType);
+    auto stride = static_cast<size_t>(accessor.ByteStride(view));
+
+    const uint8_t* data = buffer.data.data() + view.byteOffset + accessor.byteOffset;
+
+    for (size_t i = 0; i < accessor.count; i++)
+    {
+        auto* element = data + i * stride;
+        auto* out = reinterpret_cast<ComponentType*>(&outData[i]);
+        for (uint32_t c = 0; c < outComponents && c < components; c++)
+            out[c] = ReadComponent<ComponentType>(element + c * size, accessor.componentType, accessor.normalized);
+    }
+}
@@ -16,6 +16,12 @@ struct Vertex
     float padding2;
 };
 
+struct SkinVertex // joints and weights for linear blend skinning, has to match the layout in Deformation.hlsl
+{
+    glm::uvec4 Joints = glm::uvec4(0);
+    glm::vec4 Weights = glm::vec4(0.0f);
+};
+
 struct GPUMaterial // has to be aligned to 16 bytes
 {
     glm::vec3 BaseColor = glm::vec3(1.0f);
@@ -24,9 +30,18 @@ struct GPUMaterial // has to be aligned to 16 bytes
     glm::vec3 Emissive = glm::vec3(0.0f);
     float Roughness = 1.0f;
 
-    uint32_t VertBufferOffset = 0;
-    uint32_t IndexBufferOffset = 0;
-
     MaterialType Type = MaterialType::Opaque;
-    float Padding;
-}; 
\ No newline at end of file
+    float Padding = 0.0f;
+    glm::vec2 Padding2 = glm::vec2(0.0f); // the padding is compared when the materials are deduplicated, keep it 0
+};
+
+// Where the shaders find a geometry and its material, one for every geometry of every BLAS
+struct GPUGeometry // has to be aligned to 8 bytes
+{
+    // device addresses of the first vertex and index of the geometry, the geometry can be in any of the vertex and index buffers
+    uint64_t VertexAddress = 0;
+    uint64_t IndexAddress = 0;
+
+    uint32_t MaterialIndex = 0; // index into the deduplicated material table
+    uint32_t Padding = 0;
+};
@@ -0,0 +1,56 @@
+#include "Common.h"
+#include "GPUTimer.h"
+
+void GPUTimer::Create(vk::Device device, vk::PhysicalDevice physicalDevice, uint32_t timestampsPerFrame, uint32_t framesInFlight)
+{
+    mDevice = device;
+    mTimestampsPerFrame = timestampsPerFrame;
+    mTimestampPeriod = physicalDevice.getProperties().limits.timestampPeriod;
+
+    auto poolInfo = vk::QueryPoolCreateInfo()
+                        .setQueryType(vk::QueryType::eTimestamp)
+                        .setQueryCount(timestampsPerFrame * framesInFlight);
+    mQueryPool = mDevice.createQueryPool(poolInfo);
+
+    mResults.resize(timestampsPerFrame * framesInFlight * 2, 0);
+    mFrameWritten.resize(framesInFlight, false);
+}
+
+void GPUTimer::Destroy()
+{
+    if (mQueryPool)
+        mDevice.destroyQueryPool(mQueryPool);
+    mQueryPool = nullptr;
+}
+
+void GPUTimer::BeginFrame(vk::CommandBuffer cmd, uint32_t frameIndex)
+{
+    uint32_t firstQuery = frameIndex * mTimestampsPerFrame;
+
+    if (mFrameWritten[frameIndex])
+    {
+        // don't wait, the frame has finished, timestamps that were never written stay unavailable
+        auto _ = mDevice.getQueryPoolResults(mQueryPool, firstQuery, mTimestampsPerFrame,
+                                             mTimestampsPerFrame * 2 * sizeof(uint64_t), mResults.data() + firstQuery * 2,
+                                             2 * sizeof(uint64_t), vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWithAvailability);
+    }
+
+    cmd.resetQueryPool(mQueryPool, firstQuery, mTimestampsPerFrame);
+    mFrameWritten[frameIndex] = true;
+}
+
+void GPUTimer::WriteTimestamp(vk::CommandBuffer cmd, uint32_t frameIndex, uint32_t timestamp, vk::PipelineStageFlagBits stage)
+{
+    cmd.writeTimestamp(stage, mQueryPool, frameIndex * mTimestampsPerFrame + timestamp);
+}
+
+double GPUTimer::GetMilliseconds(uint32_t frameIndex, uint32_t startTimestamp, uint32_t endTimestamp) const
+{
+    const uint64_t* start = mResults.data() + (frameIndex * mTimestampsPerFrame + startTimestamp) * 2;
+    const uint64_t* end = mResults.data() + (frameIndex * mTimestampsPerFrame + endTimestamp) * 2;
+
+    if (start[1] == 0 || end[1] == 0 || end[0] < start[0])
+        return 0.0;
+
+    return (end[0] - start[0]) * mTimestampPeriod / 1000000.0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "Common.h"
+
+// Measures GPU time between timestamps written into command buffers
+// Every frame in flight has its own range of queries, the results of a frame are read
+// when the frame comes around again, at that point its command buffer has finished executing
+class GPUTimer
+{
+public:
+    void Create(vk::Device device, vk::PhysicalDevice physicalDevice, uint32_t timestampsPerFrame, uint32_t framesInFlight);
+
+    void Destroy();
+
+    // Reads the results of the last use of the frame and resets its queries, has to be recorded before any timestamp of the frame
+    void BeginFrame(vk::CommandBuffer cmd, uint32_t frameIndex);
+
+    void WriteTimestamp(vk::CommandBuffer cmd, uint32_t frameIndex, uint32_t timestamp, vk::PipelineStageFlagBits stage);
+
+    // Milliseconds between two timestamps of the last finished use of the frame, 0 if they weren't written
+    double GetMilliseconds(uint32_t frameIndex, uint32_t startTimestamp, uint32_t endTimestamp) const;
+
+private:
+    vk::Device mDevice = nullptr;
+    vk::QueryPool mQueryPool = nullptr;
+
+    uint32_t mTimestampsPerFrame = 0;
+    double mTimestampPeriod = 0.0; // nanoseconds per tick
+
+    // results of every frame, the second value of a pair is the availability written by vulkan
+    std::vector<uint64_t> mResults;
+    std::vector<bool> mFrameWritten;
+};
@@ -3,90 +3,322 @@
 #include "MeshLoader.h"
 #include "Vulray/Vulray.h"
 #include "GPUMaterial.h"
+#include "ParallelFor.h"
 
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
 
-void CalculateBufferSizes(const Scene& scene,
-    uint32_t& outVertexBufferSize,
-    uint32_t& outIndexBufferSize,
-    uint32_t& outTransformBufferSize,
-    uint32_t& outMaterialBufferSize)
+// Rounds value up to a multiple of alignment, which has to be a power of two
+inline vk::DeviceSize AlignUp(vk::DeviceSize value, vk::DeviceSize alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Sizes of the buffers that CopySceneToBuffers(...) writes a scene to
+// The vertices and indices are split into several buffers so that none of them is larger than the device allows,
+// the meshes are assigned to the buffers in order and a mesh is never split, index buffer i goes with vertex buffer i
+struct SceneBufferSizes
+{
+    std::vector<vk::DeviceSize> VertexBuffers;
+    std::vector<vk::DeviceSize> IndexBuffers;
+    std::vector<uint32_t> MeshBuffers; // the buffer every mesh is copied to
+    vk::DeviceSize TransformBuffer = 0;
+    vk::DeviceSize GeometryBuffer = 0; // a GPUGeometry for every geometry of every mesh
+};
+
+// Mapped memory and device addresses of the buffers described by SceneBufferSizes, one entry per buffer
+struct SceneBufferTargets
+{
+    std::vector<Vertex*> VertexData;
+    std::vector<uint32_t*> IndexData;
+    std::vector<vk::DeviceAddress> VertexAddresses;
+    std::vector<vk::DeviceAddress> IndexAddresses;
+    char* TransformData = nullptr;
+    GPUGeometry* GeometryData = nullptr;
+    vk::DeviceAddress TransformAddress = 0;
+};
+
+// The materials of a scene without duplicates, the buffer the shaders read is Materials as it is
+struct MaterialTable
+{
+    std::vector<GPUMaterial> Materials;
+    std::vector<uint32_t> GeometryMaterials; // index into Materials of every geometry of the scene
+};
+
+// [POI]
+// Many geometries of a scene share a material, the geometries that use the same gltf material, or one with the same properties,
+// get the same entry in the table, the GPUGeometry of every geometry holds the index of its entry
+inline MaterialTable BuildMaterialTable(const Scene& scene, float emissiveMultiplier = 1.0f)
+{
+    auto less = [](const GPUMaterial& a, const GPUMaterial& b) { return memcmp(&a, &b, sizeof(GPUMaterial)) < 0; };
+    std::map<GPUMaterial, uint32_t, decltype(less)> tableIndices(less);
+    std::map<int32_t, uint32_t> gltfIndices; // shortcut for geometries from the same gltf material
+
+    MaterialTable table;
+    table.GeometryMaterials.resize(scene.Geometries.size());
+    for (size_t i = 0; i < scene.Geometries.size(); i++)
+    {
+        auto& geom = scene.Geometries[i];
+        if (geom.MaterialIndex >= 0)
+        {
+            auto it = gltfIndices.find(geom.MaterialIndex);
+            if (it != gltfIndices.end())
+            {
+                table.GeometryMaterials[i] = it->second;
+                continue;
+            }
+        }
+
+        GPUMaterial mat = {};
+        mat.BaseColor = geom.Material.BaseColorFactor;
+        mat.Emissive = geom.Material.EmissiveFactor * emissiveMultiplier;
+        mat.Roughness = geom.Material.RoughnessFactor;
+        mat.Metallic = geom.Material.MetallicFactor;
+
+        auto [it, added] = tableIndices.try_emplace(mat, static_cast<uint32_t>(table.Materials.size()));
+        if (added)
+            table.Materials.push_back(mat);
+
+        table.GeometryMaterials[i] = it->second;
+        if (geom.MaterialIndex >= 0)
+            gltfIndices[geom.MaterialIndex] = it->second;
+    }
+
+    // a scene without geometries still gets a material, so the buffer isn't empty
+    if (table.Materials.empty())
+        table.Materials.push_back(GPUMaterial{});
+
+    return table;
+}
+
+// The largest vertex or index buffer CalculateBufferSizes(...) should create on this device,
+// the buffers are storage buffers so they have to fit maxStorageBufferRange and an allocation has to fit maxMemoryAllocationSize
+inline vk::DeviceSize GetMaxGeometryBufferSize(vk::PhysicalDevice physicalDevice)
+{
+    auto props = physicalDevice.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceMaintenance3Properties>();
+    vk::DeviceSize storageRange = props.get<vk::PhysicalDeviceProperties2>().properties.limits.maxStorageBufferRange;
+    vk::DeviceSize allocationSize = props.get<vk::PhysicalDeviceMaintenance3Properties>().maxMemoryAllocationSize;
+    return std::min(storageRange, allocationSize);
+}
+
+// [POI]
+// The sizes are 64 bit, a scene can have more than 4 GB of vertices even though a single buffer can't
+inline void CalculateBufferSizes(const Scene& scene, SceneBufferSizes& outSizes, vk::DeviceSize maxBufferSize = VK_WHOLE_SIZE)
 {
     auto& geometries = scene.Geometries;
 
+    outSizes.VertexBuffers.assign(1, 0);
+    outSizes.IndexBuffers.assign(1, 0);
+    outSizes.MeshBuffers.resize(scene.Meshes.size());
+
     // calculate the size required for the buffers
-    for (auto& mesh : scene.Meshes)
+    for (size_t m = 0; m < scene.Meshes.size(); m++)
     {
+        auto& mesh = scene.Meshes[m];
+        vk::DeviceSize vertexSize = 0;
+        vk::DeviceSize indexSize = 0;
         for (auto& geomRef : mesh.GeometryReferences)
         {
-            outVertexBufferSize += geometries[geomRef].Vertices.size() * sizeof(Vertex);
-            outIndexBufferSize += geometries[geomRef].Indices.size() * sizeof(uint32_t);
-            outMaterialBufferSize += sizeof(GPUMaterial);
+            vertexSize += geometries[geomRef].Vertices.size() * sizeof(Vertex);
+            indexSize += geometries[geomRef].Indices.size() * sizeof(uint32_t);
+            outSizes.GeometryBuffer += sizeof(GPUGeometry);
+        }
+        outSizes.TransformBuffer += sizeof(vk::TransformMatrixKHR);
+
+        if (vertexSize > maxBufferSize || indexSize > maxBufferSize)
+            VULRAY_LOG_ERROR("CalculateBufferSizes: a mesh is larger than the largest buffer the device allows");
+
+        // start a new pair of buffers when the mesh doesn't fit into the current one, unless the current one is still empty
+        bool vertexFull = outSizes.VertexBuffers.back() + vertexSize > maxBufferSize;
+        bool indexFull = outSizes.IndexBuffers.back() + indexSize > maxBufferSize;
+        if ((vertexFull || indexFull) && (outSizes.VertexBuffers.back() > 0 || outSizes.IndexBuffers.back() > 0))
+        {
+            outSizes.VertexBuffers.push_back(0);
+            outSizes.IndexBuffers.push_back(0);
         }
-        outTransformBufferSize += sizeof(vk::TransformMatrixKHR);
+
+        outSizes.VertexBuffers.back() += vertexSize;
+        outSizes.IndexBuffers.back() += indexSize;
+        outSizes.MeshBuffers[m] = static_cast<uint32_t>(outSizes.VertexBuffers.size() - 1);
     }
 }
 
-void CopySceneToBuffers(
+// Offsets of the data of a mesh in the buffers written by CopySceneToBuffers(...), in elements, not bytes
+struct MeshBufferOffsets
+{
+    uint64_t Vertex = 0;
+    uint64_t Index = 0;
+    uint32_t Geometry = 0;
+};
+
+// Turns the sizes of every mesh into their offsets, offsets[i] holds the size of mesh i and becomes the sum of the sizes before it
+// The meshes are split into blocks: the blocks are summed in parallel, the block sums are scanned on one thread
+// and then every block adds its offset to the scan of its own meshes in parallel
+inline void ExclusiveScan(std::vector<MeshBufferOffsets>& offsets, ParallelFor* workers)
+{
+    const uint32_t blockSize = 4096;
+    uint32_t count = static_cast<uint32_t>(offsets.size());
+    uint32_t blockCount = (count + blockSize - 1) / blockSize;
+    std::vector<MeshBufferOffsets> blockOffsets(blockCount);
+
+    auto runBlocks = [&](const std::function<void(uint32_t, uint32_t)>& func) {
+        if (workers)
+            workers->Run(blockCount, 1, func);
+        else
+            func(0, blockCount);
+    };
+
+    runBlocks([&](uint32_t begin, uint32_t end) {
+        for (uint32_t block = begin; block < end; block++)
+        {
+            MeshBufferOffsets sum = {};
+            for (uint32_t i = block * blockSize; i < std::min((block + 1) * blockSize, count); i++)
+            {
+                sum.Vertex += offsets[i].Vertex;
+                sum.Index += offsets[i].Index;
+                sum.Geometry += offsets[i].Geometry;
+            }
+            blockOffsets[block] = sum;
+        }
+    });
+
+    MeshBufferOffsets running = {};
+    for (auto& block : blockOffsets)
+    {
+        MeshBufferOffsets sum = block;
+        block = running;
+        running.Vertex += sum.Vertex;
+        running.Index += sum.Index;
+        running.Geometry += sum.Geometry;
+    }
+
+    runBlocks([&](uint32_t begin, uint32_t end) {
+        for (uint32_t block = begin; block < end; block++)
+        {
+            MeshBufferOffsets offset = blockOffsets[block];
+            for (uint32_t i = block * blockSize; i < std::min((block + 1) * blockSize, count); i++)
+            {
+                MeshBufferOffsets size = offsets[i];
+                offsets[i] = offset;
+                offset.Vertex += size.Vertex;
+                offset.Index += size.Index;
+                offset.Geometry += size.Geometry;
+            }
+        }
+    });
+}
+
+// Copies the geometries of the scene into the mapped buffers and creates a BLAS create info for every mesh
+// sizes has to come from CalculateBufferSizes(...) for the same scene, targets has an entry for each of its buffers
+// the instance ID of a mesh is the index of the GPUGeometry of its first geometry, materials is the table of the scene
+// workers is used for the copies, if it is null a thread pool is created for scenes that are large enough to be worth it
+inline void CopySceneToBuffers(
     const Scene& scene,
-    Vertex* vertData, 
-    uint32_t* idxData,
-    char* transData,
-    char* matData,
-    vk::DeviceAddress vertexBufferDevAddress,
-    vk::DeviceAddress indexBufferDevAddress,
-    vk::DeviceAddress transformBufferDevAddress,
+    const SceneBufferSizes& sizes,
+    const SceneBufferTargets& targets,
+    const MaterialTable& materials,
     std::vector<uint32_t>& outInsanceIDs,
     std::vector<vr::BLASCreateInfo>& outBlasCreateInfos,
-    float EmissiveMultiplier = 1.0f,
-    vk::BuildAccelerationStructureFlagBitsKHR flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace)
+    vk::BuildAccelerationStructureFlagsKHR flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace,
+    ParallelFor* workers = nullptr)
 {
     auto& geometries = scene.Geometries;
+    uint32_t meshCount = static_cast<uint32_t>(scene.Meshes.size());
 
-    // copy the scene data to the buffers
-    uint32_t vertOffset = 0;
-    uint32_t idxOffset = 0;
-    uint32_t transOffset = 0;
-    uint32_t matOffset = 0;
+    // [POI]
+    // The copy is done in two passes: first the offset of every mesh in the buffers is computed with a prefix sum over the sizes,
+    // then every mesh knows where its data goes, so all of them are copied and get their BLAS create info at the same time
+    std::vector<MeshBufferOffsets> offsets(meshCount);
+    size_t totalBytes = 0;
+    for (uint32_t m = 0; m < meshCount; m++)
+    {
+        for (auto& geomRef : scene.Meshes[m].GeometryReferences)
+        {
+            offsets[m].Vertex += geometries[geomRef].Vertices.size();
+            offsets[m].Index += geometries[geomRef].Indices.size();
+            offsets[m].Geometry++;
+            totalBytes += geometries[geomRef].Vertices.size() * sizeof(Vertex) + geometries[geomRef].Indices.size() * sizeof(uint32_t);
+        }
+    }
 
-    for (auto& mesh : scene.Meshes)
+    // small scenes are copied faster than the threads wake up
+    std::unique_ptr<ParallelFor> localWorkers;
+    if (!workers && totalBytes > 16 * 1024 * 1024)
     {
-        auto& blasinfo = outBlasCreateInfos.emplace_back(vr::BLASCreateInfo{});
-        blasinfo.Flags = flags;
+        localWorkers = std::make_unique<ParallelFor>();
+        workers = localWorkers.get();
+    }
 
-        outInsanceIDs.push_back(matOffset / sizeof(GPUMaterial));
+    ExclusiveScan(offsets, workers);
 
-        for (auto& geomRef : mesh.GeometryReferences)
+    // the offsets are over the whole scene, every buffer starts where its first mesh starts
+    std::vector<MeshBufferOffsets> bufferStarts(sizes.VertexBuffers.size());
+    for (uint32_t m = meshCount; m-- > 0;)
+        bufferStarts[sizes.MeshBuffers[m]] = offsets[m];
+
+    size_t firstInfo = outBlasCreateInfos.size();
+    size_t firstID = outInsanceIDs.size();
+    outBlasCreateInfos.resize(firstInfo + meshCount);
+    outInsanceIDs.resize(firstID + meshCount);
+
+    auto copyMeshes = [&](uint32_t begin, uint32_t end) {
+        for (uint32_t m = begin; m < end; m++)
         {
-			auto& geom = geometries[geomRef];
-			vr::GeometryData geomData = {};
-			geomData.VertexFormat = vk::Format::eR32G32B32Sfloat;
-			geomData.Stride = sizeof(Vertex);
-			geomData.IndexFormat = vk::IndexType::eUint32;
-			geomData.PrimitiveCount = geom.Indices.size() / 3;
-			geomData.DataAddresses.VertexDevAddress = vertexBufferDevAddress + vertOffset * sizeof(Vertex);
-			geomData.DataAddresses.IndexDevAddress = indexBufferDevAddress + idxOffset * sizeof(uint32_t);
-			geomData.DataAddresses.TransformDevAddress = transformBufferDevAddress + transOffset;
-			blasinfo.Geometries.push_back(geomData);
-			
-            GPUMaterial mat = {}; // create a material for the geometry this material will be copied into the material buffer
-            mat.BaseColor = geom.Material.BaseColorFactor;
-            mat.Emissive = geom.Material.EmissiveFactor * EmissiveMultiplier;
-            mat.Roughness = geom.Material.RoughnessFactor;
-            mat.Metallic = geom.Material.MetallicFactor;
-            mat.VertBufferOffset = vertOffset;
-            mat.IndexBufferOffset = idxOffset;
-
-			memcpy(vertData + vertOffset, geom.Vertices.data(), geom.Vertices.size() * sizeof(Vertex));
-			memcpy(idxData + idxOffset, geom.Indices.data(), geom.Indices.size() * sizeof(uint32_t));
-            memcpy(matData + matOffset, &mat, sizeof(GPUMaterial));
-
-			vertOffset += geom.Vertices.size();
-			idxOffset += geom.Indices.size();
-            matOffset += sizeof(GPUMaterial); // material for each geometry
-		}
-
-        memcpy(transData + transOffset, &mesh.Transform, sizeof(vk::TransformMatrixKHR));
-        transOffset += sizeof(vk::TransformMatrixKHR);
-    }
+            auto& mesh = scene.Meshes[m];
+            auto& blasinfo = outBlasCreateInfos[firstInfo + m];
+            blasinfo.Flags = flags;
+            blasinfo.Geometries.reserve(mesh.GeometryReferences.size());
+
+            uint32_t buffer = sizes.MeshBuffers[m];
+            Vertex* vertData = targets.VertexData[buffer];
+            uint32_t* idxData = targets.IndexData[buffer];
+            vk::DeviceAddress vertexBufferDevAddress = targets.VertexAddresses[buffer];
+            vk::DeviceAddress indexBufferDevAddress = targets.IndexAddresses[buffer];
+
+            // a buffer is never larger than maxStorageBufferRange, so the offsets inside of it fit 32 bits
+            uint32_t vertOffset = static_cast<uint32_t>(offsets[m].Vertex - bufferStarts[buffer].Vertex);
+            uint32_t idxOffset = static_cast<uint32_t>(offsets[m].Index - bufferStarts[buffer].Index);
+            uint32_t geomIndex = offsets[m].Geometry;
+            size_t transOffset = m * sizeof(vk::TransformMatrixKHR);
 
-}
\ No newline at end of file
+            outInsanceIDs[firstID + m] = offsets[m].Geometry;
+
+            for (auto& geomRef : mesh.GeometryReferences)
+            {
+                auto& geom = geometries[geomRef];
+                vr::GeometryData geomData = {};
+                geomData.VertexFormat = vk::Format::eR32G32B32Sfloat;
+                geomData.Stride = sizeof(Vertex);
+                geomData.IndexFormat = vk::IndexType::eUint32;
+                geomData.PrimitiveCount = geom.Indices.size() / 3;
+                geomData.DataAddresses.VertexDevAddress = vertexBufferDevAddress + vertOffset * sizeof(Vertex);
+                geomData.DataAddresses.IndexDevAddress = indexBufferDevAddress + idxOffset * sizeof(uint32_t);
+                geomData.DataAddresses.TransformDevAddress = targets.TransformAddress + transOffset;
+                blasinfo.Geometries.push_back(geomData);
+
+                GPUGeometry record = {}; // where the shaders find the geometry and its material
+                record.VertexAddress = geomData.DataAddresses.VertexDevAddress;
+                record.IndexAddress = geomData.DataAddresses.IndexDevAddress;
+                record.MaterialIndex = materials.GeometryMaterials[geomRef];
+
+                memcpy(vertData + vertOffset, geom.Vertices.data(), geom.Vertices.size() * sizeof(Vertex));
+                memcpy(idxData + idxOffset, geom.Indices.data(), geom.Indices.size() * sizeof(uint32_t));
+                targets.GeometryData[geomIndex] = record;
+
+                vertOffset += geom.Vertices.size();
+                idxOffset += geom.Indices.size();
+                geomIndex++; // record for each geometry
+            }
+
+            memcpy(targets.TransformData + transOffset, &mesh.Transform, sizeof(vk::TransformMatrixKHR));
+        }
+    };
+
+    // a few meshes per job, the meshes of a scene can differ a lot in size
+    if (workers)
+        workers->Run(meshCount, 16, copyMeshes);
+    else
+        copyMeshes(0, meshCount);
+}
@@ -0,0 +1,162 @@
+#include "Common.h"
+#include "InstanceBuffer.h"
+
+#include <algorithm>
+
+void InstanceBufferManager::Create(vr::VulrayDevice* vrDev, uint32_t maxInstanceCount, uint32_t framesInFlight)
+{
+    mVRDev = vrDev;
+    mInstances.resize(maxInstanceCount);
+    mInstanceCount = 0;
+
+    mFrames.resize(framesInFlight);
+    for (auto& frame : mFrames)
+    {
+        // [POI]
+        // The instance buffers are mapped once and stay mapped, so updating them is only a memcpy of the changed records
+        frame.Buffer = mVRDev->CreateInstanceBuffer(maxInstanceCount);
+        frame.Mapped = (vk::AccelerationStructureInstanceKHR*)mVRDev->MapBuffer(frame.Buffer);
+    }
+}
+
+void InstanceBufferManager::Destroy()
+{
+    for (auto& frame : mFrames)
+    {
+        if (frame.Mapped)
+            mVRDev->UnmapBuffer(frame.Buffer);
+        mVRDev->DestroyBuffer(frame.Buffer);
+    }
+    mFrames.clear();
+    mInstances.clear();
+    mInstanceCount = 0;
+}
+
+void InstanceBufferManager::Resize(uint32_t instanceCount)
+{
+    instanceCount = std::min(instanceCount, static_cast<uint32_t>(mInstances.size()));
+
+    uint32_t oldCount = mInstanceCount;
+    mInstanceCount = instanceCount;
+
+    if (instanceCount > oldCount)
+    {
+        std::fill(mInstances.begin() + oldCount, mInstances.begin() + instanceCount, vk::AccelerationStructureInstanceKHR());
+        MarkDirty(oldCount, instanceCount - oldCount);
+    }
+}
+
+void InstanceBufferManager::SetInstance(uint32_t index, const vk::AccelerationStructureInstanceKHR& instance)
+{
+    mInstances[index] = instance;
+    MarkDirty(index, 1);
+}
+
+void InstanceBufferManager::SetTransform(uint32_t index, const vk::TransformMatrixKHR& transform)
+{
+    mInstances[index].transform = transform;
+    MarkDirty(index, 1);
+}
+
+void InstanceBufferManager::MarkDirty(uint32_t first, uint32_t count)
+{
+    if (count == 0 || first >= mInstanceCount)
+        return;
+    count = std::min(count, mInstanceCount - first);
+
+    for (auto& frame : mFrames)
+    {
+        // instances are usually written in order, so most ranges can be appended to the last one
+        if (!frame.Dirty.empty())
+        {
+            auto& last = frame.Dirty.back();
+            if (first >= last.First && first <= last.First + last.Count)
+            {
+                last.Count = std::max(last.Count, first + count - last.First);
+                continue;
+            }
+        }
+        frame.Dirty.push_back({first, count});
+    }
+}
+
+void InstanceBufferManager::Flush(uint32_t frameIndex)
+{
+    SimpleTimer timer;
+    timer.Start();
+
+    auto& frame = mFrames[frameIndex];
+    mLastStats = {};
+
+    // the buffer holds a compacted list, everything has to be copied again
+    if (frame.Compacted)
+    {
+        frame.Dirty.clear();
+        frame.Dirty.push_back({0, mInstanceCount});
+        frame.Compacted = false;
+    }
+
+    if (!frame.Dirty.empty())
+    {
+        // merge overlapping and adjacent ranges, so every record is copied once and the copies are as large as possible
+        std::sort(frame.Dirty.begin(), frame.Dirty.end(), [](const DirtyRange& a, const DirtyRange& b) { return a.First < b.First; });
+
+        uint32_t merged = 0;
+        for (uint32_t i = 1; i < frame.Dirty.size(); i++)
+        {
+            auto& last = frame.Dirty[merged];
+            auto& range = frame.Dirty[i];
+            if (range.First <= last.First + last.Count)
+                last.Count = std::max(last.Count, range.First + range.Count - last.First);
+            else
+                frame.Dirty[++merged] = range;
+        }
+        frame.Dirty.resize(merged + 1);
+
+        for (auto& range : frame.Dirty)
+        {
+            // ranges that were marked before a Resize(...) to fewer instances may point past the end
+            if (range.First >= mInstanceCount)
+                continue;
+            uint32_t count = std::min(range.Count, mInstanceCount - range.First);
+
+            memcpy(frame.Mapped + range.First, mInstances.data() + range.First, count * sizeof(vk::AccelerationStructureInstanceKHR));
+
+            mLastStats.RangesCopied++;
+            mLastStats.InstancesCopied += count;
+        }
+        mLastStats.BytesCopied = static_cast<uint64_t>(mLastStats.InstancesCopied) * sizeof(vk::AccelerationStructureInstanceKHR);
+
+        frame.Dirty.clear(); // keeps the capacity, so there are no allocations in the following frames
+    }
+
+    mLastStats.FlushTimeMs = timer.Endd(TimerAccuracy::MilliSec);
+}
+
+void InstanceBufferManager::FlushCompacted(uint32_t frameIndex, const std::vector<uint32_t>& instanceIndices)
+{
+    SimpleTimer timer;
+    timer.Start();
+
+    auto& frame = mFrames[frameIndex];
+    mLastStats = {};
+
+    // [POI]
+    // The order of the instances changes whenever the visible set changes, so dirty ranges don't help here
+    // and every visible instance is copied, the copy is still cheaper than building the culled instances into the TLAS
+    uint32_t count = 0;
+    for (auto index : instanceIndices)
+    {
+        if (index < mInstanceCount)
+            frame.Mapped[count++] = mInstances[index];
+    }
+
+    frame.Compacted = true;
+    frame.CompactedCount = count;
+    frame.Dirty.clear();
+
+    mLastStats.RangesCopied = count;
+    mLastStats.InstancesCopied = count;
+    mLastStats.BytesCopied = static_cast<uint64_t>(count) * sizeof(vk::AccelerationStructureInstanceKHR);
+    mLastStats.FlushTimeMs = timer.Endd(TimerAccuracy::MilliSec);
+}
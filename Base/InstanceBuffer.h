@@ -0,0 +1,77 @@
+#pragma once
+
+#include "Common.h"
+
+// What the last Flush(...) copied, to see how much the dirty tracking saves
+struct InstanceUploadStats
+{
+    uint64_t BytesCopied = 0;
+    uint32_t RangesCopied = 0;
+    uint32_t InstancesCopied = 0;
+    double FlushTimeMs = 0.0;
+};
+
+// Keeps the instances of a TLAS on the CPU and one persistently mapped instance buffer for every frame in flight
+// Only the instances that changed since a frame's buffer was last written are copied to it
+// so the buffer of the frame being recorded is written while the other frames are still read by the GPU
+class InstanceBufferManager
+{
+public:
+    void Create(vr::VulrayDevice* vrDev, uint32_t maxInstanceCount, uint32_t framesInFlight);
+
+    void Destroy();
+
+    // Sets the number of instances that are built into the TLAS, new instances are zeroed and marked dirty
+    void Resize(uint32_t instanceCount);
+
+    // Writes an instance on the CPU and marks it dirty in every frame's buffer
+    void SetInstance(uint32_t index, const vk::AccelerationStructureInstanceKHR& instance);
+
+    // Only writes the transform of an instance, the rest of the record stays the same
+    void SetTransform(uint32_t index, const vk::TransformMatrixKHR& transform);
+
+    // Gives direct access to the CPU copy, the written range has to be marked dirty with MarkDirty(...)
+    vk::AccelerationStructureInstanceKHR* GetInstances() { return mInstances.data(); }
+
+    void MarkDirty(uint32_t first, uint32_t count);
+
+    // Copies the dirty ranges of a frame to its mapped buffer, the frame must not be in flight
+    void Flush(uint32_t frameIndex);
+
+    // Copies only the given instances to the front of a frame's buffer, eg. the ones that survived culling
+    // the buffer doesn't mirror the CPU copy anymore, so the next Flush(...) of the frame copies every instance
+    void FlushCompacted(uint32_t frameIndex, const std::vector<uint32_t>& instanceIndices);
+
+    const vr::AllocatedBuffer& GetBuffer(uint32_t frameIndex) const { return mFrames[frameIndex].Buffer; }
+
+    // Number of instances in the buffer of a frame, this is the instance count of the TLAS build
+    uint32_t GetBuiltCount(uint32_t frameIndex) const { return mFrames[frameIndex].Compacted ? mFrames[frameIndex].CompactedCount : mInstanceCount; }
+
+    uint32_t GetInstanceCount() const { return mInstanceCount; }
+
+    const InstanceUploadStats& GetLastStats() const { return mLastStats; }
+
+private:
+    struct DirtyRange
+    {
+        uint32_t First;
+        uint32_t Count;
+    };
+
+    struct FrameSlice
+    {
+        vr::AllocatedBuffer Buffer = {};
+        vk::AccelerationStructureInstanceKHR* Mapped = nullptr;
+        std::vector<DirtyRange> Dirty;
+        bool Compacted = false;
+        uint32_t CompactedCount = 0;
+    };
+
+    vr::VulrayDevice* mVRDev = nullptr;
+
+    std::vector<vk::AccelerationStructureInstanceKHR> mInstances;
+    std::vector<FrameSlice> mFrames;
+    uint32_t mInstanceCount = 0;
+
+    InstanceUploadStats mLastStats = {};
+};
@@ -0,0 +1,192 @@
+#include "Common.h"
+#include "InstanceGenerator.h"
+#include "Culling.h"
+
+// has to match the layout in InstanceGeneration.hlsl
+struct GPUBLASEntry
+{
+    vk::DeviceAddress Address;
+    uint64_t Padding;
+    glm::vec4 Min;
+    glm::vec4 Max;
+};
+
+// has to match the layout in InstanceGeneration.hlsl, 128 bytes is the minimum push constant size every device supports
+struct InstanceGeneratorPushConstants
+{
+    vk::DeviceAddress Sources;
+    vk::DeviceAddress BLASes;
+    vk::DeviceAddress OutInstances;
+    vk::DeviceAddress VisibleCounts;
+    uint32_t InstanceCount;
+    float Time;
+    float MaxDistance;   // 0 disables distance culling
+    float FrustumMargin;
+    glm::vec3 CameraPosition;
+    uint32_t FrustumCulling;
+    glm::vec4 Planes[4];
+};
+static_assert(sizeof(InstanceGeneratorPushConstants) == 128);
+
+static constexpr uint32_t InstanceGeneratorGroupSize = 64; // numthreads in InstanceGeneration.hlsl
+
+void InstanceGenerator::Create(vr::VulrayDevice* vrDev,
+                               vk::Device device,
+                               ShaderCompiler& compiler,
+                               const std::vector<GPUInstanceSource>& sources,
+                               const std::vector<vr::BLASHandle>& blases,
+                               const std::vector<AABB>& blasBounds,
+                               uint32_t framesInFlight,
+                               vk::CommandBuffer uploadCmd)
+{
+    mVRDev = vrDev;
+    mDevice = device;
+    mInstanceCount = static_cast<uint32_t>(sources.size());
+    mGroupCount = (mInstanceCount + InstanceGeneratorGroupSize - 1) / InstanceGeneratorGroupSize;
+
+    std::vector<GPUBLASEntry> blasEntries(blases.size());
+    for (size_t i = 0; i < blases.size(); i++)
+    {
+        blasEntries[i].Address = blases[i].Buffer.DevAddress;
+        blasEntries[i].Padding = 0;
+        blasEntries[i].Min = glm::vec4(blasBounds[i].Min, 0.0f);
+        blasEntries[i].Max = glm::vec4(blasBounds[i].Max, 0.0f);
+    }
+
+    vk::DeviceSize sourceSize = sources.size() * sizeof(GPUInstanceSource);
+    vk::DeviceSize blasSize = blasEntries.size() * sizeof(GPUBLASEntry);
+
+    // [POI]
+    // The sources are read every frame and never change, so they live in device local memory like the inputs of the Deformer
+    auto deviceUsage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst;
+    mSourceBuffer = mVRDev->CreateBuffer(sourceSize, deviceUsage, 0);
+    mBLASBuffer = mVRDev->CreateBuffer(blasSize, deviceUsage, 0);
+
+    mStagingBuffer = mVRDev->CreateBuffer(
+        sourceSize + blasSize,
+        vk::BufferUsageFlagBits::eTransferSrc,
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+
+    char* staging = (char*)mVRDev->MapBuffer(mStagingBuffer);
+    memcpy(staging, sources.data(), sourceSize);
+    memcpy(staging + sourceSize, blasEntries.data(), blasSize);
+    mVRDev->UnmapBuffer(mStagingBuffer);
+
+    uploadCmd.copyBuffer(mStagingBuffer.Buffer, mSourceBuffer.Buffer, vk::BufferCopy(0, 0, sourceSize));
+    uploadCmd.copyBuffer(mStagingBuffer.Buffer, mBLASBuffer.Buffer, vk::BufferCopy(sourceSize, 0, blasSize));
+
+    auto uploadBarrier = vk::MemoryBarrier()
+                             .setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+                             .setDstAccessMask(vk::AccessFlagBits::eShaderRead);
+    uploadCmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader,
+                              {}, uploadBarrier, nullptr, nullptr);
+
+    // Every frame writes its own instance buffer, the GPU is the only one touching it so it can be device local
+    mFrames.resize(framesInFlight);
+    for (auto& frame : mFrames)
+    {
+        frame.Instances = mVRDev->CreateBuffer(
+            std::max(mInstanceCount, 1u) * sizeof(vk::AccelerationStructureInstanceKHR),
+            vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer,
+            0);
+
+        frame.Counts = mVRDev->CreateBuffer(
+            std::max(mGroupCount, 1u) * sizeof(uint32_t),
+            vk::BufferUsageFlagBits::eStorageBuffer,
+            VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT);
+        frame.GroupCounts = (uint32_t*)mVRDev->MapBuffer(frame.Counts); // stays mapped until Destroy()
+        memset(frame.GroupCounts, 0, std::max(mGroupCount, 1u) * sizeof(uint32_t));
+    }
+
+    auto pushConstantRange = vk::PushConstantRange()
+                                 .setStageFlags(vk::ShaderStageFlagBits::eCompute)
+                                 .setOffset(0)
+                                 .setSize(sizeof(InstanceGeneratorPushConstants));
+
+    mPipelineLayout = mDevice.createPipelineLayout(vk::PipelineLayoutCreateInfo().setPushConstantRanges(pushConstantRange));
+
+    auto spv = compiler.CompileSPIRVFromFile("Shaders/InstanceGeneration/InstanceGeneration.hlsl", L"cs_6_5");
+    auto shaderModule = mVRDev->CreateShaderFromSPV(spv);
+
+    auto stageInfo = vk::PipelineShaderStageCreateInfo()
+                         .setStage(vk::ShaderStageFlagBits::eCompute)
+                         .setModule(shaderModule.Module)
+                         .setPName("main");
+
+    mPipeline = mDevice.createComputePipeline(nullptr, vk::ComputePipelineCreateInfo().setStage(stageInfo).setLayout(mPipelineLayout)).value;
+
+    mDevice.destroyShaderModule(shaderModule.Module);
+}
+
+void InstanceGenerator::FinishUpload()
+{
+    if (mStagingBuffer.Buffer)
+        mVRDev->DestroyBuffer(mStagingBuffer);
+    mStagingBuffer = {};
+}
+
+void InstanceGenerator::Generate(vk::CommandBuffer cmd, uint32_t frameIndex, float time, const InstanceCuller* culler)
+{
+    auto& frame = mFrames[frameIndex];
+
+    InstanceGeneratorPushConstants pc = {};
+    pc.Sources = mSourceBuffer.DevAddress;
+    pc.BLASes = mBLASBuffer.DevAddress;
+    pc.OutInstances = frame.Instances.DevAddress;
+    pc.VisibleCounts = frame.Counts.DevAddress;
+    pc.InstanceCount = mInstanceCount;
+    pc.Time = time;
+
+    if (culler && culler->IsEnabled())
+    {
+        pc.MaxDistance = culler->Settings.MaxDistance;
+        pc.FrustumMargin = culler->Settings.FrustumMargin;
+        pc.CameraPosition = culler->GetCameraPosition();
+        pc.FrustumCulling = culler->Settings.FrustumCulling ? 1 : 0;
+        for (uint32_t i = 0; i < 4; i++)
+            pc.Planes[i] = culler->GetPlanes()[i];
+    }
+
+    cmd.bindPipeline(vk::PipelineBindPoint::eCompute, mPipeline);
+    cmd.pushConstants(mPipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(InstanceGeneratorPushConstants), &pc);
+    cmd.dispatch(mGroupCount, 1, 1);
+
+    // [POI]
+    // The TLAS build reads the instances with shader read access, the host reads the visible counts after the fence
+    auto buildBarrier = vk::MemoryBarrier()
+                            .setSrcAccessMask(vk::AccessFlagBits::eShaderWrite)
+                            .setDstAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eHostRead);
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                        vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR | vk::PipelineStageFlagBits::eHost,
+                        {}, buildBarrier, nullptr, nullptr);
+}
+
+uint32_t InstanceGenerator::GetVisibleCount(uint32_t frameIndex) const
+{
+    auto& frame = mFrames[frameIndex];
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < mGroupCount; i++)
+        count += frame.GroupCounts[i];
+    return count;
+}
+
+void InstanceGenerator::Destroy()
+{
+    FinishUpload();
+
+    for (auto& frame : mFrames)
+    {
+        if (frame.GroupCounts)
+            mVRDev->UnmapBuffer(frame.Counts);
+        mVRDev->DestroyBuffer(frame.Counts);
+        mVRDev->DestroyBuffer(frame.Instances);
+    }
+    mFrames.clear();
+
+    mVRDev->DestroyBuffer(mSourceBuffer);
+    mVRDev->DestroyBuffer(mBLASBuffer);
+
+    mDevice.destroyPipeline(mPipeline);
+    mDevice.destroyPipelineLayout(mPipelineLayout);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "Common.h"
+#include "MeshLoader.h"
+#include "ShaderCompiler.h"
+
+class InstanceCuller;
+
+// Compact description of an instance, the compute shader turns it into a VkAccelerationStructureInstanceKHR
+// has to match the layout in InstanceGeneration.hlsl
+struct GPUInstanceSource
+{
+    glm::vec3 Position = glm::vec3(0.0f);
+    float Phase = -1.0f;      // animation phase, negative for instances that don't move
+    uint32_t BLASIndex = 0;   // index into the BLASes passed to Create(...)
+    uint32_t CustomIndex = 0; // instance custom index, eg. the material offset
+    uint32_t Mask = 0xFF;
+    uint32_t Flags = 0;       // VkGeometryInstanceFlagsKHR
+};
+
+// Writes the TLAS instance buffer of a frame with a compute shader
+// The instances are animated and culled on the GPU, so the CPU only records a dispatch every frame,
+// no matter how many instances there are
+class InstanceGenerator
+{
+public:
+    // Records the upload of the sources and the BLAS table into uploadCmd
+    // blasBounds are the bounds of the BLASes in their own space, eg. Mesh::Bounds, used for culling
+    void Create(vr::VulrayDevice* vrDev,
+                vk::Device device,
+                ShaderCompiler& compiler,
+                const std::vector<GPUInstanceSource>& sources,
+                const std::vector<vr::BLASHandle>& blases,
+                const std::vector<AABB>& blasBounds,
+                uint32_t framesInFlight,
+                vk::CommandBuffer uploadCmd);
+
+    // Destroys the staging buffer, call after the upload command buffer has finished executing
+    void FinishUpload();
+
+    void Destroy();
+
+    // Records the generation of the instances of a frame and a barrier so the TLAS build can read them
+    // culled instances are written as inactive instances, culler can be null, then every instance is visible
+    void Generate(vk::CommandBuffer cmd, uint32_t frameIndex, float time, const InstanceCuller* culler);
+
+    // Instance buffer of a frame, build the TLAS with GetInstanceCount() instances from it
+    const vr::AllocatedBuffer& GetBuffer(uint32_t frameIndex) const { return mFrames[frameIndex].Instances; }
+
+    uint32_t GetInstanceCount() const { return mInstanceCount; }
+
+    // Number of instances that survived culling in the last finished use of the frame
+    // adds up one count per workgroup, so it is meant for statistics, not for every frame
+    uint32_t GetVisibleCount(uint32_t frameIndex) const;
+
+private:
+    vr::VulrayDevice* mVRDev = nullptr;
+    vk::Device mDevice = nullptr;
+
+    vk::Pipeline mPipeline = nullptr;
+    vk::PipelineLayout mPipelineLayout = nullptr;
+
+    vr::AllocatedBuffer mSourceBuffer = {};
+    vr::AllocatedBuffer mBLASBuffer = {};
+    vr::AllocatedBuffer mStagingBuffer = {};
+
+    struct FrameSlice
+    {
+        vr::AllocatedBuffer Instances = {};
+        vr::AllocatedBuffer Counts = {}; // visible instance count of every workgroup, persistently mapped
+        uint32_t* GroupCounts = nullptr;
+    };
+    std::vector<FrameSlice> mFrames;
+
+    uint32_t mInstanceCount = 0;
+    uint32_t mGroupCount = 0;
+};
@@ -0,0 +1,416 @@
+#include "Common.h"
+#include "MeshLOD.h"
+#include "ParallelFor.h"
+
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
+
+// Symmetric 4x4 matrix of the squared distance to a set of planes, only the upper triangle is stored
+struct Quadric
+{
+    double XX = 0.0, XY = 0.0, XZ = 0.0, XW = 0.0;
+    double YY = 0.0, YZ = 0.0, YW = 0.0;
+    double ZZ = 0.0, ZW = 0.0;
+    double WW = 0.0;
+
+    static Quadric FromPlane(const glm::dvec3& normal, double distance, double weight)
+    {
+        Quadric q;
+        q.XX = normal.x * normal.x * weight; q.XY = normal.x * normal.y * weight; q.XZ = normal.x * normal.z * weight; q.XW = normal.x * distance * weight;
+        q.YY = normal.y * normal.y * weight; q.YZ = normal.y * normal.z * weight; q.YW = normal.y * distance * weight;
+        q.ZZ = normal.z * normal.z * weight; q.ZW = normal.z * distance * weight;
+        q.WW = distance * distance * weight;
+        return q;
+    }
+
+    void Add(const Quadric& other)
+    {
+        XX += other.XX; XY += other.XY; XZ += other.XZ; XW += other.XW;
+        YY += other.YY; YZ += other.YZ; YW += other.YW;
+        ZZ += other.ZZ; ZW += other.ZW;
+        WW += other.WW;
+    }
+
+    double Error(const glm::dvec3& p) const
+    {
+        return XX * p.x * p.x + 2.0 * XY * p.x * p.y + 2.0 * XZ * p.x * p.z + 2.0 * XW * p.x
+             + YY * p.y * p.y + 2.0 * YZ * p.y * p.z + 2.0 * YW * p.y
+             + ZZ * p.z * p.z + 2.0 * ZW * p.z
+             + WW;
+    }
+
+    // The point with the smallest error, false if the planes don't pin down a single point, eg. on a flat area
+    bool Minimum(glm::dvec3& outPoint) const
+    {
+        glm::dmat3 a = glm::dmat3(XX, XY, XZ,
+                                  XY, YY, YZ,
+                                  XZ, YZ, ZZ);
+        double det = glm::determinant(a);
+        if (std::abs(det) < 1e-12)
+            return false;
+
+        outPoint = glm::inverse(a) * -glm::dvec3(XW, YW, ZW);
+        return true;
+    }
+};
+
+static uint64_t EdgeKey(uint32_t a, uint32_t b)
+{
+    return a < b ? (static_cast<uint64_t>(a) << 32) | b : (static_cast<uint64_t>(b) << 32) | a;
+}
+
+struct Collapse
+{
+    double Cost;
+    uint32_t A, B;
+    uint32_t VersionA, VersionB; // the collapse is stale if one of the vertices changed since it was queued
+    glm::vec3 Position;
+
+    bool operator>(const Collapse& other) const { return Cost > other.Cost; }
+};
+
+Geometry MeshLOD::Simplify(const Geometry& geometry, uint32_t targetTriangleCount)
+{
+    // weld the vertices by position, otherwise every hard edge and UV seam would split the mesh into patches that tear apart
+    std::vector<glm::vec3> positions;
+    std::vector<uint32_t> remap(geometry.Vertices.size());
+    {
+        struct PositionHash
+        {
+            size_t operator()(const glm::vec3& p) const
+            {
+                uint32_t bits[3];
+                memcpy(bits, &p, sizeof(bits));
+                return (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+            }
+        };
+        std::unordered_map<glm::vec3, uint32_t, PositionHash> unique;
+        unique.reserve(geometry.Vertices.size());
+
+        for (size_t i = 0; i < geometry.Vertices.size(); i++)
+        {
+            auto [it, inserted] = unique.try_emplace(geometry.Vertices[i].Position, static_cast<uint32_t>(positions.size()));
+            if (inserted)
+                positions.push_back(geometry.Vertices[i].Position);
+            remap[i] = it->second;
+        }
+    }
+
+    // triangles without area are dropped here, they get no planes and no adjacency, so a collapse would never remap them
+    std::vector<glm::uvec3> triangles;
+    triangles.reserve(geometry.Indices.size() / 3);
+    for (size_t i = 0; i + 2 < geometry.Indices.size(); i += 3)
+    {
+        glm::uvec3 tri = glm::uvec3(remap[geometry.Indices[i]], remap[geometry.Indices[i + 1]], remap[geometry.Indices[i + 2]]);
+        if (tri.x == tri.y || tri.y == tri.z || tri.x == tri.z)
+            continue;
+
+        glm::dvec3 p0 = glm::dvec3(positions[tri.x]), p1 = glm::dvec3(positions[tri.y]), p2 = glm::dvec3(positions[tri.z]);
+        glm::dvec3 cross = glm::cross(p1 - p0, p2 - p0);
+        if (glm::dot(cross, cross) > 0.0)
+            triangles.push_back(tri);
+    }
+
+    uint32_t vertexCount = static_cast<uint32_t>(positions.size());
+    std::vector<Quadric> quadrics(vertexCount);
+    std::vector<std::vector<uint32_t>> vertexTriangles(vertexCount);
+    std::unordered_map<uint64_t, uint32_t> edgeUses;
+
+    for (uint32_t t = 0; t < triangles.size(); t++)
+    {
+        auto& tri = triangles[t];
+        glm::dvec3 p0 = glm::dvec3(positions[tri.x]), p1 = glm::dvec3(positions[tri.y]), p2 = glm::dvec3(positions[tri.z]);
+        glm::dvec3 cross = glm::cross(p1 - p0, p2 - p0);
+        double area = glm::length(cross) * 0.5;
+
+        // [POI]
+        // Every vertex gets the planes of its triangles, weighted by area so small triangles don't dominate
+        glm::dvec3 normal = cross / (area * 2.0);
+        Quadric q = Quadric::FromPlane(normal, -glm::dot(normal, p0), area);
+        for (uint32_t corner = 0; corner < 3; corner++)
+        {
+            quadrics[tri[corner]].Add(q);
+            vertexTriangles[tri[corner]].push_back(t);
+            edgeUses[EdgeKey(tri[corner], tri[(corner + 1) % 3])]++;
+        }
+    }
+
+    // open borders get a plane perpendicular to the triangle through the border edge, so they don't shrink
+    for (auto& tri : triangles)
+    {
+        glm::dvec3 p[3] = {glm::dvec3(positions[tri.x]), glm::dvec3(positions[tri.y]), glm::dvec3(positions[tri.z])};
+        glm::dvec3 faceNormal = glm::cross(p[1] - p[0], p[2] - p[0]);
+        if (glm::dot(faceNormal, faceNormal) <= 0.0)
+            continue;
+
+        for (uint32_t corner = 0; corner < 3; corner++)
+        {
+            uint32_t next = (corner + 1) % 3;
+            if (edgeUses[EdgeKey(tri[corner], tri[next])] != 1)
+                continue;
+
+            glm::dvec3 edge = p[next] - p[corner];
+            double length = glm::length(edge);
+            if (length <= 0.0)
+                continue;
+
+            glm::dvec3 borderNormal = glm::normalize(glm::cross(edge, faceNormal));
+            Quadric q = Quadric::FromPlane(borderNormal, -glm::dot(borderNormal, p[corner]), length * length * 10.0);
+            quadrics[tri[corner]].Add(q);
+            quadrics[tri[next]].Add(q);
+        }
+    }
+
+    std::vector<uint32_t> versions(vertexCount, 0);
+    std::vector<uint8_t> removedVertices(vertexCount, 0);
+    std::vector<uint8_t> removedTriangles(triangles.size(), 0);
+
+    std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> queue;
+
+    auto queueCollapse = [&](uint32_t a, uint32_t b) {
+        Quadric q = quadrics[a];
+        q.Add(quadrics[b]);
+
+        glm::dvec3 pa = glm::dvec3(positions[a]), pb = glm::dvec3(positions[b]);
+        glm::dvec3 candidates[4] = {pa, pb, (pa + pb) * 0.5, glm::dvec3(0.0)};
+        uint32_t candidateCount = 3;
+
+        // the optimal point can be far away when the planes are almost parallel, then it is not used
+        glm::dvec3 optimal;
+        if (q.Minimum(optimal) && glm::distance(optimal, candidates[2]) < glm::distance(pa, pb) * 2.0)
+            candidates[candidateCount++] = optimal;
+
+        Collapse collapse = {};
+        collapse.Cost = std::numeric_limits<double>::max();
+        for (uint32_t i = 0; i < candidateCount; i++)
+        {
+            double cost = q.Error(candidates[i]);
+            if (cost < collapse.Cost)
+            {
+                collapse.Cost = cost;
+                collapse.Position = glm::vec3(candidates[i]);
+            }
+        }
+        collapse.A = a;
+        collapse.B = b;
+        collapse.VersionA = versions[a];
+        collapse.VersionB = versions[b];
+        queue.push(collapse);
+    };
+
+    for (auto& [key, uses] : edgeUses)
+        queueCollapse(static_cast<uint32_t>(key >> 32), static_cast<uint32_t>(key & 0xFFFFFFFF));
+
+    // checks that moving a vertex doesn't flip or squash any of its triangles, except the ones that are collapsed
+    auto keepsOrientation = [&](uint32_t vertex, uint32_t other, const glm::vec3& newPosition) {
+        for (uint32_t t : vertexTriangles[vertex])
+        {
+            if (removedTriangles[t])
+                continue;
+            auto& tri = triangles[t];
+            if (tri.x == other || tri.y == other || tri.z == other)
+                continue;
+
+            glm::vec3 p[3] = {positions[tri.x], positions[tri.y], positions[tri.z]};
+            glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+            p[tri.x == vertex ? 0 : tri.y == vertex ? 1 : 2] = newPosition;
+            glm::vec3 after = glm::cross(p[1] - p[0], p[2] - p[0]);
+
+            float lengths = glm::length(before) * glm::length(after);
+            if (lengths <= 0.0f || glm::dot(before, after) < 0.2f * lengths)
+                return false;
+        }
+        return true;
+    };
+
+    uint32_t triangleCount = static_cast<uint32_t>(triangles.size());
+    std::vector<uint32_t> neighbours;
+
+    while (triangleCount > targetTriangleCount && !queue.empty())
+    {
+        Collapse collapse = queue.top();
+        queue.pop();
+
+        uint32_t a = collapse.A, b = collapse.B;
+        if (removedVertices[a] || removedVertices[b] || versions[a] != collapse.VersionA || versions[b] != collapse.VersionB)
+            continue;
+
+        if (!keepsOrientation(a, b, collapse.Position) || !keepsOrientation(b, a, collapse.Position))
+            continue;
+
+        // [POI]
+        // b is merged into a: the triangles on the edge disappear, the others of b are moved over to a
+        positions[a] = collapse.Position;
+        quadrics[a].Add(quadrics[b]);
+        removedVertices[b] = 1;
+        versions[a]++;
+
+        for (uint32_t t : vertexTriangles[b])
+        {
+            if (removedTriangles[t])
+                continue;
+
+            auto& tri = triangles[t];
+            if (tri.x == a || tri.y == a || tri.z == a)
+            {
+                removedTriangles[t] = 1;
+                triangleCount--;
+                continue;
+            }
+
+            for (uint32_t corner = 0; corner < 3; corner++)
+            {
+                if (tri[corner] == b)
+                    tri[corner] = a;
+            }
+            vertexTriangles[a].push_back(t);
+        }
+        vertexTriangles[b].clear();
+
+        // drop the removed triangles from a and requeue the edges around it with the new quadric
+        auto& aTriangles = vertexTriangles[a];
+        aTriangles.erase(std::remove_if(aTriangles.begin(), aTriangles.end(), [&](uint32_t t) { return removedTriangles[t] != 0; }), aTriangles.end());
+
+        neighbours.clear();
+        for (uint32_t t : aTriangles)
+        {
+            for (uint32_t corner = 0; corner < 3; corner++)
+            {
+                uint32_t v = triangles[t][corner];
+                if (v != a && std::find(neighbours.begin(), neighbours.end(), v) == neighbours.end())
+                    neighbours.push_back(v);
+            }
+        }
+        for (uint32_t v : neighbours)
+            queueCollapse(a, v);
+    }
+
+    // write the surviving triangles, the normals are recomputed from the new surface
+    Geometry result = {};
+    result.Transform = geometry.Transform;
+    result.Material = geometry.Material;
+    result.MaterialIndex = geometry.MaterialIndex;
+
+    std::vector<uint32_t> outputIndex(vertexCount, ~0u);
+    for (uint32_t t = 0; t < triangles.size(); t++)
+    {
+        if (removedTriangles[t])
+            continue;
+
+        auto& tri = triangles[t];
+        glm::vec3 faceNormal = glm::cross(positions[tri.y] - positions[tri.x], positions[tri.z] - positions[tri.x]);
+
+        for (uint32_t corner = 0; corner < 3; corner++)
+        {
+            uint32_t v = tri[corner];
+            if (outputIndex[v] == ~0u)
+            {
+                outputIndex[v] = static_cast<uint32_t>(result.Vertices.size());
+                Vertex vertex = {};
+                vertex.Position = positions[v];
+                vertex.Normal = glm::vec3(0.0f);
+                result.Vertices.push_back(vertex);
+
+                result.Bounds.Min = glm::min(result.Bounds.Min, vertex.Position);
+                result.Bounds.Max = glm::max(result.Bounds.Max, vertex.Position);
+            }
+            result.Vertices[outputIndex[v]].Normal += faceNormal; // area weighted, the cross product is twice the area
+            result.Indices.push_back(outputIndex[v]);
+        }
+    }
+
+    for (auto& vertex : result.Vertices)
+    {
+        float length = glm::length(vertex.Normal);
+        vertex.Normal = length > 0.0f ? vertex.Normal / length : glm::vec3(0.0f, 1.0f, 0.0f);
+    }
+
+    return result;
+}
+
+uint32_t MeshLOD::GenerateLevels(Scene& scene, const LODSettings& settings, ParallelFor* workers)
+{
+    // only the geometries that are used by a mesh are simplified
+    std::vector<uint32_t> sourceGeometries;
+    std::vector<int32_t> sourceIndex(scene.Geometries.size(), -1);
+    for (auto& mesh : scene.Meshes)
+    {
+        for (uint32_t ref : mesh.GeometryReferences)
+        {
+            auto& geom = scene.Geometries[ref];
+            if (sourceIndex[ref] >= 0 || !geom.Skin.empty() || !geom.MorphTargets.empty())
+                continue;
+
+            sourceIndex[ref] = static_cast<int32_t>(sourceGeometries.size());
+            sourceGeometries.push_back(ref);
+        }
+    }
+
+    // levels[source][l - 1] is level l of the source geometry, empty if it reuses the level before it
+    std::vector<std::vector<Geometry>> levels(sourceGeometries.size());
+
+    auto simplifyRange = [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            const Geometry* previous = &scene.Geometries[sourceGeometries[i]];
+            uint32_t previousCount = static_cast<uint32_t>(previous->Indices.size() / 3);
+            float target = static_cast<float>(previousCount);
+
+            levels[i].resize(settings.LevelCount);
+            for (uint32_t level = 0; level < settings.LevelCount; level++)
+            {
+                // every level is simplified from the one before it, which is smaller and gives nested levels
+                target *= settings.Reduction;
+                uint32_t targetCount = static_cast<uint32_t>(target);
+                if (targetCount < settings.MinTriangles || targetCount >= previousCount)
+                    break;
+
+                levels[i][level] = Simplify(*previous, targetCount);
+                previous = &levels[i][level];
+                previousCount = static_cast<uint32_t>(previous->Indices.size() / 3);
+            }
+        }
+    };
+
+    // a geometry per job, the geometries differ a lot in size, so small chunks balance the threads better
+    if (workers)
+        workers->Run(static_cast<uint32_t>(sourceGeometries.size()), 1, simplifyRange);
+    else
+        simplifyRange(0, static_cast<uint32_t>(sourceGeometries.size()));
+
+    // levelReferences[source][l] is the geometry used at level l, levels that weren't simplified reuse the one before
+    std::vector<std::vector<uint32_t>> levelReferences(sourceGeometries.size());
+    for (uint32_t i = 0; i < sourceGeometries.size(); i++)
+    {
+        levelReferences[i].push_back(sourceGeometries[i]);
+        for (auto& geom : levels[i])
+        {
+            if (geom.Indices.empty())
+            {
+                levelReferences[i].push_back(levelReferences[i].back());
+                continue;
+            }
+            levelReferences[i].push_back(static_cast<uint32_t>(scene.Geometries.size()));
+            scene.Geometries.push_back(std::move(geom));
+        }
+    }
+
+    uint32_t meshCount = static_cast<uint32_t>(scene.Meshes.size());
+    scene.Meshes.reserve(static_cast<size_t>(meshCount) * (settings.LevelCount + 1));
+    for (uint32_t level = 1; level <= settings.LevelCount; level++)
+    {
+        for (uint32_t m = 0; m < meshCount; m++)
+        {
+            Mesh mesh = scene.Meshes[m];
+            for (auto& ref : mesh.GeometryReferences)
+            {
+                if (sourceIndex[ref] >= 0)
+                    ref = levelReferences[sourceIndex[ref]][level];
+            }
+            scene.Meshes.push_back(std::move(mesh));
+        }
+    }
+
+    return settings.LevelCount + 1;
+}
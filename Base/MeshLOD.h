@@ -0,0 +1,29 @@
+#pragma once
+
+#include "MeshLoader.h"
+
+class ParallelFor;
+
+struct LODSettings
+{
+    uint32_t LevelCount = 3;      // simplified levels generated in addition to the loaded geometry
+    float Reduction = 0.35f;      // triangle count of a level relative to the level before it
+    uint32_t MinTriangles = 16;   // geometries aren't simplified below this, the level reuses the one before it
+};
+
+// Generates simplified versions of the geometries of a scene with quadric error metric edge collapses (Garland / Heckbert)
+// Skinned and morphed geometries are left as they are, their skin and morph targets couldn't follow the collapses
+class MeshLOD
+{
+public:
+    // Collapses edges until the geometry has about targetTriangleCount triangles, or no collapse is left that doesn't flip a triangle
+    // vertices that share a position are welded first, so the result has smooth normals even where the input had hard edges
+    static Geometry Simplify(const Geometry& geometry, uint32_t targetTriangleCount);
+
+    // [POI]
+    // Simplifies every geometry used by the meshes of the scene, one geometry per job on the threads of workers
+    // The simplified geometries and a copy of every mesh for every level are appended to the scene,
+    // the mesh m at level l is scene.Meshes[l * meshCount + m], level 0 are the meshes as they were loaded
+    // Returns the number of levels including level 0
+    static uint32_t GenerateLevels(Scene& scene, const LODSettings& settings, ParallelFor* workers = nullptr);
+};
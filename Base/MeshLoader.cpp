@@ -5,6 +5,132 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 
 #include "MeshLoader.h"
+#include "SIMD.h"
+
+Scene& Scene::operator=(Scene&& other) noexcept
+{
+    // the geometries are freed before the arena they were allocated from, the default would free the arena first
+    Cameras = std::move(other.Cameras);
+    Geometries = std::move(other.Geometries);
+    Meshes = std::move(other.Meshes);
+    Skins = std::move(other.Skins);
+    Arena = std::move(other.Arena);
+    return *this;
+}
+
+AABB AABB::Transformed(const glm::mat3x4& rowMajorTransform) const
+{
+    if (IsEmpty())
+        return *this;
+
+    // transform the center and project the extents onto the new axes, cheaper than transforming all 8 corners
+    glm::vec3 center = (Min + Max) * 0.5f;
+    glm::vec3 extents = (Max - Min) * 0.5f;
+
+    glm::vec3 newCenter;
+    glm::vec3 newExtents;
+    for (int row = 0; row < 3; row++)
+    {
+        glm::vec3 axis = glm::vec3(rowMajorTransform[row]);
+        newCenter[row] = glm::dot(axis, center) + rowMajorTransform[row].w;
+        newExtents[row] = glm::dot(glm::abs(axis), extents);
+    }
+
+    AABB result;
+    result.Min = newCenter - newExtents;
+    result.Max = newCenter + newExtents;
+    return result;
+}
+
+// [POI]
+// The bounds are computed once while loading, with SSE the min and max of all 3 components are found in one instruction each
+static AABB ComputeBounds(const std::pmr::vector<Vertex>& vertices)
+{
+    AABB bounds;
+    if (vertices.empty())
+        return bounds;
+
+#ifdef SAMPLES_SSE
+    // the position is followed by padding, so 4 floats can be loaded, the 4th lane is ignored
+    __m128 minV = _mm_loadu_ps(&vertices[0].Position.x);
+    __m128 maxV = minV;
+    for (size_t i = 1; i < vertices.size(); i++)
+    {
+        __m128 position = _mm_loadu_ps(&vertices[i].Position.x);
+        minV = _mm_min_ps(minV, position);
+        maxV = _mm_max_ps(maxV, position);
+    }
+
+    float minF[4], maxF[4];
+    _mm_storeu_ps(minF, minV);
+    _mm_storeu_ps(maxF, maxV);
+    bounds.Min = glm::vec3(minF[0], minF[1], minF[2]);
+    bounds.Max = glm::vec3(maxF[0], maxF[1], maxF[2]);
+#else
+    for (auto& vertex : vertices)
+    {
+        bounds.Min = glm::min(bounds.Min, vertex.Position);
+        bounds.Max = glm::max(bounds.Max, vertex.Position);
+    }
+#endif
+
+    return bounds;
+}
+
+// What a mesh allocates while it is loaded, the same sizes AddMeshToScene(...) allocates
+struct MeshMeasure
+{
+    size_t ArenaBytes = 0;   // vertices, indices, skin, morph targets and textures of the geometries
+    size_t ScratchBytes = 0; // the largest primitive's data that is only needed while it is read
+    size_t Geometries = 0;
+};
+
+static MeshMeasure MeasureMesh(const tinygltf::Mesh& mesh, const tinygltf::Model& model)
+{
+    auto imageSize = [&](int textureIndex) -> size_t {
+        if (textureIndex == -1)
+            return 0;
+        auto& image = model.images[model.textures[textureIndex].source];
+        return image.bufferView == -1 ? 0 : SceneArena::GetAllocationSize(model.bufferViews[image.bufferView].byteLength);
+    };
+
+    MeshMeasure measure;
+    for (auto& primitive : mesh.primitives)
+    {
+        auto attributeCount = [&](const char* attribute) -> size_t {
+            auto it = primitive.attributes.find(attribute);
+            return it == primitive.attributes.end() ? 0 : model.accessors[it->second].count;
+        };
+
+        measure.Geometries++;
+        if (primitive.indices != -1)
+            measure.ArenaBytes += SceneArena::GetAllocationSize(model.accessors[primitive.indices].count * sizeof(uint32_t));
+
+        size_t vertexCount = std::max(attributeCount("POSITION"), attributeCount("NORMAL"));
+        measure.ArenaBytes += SceneArena::GetAllocationSize(vertexCount * sizeof(Vertex));
+
+        size_t jointCount = attributeCount("JOINTS_0");
+        size_t weightCount = attributeCount("WEIGHTS_0");
+        if (jointCount > 0 && weightCount > 0)
+        {
+            measure.ArenaBytes += SceneArena::GetAllocationSize(jointCount * sizeof(SkinVertex));
+            size_t scratch = SceneArena::GetAllocationSize(jointCount * sizeof(glm::uvec4)) + SceneArena::GetAllocationSize(weightCount * sizeof(glm::vec4));
+            measure.ScratchBytes = std::max(measure.ScratchBytes, scratch);
+        }
+
+        // the deltas of a target have one element for every vertex
+        measure.ArenaBytes += primitive.targets.size() * 2 * SceneArena::GetAllocationSize(vertexCount * sizeof(glm::vec3));
+
+        if (primitive.material != -1)
+        {
+            auto& mat = model.materials[primitive.material];
+            measure.ArenaBytes += imageSize(mat.pbrMetallicRoughness.baseColorTexture.index);
+            measure.ArenaBytes += imageSize(mat.pbrMetallicRoughness.metallicRoughnessTexture.index);
+            measure.ArenaBytes += imageSize(mat.normalTexture.index);
+        }
+    }
+    return measure;
+}
 
 // Simply Load a gltf file
 
@@ -12,17 +138,57 @@
 Scene MeshLoader::LoadGLBMesh(const std::string& path)
 {
     Scene outScene = {};
+    mStats = {};
 
     tinygltf::Model model;
 
     std::string err;
     std::string warn;
 
+    SimpleTimer timer;
+    timer.Start();
     mLoader.LoadBinaryFromFile(&model, &err, &warn, path);
     if (!warn.empty())
         std::cout << warn << std::endl;
     if (!err.empty())
         std::cout << err << std::endl;
+    mStats.ParseMs = timer.Endd(TimerAccuracy::MilliSec);
+
+    // [POI]
+    // The geometry of every node is measured first, so the whole scene goes into one allocation
+    // instead of a few vectors for every primitive, the scene frees it at once when it is destroyed
+    // The joints and weights that are only read to be interleaved go into a scratch block that is reused by every primitive
+    timer.Start();
+    MeshMeasure sceneMeasure;
+    for (auto& node : model.nodes)
+    {
+        if (node.mesh == -1)
+            continue;
+        auto measure = MeasureMesh(model.meshes[node.mesh], model);
+        sceneMeasure.ArenaBytes += measure.ArenaBytes;
+        sceneMeasure.ScratchBytes = std::max(sceneMeasure.ScratchBytes, measure.ScratchBytes);
+        sceneMeasure.Geometries += measure.Geometries;
+    }
+
+    if (mUseArena)
+    {
+        outScene.Arena->Reserve(sceneMeasure.ArenaBytes);
+        outScene.Geometries.reserve(sceneMeasure.Geometries);
+    }
+    std::vector<std::byte> scratchBlock(std::max<size_t>(sceneMeasure.ScratchBytes, 1));
+    std::pmr::monotonic_buffer_resource scratch(scratchBlock.data(), scratchBlock.size());
+
+    // Load the skins, the joint matrices are computed by the application every frame
+    for (auto& skin : model.skins)
+    {
+        auto& outSkin = outScene.Skins.emplace_back(Skin{});
+        outSkin.JointNodes.assign(skin.joints.begin(), skin.joints.end());
+
+        if (skin.inverseBindMatrices != -1)
+            ReadAccessor(model, model.accessors[skin.inverseBindMatrices], outSkin.InverseBindMatrices);
+        else
+            outSkin.InverseBindMatrices.assign(skin.joints.size(), glm::mat4(1.0f));
+    }
 
     for (auto& node : model.nodes)
     {
@@ -50,8 +216,16 @@ Scene MeshLoader::LoadGLBMesh(const std::string& path)
         }
         if (node.mesh != -1)
         {
-            AddMeshToScene(model.meshes[node.mesh], model, outScene);
-            outScene.Meshes.back().Transform = glm::rowMajor4(matrix);
+            AddMeshToScene(model.meshes[node.mesh], model, outScene, scratch);
+            auto& outMesh = outScene.Meshes.back();
+            outMesh.Transform = glm::rowMajor4(matrix);
+            outMesh.SkinIndex = node.skin;
+
+            // the geometries are transformed by the mesh transform when the BLAS is built
+            AABB geometryBounds;
+            for (auto geomRef : outMesh.GeometryReferences)
+                geometryBounds.Expand(outScene.Geometries[geomRef].Bounds);
+            outMesh.Bounds = geometryBounds.Transformed(outMesh.Transform);
         }
         if(node.camera != -1)
         {
@@ -66,19 +240,30 @@ Scene MeshLoader::LoadGLBMesh(const std::string& path)
         }
 
     }
+
+    mStats.LoadMs = timer.Endd(TimerAccuracy::MilliSec);
+    mStats.ArenaBytes = outScene.Arena->GetUsed();
+    mStats.ArenaAllocations = outScene.Arena->GetAllocationCount();
+    mStats.HeapAllocations = outScene.Arena->GetOverflowCount();
+
+    std::cout << "Loaded " << path << ": " << outScene.Geometries.size() << " geometries in " << mStats.ParseMs + mStats.LoadMs << " ms, "
+              << mStats.ArenaBytes / (1024.0 * 1024.0) << " MB in the scene arena, " << mStats.ArenaAllocations << " allocations in the arena, "
+              << mStats.HeapAllocations << " on the heap, peak RSS " << GetPeakResidentMemory() / (1024.0 * 1024.0) << " MB" << std::endl;
     return outScene;
 }
 
 
-void MeshLoader::AddMeshToScene(const tinygltf::Mesh& mesh, tinygltf::Model& model, Scene& outScene)
+void MeshLoader::AddMeshToScene(const tinygltf::Mesh& mesh, tinygltf::Model& model, Scene& outScene, std::pmr::monotonic_buffer_resource& scratch)
 {
     auto& outMesh = outScene.Meshes.emplace_back();
+    outMesh.MorphWeights.assign(mesh.weights.begin(), mesh.weights.end());
+
     for (auto& primitive : mesh.primitives)
     {
         // get index of the new geometry
         outMesh.GeometryReferences.push_back(outScene.Geometries.size());
         // add new geometry
-        auto& outGeom = outScene.Geometries.emplace_back(Geometry{});
+        auto& outGeom = outScene.Geometries.emplace_back(outScene.Arena.get());
 
         // Get indices
         auto indices = primitive.indices;
@@ -114,15 +299,23 @@ void MeshLoader::AddMeshToScene(const tinygltf::Mesh& mesh, tinygltf::Model& mod
                 throw std::runtime_error("Unsupported index type");
 
         }
-        // Get positions
+        // positions and normals are interleaved into the same vertices, allocated once for the larger of the two
         auto positions = primitive.attributes.find("POSITION");
+        auto normals = primitive.attributes.find("NORMAL");
+        size_t vertexCount = 0;
+        if (positions != primitive.attributes.end())
+            vertexCount = model.accessors[positions->second].count;
+        if (normals != primitive.attributes.end())
+            vertexCount = std::max(vertexCount, model.accessors[normals->second].count);
+        outGeom.Vertices.resize(vertexCount);
+
+        // Get positions
         if (positions != primitive.attributes.end())
         {
             auto& positionsAccessor = model.accessors[positions->second];
             auto& positionsView = model.bufferViews[positionsAccessor.bufferView];
             auto& positionsBuffer = model.buffers[positionsView.buffer];
             auto& positionsData = positionsBuffer.data;
-            outGeom.Vertices.resize(positionsAccessor.count);
             auto components = GetComponentsFromTinyGLTFType(positionsAccessor.type);
             auto size = GetSizeFromType(positionsAccessor.componentType);
 
@@ -147,14 +340,12 @@ void MeshLoader::AddMeshToScene(const tinygltf::Mesh& mesh, tinygltf::Model& mod
                 throw std::runtime_error("Unsupported position type");
         }
         // Get normals
-        auto normals = primitive.attributes.find("NORMAL");
         if (normals != primitive.attributes.end())
         {
             auto& normalsAccessor = model.accessors[normals->second];
             auto& normalsView = model.bufferViews[normalsAccessor.bufferView];
             auto& normalsBuffer = model.buffers[normalsView.buffer];
             auto& normalsData = normalsBuffer.data;
-            outGeom.Vertices.resize(normalsAccessor.count);
 
             auto components = GetComponentsFromTinyGLTFType(normalsAccessor.type);
             auto size = GetSizeFromType(normalsAccessor.componentType);
@@ -180,8 +371,48 @@ void MeshLoader::AddMeshToScene(const tinygltf::Mesh& mesh, tinygltf::Model& mod
                 throw std::runtime_error("Unsupported normal type");
         }
 
+        outGeom.Bounds = ComputeBounds(outGeom.Vertices);
+
+        // Get joints and weights for skinning
+        auto joints = primitive.attributes.find("JOINTS_0");
+        auto weights = primitive.attributes.find("WEIGHTS_0");
+        if (joints != primitive.attributes.end() && weights != primitive.attributes.end())
+        {
+            std::pmr::vector<glm::uvec4> jointData(&scratch);
+            std::pmr::vector<glm::vec4> weightData(&scratch);
+            ReadAccessor(model, model.accessors[joints->second], jointData);
+            ReadAccessor(model, model.accessors[weights->second], weightData);
+
+            outGeom.Skin.resize(jointData.size());
+            for (size_t i = 0; i < jointData.size(); i++)
+            {
+                outGeom.Skin[i].Joints = jointData[i];
+                outGeom.Skin[i].Weights = weightData[i];
+            }
+        }
+        scratch.release(); // the joints and weights are interleaved, the next primitive starts at the front of the scratch block again
+
+        // Get morph targets, only positions and normals are used
+        for (auto& target : primitive.targets)
+        {
+            auto& outTarget = outGeom.MorphTargets.emplace_back(outScene.Arena.get());
+
+            auto targetPositions = target.find("POSITION");
+            if (targetPositions != target.end())
+                ReadAccessor(model, model.accessors[targetPositions->second], outTarget.PositionDeltas);
+
+            auto targetNormals = target.find("NORMAL");
+            if (targetNormals != target.end())
+                ReadAccessor(model, model.accessors[targetNormals->second], outTarget.NormalDeltas);
+
+            // targets without positions or normals don't move the vertices
+            outTarget.PositionDeltas.resize(outGeom.Vertices.size(), glm::vec3(0.0f));
+            outTarget.NormalDeltas.resize(outGeom.Vertices.size(), glm::vec3(0.0f));
+        }
+
         // get material
         auto material = primitive.material;
+        outGeom.MaterialIndex = material;
         if(material != -1)
         {
             auto& mat = model.materials[material];
@@ -203,8 +434,7 @@ void MeshLoader::AddMeshToScene(const tinygltf::Mesh& mesh, tinygltf::Model& mod
                 auto& view = model.bufferViews[image.bufferView];
                 auto& buffer = model.buffers[view.buffer];
                 auto& data = buffer.data;
-                outGeom.Material.BaseColorTexture.resize(view.byteLength);
-                memcpy(outGeom.Material.BaseColorTexture.data(), data.data() + view.byteOffset, view.byteLength);
+                outGeom.Material.BaseColorTexture.assign(data.begin() + view.byteOffset, data.begin() + view.byteOffset + view.byteLength);
             }
             if(pbr.metallicRoughnessTexture.index != -1)
             {
@@ -213,8 +443,7 @@ void MeshLoader::AddMeshToScene(const tinygltf::Mesh& mesh, tinygltf::Model& mod
                 auto& view = model.bufferViews[image.bufferView];
                 auto& buffer = model.buffers[view.buffer];
                 auto& data = buffer.data;
-                outGeom.Material.MetallicRoughnessTexture.resize(view.byteLength);
-                memcpy(outGeom.Material.MetallicRoughnessTexture.data(), data.data() + view.byteOffset, view.byteLength);
+                outGeom.Material.MetallicRoughnessTexture.assign(data.begin() + view.byteOffset, data.begin() + view.byteOffset + view.byteLength);
             }
             if(mat.normalTexture.index != -1)
             {
@@ -223,8 +452,7 @@ void MeshLoader::AddMeshToScene(const tinygltf::Mesh& mesh, tinygltf::Model& mod
                 auto& view = model.bufferViews[image.bufferView];
                 auto& buffer = model.buffers[view.buffer];
                 auto& data = buffer.data;
-                outGeom.Material.NormalTexture.resize(view.byteLength);
-                memcpy(outGeom.Material.NormalTexture.data(), data.data() + view.byteOffset, view.byteLength);
+                outGeom.Material.NormalTexture.assign(data.begin() + view.byteOffset, data.begin() + view.byteOffset + view.byteLength);
             }
         }
     }
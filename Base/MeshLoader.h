@@ -1,12 +1,32 @@
 #pragma once
 
 #include <iostream>
+#include <limits>
 #include <glm/glm.hpp>
 #include <vulkan/vulkan.hpp>
 #include <tiny_gltf.h>
 #include "Camera.h"
 #include <glm/gtx/matrix_major_storage.hpp>
 #include "GPUMaterial.h"
+#include "SceneArena.h"
+
+// Axis aligned bounding box, empty until a point is added
+struct AABB
+{
+    glm::vec3 Min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 Max = glm::vec3(std::numeric_limits<float>::lowest());
+
+    bool IsEmpty() const { return Min.x > Max.x; }
+
+    void Expand(const AABB& other)
+    {
+        Min = glm::min(Min, other.Min);
+        Max = glm::max(Max, other.Max);
+    }
+
+    // Bounds of the box after transforming it, the transform is stored in row major order like VkTransformMatrixKHR
+    AABB Transformed(const glm::mat3x4& rowMajorTransform) const;
+};
 
 struct Mesh
 {
@@ -15,6 +35,34 @@ struct Mesh
     // transform is applied to all geometries in the mesh
     // stored in row major order, similar to VkTransformMatrixKHR
     glm::mat3x4 Transform = glm::mat3x4(1.0f); 
+
+    // index into Scene::Skins, -1 if the mesh is not skinned
+    int32_t SkinIndex = -1;
+
+    // default weights of the morph targets of the geometries
+    std::vector<float> MorphWeights;
+
+    // bounds of all geometries with the transform applied, the space the BLAS of the mesh is built in
+    AABB Bounds;
+};
+
+struct Skin
+{
+    // node indices of the joints in the gltf file
+    std::vector<int32_t> JointNodes;
+
+    // transforms the mesh from model space to the local space of the joint
+    std::vector<glm::mat4> InverseBindMatrices;
+};
+
+struct MorphTarget
+{
+    // deltas that are added to the vertices, scaled by the weight of the target
+    std::pmr::vector<glm::vec3> PositionDeltas;
+    std::pmr::vector<glm::vec3> NormalDeltas;
+
+    MorphTarget() = default;
+    explicit MorphTarget(std::pmr::memory_resource* memory) : PositionDeltas(memory), NormalDeltas(memory) {}
 };
 
 struct GeometryMaterial
@@ -24,42 +72,91 @@ struct GeometryMaterial
     float RoughnessFactor = 1.0f;
     glm::vec3 EmissiveFactor = glm::vec3(0.0f);
 
-    std::vector<uint8_t> BaseColorTexture;
-    std::vector<uint8_t> MetallicRoughnessTexture;
-    std::vector<uint8_t> NormalTexture;
+    std::pmr::vector<uint8_t> BaseColorTexture;
+    std::pmr::vector<uint8_t> MetallicRoughnessTexture;
+    std::pmr::vector<uint8_t> NormalTexture;
+
+    GeometryMaterial() = default;
+    explicit GeometryMaterial(std::pmr::memory_resource* memory)
+        : BaseColorTexture(memory), MetallicRoughnessTexture(memory), NormalTexture(memory) {}
 };
 
 struct Geometry
 {
-    
-    std::vector<Vertex> Vertices;
-    std::vector<uint32_t> Indices;
+    // allocated from the arena of the scene when the geometry was loaded, from the heap otherwise
+    std::pmr::vector<Vertex> Vertices;
+    std::pmr::vector<uint32_t> Indices;
+
+    // empty if the geometry is not skinned / has no morph targets
+    std::pmr::vector<SkinVertex> Skin;
+    std::vector<MorphTarget> MorphTargets;
     
     glm::mat4 Transform = glm::mat4(1.0f);
 
+    // object space bounds of the vertex positions
+    AABB Bounds;
+
     GeometryMaterial Material;
+
+    // index of the material in the gltf file, geometries with the same index share one entry in the material table, -1 if there is none
+    int32_t MaterialIndex = -1;
+
+    Geometry() = default;
+    explicit Geometry(std::pmr::memory_resource* memory) : Vertices(memory), Indices(memory), Skin(memory), Material(memory) {}
 };
 
+// Move only, the vertices, indices and textures of the geometries live in the arena of the scene,
+// moving the scene keeps them where they are instead of copying every geometry
 struct Scene
 {
+    // declared first, so it is destroyed after the geometries that were allocated from it
+    std::unique_ptr<SceneArena> Arena = std::make_unique<SceneArena>();
+
     std::vector<Camera> Cameras;
     std::vector<Geometry> Geometries;
 
     std::vector<Mesh> Meshes;
 
+    std::vector<Skin> Skins;
+
+    Scene() = default;
+    Scene(Scene&&) noexcept = default;
+    Scene& operator=(Scene&& other) noexcept;
+
+    Scene(const Scene&) = delete;
+    Scene& operator=(const Scene&) = delete;
 };
 
 
+// What the last LoadGLBMesh(...) took
+struct MeshLoaderStats
+{
+    double ParseMs = 0.0; // tinygltf reading the file
+    double LoadMs = 0.0;  // measuring the accessors and copying them into the scene
+    size_t ArenaBytes = 0;
+    uint64_t ArenaAllocations = 0; // vectors of the scene placed in the arena
+    uint64_t HeapAllocations = 0;  // vectors of the scene that went to the heap, all of them without the arena
+};
+
 class MeshLoader
 {
 public:
     Scene LoadGLBMesh(const std::string& path);
 
+    // Without the arena every vector of the scene is allocated on its own, to compare the allocation count and load time
+    void SetUseArena(bool useArena) { mUseArena = useArena; }
+
+    const MeshLoaderStats& GetStats() const { return mStats; }
+
 private:
 
 
-    void AddMeshToScene(const tinygltf::Mesh& mesh, tinygltf::Model& model, Scene& outScene);
+    // scratch holds what is only needed while a primitive is read, it is released after every primitive
+    void AddMeshToScene(const tinygltf::Mesh& mesh, tinygltf::Model& model, Scene& outScene, std::pmr::monotonic_buffer_resource& scratch);
 
     tinygltf::TinyGLTF mLoader;
+
+    bool mUseArena = true;
+    MeshLoaderStats mStats = {};
 };
 
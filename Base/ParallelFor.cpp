@@ -0,0 +1,97 @@
+#include "ParallelFor.h"
+
+#include <algorithm>
+
+ParallelFor::ParallelFor(uint32_t threadCount)
+{
+    if (threadCount == 0)
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+    // the calling thread works too, so one thread less is needed
+    for (uint32_t i = 1; i < threadCount; i++)
+        mWorkers.emplace_back(&ParallelFor::WorkerLoop, this);
+}
+
+ParallelFor::~ParallelFor()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mWakeCondition.notify_all();
+
+    for (auto& worker : mWorkers)
+        worker.join();
+}
+
+void ParallelFor::Run(uint32_t count, uint32_t chunkSize, const std::function<void(uint32_t, uint32_t)>& func, uint32_t alignment)
+{
+    if (count == 0)
+        return;
+
+    chunkSize = std::max(chunkSize, 1u);
+    chunkSize = (chunkSize + alignment - 1) / alignment * alignment;
+
+    // not worth waking the workers
+    if (mWorkers.empty() || count <= chunkSize)
+    {
+        func(0, count);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mJob = &func;
+        mCount = count;
+        mChunkSize = chunkSize;
+        mNextIndex.store(0, std::memory_order_relaxed);
+        mBusyWorkers = static_cast<uint32_t>(mWorkers.size());
+        mGeneration++;
+    }
+    mWakeCondition.notify_all();
+
+    ProcessChunks();
+
+    // func is owned by the caller, so all workers have to be done with it before returning
+    std::unique_lock<std::mutex> lock(mMutex);
+    mDoneCondition.wait(lock, [this]() { return mBusyWorkers == 0; });
+    mJob = nullptr;
+}
+
+void ParallelFor::WorkerLoop()
+{
+    uint64_t seenGeneration = 0;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mWakeCondition.wait(lock, [&]() { return mStop || mGeneration != seenGeneration; });
+            if (mStop)
+                return;
+            seenGeneration = mGeneration;
+        }
+
+        ProcessChunks();
+
+        bool last = false;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            last = --mBusyWorkers == 0;
+        }
+        if (last)
+            mDoneCondition.notify_one();
+    }
+}
+
+void ParallelFor::ProcessChunks()
+{
+    while (true)
+    {
+        uint32_t begin = mNextIndex.fetch_add(mChunkSize, std::memory_order_relaxed);
+        if (begin >= mCount)
+            return;
+
+        (*mJob)(begin, std::min(begin + mChunkSize, mCount));
+    }
+}
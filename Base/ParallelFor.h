@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A small pool of worker threads that split a range of work into chunks
+// The threads are created once and sleep between calls, so it can be used every frame
+class ParallelFor
+{
+public:
+    // threadCount includes the calling thread, 0 uses all hardware threads
+    explicit ParallelFor(uint32_t threadCount = 0);
+    ~ParallelFor();
+
+    ParallelFor(const ParallelFor&) = delete;
+    ParallelFor& operator=(const ParallelFor&) = delete;
+
+    // Calls func(begin, end) for chunks of [0, count) on all threads and returns when every chunk is done
+    // chunkSize is rounded up to a multiple of alignment, so SIMD loops can process full batches
+    void Run(uint32_t count, uint32_t chunkSize, const std::function<void(uint32_t, uint32_t)>& func, uint32_t alignment = 1);
+
+    uint32_t GetThreadCount() const { return static_cast<uint32_t>(mWorkers.size()) + 1; }
+
+private:
+    void WorkerLoop();
+    void ProcessChunks();
+
+    std::vector<std::thread> mWorkers;
+
+    std::mutex mMutex;
+    std::condition_variable mWakeCondition;
+    std::condition_variable mDoneCondition;
+
+    // the job that is currently running, only written by Run(...) while all workers are idle
+    const std::function<void(uint32_t, uint32_t)>* mJob = nullptr;
+    uint32_t mCount = 0;
+    uint32_t mChunkSize = 0;
+
+    std::atomic<uint32_t> mNextIndex = 0;
+    uint32_t mBusyWorkers = 0;
+    uint64_t mGeneration = 0; // incremented for every job, so the workers know when there is new work
+    bool mStop = false;
+};
@@ -0,0 +1,8 @@
+#pragma once
+
+// SSE2 is available on every x64 CPU, code using it has to provide a scalar fallback for other architectures
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SAMPLES_SSE 1
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#endif
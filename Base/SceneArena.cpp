@@ -0,0 +1,75 @@
+#include "Common.h"
+#include "SceneArena.h"
+
+#include <algorithm>
+
+#ifdef _WIN32
+    #define NOMINMAX
+    #include <windows.h>
+    #include <psapi.h>
+#else
+    #include <sys/resource.h>
+#endif
+
+SceneArena::~SceneArena() = default;
+
+void SceneArena::Reserve(size_t bytes)
+{
+    if (mBlock || bytes == 0)
+        return;
+
+    // new[] aligns to at least alignof(std::max_align_t), GetAllocationSize(...) rounds every allocation up to it
+    mBlock = std::make_unique_for_overwrite<std::byte[]>(bytes);
+    mCapacity = bytes;
+    mUsed = 0;
+}
+
+size_t SceneArena::GetAllocationSize(size_t bytes)
+{
+    constexpr size_t alignment = alignof(std::max_align_t);
+    return (bytes + alignment - 1) & ~(alignment - 1);
+}
+
+void* SceneArena::do_allocate(size_t bytes, size_t alignment)
+{
+    size_t offset = (mUsed + alignment - 1) & ~(alignment - 1);
+    if (mBlock && offset + bytes <= mCapacity)
+    {
+        mUsed = offset + GetAllocationSize(bytes);
+        mUsed = std::min(mUsed, mCapacity);
+        mAllocations++;
+        return mBlock.get() + offset;
+    }
+
+    mOverflowBytes += bytes;
+    mOverflowAllocations++;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+}
+
+void SceneArena::do_deallocate(void* ptr, size_t bytes, size_t alignment)
+{
+    auto* p = static_cast<std::byte*>(ptr);
+    if (mBlock && p >= mBlock.get() && p < mBlock.get() + mCapacity)
+        return; // freed with the block
+
+    std::pmr::new_delete_resource()->deallocate(ptr, bytes, alignment);
+}
+
+uint64_t GetPeakResidentMemory()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters = {};
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize;
+    return 0;
+#else
+    rusage usage = {};
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss); // bytes on macOS
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024; // kilobytes on Linux
+#endif
+#endif
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+
+// Memory of the vertices, indices and textures of a scene: one block that is filled front to back and freed at once
+// The loader measures the scene first and reserves the whole block, allocations that don't fit go to the heap
+// Freeing inside the block does nothing, the block is only freed when the arena is destroyed
+class SceneArena : public std::pmr::memory_resource
+{
+public:
+    SceneArena() = default;
+    ~SceneArena() override;
+
+    SceneArena(const SceneArena&) = delete;
+    SceneArena& operator=(const SceneArena&) = delete;
+
+    // Allocates the block, has to be called before anything is allocated from the arena
+    void Reserve(size_t bytes);
+
+    // Size an allocation of bytes takes up in the block, to add up what Reserve(...) is called with
+    static size_t GetAllocationSize(size_t bytes);
+
+    size_t GetCapacity() const { return mCapacity; }
+    size_t GetUsed() const { return mUsed; }
+    uint64_t GetOverflowBytes() const { return mOverflowBytes; } // allocated from the heap because the block was full
+    uint64_t GetAllocationCount() const { return mAllocations; }
+    uint64_t GetOverflowCount() const { return mOverflowAllocations; }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+    std::unique_ptr<std::byte[]> mBlock;
+    size_t mCapacity = 0;
+    size_t mUsed = 0;
+    uint64_t mOverflowBytes = 0;
+    uint64_t mAllocations = 0;
+    uint64_t mOverflowAllocations = 0;
+};
+
+// Largest resident set size of the process so far in bytes, 0 where the platform doesn't report it
+uint64_t GetPeakResidentMemory();
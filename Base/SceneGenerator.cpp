@@ -0,0 +1,274 @@
+#include "Common.h"
+#include "SceneGenerator.h"
+
+#include <glm/gtc/constants.hpp>
+#include <glm/gtx/matrix_major_storage.hpp>
+#include <map>
+
+// PCG32, small and fast, and unlike the standard distributions the results are the same on every platform
+struct PCG32
+{
+    uint64_t State = 0;
+    uint64_t Increment = 1;
+
+    PCG32(uint64_t seed, uint64_t sequence)
+    {
+        Increment = (sequence << 1u) | 1u;
+        Next();
+        State += seed;
+        Next();
+    }
+
+    uint32_t Next()
+    {
+        uint64_t old = State;
+        State = old * 6364136223846793005ULL + Increment;
+        uint32_t xorShifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+        uint32_t rot = static_cast<uint32_t>(old >> 59u);
+        return (xorShifted >> rot) | (xorShifted << ((~rot + 1u) & 31));
+    }
+
+    // [0, 1)
+    float NextFloat() { return (Next() >> 8) * (1.0f / 16777216.0f); }
+
+    float NextFloat(float min, float max) { return min + NextFloat() * (max - min); }
+};
+
+// A sphere that is pushed in and out by a few waves, so every shape looks different and has some depth complexity
+static void GenerateShape(PCG32& rng, uint32_t triangleCount, Geometry& outGeom)
+{
+    // a sphere with r rings and 2r segments has about 4r^2 triangles
+    uint32_t rings = std::max(static_cast<uint32_t>(std::sqrt(triangleCount / 4.0)), 2u);
+    uint32_t segments = rings * 2;
+
+    glm::vec3 frequency = glm::vec3(rng.NextFloat(1.0f, 6.0f), rng.NextFloat(1.0f, 6.0f), rng.NextFloat(1.0f, 6.0f));
+    float amplitude = rng.NextFloat(0.05f, 0.3f);
+
+    outGeom.Vertices.resize(static_cast<size_t>(rings + 1) * (segments + 1));
+    for (uint32_t ring = 0; ring <= rings; ring++)
+    {
+        float theta = glm::pi<float>() * ring / rings;
+        for (uint32_t segment = 0; segment <= segments; segment++)
+        {
+            float phi = glm::two_pi<float>() * segment / segments;
+            glm::vec3 normal = glm::vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            float radius = 1.0f + amplitude * std::sin(normal.x * frequency.x) * std::sin(normal.y * frequency.y) * std::sin(normal.z * frequency.z);
+
+            auto& vertex = outGeom.Vertices[ring * (segments + 1) + segment];
+            vertex.Position = normal * radius;
+            vertex.Normal = normal; // the normal of the sphere, close enough for shading the test scenes
+
+            outGeom.Bounds.Min = glm::min(outGeom.Bounds.Min, vertex.Position);
+            outGeom.Bounds.Max = glm::max(outGeom.Bounds.Max, vertex.Position);
+        }
+    }
+
+    outGeom.Indices.reserve(static_cast<size_t>(rings) * segments * 6);
+    for (uint32_t ring = 0; ring < rings; ring++)
+    {
+        for (uint32_t segment = 0; segment < segments; segment++)
+        {
+            uint32_t i = ring * (segments + 1) + segment;
+            uint32_t below = i + segments + 1;
+            outGeom.Indices.insert(outGeom.Indices.end(), {i, i + 1, below, i + 1, below + 1, below});
+        }
+    }
+}
+
+Scene SceneGenerator::Generate(const SceneGeneratorSettings& settings)
+{
+    Scene scene = {};
+
+    // every part of the scene has its own sequence, so changing one setting doesn't change the rest
+    PCG32 materialRng(settings.Seed, 1);
+    PCG32 shapeRng(settings.Seed, 2);
+    PCG32 instanceRng(settings.Seed, 3);
+
+    uint32_t materialCount = std::max(settings.MaterialCount, 1u);
+    uint32_t emissiveCount = static_cast<uint32_t>(std::round(materialCount * std::clamp(settings.EmissiveRatio, 0.0f, 1.0f)));
+
+    std::vector<GeometryMaterial> materials(materialCount);
+    for (uint32_t i = 0; i < materialCount; i++)
+    {
+        auto& mat = materials[i];
+        mat.BaseColorFactor = glm::vec4(materialRng.NextFloat(0.1f, 1.0f), materialRng.NextFloat(0.1f, 1.0f), materialRng.NextFloat(0.1f, 1.0f), 1.0f);
+        mat.MetallicFactor = materialRng.NextFloat();
+        mat.RoughnessFactor = materialRng.NextFloat(0.1f, 1.0f);
+
+        // the emissive materials are spread evenly over the list
+        if (emissiveCount > 0 && (i * emissiveCount) % materialCount < emissiveCount)
+            mat.EmissiveFactor = glm::vec3(mat.BaseColorFactor);
+    }
+
+    uint32_t meshCount = std::max(settings.MeshCount, 1u);
+    scene.Geometries.resize(meshCount);
+    for (uint32_t i = 0; i < meshCount; i++)
+    {
+        GenerateShape(shapeRng, settings.TrianglesPerMesh, scene.Geometries[i]);
+        scene.Geometries[i].Material = materials[i % materialCount];
+        scene.Geometries[i].MaterialIndex = static_cast<int32_t>(i % materialCount);
+    }
+
+    // [POI]
+    // The instances reference the shapes like the meshes of a loaded scene reference their geometries,
+    // so a generated scene goes through CopySceneToBuffers(...) and the BLAS creation like any other scene
+    scene.Meshes.resize(settings.InstanceCount);
+    float halfSize = settings.SceneSize * 0.5f;
+    for (uint32_t i = 0; i < settings.InstanceCount; i++)
+    {
+        auto& mesh = scene.Meshes[i];
+        mesh.GeometryReferences.push_back(i % meshCount);
+
+        glm::vec3 position = glm::vec3(instanceRng.NextFloat(-halfSize, halfSize), instanceRng.NextFloat(0.0f, 4.0f), instanceRng.NextFloat(-halfSize, halfSize));
+        float angle = instanceRng.NextFloat(0.0f, glm::two_pi<float>());
+        float scale = instanceRng.NextFloat(0.5f, 2.0f);
+
+        glm::mat4 matrix = glm::translate(glm::mat4(1.0f), position);
+        matrix = glm::rotate(matrix, angle, glm::vec3(0.0f, 1.0f, 0.0f));
+        matrix = glm::scale(matrix, glm::vec3(scale));
+
+        mesh.Transform = glm::rowMajor4(matrix);
+        mesh.Bounds = scene.Geometries[i % meshCount].Bounds.Transformed(mesh.Transform);
+    }
+
+    // looks at the scene from above one of its edges
+    auto& camera = scene.Cameras.emplace_back(Camera{});
+    camera.Position = glm::vec3(0.0f, settings.SceneSize * 0.25f, settings.SceneSize * 0.75f);
+    camera.FarPlane = settings.SceneSize * 4.0f;
+
+    return scene;
+}
+
+uint64_t SceneGenerator::CountTriangles(const Scene& scene)
+{
+    uint64_t triangles = 0;
+    for (auto& mesh : scene.Meshes)
+    {
+        for (auto geomRef : mesh.GeometryReferences)
+            triangles += scene.Geometries[geomRef].Indices.size() / 3;
+    }
+    return triangles;
+}
+
+// Appends data to the buffer and adds a view and an accessor for it, returns the index of the accessor
+static int AddAccessor(tinygltf::Model& model, const void* data, size_t size, int componentType, int type, size_t count, int target)
+{
+    auto& buffer = model.buffers[0];
+
+    // the views are 4 byte aligned, every element in the file is 4 bytes
+    tinygltf::BufferView view;
+    view.buffer = 0;
+    view.byteOffset = buffer.data.size();
+    view.byteLength = size;
+    view.target = target;
+    buffer.data.insert(buffer.data.end(), static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size);
+    model.bufferViews.push_back(view);
+
+    tinygltf::Accessor accessor;
+    accessor.bufferView = static_cast<int>(model.bufferViews.size() - 1);
+    accessor.componentType = componentType;
+    accessor.type = type;
+    accessor.count = count;
+    model.accessors.push_back(accessor);
+
+    return static_cast<int>(model.accessors.size() - 1);
+}
+
+bool SceneGenerator::WriteGLB(const Scene& scene, const std::string& path)
+{
+    tinygltf::Model model;
+    model.asset.version = "2.0";
+    model.asset.generator = SAMPLE_NAME;
+    model.buffers.emplace_back();
+
+    auto& gltfScene = model.scenes.emplace_back();
+    model.defaultScene = 0;
+
+    // one gltf mesh and material for every geometry, the MeshLoader gives every node its own copy of the geometries
+    for (auto& geom : scene.Geometries)
+    {
+        std::vector<glm::vec3> positions(geom.Vertices.size());
+        std::vector<glm::vec3> normals(geom.Vertices.size());
+        for (size_t i = 0; i < geom.Vertices.size(); i++)
+        {
+            positions[i] = geom.Vertices[i].Position;
+            normals[i] = geom.Vertices[i].Normal;
+        }
+
+        tinygltf::Primitive primitive;
+        primitive.mode = TINYGLTF_MODE_TRIANGLES;
+        primitive.indices = AddAccessor(model, geom.Indices.data(), geom.Indices.size() * sizeof(uint32_t),
+                                        TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT, TINYGLTF_TYPE_SCALAR, geom.Indices.size(), TINYGLTF_TARGET_ELEMENT_ARRAY_BUFFER);
+        primitive.attributes["POSITION"] = AddAccessor(model, positions.data(), positions.size() * sizeof(glm::vec3),
+                                                       TINYGLTF_COMPONENT_TYPE_FLOAT, TINYGLTF_TYPE_VEC3, positions.size(), TINYGLTF_TARGET_ARRAY_BUFFER);
+        primitive.attributes["NORMAL"] = AddAccessor(model, normals.data(), normals.size() * sizeof(glm::vec3),
+                                                     TINYGLTF_COMPONENT_TYPE_FLOAT, TINYGLTF_TYPE_VEC3, normals.size(), TINYGLTF_TARGET_ARRAY_BUFFER);
+
+        // gltf requires the bounds of the positions
+        auto& positionAccessor = model.accessors[primitive.attributes["POSITION"]];
+        positionAccessor.minValues = {geom.Bounds.Min.x, geom.Bounds.Min.y, geom.Bounds.Min.z};
+        positionAccessor.maxValues = {geom.Bounds.Max.x, geom.Bounds.Max.y, geom.Bounds.Max.z};
+
+        auto& material = model.materials.emplace_back();
+        auto& mat = geom.Material;
+        material.pbrMetallicRoughness.baseColorFactor = {mat.BaseColorFactor.r, mat.BaseColorFactor.g, mat.BaseColorFactor.b, mat.BaseColorFactor.a};
+        material.pbrMetallicRoughness.metallicFactor = mat.MetallicFactor;
+        material.pbrMetallicRoughness.roughnessFactor = mat.RoughnessFactor;
+        material.emissiveFactor = {mat.EmissiveFactor.r, mat.EmissiveFactor.g, mat.EmissiveFactor.b};
+        primitive.material = static_cast<int>(model.materials.size() - 1);
+
+        model.meshes.emplace_back().primitives.push_back(primitive);
+    }
+
+    // a mesh of the scene with more than one geometry becomes a gltf mesh with one primitive per geometry
+    std::map<std::vector<uint32_t>, int> combinedMeshes;
+    for (auto& mesh : scene.Meshes)
+    {
+        int meshIndex = static_cast<int>(mesh.GeometryReferences.empty() ? -1 : mesh.GeometryReferences[0]);
+        if (mesh.GeometryReferences.size() > 1)
+        {
+            auto it = combinedMeshes.find(mesh.GeometryReferences);
+            if (it == combinedMeshes.end())
+            {
+                auto& combined = model.meshes.emplace_back();
+                for (auto geomRef : mesh.GeometryReferences)
+                    combined.primitives.push_back(model.meshes[geomRef].primitives[0]);
+                it = combinedMeshes.emplace(mesh.GeometryReferences, static_cast<int>(model.meshes.size() - 1)).first;
+            }
+            meshIndex = it->second;
+        }
+
+        // the transform is stored row major, gltf wants the full column major matrix
+        glm::mat4 matrix = glm::transpose(glm::mat4(mesh.Transform));
+
+        auto& node = model.nodes.emplace_back();
+        node.mesh = meshIndex;
+        node.matrix.assign(glm::value_ptr(matrix), glm::value_ptr(matrix) + 16);
+        gltfScene.nodes.push_back(static_cast<int>(model.nodes.size() - 1));
+    }
+
+    if (!scene.Cameras.empty())
+    {
+        auto& sceneCamera = scene.Cameras[0];
+
+        auto& camera = model.cameras.emplace_back();
+        camera.type = "perspective";
+        camera.perspective.yfov = glm::radians(sceneCamera.Fov);
+        camera.perspective.aspectRatio = sceneCamera.AspectRatio;
+        camera.perspective.znear = sceneCamera.NearPlane;
+        camera.perspective.zfar = sceneCamera.FarPlane;
+
+        auto& node = model.nodes.emplace_back();
+        node.camera = 0;
+        node.translation = {sceneCamera.Position.x, sceneCamera.Position.y, sceneCamera.Position.z};
+        gltfScene.nodes.push_back(static_cast<int>(model.nodes.size() - 1));
+    }
+
+    tinygltf::TinyGLTF writer;
+    if (!writer.WriteGltfSceneToFile(&model, path, true, true, false, true))
+    {
+        VULRAY_FLOG_ERROR("Failed to write scene to %s", path.c_str());
+        return false;
+    }
+    return true;
+}
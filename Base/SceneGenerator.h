@@ -0,0 +1,29 @@
+#pragma once
+
+#include "MeshLoader.h"
+
+// Settings of a generated scene, the same settings and seed always give the same scene
+struct SceneGeneratorSettings
+{
+    uint32_t Seed = 1;
+
+    uint32_t MeshCount = 16;            // different shapes, every shape is one geometry
+    uint32_t TrianglesPerMesh = 10000;  // approximate, the shapes are built from rings and segments
+    uint32_t InstanceCount = 64;        // meshes placed in the scene, every one uses one of the shapes with its own transform
+    uint32_t MaterialCount = 8;         // the shapes use the materials in turn
+    float EmissiveRatio = 0.1f;         // fraction of the materials that are emissive
+
+    float SceneSize = 100.0f;           // the instances are placed in a square of this size around the origin
+};
+
+// Generates scenes of any size for scaling tests, either in memory or written to a GLB file that MeshLoader can load
+class SceneGenerator
+{
+public:
+    static Scene Generate(const SceneGeneratorSettings& settings);
+
+    // Writes the meshes, materials and the first camera of a scene, skins and morph targets are left out
+    static bool WriteGLB(const Scene& scene, const std::string& path);
+
+    static uint64_t CountTriangles(const Scene& scene);
+};
@@ -0,0 +1,1003 @@
+#include "Common.h"
+#include "SceneUploader.h"
+#include "Helpers.h"
+
+#include <algorithm>
+#include <map>
+
+static const vk::BufferUsageFlags GeometryBufferUsage =
+    vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer;
+
+// Content hash of the vertices and indices of a mesh, FNV-1a over 8 bytes at a time, Reload(...) rebuilds the BLASes whose hash changed
+static uint64_t HashMeshGeometry(const Scene& scene, const Mesh& mesh)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto hashBytes = [&](const void* data, size_t size) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        size_t words = size / sizeof(uint64_t);
+        for (size_t i = 0; i < words; i++)
+        {
+            uint64_t word;
+            memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(uint64_t));
+            hash ^= word;
+            hash *= 0x100000001b3ull;
+        }
+        for (size_t i = words * sizeof(uint64_t); i < size; i++)
+        {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ull;
+        }
+    };
+
+    for (auto geomRef : mesh.GeometryReferences)
+    {
+        auto& geom = scene.Geometries[geomRef];
+
+        uint64_t counts[2] = {geom.Vertices.size(), geom.Indices.size()};
+        hashBytes(counts, sizeof(counts));
+
+        // the normals are hashed as well, the shaders read them from the vertex buffer
+        hashBytes(geom.Vertices.data(), geom.Vertices.size() * sizeof(Vertex));
+        hashBytes(geom.Indices.data(), geom.Indices.size() * sizeof(uint32_t));
+    }
+    return hash;
+}
+
+void SceneUploader::Create(vr::VulrayDevice* vrDev, vk::Device device, vk::PhysicalDevice physicalDevice,
+                           const vr::CommandQueues& queues, vk::CommandPool commandPool)
+{
+    mVRDev = vrDev;
+    mDevice = device;
+    mPhysicalDevice = physicalDevice;
+    mQueues = queues;
+    mCommandPool = commandPool;
+}
+
+void SceneUploader::Destroy()
+{
+    if (mCacheOpen)
+        mCache.Destroy();
+    mCacheOpen = false;
+
+    // the pool destroys the retired BLASes with the others
+    for (auto& pending : mPendingCompactions)
+        mDevice.destroyQueryPool(pending.Pool);
+    mPendingCompactions.clear();
+    mRetiredBLAS.clear();
+    mBLASPool.Destroy();
+
+    if (mScratchBuffer.Buffer)
+        mVRDev->DestroyBuffer(mScratchBuffer);
+    mScratchBuffer = {};
+
+    if (mTLASHandle.Buffer.Buffer)
+        mVRDev->DestroyTLAS(mTLASHandle);
+    if (mTLASScratchBuffer.Buffer)
+        mVRDev->DestroyBuffer(mTLASScratchBuffer);
+    mTLASHandle = {};
+    mTLASScratchBuffer = {};
+
+    for (auto& buffer : mInstanceBuffers)
+        mVRDev->DestroyBuffer(buffer);
+    mInstanceBuffers.clear();
+
+    for (auto& buffer : mVertexBuffers)
+        mVRDev->DestroyBuffer(buffer);
+    for (auto& buffer : mIndexBuffers)
+        mVRDev->DestroyBuffer(buffer);
+    mVertexBuffers.clear();
+    mIndexBuffers.clear();
+
+    if (mTransformBuffer.Buffer)
+        mVRDev->DestroyBuffer(mTransformBuffer);
+    if (mMaterialBuffer.Buffer)
+        mVRDev->DestroyBuffer(mMaterialBuffer);
+    if (mGeometryBuffer.Buffer)
+        mVRDev->DestroyBuffer(mGeometryBuffer);
+    mTransformBuffer = {};
+    mMaterialBuffer = {};
+    mGeometryBuffer = {};
+
+    mBLASReady.clear();
+    mInstanceIDs.clear();
+    mInstances.clear();
+    mDeferredBLAS.clear();
+    mKeysToStore.clear();
+    mBLASToStore.clear();
+
+    if (mUpdateScratchBuffer.Buffer)
+        mVRDev->DestroyBuffer(mUpdateScratchBuffer);
+    mUpdateScratchBuffer = {};
+    mMaterials = {};
+    mBLASTransforms.clear();
+    mMeshInstances.clear();
+    mDirtyMaterials.clear();
+    mDirtyTransforms.clear();
+    mDirtyBLAS.clear();
+    mTLASDirty = false;
+
+    for (auto& [reload, buffers] : mReloadBuffers)
+    {
+        for (auto& buffer : buffers.Buffers)
+            mVRDev->DestroyBuffer(buffer);
+    }
+    for (auto& [buffer, update] : mRetiredBuffers)
+        mVRDev->DestroyBuffer(buffer);
+    mReloadBuffers.clear();
+    mRetiredBuffers.clear();
+    mBLASIds.clear();
+    mBLASHashes.clear();
+    mGeometryRecords.clear();
+    mDirtyGeometries.clear();
+    mNewBLAS.clear();
+    mSlotReloads.clear();
+    mNextReload = 1;
+    mUpdateCount = 0;
+}
+
+void SceneUploader::CreateInstances(Scene& scene, std::vector<Instance>& outInstances, std::vector<uint32_t>& outMeshInstances) const
+{
+    outInstances.clear();
+
+    // the meshes keep their instance in the modes that don't merge them
+    outMeshInstances.resize(scene.Meshes.size());
+    for (uint32_t i = 0; i < scene.Meshes.size(); i++)
+        outMeshInstances[i] = i;
+
+    if (mSettings.Instancing == SceneInstancing::Grouped)
+    {
+        auto stats = BLASGrouping::Group(scene, mSettings.Grouping, &outMeshInstances);
+        std::cout << "SceneUploader: grouped " << stats.GroupedMeshes << " small meshes into " << stats.Groups << " BLASes, "
+                  << stats.MeshesAfter << " TLAS instances instead of " << stats.MeshesBefore << std::endl;
+    }
+
+    if (mSettings.Instancing != SceneInstancing::SharedGeometry)
+    {
+        for (uint32_t i = 0; i < scene.Meshes.size(); i++)
+            outInstances.push_back(Instance{i});
+        return;
+    }
+
+    // [POI]
+    // Meshes with the same geometries only differ in their transform, so the BLAS is built once without it
+    // and every mesh becomes an instance of it, the transform is applied by the TLAS instead
+    std::vector<Mesh> blasMeshes;
+    std::map<std::vector<uint32_t>, uint32_t> blasOfGeometries;
+    for (auto& mesh : scene.Meshes)
+    {
+        auto [it, added] = blasOfGeometries.try_emplace(mesh.GeometryReferences, static_cast<uint32_t>(blasMeshes.size()));
+        if (added)
+        {
+            auto& blasMesh = blasMeshes.emplace_back(mesh);
+            blasMesh.Transform = glm::mat3x4(1.0f);
+        }
+        outInstances.push_back(Instance{it->second, mesh.Transform});
+    }
+
+    std::cout << "SceneUploader: " << scene.Meshes.size() << " meshes share " << blasMeshes.size() << " BLASes" << std::endl;
+    scene.Meshes = std::move(blasMeshes);
+}
+
+SceneInstancing SceneUploader::ParseInstancing(const char* name)
+{
+    std::string value = name ? name : "";
+    if (value == "shared")
+        return SceneInstancing::SharedGeometry;
+    if (value == "grouped")
+        return SceneInstancing::Grouped;
+    return SceneInstancing::PerMesh;
+}
+
+void SceneUploader::UploadBuffers(const Scene& scene, BufferUploader& uploader, std::vector<vr::BLASCreateInfo>& outBlasCreateInfos)
+{
+    // large scenes are split into several vertex and index buffers, each of them has to fit the limits of the device
+    SceneBufferSizes sizes;
+    CalculateBufferSizes(scene, sizes, GetMaxGeometryBufferSize(mPhysicalDevice));
+
+    SceneBufferTargets targets;
+    for (size_t i = 0; i < sizes.VertexBuffers.size(); i++)
+    {
+        auto& vertexBuffer = mVertexBuffers.emplace_back(uploader.CreateBuffer(sizes.VertexBuffers[i], GeometryBufferUsage));
+        auto& indexBuffer = mIndexBuffers.emplace_back(uploader.CreateBuffer(sizes.IndexBuffers[i], GeometryBufferUsage));
+
+        targets.VertexData.push_back((Vertex*)uploader.BeginWrite(vertexBuffer));
+        targets.IndexData.push_back((uint32_t*)uploader.BeginWrite(indexBuffer));
+        targets.VertexAddresses.push_back(vertexBuffer.DevAddress);
+        targets.IndexAddresses.push_back(indexBuffer.DevAddress);
+    }
+
+    // geometries that share a material share its entry in the table
+    // the table is kept, so the live edits can patch single entries
+    mMaterials = BuildMaterialTable(scene, mSettings.EmissiveMultiplier);
+    std::cout << "SceneUploader: " << scene.Geometries.size() << " geometries use " << mMaterials.Materials.size() << " materials" << std::endl;
+
+    // the material, geometry and transform buffers are transfer destinations for the patches of RecordUpdates(...)
+    mMaterialBuffer = uploader.CreateBuffer(mMaterials.Materials.size() * sizeof(GPUMaterial),
+                                            vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst);
+    uploader.Upload(mMaterialBuffer, 0, mMaterials.Materials.data(), mMaterials.Materials.size() * sizeof(GPUMaterial));
+
+    mGeometryBuffer = uploader.CreateBuffer(sizes.GeometryBuffer, vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst);
+    mTransformBuffer = uploader.CreateBuffer(sizes.TransformBuffer, GeometryBufferUsage | vk::BufferUsageFlagBits::eTransferDst);
+
+    mBLASTransforms.clear();
+    for (auto& mesh : scene.Meshes)
+        mBLASTransforms.push_back(mesh.Transform);
+
+    // a reload patches single records, so it needs to know the others, the records are written to the host copy and uploaded from there
+    if (mSettings.HotReload)
+        mGeometryRecords.resize(sizes.GeometryBuffer / sizeof(GPUGeometry));
+
+    targets.TransformData = (char*)uploader.BeginWrite(mTransformBuffer);
+    targets.GeometryData = mSettings.HotReload ? mGeometryRecords.data() : (GPUGeometry*)uploader.BeginWrite(mGeometryBuffer);
+    targets.TransformAddress = mTransformBuffer.DevAddress;
+
+    auto flags = mSettings.BLASFlags;
+    if (mSettings.Compact)
+        flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction;
+
+    CopySceneToBuffers(scene, sizes, targets, mMaterials, mInstanceIDs, outBlasCreateInfos, flags);
+
+    for (size_t i = 0; i < mVertexBuffers.size(); i++)
+    {
+        uploader.EndWrite(mVertexBuffers[i]);
+        uploader.EndWrite(mIndexBuffers[i]);
+    }
+    uploader.EndWrite(mTransformBuffer);
+    if (mSettings.HotReload)
+        uploader.Upload(mGeometryBuffer, 0, mGeometryRecords.data(), sizes.GeometryBuffer);
+    else
+        uploader.EndWrite(mGeometryBuffer);
+}
+
+void SceneUploader::Upload(Scene scene, const SceneUploadSettings& settings)
+{
+    mSettings = settings;
+
+    CreateInstances(scene, mInstances, mMeshInstances);
+
+    mBLASIds.resize(scene.Meshes.size());
+    for (uint32_t i = 0; i < scene.Meshes.size(); i++)
+        mBLASIds[i] = i;
+    mSlotReloads.assign(scene.Meshes.size(), 0);
+
+    if (mSettings.HotReload)
+    {
+        for (auto& mesh : scene.Meshes)
+            mBLASHashes.push_back(HashMeshGeometry(scene, mesh));
+    }
+
+    // [POI]
+    // The closest hit shaders read the vertices, indices and materials of every hit, so by default they are placed in device local memory
+    // and written through a staging ring, or directly with resizable BAR, see Base/BufferUploader.h
+    BufferUploader uploader;
+    uploader.Create(mVRDev, mDevice, mPhysicalDevice, mQueues, mSettings.Placement);
+
+    std::vector<vr::BLASCreateInfo> blasCreateInfos;
+    UploadBuffers(scene, uploader, blasCreateInfos);
+
+    // the BLASes are placed in a few large buffers of the BLAS pool instead of one allocation each, see Base/BLASPool.h
+    mBLASPool.Create(mVRDev, mDevice, mPhysicalDevice);
+    for (uint32_t i = 0; i < blasCreateInfos.size(); i++)
+        mBLASPool.CreateBLAS(blasCreateInfos[i], scene, scene.Meshes[i]);
+
+    uint32_t blasCount = mBLASPool.GetBLASCount();
+    mBLASReady.assign(blasCount, false);
+
+    // the stats ids are the BLAS ids, the TLAS is added after the BLASes
+    if (mSettings.Stats)
+    {
+        for (uint32_t i = 0; i < blasCount; i++)
+            mSettings.Stats->AddBLAS("Mesh " + std::to_string(i), mBLASPool.GetPrimitiveCount(i), mBLASPool.GetBuildSizes(i));
+    }
+
+    // the key is a hash of the geometry, the build flags and the device, see Base/ASCache.h
+    std::vector<uint64_t> cacheKeys(blasCount, 0);
+    if (mSettings.UseCache)
+    {
+        mCache.Create(mVRDev, mDevice, mPhysicalDevice);
+        mCacheOpen = true;
+        for (uint32_t i = 0; i < blasCount; i++)
+            cacheKeys[i] = mCache.ComputeKey(scene, scene.Meshes[i], blasCreateInfos[i].Flags);
+    }
+
+    auto cmd = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(mCommandPool, vk::CommandBufferLevel::ePrimary, 1))[0];
+    cmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+
+    // the geometry has to be in place before the builds read it, deferred builds included
+    uploader.Finish(cmd);
+
+    auto& uploadStats = uploader.GetStats();
+    std::cout << "Uploaded " << (uploadStats.BytesStaged + uploadStats.BytesDirect) / (1024.0 * 1024.0) << " MB of geometry in "
+              << uploadStats.UploadMs << " ms, " << BufferUploader::GetPlacementName(uploader.GetPlacement()) << std::endl;
+    if (uploadStats.StagedFallbacks > 0)
+        std::cout << uploadStats.StagedFallbacks << " buffers didn't get device local host visible memory and were staged" << std::endl;
+
+    std::vector<uint32_t> blasToBuild;
+    for (uint32_t i = 0; i < blasCount; i++)
+    {
+        if (mCacheOpen && mCache.Load(cacheKeys[i], mBLASPool.GetHandle(i), cmd))
+        {
+            mBLASReady[i] = true;
+            continue;
+        }
+
+        // not cached or not compatible, build it and store it after the build
+        blasToBuild.push_back(i);
+        if (mCacheOpen)
+        {
+            mKeysToStore.push_back(cacheKeys[i]);
+            mBLASToStore.push_back(&mBLASPool.GetHandle(i));
+        }
+    }
+
+    if (mSettings.DeferBuilds)
+        mDeferredBLAS = blasToBuild;
+    else
+        BuildBatched(blasToBuild, cmd);
+
+    // the barrier covers the deserialization copies as well, they run in the acceleration structure build stage
+    mVRDev->AddAccelerationBuildBarrier(cmd);
+
+    cmd.end();
+    SubmitAndWait(cmd);
+
+    mBLASPool.FinishBuild();
+    if (mScratchBuffer.Buffer)
+        mVRDev->DestroyBuffer(mScratchBuffer);
+    mScratchBuffer = {};
+    uploader.Destroy();
+
+    // [POI]
+    // The copies to the GPU buffers have retired, nothing reads the CPU copy of the scene anymore,
+    // its vertices, indices and textures are freed in one go with the arena they were loaded into
+    size_t arenaSize = scene.Arena->GetCapacity();
+    scene = Scene();
+    std::cout << "SceneUploader: freed " << arenaSize / (1024.0 * 1024.0) << " MB of scene data, peak RSS "
+              << GetPeakResidentMemory() / (1024.0 * 1024.0) << " MB" << std::endl;
+
+    if (mCacheOpen)
+        std::cout << "Loaded " << mCache.GetLoadedCount() << " of " << blasCount << " BLASes from the cache" << std::endl;
+
+    // with deferred builds the BLASes are stored and compacted by FinishDeferredBuilds()
+    if (mDeferredBLAS.empty())
+        StoreAndCompact();
+
+    vr::TLASCreateInfo tlasCreateInfo = {};
+    tlasCreateInfo.Flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+    tlasCreateInfo.MaxInstanceCount = GetInstanceCount();
+
+    std::tie(mTLASHandle, mTLASBuildInfo) = mVRDev->CreateTLAS(tlasCreateInfo);
+
+    for (uint32_t i = 0; i < std::max(mSettings.FramesInFlight, 1u); i++)
+        mInstanceBuffers.push_back(mVRDev->CreateInstanceBuffer(GetInstanceCount()));
+
+    mTLASScratchBuffer = mVRDev->CreateScratchBufferFromBuildInfo(mTLASBuildInfo);
+
+    cmd.reset();
+    cmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+
+    uint32_t timedBuild = 0;
+    if (mSettings.Stats)
+    {
+        mTLASStatsId = mSettings.Stats->AddTLAS("TLAS", GetInstanceCount(), mTLASBuildInfo);
+        timedBuild = mSettings.Stats->BeginBuild(cmd, {mTLASStatsId});
+    }
+    BuildTLAS(cmd, 0);
+    if (mSettings.Stats)
+        mSettings.Stats->EndBuild(cmd, timedBuild);
+
+    cmd.end();
+    SubmitAndWait(cmd);
+
+    mDevice.freeCommandBuffers(mCommandPool, cmd);
+}
+
+void SceneUploader::BuildBatched(const std::vector<uint32_t>& ids, vk::CommandBuffer cmd)
+{
+    if (ids.empty())
+        return;
+
+    // [POI]
+    // A scratch buffer for all the BLASes of a large scene can be larger than the BLASes themselves,
+    // with a budget the builds are split into batches that run one after another and share the scratch buffer of the largest batch
+    std::vector<std::vector<uint32_t>> batches(1);
+    vk::DeviceSize batchScratch = 0;
+    for (auto id : ids)
+    {
+        vk::DeviceSize scratch = mBLASPool.GetScratchSize({id});
+        if (mSettings.BuildScratchBudget > 0 && !batches.back().empty() && batchScratch + scratch > mSettings.BuildScratchBudget)
+        {
+            batches.emplace_back();
+            batchScratch = 0;
+        }
+        batches.back().push_back(id);
+        batchScratch += scratch;
+    }
+
+    vk::DeviceSize scratchSize = 0;
+    for (auto& batch : batches)
+        scratchSize = std::max(scratchSize, mBLASPool.GetScratchSize(batch));
+
+    mScratchBuffer = mVRDev->CreateBuffer(scratchSize, vk::BufferUsageFlagBits::eStorageBuffer, 0);
+
+    for (size_t i = 0; i < batches.size(); i++)
+    {
+        // the batch before has to be done with the scratch buffer
+        if (i > 0)
+            mVRDev->AddAccelerationBuildBarrier(cmd);
+
+        uint32_t timedBuild = 0;
+        if (mSettings.Stats)
+            timedBuild = mSettings.Stats->BeginBuild(cmd, batches[i]);
+        mBLASPool.Build(batches[i], cmd, mScratchBuffer);
+        if (mSettings.Stats)
+            mSettings.Stats->EndBuild(cmd, timedBuild);
+    }
+
+    for (auto id : ids)
+        mBLASReady[id] = true;
+
+    if (batches.size() > 1)
+        std::cout << "SceneUploader: built " << ids.size() << " BLASes in " << batches.size() << " batches with "
+                  << scratchSize / (1024.0 * 1024.0) << " MB of scratch memory" << std::endl;
+}
+
+void SceneUploader::BuildTLAS(vk::CommandBuffer cmd, uint32_t frameIndex)
+{
+    std::vector<vk::AccelerationStructureInstanceKHR> instances;
+    instances.reserve(mInstances.size());
+
+    for (auto& instance : mInstances)
+    {
+        // a BLAS that isn't built yet gets the reference 0, which makes the instance inactive, so it is skipped by the build and the rays
+        uint32_t id = mBLASIds[instance.BLAS];
+        vk::DeviceAddress reference = mBLASReady[id] ? mBLASPool.GetHandle(id).Buffer.DevAddress : 0;
+
+        auto inst = vk::AccelerationStructureInstanceKHR()
+                        .setInstanceCustomIndex(mInstanceIDs[instance.BLAS]) // index of the first material of the BLAS
+                        .setAccelerationStructureReference(reference)
+                        .setFlags(mSettings.InstanceFlags)
+                        .setMask(0xFF)
+                        .setInstanceShaderBindingTableRecordOffset(0);
+
+        // row major like the mesh transform, the identity if the transform is built into the BLAS
+        memcpy(&inst.transform, &instance.Transform, sizeof(vk::TransformMatrixKHR));
+
+        instances.push_back(inst);
+    }
+
+    auto& instanceBuffer = mInstanceBuffers[frameIndex];
+    mVRDev->UpdateBuffer(instanceBuffer, instances.data(), sizeof(vk::AccelerationStructureInstanceKHR) * instances.size());
+
+    // the TLAS is rebuilt in place, the build waits for the rays and builds of the frame before it, which were submitted earlier to the same queue
+    auto barrier = vk::MemoryBarrier()
+                       .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR | vk::AccessFlagBits::eAccelerationStructureWriteKHR)
+                       .setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR);
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR | vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                        vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, barrier, {}, {});
+
+    mVRDev->BindScratchAdressToBuildInfo(mTLASScratchBuffer.DevAddress, mTLASBuildInfo);
+    mVRDev->BuildTLAS(mTLASBuildInfo, instanceBuffer, static_cast<uint32_t>(instances.size()), cmd);
+}
+
+void SceneUploader::SetBLASReady(const std::vector<uint32_t>& ids)
+{
+    for (auto id : ids)
+        mBLASReady[id] = true;
+}
+
+void SceneUploader::SetMaterial(uint32_t materialIndex, const GPUMaterial& material)
+{
+    mMaterials.Materials[materialIndex] = material;
+    mDirtyMaterials.insert(materialIndex);
+}
+
+bool SceneUploader::SetMeshTransform(uint32_t meshIndex, const glm::mat3x4& transform)
+{
+    uint32_t instanceIndex = mMeshInstances[meshIndex];
+    if (instanceIndex == UINT32_MAX)
+        return false;
+
+    SetInstanceTransform(instanceIndex, transform);
+    return true;
+}
+
+void SceneUploader::SetInstanceTransform(uint32_t instanceIndex, const glm::mat3x4& transform)
+{
+    auto& instance = mInstances[instanceIndex];
+    mTLASDirty = true;
+
+    if (mSettings.Instancing == SceneInstancing::SharedGeometry)
+    {
+        instance.Transform = transform;
+        return;
+    }
+
+    // a compacted BLAS is too small for a new build, the change goes into the instance instead,
+    // as the transform relative to the one that was built into the BLAS
+    uint32_t slot = instance.BLAS;
+    uint32_t id = mBLASIds[slot];
+    if (mBLASPool.GetSize(id) < mBLASPool.GetBuildSizes(id).accelerationStructureSize)
+    {
+        glm::mat4 built = glm::transpose(glm::mat4(mBLASTransforms[slot]));
+        glm::mat4 target = glm::transpose(glm::mat4(transform));
+        instance.Transform = glm::mat3x4(glm::transpose(target * glm::inverse(built)));
+        return;
+    }
+
+    mBLASTransforms[slot] = transform;
+    mDirtyTransforms.insert(slot);
+    mDirtyBLAS.insert(slot);
+}
+
+uint32_t SceneUploader::GetRecordCount(uint32_t slot) const
+{
+    uint32_t end = slot + 1 < mInstanceIDs.size() ? mInstanceIDs[slot + 1] : static_cast<uint32_t>(mGeometryRecords.size());
+    return end - mInstanceIDs[slot];
+}
+
+bool SceneUploader::Reload(Scene& scene, vk::CommandBuffer cmd)
+{
+    // the BLASes that the caller still builds would be replaced under its hands
+    // grouping merges the meshes into new ones, which slot a mesh of the file went to isn't kept, so a grouped scene is uploaded again
+    if (!mSettings.HotReload || !mDeferredBLAS.empty() || mSettings.Instancing == SceneInstancing::Grouped)
+        return false;
+
+    // CreateInstances(...) replaces the meshes with SharedGeometry, the caller gets them back as they were in the file
+    std::vector<Mesh> fileMeshes = scene.Meshes;
+    bool reloaded = ReloadInstances(scene, cmd);
+    scene.Meshes = std::move(fileMeshes);
+    return reloaded;
+}
+
+bool SceneUploader::ReloadInstances(Scene& scene, vk::CommandBuffer cmd)
+{
+    std::vector<Instance> instances;
+    std::vector<uint32_t> meshInstances;
+    CreateInstances(scene, instances, meshInstances);
+
+    // [POI]
+    // The TLAS, the transform buffer and the geometry buffer keep their size and the instance IDs stay where they are,
+    // that only works if every slot gets the same number of geometries and the material table the same number of entries
+    uint32_t slotCount = static_cast<uint32_t>(mBLASIds.size());
+    if (scene.Meshes.size() != slotCount || instances.size() != mInstances.size())
+        return false;
+    for (uint32_t i = 0; i < instances.size(); i++)
+    {
+        if (instances[i].BLAS != mInstances[i].BLAS)
+            return false;
+    }
+    for (uint32_t slot = 0; slot < slotCount; slot++)
+    {
+        if (scene.Meshes[slot].GeometryReferences.size() != GetRecordCount(slot))
+            return false;
+    }
+
+    MaterialTable materials = BuildMaterialTable(scene, mSettings.EmissiveMultiplier);
+    if (materials.Materials.size() != mMaterials.Materials.size())
+        return false;
+
+    for (uint32_t m = 0; m < materials.Materials.size(); m++)
+    {
+        if (memcmp(&materials.Materials[m], &mMaterials.Materials[m], sizeof(GPUMaterial)) != 0)
+            SetMaterial(m, materials.Materials[m]);
+    }
+
+    std::vector<uint32_t> changed;
+    for (uint32_t slot = 0; slot < slotCount; slot++)
+    {
+        auto& mesh = scene.Meshes[slot];
+        uint64_t hash = HashMeshGeometry(scene, mesh);
+        if (hash != mBLASHashes[slot])
+        {
+            changed.push_back(slot);
+            mBLASHashes[slot] = hash;
+            continue;
+        }
+
+        // the geometry is the same, but its material can be at another entry of the table
+        uint32_t first = mInstanceIDs[slot];
+        for (uint32_t g = 0; g < mesh.GeometryReferences.size(); g++)
+        {
+            uint32_t material = materials.GeometryMaterials[mesh.GeometryReferences[g]];
+            if (mGeometryRecords[first + g].MaterialIndex != material)
+            {
+                mGeometryRecords[first + g].MaterialIndex = material;
+                mDirtyGeometries.insert(first + g);
+            }
+        }
+
+        // the mesh moved, or a live edit moved it away from the file, with PerMesh slot and instance are the same
+        bool moved = mBLASTransforms[slot] != mesh.Transform || mInstances[slot].Transform != glm::mat3x4(1.0f);
+        if (mSettings.Instancing != SceneInstancing::SharedGeometry && moved)
+            SetInstanceTransform(slot, mesh.Transform);
+    }
+
+    if (mSettings.Instancing == SceneInstancing::SharedGeometry)
+    {
+        for (uint32_t i = 0; i < instances.size(); i++)
+        {
+            if (instances[i].Transform != mInstances[i].Transform)
+                SetInstanceTransform(i, instances[i].Transform);
+        }
+    }
+
+    if (!changed.empty())
+        ReplaceBLASes(scene, changed, materials, cmd);
+
+    mMaterials.GeometryMaterials = std::move(materials.GeometryMaterials);
+    mMeshInstances = std::move(meshInstances);
+
+    std::cout << "SceneUploader: reloaded the scene, " << changed.size() << " of " << slotCount << " BLASes changed" << std::endl;
+    return true;
+}
+
+void SceneUploader::ReplaceBLASes(const Scene& scene, const std::vector<uint32_t>& slots, const MaterialTable& materials, vk::CommandBuffer cmd)
+{
+    // the meshes that changed get a scene of their own, which is copied into its buffers like a whole scene is
+    Scene changedScene;
+    MaterialTable changedMaterials;
+    for (auto slot : slots)
+    {
+        auto& mesh = changedScene.Meshes.emplace_back(scene.Meshes[slot]);
+        mesh.GeometryReferences.clear();
+        for (auto geomRef : scene.Meshes[slot].GeometryReferences)
+        {
+            mesh.GeometryReferences.push_back(static_cast<uint32_t>(changedScene.Geometries.size()));
+            auto& geom = changedScene.Geometries.emplace_back();
+            geom.Vertices.assign(scene.Geometries[geomRef].Vertices.begin(), scene.Geometries[geomRef].Vertices.end());
+            geom.Indices.assign(scene.Geometries[geomRef].Indices.begin(), scene.Geometries[geomRef].Indices.end());
+            changedMaterials.GeometryMaterials.push_back(materials.GeometryMaterials[geomRef]);
+        }
+    }
+
+    SceneBufferSizes sizes;
+    CalculateBufferSizes(changedScene, sizes, GetMaxGeometryBufferSize(mPhysicalDevice));
+
+    BufferUploader uploader;
+    uploader.Create(mVRDev, mDevice, mPhysicalDevice, mQueues, mSettings.Placement);
+
+    uint32_t reload = mNextReload++;
+    auto& reloadBuffers = mReloadBuffers[reload];
+
+    SceneBufferTargets targets;
+    for (size_t i = 0; i < sizes.VertexBuffers.size(); i++)
+    {
+        auto vertexBuffer = uploader.CreateBuffer(sizes.VertexBuffers[i], GeometryBufferUsage);
+        auto indexBuffer = uploader.CreateBuffer(sizes.IndexBuffers[i], GeometryBufferUsage);
+        reloadBuffers.Buffers.push_back(vertexBuffer);
+        reloadBuffers.Buffers.push_back(indexBuffer);
+
+        targets.VertexData.push_back((Vertex*)uploader.BeginWrite(vertexBuffer));
+        targets.IndexData.push_back((uint32_t*)uploader.BeginWrite(indexBuffer));
+        targets.VertexAddresses.push_back(vertexBuffer.DevAddress);
+        targets.IndexAddresses.push_back(indexBuffer.DevAddress);
+    }
+
+    // the records and transforms go into the host copies, RecordUpdates(...) patches them into the buffers of the upload
+    std::vector<GPUGeometry> records(sizes.GeometryBuffer / sizeof(GPUGeometry));
+    std::vector<char> transforms(sizes.TransformBuffer);
+    targets.GeometryData = records.data();
+    targets.TransformData = transforms.data();
+
+    std::vector<uint32_t> firstRecords;
+    std::vector<vr::BLASCreateInfo> blasCreateInfos;
+    // like Upload(...), the BLASes are compacted once they are built, see CompactReloadedBLASes(...)
+    auto blasFlags = mSettings.BLASFlags;
+    if (mSettings.Compact)
+        blasFlags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction;
+    CopySceneToBuffers(changedScene, sizes, targets, changedMaterials, firstRecords, blasCreateInfos, blasFlags);
+
+    for (auto& buffer : reloadBuffers.Buffers)
+        uploader.EndWrite(buffer);
+
+    // waits for the copies on the transfer queue, the queues that render the frames in flight keep going
+    uploader.Finish(cmd);
+    uploader.Destroy();
+
+    for (uint32_t k = 0; k < slots.size(); k++)
+    {
+        uint32_t slot = slots[k];
+
+        // the new BLAS reads its transform from the entry of the slot
+        for (auto& geometry : blasCreateInfos[k].Geometries)
+            geometry.DataAddresses.TransformDevAddress = mTransformBuffer.DevAddress + slot * sizeof(vk::TransformMatrixKHR);
+
+        uint32_t first = mInstanceIDs[slot];
+        for (uint32_t g = 0; g < blasCreateInfos[k].Geometries.size(); g++)
+        {
+            mGeometryRecords[first + g] = records[firstRecords[k] + g];
+            mDirtyGeometries.insert(first + g);
+        }
+
+        // the frames in flight still trace the old BLAS, a freed id is reused by CreateBLAS(...)
+        RetireBLAS(mBLASIds[slot]);
+        uint32_t id = mBLASPool.CreateBLAS(blasCreateInfos[k], changedScene, changedScene.Meshes[k]);
+        if (id >= mBLASReady.size())
+            mBLASReady.resize(id + 1);
+        mBLASReady[id] = false;
+        mBLASIds[slot] = id;
+        mNewBLAS.insert(slot);
+        mDirtyBLAS.erase(slot); // the old BLAS isn't used anymore
+
+        // the new BLAS is built with the transform of the file, the instance doesn't have to correct it
+        mBLASTransforms[slot] = changedScene.Meshes[k].Transform;
+        mDirtyTransforms.insert(slot);
+        if (mSettings.Instancing != SceneInstancing::SharedGeometry)
+            mInstances[slot].Transform = glm::mat3x4(1.0f);
+
+        // the buffers of an earlier reload are freed when no slot uses them anymore, the upload buffers are shared by all slots
+        uint32_t previous = mSlotReloads[slot];
+        auto it = mReloadBuffers.find(previous);
+        if (it != mReloadBuffers.end() && --it->second.Users == 0)
+        {
+            for (auto& buffer : it->second.Buffers)
+                Retire(buffer);
+            mReloadBuffers.erase(it);
+        }
+        mSlotReloads[slot] = reload;
+        reloadBuffers.Users++;
+    }
+
+    mTLASDirty = true;
+}
+
+void SceneUploader::Retire(const vr::AllocatedBuffer& buffer)
+{
+    mRetiredBuffers.emplace_back(buffer, mUpdateCount + std::max(mSettings.FramesInFlight, 1u));
+}
+
+void SceneUploader::RetireBLAS(uint32_t id)
+{
+    mRetiredBLAS.emplace_back(id, mUpdateCount + std::max(mSettings.FramesInFlight, 1u));
+
+    // a compaction that was queried for it would copy a BLAS that is gone
+    for (auto& pending : mPendingCompactions)
+        std::replace(pending.Ids.begin(), pending.Ids.end(), id, UINT32_MAX);
+}
+
+void SceneUploader::QueryCompactedSizes(const std::vector<uint32_t>& slots, vk::CommandBuffer cmd)
+{
+    auto& pending = mPendingCompactions.emplace_back();
+    pending.Slots = slots;
+    pending.Update = mUpdateCount;
+
+    std::vector<vk::AccelerationStructureKHR> handles;
+    for (auto slot : slots)
+    {
+        pending.Ids.push_back(mBLASIds[slot]);
+        handles.push_back(mBLASPool.GetHandle(mBLASIds[slot]).AccelerationStructure);
+    }
+
+    pending.Pool = mDevice.createQueryPool(vk::QueryPoolCreateInfo()
+                                               .setQueryType(vk::QueryType::eAccelerationStructureCompactedSizeKHR)
+                                               .setQueryCount(static_cast<uint32_t>(slots.size())));
+    cmd.resetQueryPool(pending.Pool, 0, static_cast<uint32_t>(slots.size()));
+    cmd.writeAccelerationStructuresPropertiesKHR(handles, vk::QueryType::eAccelerationStructureCompactedSizeKHR, pending.Pool, 0);
+}
+
+bool SceneUploader::CompactReloadedBLASes(vk::CommandBuffer cmd)
+{
+    // [POI]
+    // The sizes are read once the frame that queried them is done, the results are there without waiting for the device
+    // every compacted BLAS is a copy into a new BLAS, the slot moves to it and the old one is retired like a replaced one
+    bool compacted = false;
+    std::erase_if(mPendingCompactions, [&](PendingCompaction& pending) {
+        if (pending.Update + std::max(mSettings.FramesInFlight, 1u) >= mUpdateCount)
+            return false;
+
+        std::vector<vk::DeviceSize> sizes(pending.Slots.size());
+        auto result = mDevice.getQueryPoolResults(pending.Pool, 0, static_cast<uint32_t>(sizes.size()), sizes.size() * sizeof(vk::DeviceSize),
+                                                  sizes.data(), sizeof(vk::DeviceSize), vk::QueryResultFlagBits::e64);
+        if (result == vk::Result::eNotReady)
+            return false;
+
+        for (uint32_t i = 0; i < pending.Slots.size(); i++)
+        {
+            uint32_t slot = pending.Slots[i];
+            if (result != vk::Result::eSuccess || pending.Ids[i] == UINT32_MAX || mDirtyBLAS.count(slot))
+                continue;
+
+            uint32_t id = mBLASPool.CompactBLAS(pending.Ids[i], sizes[i], cmd);
+            if (id >= mBLASReady.size())
+                mBLASReady.resize(id + 1);
+            mBLASReady[id] = true;
+            // no other query holds the id, so it is retired without RetireBLAS(...) looking through them
+            mRetiredBLAS.emplace_back(pending.Ids[i], mUpdateCount + std::max(mSettings.FramesInFlight, 1u));
+            mBLASIds[slot] = id;
+            compacted = true;
+        }
+
+        mDevice.destroyQueryPool(pending.Pool);
+        return true;
+    });
+    return compacted;
+}
+
+void SceneUploader::PatchBuffer(vk::CommandBuffer cmd, const vr::AllocatedBuffer& buffer, const std::set<uint32_t>& indices,
+                                const void* data, vk::DeviceSize stride)
+{
+    // vkCmdUpdateBuffer copies at most 64 KB, the data is copied into the command buffer when it is recorded
+    constexpr vk::DeviceSize maxPatchSize = 65536;
+    auto* bytes = static_cast<const char*>(data);
+
+    auto it = indices.begin();
+    while (it != indices.end())
+    {
+        uint32_t first = *it;
+        uint32_t count = 1;
+        for (++it; it != indices.end() && *it == first + count && (count + 1) * stride <= maxPatchSize; ++it)
+            count++;
+
+        cmd.updateBuffer(buffer.Buffer, first * stride, count * stride, bytes + first * stride);
+    }
+}
+
+bool SceneUploader::RecordUpdates(vk::CommandBuffer cmd, uint32_t frameIndex)
+{
+    // the frames that were recorded before a buffer was retired are done with it once FramesInFlight more have been recorded
+    mUpdateCount++;
+    std::erase_if(mRetiredBuffers, [&](const std::pair<vr::AllocatedBuffer, uint64_t>& retired) {
+        if (retired.second >= mUpdateCount)
+            return false;
+        mVRDev->DestroyBuffer(retired.first);
+        return true;
+    });
+    std::erase_if(mRetiredBLAS, [&](const std::pair<uint32_t, uint64_t>& retired) {
+        if (retired.second >= mUpdateCount)
+            return false;
+        mBLASPool.FreeBLAS(retired.first);
+        return true;
+    });
+
+    // the copies only read the BLASes, which were built frames ago, the TLAS build below waits for them
+    if (CompactReloadedBLASes(cmd))
+    {
+        mVRDev->AddAccelerationBuildBarrier(cmd);
+        mTLASDirty = true;
+    }
+
+    if (!mDirtyMaterials.empty() || !mDirtyTransforms.empty() || !mDirtyGeometries.empty())
+    {
+        // the rays and builds of the frames before may still read the entries that are overwritten
+        auto before = vk::MemoryBarrier()
+                          .setSrcAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eAccelerationStructureReadKHR)
+                          .setDstAccessMask(vk::AccessFlagBits::eTransferWrite);
+        cmd.pipelineBarrier(vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                            vk::PipelineStageFlagBits::eTransfer, {}, before, {}, {});
+
+        static_assert(sizeof(glm::mat3x4) == sizeof(vk::TransformMatrixKHR));
+        PatchBuffer(cmd, mMaterialBuffer, mDirtyMaterials, mMaterials.Materials.data(), sizeof(GPUMaterial));
+        PatchBuffer(cmd, mTransformBuffer, mDirtyTransforms, mBLASTransforms.data(), sizeof(vk::TransformMatrixKHR));
+        PatchBuffer(cmd, mGeometryBuffer, mDirtyGeometries, mGeometryRecords.data(), sizeof(GPUGeometry));
+
+        // the shaders read the materials and geometry records, the BLAS builds read the transforms
+        auto after = vk::MemoryBarrier()
+                         .setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+                         .setDstAccessMask(vk::AccessFlagBits::eShaderRead);
+        cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                            vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                            {}, after, {}, {});
+
+        mDirtyMaterials.clear();
+        mDirtyTransforms.clear();
+        mDirtyGeometries.clear();
+    }
+
+    // [POI]
+    // Only the BLASes whose transform changed are rebuilt, in place, the ones that aren't built yet get the new transform with their first build
+    // the BLASes a reload created for changed geometry are built with them
+    std::vector<uint32_t> rebuild;
+    for (auto slot : mDirtyBLAS)
+    {
+        if (!mBLASReady[mBLASIds[slot]])
+            continue;
+        rebuild.push_back(mBLASIds[slot]);
+
+        // a rebuild can change the compacted size that was queried before it
+        for (auto& pending : mPendingCompactions)
+            std::replace(pending.Ids.begin(), pending.Ids.end(), mBLASIds[slot], UINT32_MAX);
+    }
+    mDirtyBLAS.clear();
+
+    std::vector<uint32_t> newSlots(mNewBLAS.begin(), mNewBLAS.end());
+    for (auto slot : newSlots)
+        rebuild.push_back(mBLASIds[slot]);
+
+    if (!rebuild.empty())
+    {
+        vk::DeviceSize scratchSize = mBLASPool.GetScratchSize(rebuild);
+        if (mUpdateScratchBuffer.Size < scratchSize)
+        {
+            // the old scratch buffer may still be used by the frames in flight
+            if (mUpdateScratchBuffer.Buffer)
+                Retire(mUpdateScratchBuffer);
+            mUpdateScratchBuffer = mVRDev->CreateBuffer(scratchSize, vk::BufferUsageFlagBits::eStorageBuffer, 0);
+        }
+
+        // the BLASes are rebuilt in place, after the rays and builds of the frames before and the scratch use of the last rebuild
+        auto barrier = vk::MemoryBarrier()
+                           .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR | vk::AccessFlagBits::eAccelerationStructureWriteKHR)
+                           .setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR);
+        cmd.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR | vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                            vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, barrier, {}, {});
+
+        mBLASPool.Build(rebuild, cmd, mUpdateScratchBuffer);
+        mVRDev->AddAccelerationBuildBarrier(cmd);
+        mTLASDirty = true;
+
+        for (auto slot : newSlots)
+            mBLASReady[mBLASIds[slot]] = true;
+        mNewBLAS.clear();
+
+        if (mSettings.Compact && !newSlots.empty())
+            QueryCompactedSizes(newSlots, cmd);
+    }
+
+    if (!mTLASDirty)
+        return false;
+
+    BuildTLAS(cmd, frameIndex);
+    mTLASDirty = false;
+    return true;
+}
+
+void SceneUploader::FinishDeferredBuilds()
+{
+    // the compaction moves the BLASes, so the TLAS is rebuilt with their new addresses
+    mDevice.waitIdle();
+
+    StoreAndCompact();
+    mDeferredBLAS.clear();
+
+    auto cmd = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(mCommandPool, vk::CommandBufferLevel::ePrimary, 1))[0];
+    cmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+    BuildTLAS(cmd, 0);
+    cmd.end();
+
+    SubmitAndWait(cmd);
+    mDevice.freeCommandBuffers(mCommandPool, cmd);
+}
+
+void SceneUploader::StoreAndCompact()
+{
+    // serialize the BLASes that were built, so the next run can load them
+    if (mCacheOpen)
+    {
+        mCache.Store(mKeysToStore, mBLASToStore, mCommandPool, mQueues.GraphicsQueue);
+        mCache.Destroy();
+        mCacheOpen = false;
+    }
+    mKeysToStore.clear();
+    mBLASToStore.clear();
+
+    if (!mSettings.Compact)
+        return;
+
+    // [POI]
+    // Compaction shrinks the BLASes, the pool moves them into new buffers without gaps at the same time
+    auto statsBefore = mBLASPool.GetStats();
+    mBLASPool.CompactAndDefragment(mCommandPool, mQueues.GraphicsQueue);
+    BLASPool::PrintStats("before compaction", statsBefore);
+    BLASPool::PrintStats("after compaction", mBLASPool.GetStats());
+
+    if (!mSettings.Stats)
+        return;
+
+    for (uint32_t i = 0; i < mBLASPool.GetBLASCount(); i++)
+    {
+        if (mBLASPool.GetSize(i) < mBLASPool.GetBuildSizes(i).accelerationStructureSize)
+            mSettings.Stats->SetCompactedSize(i, mBLASPool.GetSize(i));
+    }
+}
+
+void SceneUploader::SubmitAndWait(vk::CommandBuffer cmd)
+{
+    auto submitInfo = vk::SubmitInfo()
+                          .setCommandBufferCount(1)
+                          .setPCommandBuffers(&cmd);
+
+    mQueues.GraphicsQueue.submit(submitInfo, nullptr);
+
+    mDevice.waitIdle();
+}
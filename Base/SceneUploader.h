@@ -0,0 +1,252 @@
+#pragma once
+
+#include "Common.h"
+#include "MeshLoader.h"
+#include "BufferUploader.h"
+#include "BLASPool.h"
+#include "ASCache.h"
+#include "ASStats.h"
+#include "BLASGrouping.h"
+#include "Helpers.h"
+
+#include <map>
+#include <set>
+
+// Which meshes share a BLAS
+enum class SceneInstancing
+{
+    PerMesh,       // one BLAS per mesh with the mesh transform built into it, every instance has the identity transform
+    SharedGeometry, // meshes that reference the same geometries share one BLAS, the mesh transform goes into the instance
+    Grouped         // small static meshes that are close to each other share a BLAS, see Base/BLASGrouping.h
+};
+
+// The policies of a scene upload, every sample that uploads a GLB scene picks them here instead of writing its own code
+struct SceneUploadSettings
+{
+    BufferPlacement Placement = BufferPlacement::Auto; // where the vertex, index, material and transform buffers go
+    SceneInstancing Instancing = SceneInstancing::PerMesh;
+    BLASGroupingSettings Grouping = {}; // used with SceneInstancing::Grouped
+
+    vk::BuildAccelerationStructureFlagsKHR BLASFlags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+    bool Compact = false;  // builds with eAllowCompaction and compacts the BLASes once all of them are built
+    bool UseCache = false; // loads the BLASes from the on disk cache and stores the ones it builds, see Base/ASCache.h
+
+    // largest scratch buffer of a build batch, the BLASes are built in batches that reuse the same scratch buffer
+    // with a barrier between them, 0 builds all of them in one batch
+    vk::DeviceSize BuildScratchBudget = 0;
+
+    // leaves the BLASes that aren't cached unbuilt, the caller builds them with GetBLASPool() (eg. SlicedBLASBuilder)
+    // marks them with SetBLASReady(...) and calls FinishDeferredBuilds() when the last one is done
+    bool DeferBuilds = false;
+
+    uint32_t FramesInFlight = 1; // instance buffers, BuildTLAS(...) can rebuild the TLAS every frame
+    vk::GeometryInstanceFlagsKHR InstanceFlags = vk::GeometryInstanceFlagBitsKHR::eTriangleFlipFacing;
+    float EmissiveMultiplier = 1.0f;
+
+    ASStats* Stats = nullptr; // the BLASes, the TLAS and their builds are added to it if it isn't null
+
+    // keeps a content hash of every BLAS and a host copy of the geometry records, so Reload(...) can patch the scene in place
+    bool HotReload = false;
+};
+
+// Turns a scene into everything the ray tracing shaders need: the geometry and material buffers, the BLASes, the TLAS
+// and the instance IDs that index the geometry records. Everything is owned by the uploader and freed by Destroy()
+class SceneUploader
+{
+public:
+    void Create(vr::VulrayDevice* vrDev,
+                vk::Device device,
+                vk::PhysicalDevice physicalDevice,
+                const vr::CommandQueues& queues,
+                vk::CommandPool commandPool);
+
+    void Destroy();
+
+    // [POI]
+    // Uploads the geometry, loads or builds the BLASes and builds the TLAS, blocks until the GPU is done
+    // the scene is move only, move it in, its CPU copy of the geometry is freed as soon as the copies to the GPU are done
+    void Upload(Scene scene, const SceneUploadSettings& settings);
+
+    // Writes the instances into the instance buffer of frameIndex and builds the TLAS in place,
+    // the instances of BLASes that aren't ready are inactive
+    void BuildTLAS(vk::CommandBuffer cmd, uint32_t frameIndex);
+
+    // [POI]
+    // Live edits: SetMaterial(...) and SetMeshTransform(...) only change the host copies, RecordUpdates(...) patches the entries
+    // that changed with small copies and rebuilds what depends on them, nothing is uploaded again
+
+    // Overwrites an entry of the material table, every geometry that uses the entry changes, see GetGeometryMaterial(...)
+    void SetMaterial(uint32_t materialIndex, const GPUMaterial& material);
+    const GPUMaterial& GetMaterial(uint32_t materialIndex) const { return mMaterials.Materials[materialIndex]; }
+    uint32_t GetMaterialCount() const { return static_cast<uint32_t>(mMaterials.Materials.size()); }
+
+    // Entry of the material table of a geometry, the index of the geometry in the scene that was uploaded
+    uint32_t GetGeometryMaterial(uint32_t geometryIndex) const { return mMaterials.GeometryMaterials[geometryIndex]; }
+
+    // Moves a mesh, meshIndex is the index in Scene::Meshes of the scene that was uploaded
+    // If the transform is built into the BLAS (PerMesh) the BLAS is rebuilt, otherwise only the instance changes
+    // Returns false for meshes that SceneInstancing::Grouped merged into a group, their transform is in their vertices
+    bool SetMeshTransform(uint32_t meshIndex, const glm::mat3x4& transform);
+
+    // [POI]
+    // With HotReload, applies a new version of the uploaded scene, eg. the GLB file after it was edited
+    // Only the BLASes whose geometry hash changed are uploaded again, into buffers of their own, and built as new BLASes that
+    // replace the old ones in the TLAS, changed materials and transforms are patched like the live edits
+    // The transfers wait on the transfer queue only, cmd gets the barrier before the builds, which RecordUpdates(...) records
+    // Returns false and changes nothing if meshes, geometries or materials were added or removed, then the scene has to be uploaded again
+    // SceneInstancing::Grouped always returns false, its groups don't map back to the meshes of the file, see Base/BLASGrouping.h
+    // The scene is left as it was, so the caller can upload it after a false
+    bool Reload(Scene& scene, vk::CommandBuffer cmd);
+
+    // Records the copies and builds of the edits since the last call, returns true if the TLAS was rebuilt
+    // the caller has to make the TLAS build visible to the rays, like after BuildTLAS(...)
+    // called every frame, it frees the buffers that reloads replaced once the frames in flight are done with them
+    bool RecordUpdates(vk::CommandBuffer cmd, uint32_t frameIndex);
+
+    // With DeferBuilds, the BLASes that have been built by the caller since the upload
+    void SetBLASReady(const std::vector<uint32_t>& ids);
+
+    // With DeferBuilds, stores the BLASes in the cache, compacts them and rebuilds the TLAS, blocks
+    void FinishDeferredBuilds();
+
+    // BLASes that DeferBuilds left for the caller to build
+    const std::vector<uint32_t>& GetDeferredBLAS() const { return mDeferredBLAS; }
+
+    BLASPool& GetBLASPool() { return mBLASPool; }
+    uint32_t GetBLASCount() const { return mBLASPool.GetBLASCount(); }
+    uint32_t GetInstanceCount() const { return static_cast<uint32_t>(mInstances.size()); }
+
+    const vr::TLASHandle& GetTLAS() const { return mTLASHandle; }
+    const vr::AllocatedBuffer& GetMaterialBuffer() const { return mMaterialBuffer; } // deduplicated GPUMaterial table
+    const vr::AllocatedBuffer& GetGeometryBuffer() const { return mGeometryBuffer; } // a GPUGeometry for every geometry of every BLAS
+    const vr::AllocatedBuffer& GetTransformBuffer() const { return mTransformBuffer; }
+    const std::vector<vr::AllocatedBuffer>& GetVertexBuffers() const { return mVertexBuffers; }
+    const std::vector<vr::AllocatedBuffer>& GetIndexBuffers() const { return mIndexBuffers; }
+
+    // instance custom index of every BLAS, the index of the GPUGeometry of its first geometry
+    const std::vector<uint32_t>& GetInstanceIDs() const { return mInstanceIDs; }
+
+    // "mesh", "shared" or "grouped", anything else is PerMesh
+    static SceneInstancing ParseInstancing(const char* name);
+
+private:
+    struct Instance
+    {
+        uint32_t BLAS = 0; // slot of the BLAS, mBLASIds has its id in the pool
+        glm::mat3x4 Transform = glm::mat3x4(1.0f);
+    };
+
+    // Vertex and index buffers of the meshes that changed in one reload
+    struct ReloadBuffers
+    {
+        std::vector<vr::AllocatedBuffer> Buffers;
+        uint32_t Users = 0; // slots whose geometry is in the buffers, they are retired when the last one is replaced
+    };
+
+    // Compacted sizes of the BLASes one RecordUpdates(...) built for a reload, read once its frame is done
+    struct PendingCompaction
+    {
+        vk::QueryPool Pool = nullptr;
+        std::vector<uint32_t> Slots;
+        std::vector<uint32_t> Ids; // UINT32_MAX once the slot was rebuilt or replaced, the queried size doesn't fit anymore
+        uint64_t Update = 0;
+    };
+
+    // Copies the entries in indices from data into buffer, runs of neighbouring entries are copied together
+    static void PatchBuffer(vk::CommandBuffer cmd, const vr::AllocatedBuffer& buffer, const std::set<uint32_t>& indices,
+                            const void* data, vk::DeviceSize stride);
+
+    // Replaces the meshes of the scene with one mesh per BLAS and creates its instances
+    void CreateInstances(Scene& scene, std::vector<Instance>& outInstances, std::vector<uint32_t>& outMeshInstances) const;
+
+    // Moves the instance of a mesh, rebuilds the BLAS if the transform is built into it
+    void SetInstanceTransform(uint32_t instanceIndex, const glm::mat3x4& transform);
+
+    // Reload(...) after the checks that don't need the instances, scene.Meshes is replaced by the meshes of the BLASes
+    bool ReloadInstances(Scene& scene, vk::CommandBuffer cmd);
+
+    // Uploads the meshes of the slots into new buffers and creates the BLASes that replace the ones of the slots
+    void ReplaceBLASes(const Scene& scene, const std::vector<uint32_t>& slots, const MaterialTable& materials, vk::CommandBuffer cmd);
+
+    // Queries the compacted sizes of the BLASes a reload built, with Compact, after the builds in cmd
+    void QueryCompactedSizes(const std::vector<uint32_t>& slots, vk::CommandBuffer cmd);
+
+    // Records the compacting copies of the queries whose frames are done, returns true if a slot moved to a compacted BLAS
+    bool CompactReloadedBLASes(vk::CommandBuffer cmd);
+
+    // Number of geometry records of a slot
+    uint32_t GetRecordCount(uint32_t slot) const;
+
+    // Destroys the buffer once the frames in flight that may read it are done, see RecordUpdates(...)
+    void Retire(const vr::AllocatedBuffer& buffer);
+
+    // Frees the BLAS in the pool once the frames in flight that may trace it are done
+    void RetireBLAS(uint32_t id);
+
+    void UploadBuffers(const Scene& scene, BufferUploader& uploader, std::vector<vr::BLASCreateInfo>& outBlasCreateInfos);
+
+    // Records the builds of the BLASes in batches that fit the scratch budget
+    void BuildBatched(const std::vector<uint32_t>& ids, vk::CommandBuffer cmd);
+
+    // Stores the built BLASes in the cache and compacts them if the settings ask for it, blocks
+    void StoreAndCompact();
+
+    void SubmitAndWait(vk::CommandBuffer cmd);
+
+    vr::VulrayDevice* mVRDev = nullptr;
+    vk::Device mDevice = nullptr;
+    vk::PhysicalDevice mPhysicalDevice = nullptr;
+    vr::CommandQueues mQueues = {};
+    vk::CommandPool mCommandPool = nullptr;
+
+    SceneUploadSettings mSettings = {};
+
+    std::vector<vr::AllocatedBuffer> mVertexBuffers;
+    std::vector<vr::AllocatedBuffer> mIndexBuffers;
+    vr::AllocatedBuffer mTransformBuffer = {};
+    vr::AllocatedBuffer mMaterialBuffer = {};
+    vr::AllocatedBuffer mGeometryBuffer = {};
+
+    BLASPool mBLASPool;
+    std::vector<bool> mBLASReady;
+    std::vector<uint32_t> mInstanceIDs;
+    std::vector<Instance> mInstances;
+    vr::AllocatedBuffer mScratchBuffer = {};
+
+    ASCache mCache;
+    bool mCacheOpen = false;
+    std::vector<uint64_t> mKeysToStore;
+    std::vector<const vr::BLASHandle*> mBLASToStore;
+    std::vector<uint32_t> mDeferredBLAS;
+
+    vr::TLASHandle mTLASHandle = {};
+    vr::TLASBuildInfo mTLASBuildInfo = {};
+    vr::AllocatedBuffer mTLASScratchBuffer = {};
+    std::vector<vr::AllocatedBuffer> mInstanceBuffers; // one for every frame in flight
+    uint32_t mTLASStatsId = 0;
+
+    // host copies of the material and transform buffers, the live edits change them and patch the buffers
+    MaterialTable mMaterials;
+    std::vector<glm::mat3x4> mBLASTransforms; // transform built into every BLAS
+    std::vector<uint32_t> mMeshInstances;     // instance of every mesh of the uploaded scene, UINT32_MAX if it was grouped
+    std::set<uint32_t> mDirtyMaterials;
+    std::set<uint32_t> mDirtyTransforms;
+    std::set<uint32_t> mDirtyBLAS;
+    bool mTLASDirty = false;
+    vr::AllocatedBuffer mUpdateScratchBuffer = {};
+
+    // the instances, the transforms and the geometry records are indexed by slot, a reload moves a slot to a new BLAS
+    // the replaced BLAS is freed in the pool once the frames in flight are done with it, the new ones reuse its space
+    std::vector<uint32_t> mBLASIds;
+    std::vector<uint64_t> mBLASHashes;         // with HotReload, content hash of the geometry of every slot
+    std::vector<GPUGeometry> mGeometryRecords; // with HotReload, host copy of the geometry buffer
+    std::set<uint32_t> mDirtyGeometries;
+    std::set<uint32_t> mNewBLAS;               // slots whose BLAS a reload created, built by the next RecordUpdates(...)
+    std::map<uint32_t, ReloadBuffers> mReloadBuffers;
+    std::vector<uint32_t> mSlotReloads;        // reload whose buffers hold the geometry of every slot, 0 for the upload buffers
+    uint32_t mNextReload = 1;
+    std::vector<std::pair<vr::AllocatedBuffer, uint64_t>> mRetiredBuffers; // with the update after which nothing reads them
+    std::vector<std::pair<uint32_t, uint64_t>> mRetiredBLAS;                // pool ids, the same way
+    std::vector<PendingCompaction> mPendingCompactions;
+    uint64_t mUpdateCount = 0;
+};
@@ -14,7 +14,7 @@ ShaderCompiler::ShaderCompiler()
 }
 
 
-std::vector<uint32_t> ShaderCompiler::CompileSPIRVFromSource(const std::vector<char>& source)
+std::vector<uint32_t> ShaderCompiler::CompileSPIRVFromSource(const std::vector<char>& source, const wchar_t* target)
 {
 
     CComPtr<IDxcBlobEncoding> pSource;
@@ -23,7 +23,7 @@ std::vector<uint32_t> ShaderCompiler::CompileSPIRVFromSource(const std::vector<c
     std::vector<const wchar_t*> arguments;
 
     arguments.push_back(L"-T");
-    arguments.push_back(L"lib_6_5");
+    arguments.push_back(target);
 
     arguments.push_back(L"-E");
     arguments.push_back(L"main");
@@ -61,11 +61,11 @@ std::vector<uint32_t> ShaderCompiler::CompileSPIRVFromSource(const std::vector<c
     return std::vector<uint32_t>((uint32_t*)pSpirv->GetBufferPointer(), (uint32_t*)pSpirv->GetBufferPointer() + spirvSize);
 }
 
-std::vector<uint32_t> ShaderCompiler::CompileSPIRVFromFile(const std::string& file)
+std::vector<uint32_t> ShaderCompiler::CompileSPIRVFromFile(const std::string& file, const wchar_t* target)
 {
     std::vector<char> shaderCode;
     FileRead(file, shaderCode);
-    return CompileSPIRVFromSource(shaderCode);
+    return CompileSPIRVFromSource(shaderCode, target);
 }
 
 ShaderCompiler::~ShaderCompiler()
@@ -16,8 +16,9 @@ public:
 
     ~ShaderCompiler();
 
-    std::vector<uint32_t> CompileSPIRVFromSource(const std::vector<char>& source);
-    std::vector<uint32_t> CompileSPIRVFromFile(const std::string& file);
+    // target is the shader profile, ray tracing shaders are compiled as a library, compute shaders use cs_6_5
+    std::vector<uint32_t> CompileSPIRVFromSource(const std::vector<char>& source, const wchar_t* target = L"lib_6_5");
+    std::vector<uint32_t> CompileSPIRVFromFile(const std::string& file, const wchar_t* target = L"lib_6_5");
 private:
 
     CComPtr<IDxcUtils> mUtils;
@@ -0,0 +1,94 @@
+#include "Common.h"
+#include "SlicedBLASBuilder.h"
+
+void SlicedBLASBuilder::Create(vr::VulrayDevice* vrDev, vk::Device device, vk::PhysicalDevice physicalDevice, BLASPool* pool,
+                               uint32_t framesInFlight, float budgetMs)
+{
+    mVRDev = vrDev;
+    mPool = pool;
+    mBudgetMs = budgetMs;
+
+    mScratchBuffers.resize(framesInFlight);
+    mSlicePrimitives.resize(framesInFlight, 0);
+
+    mTimer.Create(device, physicalDevice, SliceTimestampCount, framesInFlight);
+}
+
+void SlicedBLASBuilder::Destroy()
+{
+    for (auto& scratch : mScratchBuffers)
+    {
+        if (scratch.Buffer)
+            mVRDev->DestroyBuffer(scratch);
+    }
+    mScratchBuffers.clear();
+
+    mTimer.Destroy();
+}
+
+void SlicedBLASBuilder::Enqueue(const std::vector<uint32_t>& ids)
+{
+    mQueue.insert(mQueue.end(), ids.begin(), ids.end());
+}
+
+void SlicedBLASBuilder::RecordFrame(vk::CommandBuffer cmd, uint32_t frameIndex, std::vector<uint32_t>& outBuilt)
+{
+    outBuilt.clear();
+
+    // the frame has come around again, so its last slice has finished and its time can be read
+    bool timerBegun = false;
+    if (mSlicePrimitives[frameIndex] > 0)
+    {
+        mTimer.BeginFrame(cmd, frameIndex);
+        timerBegun = true;
+        mLastSliceMs = mTimer.GetMilliseconds(frameIndex, SliceStart, SliceEnd);
+        if (mLastSliceMs > 0.0)
+        {
+            // smooth the speed, a single slice can be slowed down by the trace of the frame before it
+            double msPerPrimitive = mLastSliceMs / mSlicePrimitives[frameIndex];
+            mMsPerPrimitive = mMsPerPrimitive * 0.5 + msPerPrimitive * 0.5;
+        }
+        mSlicePrimitives[frameIndex] = 0;
+    }
+
+    if (IsDone())
+        return;
+
+    // [POI]
+    // Take BLASes from the queue until the estimated build time is over the budget of this frame
+    double estimatedMs = 0.0;
+    uint64_t primitives = 0;
+    while (mNext < mQueue.size())
+    {
+        uint64_t count = mPool->GetPrimitiveCount(mQueue[mNext]);
+        double ms = count * mMsPerPrimitive;
+        if (!outBuilt.empty() && estimatedMs + ms > mBudgetMs)
+            break;
+
+        estimatedMs += ms;
+        primitives += count;
+        outBuilt.push_back(mQueue[mNext++]);
+    }
+
+    vk::DeviceSize scratchSize = mPool->GetScratchSize(outBuilt);
+    auto& scratch = mScratchBuffers[frameIndex];
+    if (scratchSize > scratch.Size)
+    {
+        // the last use of the buffer was the slice of this frame, which has finished
+        if (scratch.Buffer)
+            mVRDev->DestroyBuffer(scratch);
+        scratch = mVRDev->CreateBuffer(scratchSize, vk::BufferUsageFlagBits::eStorageBuffer, 0);
+    }
+
+    // BeginFrame(...) resets the queries, it was already recorded if the last slice of this frame was read
+    if (!timerBegun)
+        mTimer.BeginFrame(cmd, frameIndex);
+
+    mTimer.WriteTimestamp(cmd, frameIndex, SliceStart, vk::PipelineStageFlagBits::eTopOfPipe);
+    mPool->Build(outBuilt, cmd, scratch);
+    mTimer.WriteTimestamp(cmd, frameIndex, SliceEnd, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR);
+
+    mVRDev->AddAccelerationBuildBarrier(cmd);
+
+    mSlicePrimitives[frameIndex] = primitives;
+}
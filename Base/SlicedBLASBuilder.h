@@ -0,0 +1,63 @@
+#pragma once
+
+#include "Common.h"
+#include "BLASPool.h"
+#include "GPUTimer.h"
+
+// Spreads the builds of the BLASes of a pool over several frames, so the first frame doesn't wait for every BLAS of the scene
+// every frame builds as many BLASes as fit into a GPU time budget, the cost of a BLAS is estimated from its primitive count
+// and the build speed measured with timestamps in the previous slices
+class SlicedBLASBuilder
+{
+public:
+    void Create(vr::VulrayDevice* vrDev, vk::Device device, vk::PhysicalDevice physicalDevice, BLASPool* pool,
+                uint32_t framesInFlight, float budgetMs);
+
+    // the frames in flight must have finished executing
+    void Destroy();
+
+    // Queues BLASes of the pool, they are built in the order they were queued
+    void Enqueue(const std::vector<uint32_t>& ids);
+
+    // Records the builds of this frame followed by a barrier, the ids of the BLASes that were recorded are written to outBuilt
+    // they can be referenced by a TLAS that is built later in the same command buffer
+    // at least one BLAS is built every frame, so a BLAS that alone is over the budget doesn't stall the queue
+    void RecordFrame(vk::CommandBuffer cmd, uint32_t frameIndex, std::vector<uint32_t>& outBuilt);
+
+    // true once every queued BLAS has been recorded, the last slice may still be executing
+    bool IsDone() const { return mNext == mQueue.size(); }
+
+    uint32_t GetBuiltCount() const { return mNext; }
+    uint32_t GetQueuedCount() const { return static_cast<uint32_t>(mQueue.size()); }
+
+    // GPU time of the last measured slice
+    double GetLastSliceMs() const { return mLastSliceMs; }
+
+private:
+    enum SliceTimestamp
+    {
+        SliceStart = 0,
+        SliceEnd,
+        SliceTimestampCount
+    };
+
+    vr::VulrayDevice* mVRDev = nullptr;
+    BLASPool* mPool = nullptr;
+
+    float mBudgetMs = 0.0f;
+
+    // [POI]
+    // Starts with a guess of 50 million triangles per second, replaced by the measured speed after the first slices
+    // a fixed cost per build is left out, so small meshes are slightly underestimated
+    double mMsPerPrimitive = 1.0 / 50000.0;
+    double mLastSliceMs = 0.0;
+
+    std::vector<uint32_t> mQueue;
+    uint32_t mNext = 0;
+
+    // the scratch buffer of a frame is in use until the frame comes around again
+    std::vector<vr::AllocatedBuffer> mScratchBuffers;
+    std::vector<uint64_t> mSlicePrimitives; // primitives built by the last slice of every frame, 0 if it built nothing
+
+    GPUTimer mTimer;
+};
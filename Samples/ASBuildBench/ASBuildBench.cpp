@@ -0,0 +1,587 @@
+#include "Vulray/Vulray.h"
+#include "Common.h"
+#include "MeshLoader.h"
+#include "Helpers.h"
+#include "SceneGenerator.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+
+// Benchmark of acceleration structure builds, it doesn't create a window or a swapchain, so it runs headless,
+// on build machines and on software Vulkan implementations
+// Builds the BLASes of every scene in Assets/ and of generated meshes from 1K to 10M triangles with every flag combination,
+// then writes the sizes and GPU times to a CSV file, which can be compared to an earlier run to catch regressions
+//
+// Usage: ASBuildBench [--runs N] [--max-triangles N] [--out results.csv] [--baseline baseline.csv] [--tolerance 0.1] [--write-glb directory]
+// exits with 0 if everything was built and nothing regressed, 1 on errors and 2 if a result is worse than the baseline
+
+struct BenchScene
+{
+    std::string Name;
+    Scene Data;
+    uint64_t TriangleCount = 0;
+    bool Generated = false;
+};
+
+struct FlagConfig
+{
+    const char* Name;
+    vk::BuildAccelerationStructureFlagsKHR Flags;
+};
+
+struct BenchResult
+{
+    std::string Scene;
+    std::string Flags;
+    uint64_t Triangles = 0;
+    uint32_t BLASCount = 0;
+    vk::DeviceSize Size = 0;          // sum of the BLAS sizes
+    vk::DeviceSize CompactedSize = 0; // 0 if the flags don't allow compaction
+    vk::DeviceSize BuildScratchSize = 0;
+    vk::DeviceSize UpdateScratchSize = 0;
+    vk::DeviceSize TLASSize = 0;
+    double BuildMs = 0.0; // median of the runs
+    double RefitMs = 0.0; // 0 if the flags don't allow updates
+    double TLASBuildMs = 0.0;
+};
+
+static const FlagConfig FlagConfigs[] = {
+    {"FastTrace", vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace},
+    {"FastBuild", vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild},
+    {"FastTrace+Compaction", vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace | vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction},
+    {"FastBuild+Compaction", vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild | vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction},
+    {"FastTrace+Update", vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate},
+    {"FastBuild+Update", vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate},
+};
+
+class ASBuildBench
+{
+public:
+    // Creates a device without a surface, returns false if there is no device with ray tracing support
+    bool Create();
+
+    void Destroy();
+
+    bool Run(const BenchScene& scene, const FlagConfig& config, uint32_t runs, BenchResult& outResult);
+
+private:
+    // Records commands with a timestamp before and after them, submits them and waits, returns the GPU time in milliseconds
+    double Submit(const std::function<void(vk::CommandBuffer)>& record);
+
+    vr::InstanceWrapper mInstance;
+    vk::PhysicalDevice mPhysicalDevice = nullptr;
+    vk::Device mDevice = nullptr;
+    vr::CommandQueues mQueues;
+    vr::VulrayDevice* mVRDev = nullptr;
+
+    vk::CommandPool mPool = nullptr;
+    vk::CommandBuffer mCmd = nullptr;
+    vk::QueryPool mTimestampPool = nullptr;
+    vk::QueryPool mCompactionPool = nullptr;
+    uint32_t mCompactionPoolSize = 0;
+    double mTimestampPeriod = 0.0;
+};
+
+bool ASBuildBench::Create()
+{
+    vr::VulkanBuilder builder;
+#ifdef NDEBUG
+    builder.EnableDebug = false;
+#else
+    builder.EnableDebug = true;
+#endif
+
+    // [POI]
+    // No surface extensions and no surface, so the device is picked for ray tracing only and doesn't need to present
+    mInstance = builder.CreateInstance();
+    mPhysicalDevice = builder.PickPhysicalDevice(nullptr);
+    if (!mPhysicalDevice)
+    {
+        VULRAY_LOG_ERROR("No device with ray tracing support found");
+        return false;
+    }
+
+    mDevice = builder.CreateDevice();
+    mQueues = builder.GetQueues();
+
+    mVRDev = new vr::VulrayDevice(mInstance.InstanceHandle, mDevice, mPhysicalDevice);
+
+    auto properties = mPhysicalDevice.getProperties();
+    mTimestampPeriod = properties.limits.timestampPeriod;
+    if (!properties.limits.timestampComputeAndGraphics)
+        std::cout << "Warning: " << properties.deviceName << " doesn't support timestamps, all times will be 0" << std::endl;
+
+    std::cout << "Device: " << properties.deviceName << std::endl;
+
+    mPool = mDevice.createCommandPool(vk::CommandPoolCreateInfo()
+                                          .setFlags(vk::CommandPoolCreateFlagBits::eResetCommandBuffer)
+                                          .setQueueFamilyIndex(mQueues.GraphicsIndex));
+    mCmd = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(mPool, vk::CommandBufferLevel::ePrimary, 1))[0];
+
+    mTimestampPool = mDevice.createQueryPool(vk::QueryPoolCreateInfo().setQueryType(vk::QueryType::eTimestamp).setQueryCount(2));
+    return true;
+}
+
+void ASBuildBench::Destroy()
+{
+    if (mDevice)
+    {
+        mDevice.waitIdle();
+        if (mCompactionPool)
+            mDevice.destroyQueryPool(mCompactionPool);
+        mDevice.destroyQueryPool(mTimestampPool);
+        mDevice.destroyCommandPool(mPool);
+    }
+
+    delete mVRDev;
+    if (mDevice)
+        mDevice.destroy();
+    vr::InstanceWrapper::DestroyInstance(mInstance);
+}
+
+double ASBuildBench::Submit(const std::function<void(vk::CommandBuffer)>& record)
+{
+    mCmd.reset();
+    mCmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+
+    // the refits, compaction queries and TLAS builds read the BLASes built by an earlier submit,
+    // waiting for the device makes that finish first, but the writes also have to be made visible to the builds that read them
+    mVRDev->AddAccelerationBuildBarrier(mCmd);
+
+    mCmd.resetQueryPool(mTimestampPool, 0, 2);
+    mCmd.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, mTimestampPool, 0);
+    record(mCmd);
+    mCmd.writeTimestamp(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, mTimestampPool, 1);
+    mCmd.end();
+
+    mQueues.GraphicsQueue.submit(vk::SubmitInfo().setCommandBufferCount(1).setPCommandBuffers(&mCmd), nullptr);
+    mDevice.waitIdle();
+
+    uint64_t timestamps[2] = {};
+    auto result = mDevice.getQueryPoolResults(mTimestampPool, 0, 2, sizeof(timestamps), timestamps, sizeof(uint64_t),
+                                              vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+    if (result != vk::Result::eSuccess || timestamps[1] < timestamps[0])
+        return 0.0;
+
+    return (timestamps[1] - timestamps[0]) * mTimestampPeriod / 1000000.0;
+}
+
+static double Median(std::vector<double> values)
+{
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+bool ASBuildBench::Run(const BenchScene& scene, const FlagConfig& config, uint32_t runs, BenchResult& outResult)
+{
+    outResult = {};
+    outResult.Scene = scene.Name;
+    outResult.Flags = config.Name;
+    outResult.Triangles = scene.TriangleCount;
+
+    SceneBufferSizes sizes;
+    CalculateBufferSizes(scene.Data, sizes, GetMaxGeometryBufferSize(mPhysicalDevice));
+
+    auto inputUsage = vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer;
+    std::vector<vr::AllocatedBuffer> vertexBuffers;
+    std::vector<vr::AllocatedBuffer> indexBuffers;
+    SceneBufferTargets targets;
+    for (size_t i = 0; i < sizes.VertexBuffers.size(); i++)
+    {
+        auto& vertexBuffer = vertexBuffers.emplace_back(mVRDev->CreateBuffer(sizes.VertexBuffers[i], inputUsage, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT));
+        auto& indexBuffer = indexBuffers.emplace_back(mVRDev->CreateBuffer(sizes.IndexBuffers[i], inputUsage, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT));
+        targets.VertexData.push_back((Vertex*)mVRDev->MapBuffer(vertexBuffer));
+        targets.IndexData.push_back((uint32_t*)mVRDev->MapBuffer(indexBuffer));
+        targets.VertexAddresses.push_back(vertexBuffer.DevAddress);
+        targets.IndexAddresses.push_back(indexBuffer.DevAddress);
+    }
+    auto transformBuffer = mVRDev->CreateBuffer(sizes.TransformBuffer, inputUsage, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+
+    // the geometry records aren't used, they only have to go somewhere
+    MaterialTable materials = BuildMaterialTable(scene.Data);
+    std::vector<GPUGeometry> geometryRecords(sizes.GeometryBuffer / sizeof(GPUGeometry));
+    std::vector<uint32_t> instanceIDs;
+    std::vector<vr::BLASCreateInfo> blasCreateInfos;
+
+    targets.TransformData = (char*)mVRDev->MapBuffer(transformBuffer);
+    targets.GeometryData = geometryRecords.data();
+    targets.TransformAddress = transformBuffer.DevAddress;
+
+    CopySceneToBuffers(scene.Data, sizes, targets, materials, instanceIDs, blasCreateInfos);
+
+    for (size_t i = 0; i < vertexBuffers.size(); i++)
+    {
+        mVRDev->UnmapBuffer(vertexBuffers[i]);
+        mVRDev->UnmapBuffer(indexBuffers[i]);
+    }
+    mVRDev->UnmapBuffer(transformBuffer);
+
+    std::vector<vr::BLASHandle> blasHandles;
+    std::vector<vr::BLASBuildInfo> buildInfos;
+    for (auto& info : blasCreateInfos)
+    {
+        info.Flags = config.Flags;
+        auto [handle, buildInfo] = mVRDev->CreateBLAS(info);
+        blasHandles.push_back(handle);
+        buildInfos.push_back(buildInfo);
+
+        outResult.Size += buildInfo.BuildSizes.accelerationStructureSize;
+        outResult.BuildScratchSize += buildInfo.BuildSizes.buildScratchSize;
+        outResult.UpdateScratchSize += buildInfo.BuildSizes.updateScratchSize;
+    }
+    outResult.BLASCount = static_cast<uint32_t>(blasHandles.size());
+
+    auto scratchBuffer = mVRDev->CreateScratchBufferFromBuildInfos(buildInfos);
+
+    // [POI]
+    // Every run rebuilds the same BLASes from scratch, the median hides the first run, which can be slower while the driver warms up
+    std::vector<double> buildTimes;
+    for (uint32_t run = 0; run < runs; run++)
+        buildTimes.push_back(Submit([&](vk::CommandBuffer cmd) { mVRDev->BuildBLAS(buildInfos, cmd); }));
+    outResult.BuildMs = Median(buildTimes);
+
+    mVRDev->DestroyBuffer(scratchBuffer);
+
+    if (config.Flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction)
+    {
+        // the compacted size is all that is needed, the compacted copy itself is benchmarked by its size only
+        uint32_t count = outResult.BLASCount;
+        if (count > mCompactionPoolSize)
+        {
+            if (mCompactionPool)
+                mDevice.destroyQueryPool(mCompactionPool);
+            mCompactionPool = mDevice.createQueryPool(vk::QueryPoolCreateInfo()
+                                                          .setQueryType(vk::QueryType::eAccelerationStructureCompactedSizeKHR)
+                                                          .setQueryCount(count));
+            mCompactionPoolSize = count;
+        }
+
+        std::vector<vk::AccelerationStructureKHR> handles;
+        for (auto& blas : blasHandles)
+            handles.push_back(blas.AccelerationStructure);
+
+        Submit([&](vk::CommandBuffer cmd) {
+            cmd.resetQueryPool(mCompactionPool, 0, count);
+            cmd.writeAccelerationStructuresPropertiesKHR(handles, vk::QueryType::eAccelerationStructureCompactedSizeKHR, mCompactionPool, 0);
+        });
+
+        std::vector<vk::DeviceSize> compactedSizes(count);
+        auto _ = mDevice.getQueryPoolResults(mCompactionPool, 0, count, compactedSizes.size() * sizeof(vk::DeviceSize), compactedSizes.data(),
+                                             sizeof(vk::DeviceSize), vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+        for (auto size : compactedSizes)
+            outResult.CompactedSize += size;
+    }
+
+    if (config.Flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate)
+    {
+        // [POI]
+        // The refit uses the same vertices, so it measures the cost of walking the tree, not of a deformation
+        std::vector<vr::BLASBuildInfo> updateInfos;
+        for (uint32_t i = 0; i < blasHandles.size(); i++)
+        {
+            vr::BLASUpdateInfo updateInfo = {};
+            updateInfo.SourceBLAS = &blasHandles[i];
+            updateInfo.SourceBuildInfo = buildInfos[i];
+            updateInfos.push_back(mVRDev->UpdateBLAS(updateInfo));
+        }
+
+        auto updateScratchBuffer = mVRDev->CreateScratchBufferFromBuildInfos(updateInfos);
+
+        std::vector<double> refitTimes;
+        for (uint32_t run = 0; run < runs; run++)
+            refitTimes.push_back(Submit([&](vk::CommandBuffer cmd) { mVRDev->BuildBLAS(updateInfos, cmd); }));
+        outResult.RefitMs = Median(refitTimes);
+
+        mVRDev->DestroyBuffer(updateScratchBuffer);
+    }
+
+    // one instance of every BLAS, the TLAS gets the trace / build preference of the BLASes
+    vr::TLASCreateInfo tlasCreateInfo = {};
+    tlasCreateInfo.Flags = config.Flags & (vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace | vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild);
+    tlasCreateInfo.MaxInstanceCount = outResult.BLASCount;
+
+    auto [tlasHandle, tlasBuildInfo] = mVRDev->CreateTLAS(tlasCreateInfo);
+    outResult.TLASSize = tlasBuildInfo.BuildSizes.accelerationStructureSize;
+
+    std::vector<vk::AccelerationStructureInstanceKHR> instances;
+    for (auto& blas : blasHandles)
+    {
+        auto inst = vk::AccelerationStructureInstanceKHR()
+                        .setAccelerationStructureReference(blas.Buffer.DevAddress)
+                        .setMask(0xFF);
+        inst.transform = {
+            1.0f, 0.0f, 0.0f, 0.0f,
+            0.0f, 1.0f, 0.0f, 0.0f,
+            0.0f, 0.0f, 1.0f, 0.0f};
+        instances.push_back(inst);
+    }
+
+    auto instanceBuffer = mVRDev->CreateInstanceBuffer(outResult.BLASCount);
+    mVRDev->UpdateBuffer(instanceBuffer, instances.data(), instances.size() * sizeof(vk::AccelerationStructureInstanceKHR));
+    auto tlasScratchBuffer = mVRDev->CreateScratchBufferFromBuildInfo(tlasBuildInfo);
+
+    std::vector<double> tlasTimes;
+    for (uint32_t run = 0; run < runs; run++)
+        tlasTimes.push_back(Submit([&](vk::CommandBuffer cmd) { mVRDev->BuildTLAS(tlasBuildInfo, instanceBuffer, outResult.BLASCount, cmd); }));
+    outResult.TLASBuildMs = Median(tlasTimes);
+
+    mVRDev->DestroyBuffer(tlasScratchBuffer);
+    mVRDev->DestroyBuffer(instanceBuffer);
+    mVRDev->DestroyTLAS(tlasHandle);
+    mVRDev->DestroyBLAS(blasHandles);
+    for (auto& buffer : vertexBuffers)
+        mVRDev->DestroyBuffer(buffer);
+    for (auto& buffer : indexBuffers)
+        mVRDev->DestroyBuffer(buffer);
+    mVRDev->DestroyBuffer(transformBuffer);
+
+    return true;
+}
+
+static BenchScene GenerateScene(const std::string& name, const SceneGeneratorSettings& settings)
+{
+    BenchScene scene;
+    scene.Name = name;
+    scene.Data = SceneGenerator::Generate(settings);
+    scene.TriangleCount = SceneGenerator::CountTriangles(scene.Data);
+    scene.Generated = true;
+    return scene;
+}
+
+static const char* CSVHeader = "scene,flags,triangles,blasCount,size,compactedSize,buildScratchSize,updateScratchSize,tlasSize,buildMs,refitMs,tlasBuildMs";
+
+static void WriteCSV(const std::string& path, const std::vector<BenchResult>& results)
+{
+    std::ofstream file(path, std::ios::trunc);
+    file << CSVHeader << "\n";
+    for (auto& r : results)
+    {
+        file << r.Scene << "," << r.Flags << "," << r.Triangles << "," << r.BLASCount << "," << r.Size << "," << r.CompactedSize << ","
+             << r.BuildScratchSize << "," << r.UpdateScratchSize << "," << r.TLASSize << ","
+             << r.BuildMs << "," << r.RefitMs << "," << r.TLASBuildMs << "\n";
+    }
+}
+
+static std::map<std::string, BenchResult> ReadCSV(const std::string& path)
+{
+    std::map<std::string, BenchResult> results;
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line); // header
+
+    while (std::getline(file, line))
+    {
+        std::vector<std::string> fields;
+        std::stringstream stream(line);
+        std::string field;
+        while (std::getline(stream, field, ','))
+            fields.push_back(field);
+        if (fields.size() < 12)
+            continue;
+
+        BenchResult r;
+        r.Scene = fields[0];
+        r.Flags = fields[1];
+        r.Triangles = std::stoull(fields[2]);
+        r.BLASCount = static_cast<uint32_t>(std::stoul(fields[3]));
+        r.Size = std::stoull(fields[4]);
+        r.CompactedSize = std::stoull(fields[5]);
+        r.BuildScratchSize = std::stoull(fields[6]);
+        r.UpdateScratchSize = std::stoull(fields[7]);
+        r.TLASSize = std::stoull(fields[8]);
+        r.BuildMs = std::stod(fields[9]);
+        r.RefitMs = std::stod(fields[10]);
+        r.TLASBuildMs = std::stod(fields[11]);
+        results[r.Scene + "," + r.Flags] = r;
+    }
+    return results;
+}
+
+// Prints every result that is worse than the baseline by more than the tolerance, returns the number of regressions
+// times below a tenth of a millisecond are too noisy to compare
+static uint32_t CompareToBaseline(const std::vector<BenchResult>& results, const std::map<std::string, BenchResult>& baseline, double tolerance)
+{
+    uint32_t regressions = 0;
+
+    auto check = [&](const BenchResult& r, const char* what, double value, double base, double minDifference) {
+        if (value > base * (1.0 + tolerance) && value - base > minDifference)
+        {
+            std::cout << "REGRESSION " << r.Scene << " " << r.Flags << " " << what << ": " << base << " -> " << value << std::endl;
+            regressions++;
+        }
+    };
+
+    for (auto& r : results)
+    {
+        auto it = baseline.find(r.Scene + "," + r.Flags);
+        if (it == baseline.end())
+            continue;
+
+        auto& base = it->second;
+        check(r, "size", static_cast<double>(r.Size), static_cast<double>(base.Size), 0.0);
+        check(r, "compactedSize", static_cast<double>(r.CompactedSize), static_cast<double>(base.CompactedSize), 0.0);
+        check(r, "tlasSize", static_cast<double>(r.TLASSize), static_cast<double>(base.TLASSize), 0.0);
+        check(r, "buildMs", r.BuildMs, base.BuildMs, 0.1);
+        check(r, "refitMs", r.RefitMs, base.RefitMs, 0.1);
+        check(r, "tlasBuildMs", r.TLASBuildMs, base.TLASBuildMs, 0.1);
+    }
+
+    return regressions;
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t runs = 3;
+    uint64_t maxTriangles = 10000000;
+    std::string outPath = "ASBuildBench.csv";
+    std::string baselinePath;
+    double tolerance = 0.1;
+    std::string glbDirectory; // the generated scenes are written there, so the samples can load them
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string arg = argv[i];
+        if (arg == "--runs")
+            runs = std::max(static_cast<uint32_t>(std::strtoul(argv[i + 1], nullptr, 10)), 1u);
+        else if (arg == "--max-triangles")
+            maxTriangles = std::strtoull(argv[i + 1], nullptr, 10);
+        else if (arg == "--out")
+            outPath = argv[i + 1];
+        else if (arg == "--baseline")
+            baselinePath = argv[i + 1];
+        else if (arg == "--tolerance")
+            tolerance = std::strtod(argv[i + 1], nullptr);
+        else if (arg == "--write-glb")
+            glbDirectory = argv[i + 1];
+        else
+        {
+            std::cout << "Unknown argument " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<BenchScene> scenes;
+
+    MeshLoader loader;
+    if (std::filesystem::exists("Assets"))
+    {
+        for (auto& entry : std::filesystem::directory_iterator("Assets"))
+        {
+            if (entry.path().extension() != ".glb")
+                continue;
+
+            auto& scene = scenes.emplace_back(BenchScene{});
+            scene.Name = entry.path().stem().string();
+
+            // [POI]
+            // loaded once without the scene arena first, to compare the allocations and the copy time of both paths
+            loader.SetUseArena(false);
+            loader.LoadGLBMesh(entry.path().string());
+            MeshLoaderStats heapStats = loader.GetStats();
+
+            loader.SetUseArena(true);
+            scene.Data = loader.LoadGLBMesh(entry.path().string());
+            const MeshLoaderStats& arenaStats = loader.GetStats();
+            std::cout << scene.Name << ": " << heapStats.HeapAllocations << " allocations in " << heapStats.LoadMs << " ms without the arena, "
+                      << arenaStats.HeapAllocations << " heap and " << arenaStats.ArenaAllocations << " arena allocations in "
+                      << arenaStats.LoadMs << " ms with it" << std::endl;
+            for (auto& mesh : scene.Data.Meshes)
+            {
+                for (auto geomRef : mesh.GeometryReferences)
+                    scene.TriangleCount += scene.Data.Geometries[geomRef].Indices.size() / 3;
+            }
+        }
+    }
+
+    // the directory order isn't defined, sorted names keep the output comparable between runs
+    std::sort(scenes.begin(), scenes.end(), [](const BenchScene& a, const BenchScene& b) { return a.Name < b.Name; });
+
+    // [POI]
+    // One generated mesh per size shows how the build scales with the triangle count,
+    // the scene with many small meshes shows the cost per BLAS, which dominates in real scenes
+    for (uint64_t triangles = 1000; triangles <= maxTriangles; triangles *= 10)
+    {
+        SceneGeneratorSettings settings = {};
+        settings.MeshCount = 1;
+        settings.InstanceCount = 1;
+        settings.TrianglesPerMesh = static_cast<uint32_t>(triangles);
+        scenes.push_back(GenerateScene("Mesh" + std::to_string(triangles), settings));
+    }
+
+    SceneGeneratorSettings manyMeshes = {};
+    manyMeshes.MeshCount = 256;
+    manyMeshes.InstanceCount = 1024;
+    manyMeshes.TrianglesPerMesh = static_cast<uint32_t>(std::min<uint64_t>(maxTriangles / manyMeshes.InstanceCount, 5000));
+    if (manyMeshes.TrianglesPerMesh >= 16)
+        scenes.push_back(GenerateScene("ManyMeshes", manyMeshes));
+
+    if (!glbDirectory.empty())
+    {
+        std::filesystem::create_directories(glbDirectory);
+        for (auto& scene : scenes)
+        {
+            // the scenes from Assets are already files
+            if (scene.Generated)
+                SceneGenerator::WriteGLB(scene.Data, (std::filesystem::path(glbDirectory) / (scene.Name + ".glb")).string());
+        }
+    }
+
+    ASBuildBench bench;
+    if (!bench.Create())
+    {
+        bench.Destroy();
+        return 1;
+    }
+
+    std::vector<BenchResult> results;
+    for (auto& scene : scenes)
+    {
+        for (auto& config : FlagConfigs)
+        {
+            BenchResult result;
+            if (!bench.Run(scene, config, runs, result))
+            {
+                bench.Destroy();
+                return 1;
+            }
+
+            std::cout << scene.Name << " (" << scene.TriangleCount << " triangles) " << config.Name
+                      << ": build " << result.BuildMs << " ms, size " << result.Size / 1024 << " KB";
+            if (result.CompactedSize > 0)
+                std::cout << ", compacted " << result.CompactedSize / 1024 << " KB";
+            if (result.RefitMs > 0.0)
+                std::cout << ", refit " << result.RefitMs << " ms";
+            std::cout << ", TLAS " << result.TLASBuildMs << " ms" << std::endl;
+
+            results.push_back(result);
+        }
+    }
+
+    bench.Destroy();
+
+    WriteCSV(outPath, results);
+    std::cout << "Wrote " << results.size() << " results to " << outPath << std::endl;
+
+    if (!baselinePath.empty())
+    {
+        auto baseline = ReadCSV(baselinePath);
+        if (baseline.empty())
+        {
+            std::cout << "Baseline " << baselinePath << " has no results" << std::endl;
+            return 1;
+        }
+
+        uint32_t regressions = CompareToBaseline(results, baseline, tolerance);
+        std::cout << regressions << " regressions compared to " << baselinePath << std::endl;
+        if (regressions > 0)
+            return 2;
+    }
+
+    return 0;
+}
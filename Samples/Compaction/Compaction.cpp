@@ -19,7 +19,10 @@ public:
     void Compact(vk::CommandBuffer cmd);
 
     // Update the TLAS when the BLAS changes due to compaction
-    void UpdateTLAS();
+    void UpdateTLAS(vk::CommandBuffer renderCmd);
+
+    // Destroys the resources that were replaced by the compaction, once no frame in flight uses them anymore
+    void DestroyRetiredResources();
 
 public:
     ShaderCompiler mShaderCompiler;
@@ -31,12 +34,18 @@ public:
 
     std::vector<vr::DescriptorItem> mResourceBindings;
     vk::DescriptorSetLayout mResourceDescriptorLayout;
-    vr::DescriptorBuffer mResourceDescBuffer;
+
+    // One descriptor buffer per frame in flight, each one remembers the version of the TLAS it points to
+    // and is only rewritten when its frame is recorded, because then it isn't used by the GPU anymore
+    std::vector<vr::DescriptorBuffer> mResourceDescBuffers;
+    std::vector<uint32_t> mDescriptorVersions;
+    uint32_t mTLASVersion = 0;
 
     vk::Pipeline mRTPipeline = nullptr;
     vk::PipelineLayout mPipelineLayout = nullptr;
 
     vr::BLASHandle mBLASHandle;
+    uint32_t mBLASStatsId = 0;
 
     vr::TLASHandle mTLASHandle;
     vr::TLASBuildInfo mTLASBuildInfo;
@@ -48,6 +57,12 @@ public:
     std::vector<vr::BLASHandle> mBLASToDestroy;   // all the BLASes that need to be destroyed after compaction
     vr::CompactionRequest mCompactionRequest;
     bool Compacted = false;
+    uint64_t mCompactionFrame = 0; // frame that recorded the copy to the compacted BLAS
+
+    // resources that are still used by frames in flight after the TLAS is rebuilt
+    vr::TLASHandle mRetiredTLAS = {};
+    bool mHasRetired = false;
+    uint64_t mRetiredFrame = 0;
 };
 
 void Compaction::Start()
@@ -135,11 +150,19 @@ void Compaction::CreateAS()
 
     std::vector<vr::BLASBuildInfo> buildInfos = {buildInfo};
 
+    mASStats.SceneName = "Triangle";
+    mBLASStatsId = mASStats.AddBLAS("Triangle", blasCreateInfo, buildInfo);
+    uint32_t tlasStatsId = mASStats.AddTLAS("TLAS", 1, mTLASBuildInfo);
+
+    uint32_t timedBuild = mASStats.BeginBuild(buildCmd, {mBLASStatsId});
     mVRDev->BuildBLAS(buildInfos, buildCmd);
+    mASStats.EndBuild(buildCmd, timedBuild);
 
     mVRDev->AddAccelerationBuildBarrier(buildCmd);
 
+    timedBuild = mASStats.BeginBuild(buildCmd, {tlasStatsId});
     mVRDev->BuildTLAS(mTLASBuildInfo, mInstanceBuffer, 1, buildCmd);
+    mASStats.EndBuild(buildCmd, timedBuild);
 
     buildCmd.end();
 
@@ -164,7 +187,7 @@ void Compaction::CreateAS()
 }
 // A function that updates the TLAS
 // Nearly same as DynamicTLAS sample, but with no comments
-void Compaction::UpdateTLAS()
+void Compaction::UpdateTLAS(vk::CommandBuffer renderCmd)
 {
     // [POI] Put the new BLAS into the TLAS
     auto inst = vk::AccelerationStructureInstanceKHR()
@@ -178,27 +201,47 @@ void Compaction::UpdateTLAS()
         0.0f, 1.0f, 0.0f, 0.0f,
         0.0f, 0.0f, 1.0f, 0.0f};
     mVRDev->UpdateBuffer(mInstanceBuffer, &inst, sizeof(vk::AccelerationStructureInstanceKHR), 0);
-    auto buildCmd = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(mGraphicsPool, vk::CommandBufferLevel::ePrimary, 1))[0];
-    buildCmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
-    std::tie(mTLASHandle, mTLASBuildInfo) = mVRDev->UpdateTLAS(mTLASHandle, mTLASBuildInfo, true);
+
+    // [POI]
+    // The build is recorded into the AS build command buffer of this frame if there is an async compute queue, otherwise into the render command buffer
+    // the old TLAS is still traced by the frame in flight, so it is kept and destroyed later instead of waiting for the device
+    auto buildCmd = BeginASBuild(renderCmd);
+    mRetiredTLAS = mTLASHandle;
+    std::tie(mTLASHandle, mTLASBuildInfo) = mVRDev->UpdateTLAS(mTLASHandle, mTLASBuildInfo, false);
     if (mTLASBuildInfo.BuildSizes.buildScratchSize > mScratchBuffer.Size)
     {
         if (mScratchBuffer.Size > 0) // if not null
             mVRDev->DestroyBuffer(mScratchBuffer);
         mScratchBuffer = mVRDev->CreateScratchBufferFromBuildInfo(mTLASBuildInfo);
     }
+    else
+    {
+        mVRDev->BindScratchAdressToBuildInfo(mScratchBuffer.DevAddress, mTLASBuildInfo);
+    }
     mVRDev->BuildTLAS(mTLASBuildInfo, mInstanceBuffer, 1, buildCmd);
-    mVRDev->AddAccelerationBuildBarrier(buildCmd);
-    buildCmd.end();
-    auto submitInfo = vk::SubmitInfo()
-                          .setCommandBufferCount(1)
-                          .setPCommandBuffers(&buildCmd);
-    mQueues.GraphicsQueue.submit(submitInfo, nullptr);
-    mDevice.waitIdle();
-    mVRDev->UpdateDescriptorBuffer(mResourceDescBuffer,
-                                   mResourceBindings[0], // the first binding is the TLAS
-                                   0,                    // index of pResources in the binding
-                                   vr::DescriptorBufferType::Resource);
+    ReleaseASBuffer(buildCmd, mTLASHandle.Buffer);
+
+    // the render submit of this frame waits for the build, or the build is part of it
+    EndASBuild(buildCmd, renderCmd);
+
+    mHasRetired = true;
+    mRetiredFrame = mFrameCount;
+
+    // every descriptor buffer has to point to the new TLAS, they are updated when their frame is recorded
+    mTLASVersion++;
+}
+
+void Compaction::DestroyRetiredResources()
+{
+    // the last frame that used the old BLAS and TLAS was recorded before mRetiredFrame,
+    // two frames later its render fence has been waited on
+    if (mHasRetired && mFrameCount >= mRetiredFrame + 2)
+    {
+        mVRDev->DestroyBLAS(mBLASToDestroy);
+        mBLASToDestroy.clear();
+        mVRDev->DestroyTLAS(mRetiredTLAS);
+        mHasRetired = false;
+    }
 }
 
 void Compaction::Compact(vk::CommandBuffer cmdBuf)
@@ -216,6 +259,11 @@ void Compaction::Compact(vk::CommandBuffer cmdBuf)
             // Therefore we need to ensure the copy command is executed before we destroy the original BLASes and before using the compacted BLASes
             // Two options here:
             mBLASToDestroy = mVRDev->CompactBLAS(mCompactionRequest, compactedSizes, mBLASToCompact, cmdBuf);
+            mCompactionFrame = mFrameCount;
+
+            // the report was written when Run() started, write it again with the compacted size
+            mASStats.SetCompactedSize(mBLASStatsId, compactedSizes[0]);
+            mASStats.WriteJSON();
             // or
             // auto compactedBLASes = mVRDev->CompactBLAS(mCompactionRequest, compactedSizes, cmdBuf);
             // The first option will replace the BLASes in mBLASToCompact with the compacted BLASes and return a vector of the BLAS to destroy
@@ -267,7 +315,9 @@ void Compaction::CreateRTPipeline()
 
     mSBTBuffer = mVRDev->CreateSBT(mRTPipeline, sbtInfo);
 
-    mResourceDescBuffer = mVRDev->CreateDescriptorBuffer(mResourceDescriptorLayout, mResourceBindings, vr::DescriptorBufferType::Resource);
+    for (uint32_t i = 0; i < mRTRenderCmd.size(); i++)
+        mResourceDescBuffers.push_back(mVRDev->CreateDescriptorBuffer(mResourceDescriptorLayout, mResourceBindings, vr::DescriptorBufferType::Resource));
+    mDescriptorVersions.resize(mRTRenderCmd.size(), mTLASVersion);
 
     mDevice.destroyShaderModule(shaderModule.Module);
 }
@@ -277,16 +327,35 @@ void Compaction::UpdateDescriptorSet()
 
     mCamera.Position = glm::vec3(0.0f, 0.0f, 5.0f);
 
-    mVRDev->UpdateDescriptorBuffer(mResourceDescBuffer, mResourceBindings, vr::DescriptorBufferType::Resource);
+    for (auto& descBuffer : mResourceDescBuffers)
+        mVRDev->UpdateDescriptorBuffer(descBuffer, mResourceBindings, vr::DescriptorBufferType::Resource);
 }
 
 void Compaction::Update(vk::CommandBuffer renderCmd)
 {
     renderCmd.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
 
+    DestroyRetiredResources();
+
+    // [POI]
+    // Update the TLAS once the frame that recorded the copy to the compacted BLAS has finished,
+    // its render fence has been waited on two frames later, so the compacted BLAS is ready to be referenced
+    if (mBLASToDestroy.size() > 0 && !mHasRetired && mFrameCount >= mCompactionFrame + 2)
+        UpdateTLAS(renderCmd);
+
     Compact(renderCmd);
 
-    mVRDev->BindDescriptorBuffer({mResourceDescBuffer}, renderCmd);
+    // The descriptor buffer of this frame isn't used by the GPU anymore, so it can be pointed to the current TLAS
+    if (mDescriptorVersions[mRTRenderCmdIndex] != mTLASVersion)
+    {
+        mVRDev->UpdateDescriptorBuffer(mResourceDescBuffers[mRTRenderCmdIndex],
+                                       mResourceBindings[0], // the first binding is the TLAS
+                                       0,                    // index of pResources in the binding
+                                       vr::DescriptorBufferType::Resource);
+        mDescriptorVersions[mRTRenderCmdIndex] = mTLASVersion;
+    }
+
+    mVRDev->BindDescriptorBuffer({mResourceDescBuffers[mRTRenderCmdIndex]}, renderCmd);
     mVRDev->BindDescriptorSet(mPipelineLayout, 0, 0, 0, renderCmd);
 
     mVRDev->TransitionImageLayout(
@@ -307,15 +376,6 @@ void Compaction::Update(vk::CommandBuffer renderCmd)
 
     Present(renderCmd);
 
-    if (mBLASToDestroy.size() > 0)
-    {
-        // [POI]
-        // Update the TLAS now that the copying of the compacted BLAS to our used BLAS is done, because the command buffer has finished executing
-        UpdateTLAS();
-        mVRDev->DestroyBLAS(mBLASToDestroy);
-        mBLASToDestroy.clear();
-    }
-
     UpdateCamera();
 }
 
@@ -323,6 +383,12 @@ void Compaction::Stop()
 {
     auto _ = mDevice.waitForFences(mRenderFence, VK_TRUE, UINT64_MAX);
 
+    // the render fence of the last frame covers the TLAS build as well
+    if (mHasRetired)
+        mVRDev->DestroyTLAS(mRetiredTLAS);
+    if (mBLASToDestroy.size() > 0)
+        mVRDev->DestroyBLAS(mBLASToDestroy);
+
     mVRDev->DestroyBuffer(mScratchBuffer);
     mVRDev->DestroyBuffer(mInstanceBuffer);
 
@@ -333,7 +399,8 @@ void Compaction::Stop()
     mDevice.destroyPipelineLayout(mPipelineLayout);
 
     mDevice.destroyDescriptorSetLayout(mResourceDescriptorLayout);
-    mVRDev->DestroyBuffer(mResourceDescBuffer.Buffer);
+    for (auto& descBuffer : mResourceDescBuffers)
+        mVRDev->DestroyBuffer(descBuffer.Buffer);
 
     mVRDev->DestroyBuffer(mVertexBuffer);
     mVRDev->DestroyBuffer(mIndexBuffer);
@@ -3,6 +3,18 @@
 #include "Application.h"
 #include "FileRead.h"
 #include "ShaderCompiler.h"
+#include "Deformer.h"
+#include "BuildPolicy.h"
+#include "GPUTimer.h"
+
+// timestamps written by the GPU timer every frame, the costs are logged by the build policy
+enum BLASTimestamp : uint32_t
+{
+    BuildStart = 0,
+    BuildEnd = 1,
+    TraceEnd = 2,
+    TimestampCount = 3
+};
 
 class DynamicBLAS : public Application
 {
@@ -18,10 +30,16 @@ public:
 
     void UpdateBLAS(vk::CommandBuffer cmd);
 
+    // Recreates the BLAS with the flags picked by the build policy and puts it into the TLAS
+    void RecreateBLAS(vk::CommandBuffer cmd);
+
+    void DestroyRetiredBLAS();
+
 public:
     ShaderCompiler mShaderCompiler;
 
-    vr::AllocatedBuffer mVertexBuffer;
+    // [POI] deforms the triangle on the GPU, its output buffer is the vertex buffer of the BLAS
+    Deformer mDeformer;
     vr::AllocatedBuffer mIndexBuffer;
 
     vr::SBTBuffer mSBTBuffer;
@@ -37,10 +55,33 @@ public:
 
     // Save the build info for the BLAS so we can update it later
     vr::BLASBuildInfo mBLASBuildInfo;
+    vr::BLASCreateInfo mBLASCreateInfo;
 
     vr::AllocatedBuffer mUpdateScratchBuffer;
+    vr::AllocatedBuffer mBuildScratchBuffer; // for rebuilds, when the flags of the BLAS don't allow updates
 
     vr::TLASHandle mTLASHandle;
+    vr::TLASBuildInfo mTLASBuildInfo;
+    vr::AllocatedBuffer mInstanceBuffer;
+    vr::AllocatedBuffer mTLASScratchBuffer;
+
+    // [POI]
+    // The build policy picks the flags of the BLAS from how often it changes,
+    // hold space to pause the animation, after a few seconds the BLAS is recreated as a static one
+    BuildFlagPolicy mBuildPolicy;
+    uint32_t mBLASPolicyID = 0;
+    std::vector<uint32_t> mReclassified;
+
+    // the replaced BLAS can still be traced by the frame in flight
+    vr::BLASHandle mRetiredBLAS;
+    bool mHasRetired = false;
+    uint64_t mRetiredFrame = 0;
+
+    GPUTimer mGPUTimer;
+
+    // the animation time stops while it is paused
+    double mPausedTime = 0.0;
+    double mLastTime = 0.0;
 };
 
 void DynamicBLAS::Start()
@@ -51,62 +92,92 @@ void DynamicBLAS::Start()
 
     CreateRTPipeline();
     UpdateDescriptorSet();
+
+    mGPUTimer.Create(mDevice, mPhysicalDevice, BLASTimestamp::TimestampCount, static_cast<uint32_t>(mRTRenderCmd.size()));
+    mLastTime = glfwGetTime();
 }
 
 void DynamicBLAS::CreateAS()
 {
-    // vertex and index data for the triangle
-
-    float vertices[] = {
-        1.0f, -1.0f, 0.0f,
-        -1.0f, -1.0f, 0.0f,
-        0.0f, 1.0f, 0.0f};
-    uint32_t indices[] = {0, 1, 2};
-
-    mVertexBuffer = mVRDev->CreateBuffer(
-        sizeof(float) * 3 * 3,
-        vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR, // this buffer will be used as a source for the BLAS
-        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+    // [POI]
+    // The triangle is described like a skinned glTF geometry with a morph target
+    // the bottom two vertices are bound to joint 0 and the top vertex to joint 1
+    // the morph target moves every vertex to the origin, so its weight scales the triangle
+    Geometry triangle = {};
+    triangle.Vertices.resize(3);
+    triangle.Vertices[0].Position = glm::vec3(1.0f, -1.0f, 0.0f);
+    triangle.Vertices[1].Position = glm::vec3(-1.0f, -1.0f, 0.0f);
+    triangle.Vertices[2].Position = glm::vec3(0.0f, 1.0f, 0.0f);
+    triangle.Indices = {0, 1, 2};
+
+    triangle.Skin.resize(3);
+    triangle.Skin[0].Weights = glm::vec4(1.0f, 0.0f, 0.0f, 0.0f);
+    triangle.Skin[1].Weights = glm::vec4(1.0f, 0.0f, 0.0f, 0.0f);
+    triangle.Skin[2].Joints = glm::uvec4(1, 0, 0, 0);
+    triangle.Skin[2].Weights = glm::vec4(1.0f, 0.0f, 0.0f, 0.0f);
+
+    auto& shrink = triangle.MorphTargets.emplace_back(MorphTarget{});
+    for (auto& vert : triangle.Vertices)
+    {
+        vert.Normal = glm::vec3(0.0f, 0.0f, 1.0f);
+        shrink.PositionDeltas.push_back(-vert.Position);
+        shrink.NormalDeltas.push_back(glm::vec3(0.0f));
+    }
 
     mIndexBuffer = mVRDev->CreateBuffer(
         sizeof(uint32_t) * 3, // 3 vertices, 3 floats per vertex
         vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR,
         VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
 
-    mVRDev->UpdateBuffer(mVertexBuffer, vertices, sizeof(float) * 3 * 3);
-    mVRDev->UpdateBuffer(mIndexBuffer, indices, sizeof(uint32_t) * 3);
+    mVRDev->UpdateBuffer(mIndexBuffer, triangle.Indices.data(), sizeof(uint32_t) * 3);
+
+    auto buildCmd = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(mGraphicsPool, vk::CommandBufferLevel::ePrimary, 1))[0];
+
+    buildCmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+
+    // Uploads the triangle to device local memory, the upload is recorded into the build command buffer
+    mDeformer.Create(mVRDev, mDevice, mShaderCompiler, triangle, 2, static_cast<uint32_t>(mRTRenderCmd.size()), buildCmd);
+
+    // Write the rest pose for the initial build, identity joints and no shrinking
+    mDeformer.SetJointMatrices({glm::mat4(1.0f), glm::mat4(1.0f)}, 0);
+    mDeformer.SetMorphWeights({0.0f}, 0);
+    mDeformer.Deform(buildCmd, 0);
+
+    // [POI]
+    // The triangle is skinned, so it starts out as a deforming BLAS, the policy reclassifies it if that guess is wrong
+    mBLASPolicyID = mBuildPolicy.Register("triangle", BLASUsage::Deforming);
 
     vr::BLASCreateInfo blasCreateInfo = {};
-    blasCreateInfo.Flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
+    blasCreateInfo.Flags = mBuildPolicy.GetFlags(mBLASPolicyID);
 
     vr::GeometryData geomData = {};
 
     geomData.VertexFormat = vk::Format::eR32G32B32Sfloat;
-    geomData.Stride = sizeof(float) * 3;
+    geomData.Stride = sizeof(Vertex); // the deformer writes the Vertex layout, position is the first member
     geomData.IndexFormat = vk::IndexType::eUint32;
     geomData.PrimitiveCount = 1;
-    geomData.DataAddresses.VertexDevAddress = mVertexBuffer.DevAddress;
+    geomData.DataAddresses.VertexDevAddress = mDeformer.OutputBuffer.DevAddress;
     geomData.DataAddresses.IndexDevAddress = mIndexBuffer.DevAddress;
 
     blasCreateInfo.Geometries.push_back(geomData);
 
+    mBLASCreateInfo = blasCreateInfo;
     std::tie(mBLASHandle, mBLASBuildInfo) = mVRDev->CreateBLAS(blasCreateInfo);
 
-    auto BLASscratchBuffer = mVRDev->CreateScratchBufferFromBuildInfo(mBLASBuildInfo);
+    mBuildScratchBuffer = mVRDev->CreateScratchBufferFromBuildInfo(mBLASBuildInfo);
 
     // create a TLAS
     vr::TLASCreateInfo tlasCreateInfo = {};
     tlasCreateInfo.Flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
     tlasCreateInfo.MaxInstanceCount = 1; // Max number of instances in the TLAS, when building the TLAS num of instances may be lower
 
-    auto [tlasHandle, tlasBuildInfo] = mVRDev->CreateTLAS(tlasCreateInfo);
-
-    mTLASHandle = tlasHandle;
+    std::tie(mTLASHandle, mTLASBuildInfo) = mVRDev->CreateTLAS(tlasCreateInfo);
 
-    auto TLASScratchBuffer = mVRDev->CreateScratchBufferFromBuildInfo(tlasBuildInfo);
+    // the TLAS is rebuilt when the BLAS is recreated, so its scratch and instance buffers are kept
+    mTLASScratchBuffer = mVRDev->CreateScratchBufferFromBuildInfo(mTLASBuildInfo);
 
     // create a buffer for the instance data
-    auto InstanceBuffer = mVRDev->CreateInstanceBuffer(1); // 1 instance
+    mInstanceBuffer = mVRDev->CreateInstanceBuffer(1); // 1 instance
 
     // Specify the instance data
     auto inst = vk::AccelerationStructureInstanceKHR()
@@ -122,11 +193,7 @@ void DynamicBLAS::CreateAS()
         0.0f, 1.0f, 0.0f, 0.0f,
         0.0f, 0.0f, 1.0f, 0.0f};
 
-    mVRDev->UpdateBuffer(InstanceBuffer, &inst, sizeof(vk::AccelerationStructureInstanceKHR), 0);
-
-    auto buildCmd = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(mGraphicsPool, vk::CommandBufferLevel::ePrimary, 1))[0];
-
-    buildCmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+    mVRDev->UpdateBuffer(mInstanceBuffer, &inst, sizeof(vk::AccelerationStructureInstanceKHR), 0);
 
     std::vector<vr::BLASBuildInfo> buildInfos = {mBLASBuildInfo};
 
@@ -134,7 +201,7 @@ void DynamicBLAS::CreateAS()
 
     mVRDev->AddAccelerationBuildBarrier(buildCmd); // Add a barrier to the command buffer to make sure the BLAS build is finished before the TLAS build starts
 
-    mVRDev->BuildTLAS(tlasBuildInfo, InstanceBuffer, 1, buildCmd);
+    mVRDev->BuildTLAS(mTLASBuildInfo, mInstanceBuffer, 1, buildCmd);
 
     buildCmd.end();
 
@@ -147,30 +214,57 @@ void DynamicBLAS::CreateAS()
 
     mDevice.waitIdle();
 
-    // Free the scratch buffers
-    mVRDev->DestroyBuffer(BLASscratchBuffer);
-    mVRDev->DestroyBuffer(TLASScratchBuffer);
-
-    mVRDev->DestroyBuffer(InstanceBuffer);
+    // The rest pose is in device local memory now
+    mDeformer.FinishUpload();
 
     mDevice.freeCommandBuffers(mGraphicsPool, buildCmd);
 }
 
 void DynamicBLAS::UpdateBLAS(vk::CommandBuffer cmd)
 {
+    double now = glfwGetTime();
+    bool paused = glfwGetKey(mWindow, GLFW_KEY_SPACE) == GLFW_PRESS;
+    if (paused)
+        mPausedTime += now - mLastTime;
+    mLastTime = now;
+
+    // nothing changes while the animation is paused, the BLAS is left alone
+    if (paused)
+        return;
+
+    mBuildPolicy.RecordChange(mBLASPolicyID);
+
     // modify the triangle
-    float size = sinf(glfwGetTime()) / 2.0f + 0.5f;
-    float vertices[] = {
-        size, -size, 0.0f,
-        -size, -size, 0.0f,
-        0.0f, size, 0.0f};
+    float time = static_cast<float>(now - mPausedTime);
+    float size = sinf(time) / 2.0f + 0.5f;
+
+    // [POI]
+    // Only the morph weights and joint matrices are written by the CPU, the vertices are deformed by the compute shader
+    // joint 1 sways the top vertex from side to side, joint 0 stays in place
+    std::vector<glm::mat4> joints = {
+        glm::mat4(1.0f),
+        glm::translate(glm::mat4(1.0f), glm::vec3(sinf(time * 2.0f) * 0.5f, 0.0f, 0.0f))};
+
+    // Write to the frame that is being recorded, the data of the frames in flight stays untouched
+    mDeformer.SetMorphWeights({1.0f - size}, mRTRenderCmdIndex);
+    mDeformer.SetJointMatrices(joints, mRTRenderCmdIndex);
 
     // [POI] Additional Info
     // Vulkan requires the whole buffer with same size and the same number of primitives as the source BLAS, so if you want to update only one primitive,
     // you still have to give vulkan the whole buffer, not parts that you want to update
 
-    // Update the vertex buffer
-    mVRDev->UpdateBuffer(mVertexBuffer, vertices, sizeof(float) * 3 * 3);
+    // Deform the vertices, this also adds a barrier so the BLAS update sees the new positions
+    mDeformer.Deform(cmd, mRTRenderCmdIndex);
+
+    // [POI]
+    // A static BLAS is built without eAllowUpdate, so it can only be rebuilt until the policy reclassifies it
+    if (!(mBLASCreateInfo.Flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate))
+    {
+        mVRDev->BindScratchAdressToBuildInfo(mBuildScratchBuffer.DevAddress, mBLASBuildInfo);
+        mVRDev->BuildBLAS({mBLASBuildInfo}, cmd);
+        mVRDev->AddAccelerationBuildBarrier(cmd);
+        return;
+    }
 
     // [POI] set the BLAS to update
     vr::BLASUpdateInfo updateInfo = {};
@@ -181,7 +275,7 @@ void DynamicBLAS::UpdateBLAS(vk::CommandBuffer cmd)
     // [POI] This vector has to be the same size as the vector of geometries in the BLASCreateInfo if using new device addresses / buffers
     // if the vector is empty, then the device addresses used to build the source BLAS will be used
     // this line can be removed, but to demonstrate how to use it, we will set the device addresses to the new ones, although they remain unchanged
-    updateInfo.NewGeometryAddresses.push_back(vr::GeometryDeviceAddress(mVertexBuffer.DevAddress, mIndexBuffer.DevAddress));
+    updateInfo.NewGeometryAddresses.push_back(vr::GeometryDeviceAddress(mDeformer.OutputBuffer.DevAddress, mIndexBuffer.DevAddress));
 
     auto buildInfo = mVRDev->UpdateBLAS(updateInfo);
 
@@ -205,6 +299,60 @@ void DynamicBLAS::UpdateBLAS(vk::CommandBuffer cmd)
     mVRDev->AddAccelerationBuildBarrier(cmd);
 }
 
+void DynamicBLAS::RecreateBLAS(vk::CommandBuffer cmd)
+{
+    // the frame in flight may still trace the old BLAS, it is destroyed two frames later
+    // the policy reclassifies at most once per window, so there is never more than one retired BLAS
+    mRetiredBLAS = mBLASHandle;
+    mHasRetired = true;
+    mRetiredFrame = mFrameCount;
+
+    mBLASCreateInfo.Flags = mBuildPolicy.GetFlags(mBLASPolicyID);
+    std::tie(mBLASHandle, mBLASBuildInfo) = mVRDev->CreateBLAS(mBLASCreateInfo);
+
+    if (mBLASBuildInfo.BuildSizes.buildScratchSize > mBuildScratchBuffer.Size)
+    {
+        mVRDev->DestroyBuffer(mBuildScratchBuffer);
+        mBuildScratchBuffer = mVRDev->CreateScratchBufferFromBuildInfo(mBLASBuildInfo);
+    }
+    else
+    {
+        mVRDev->BindScratchAdressToBuildInfo(mBuildScratchBuffer.DevAddress, mBLASBuildInfo);
+    }
+
+    // the deformer output still holds the last pose, so the new BLAS looks the same as the old one
+    mVRDev->BuildBLAS({mBLASBuildInfo}, cmd);
+    mVRDev->AddAccelerationBuildBarrier(cmd);
+
+    // [POI]
+    // The TLAS is rebuilt in place with the address of the new BLAS, the instance buffer isn't read by the frame in flight anymore
+    auto inst = vk::AccelerationStructureInstanceKHR()
+                    .setInstanceCustomIndex(0)
+                    .setAccelerationStructureReference(mBLASHandle.Buffer.DevAddress)
+                    .setFlags(vk::GeometryInstanceFlagBitsKHR::eForceOpaque)
+                    .setMask(0xFF)
+                    .setInstanceShaderBindingTableRecordOffset(0);
+    inst.transform = {
+        1.0f, 0.0f, 0.0f, 0.0f,
+        0.0f, 1.0f, 0.0f, 0.0f,
+        0.0f, 0.0f, 1.0f, 0.0f};
+    mVRDev->UpdateBuffer(mInstanceBuffer, &inst, sizeof(vk::AccelerationStructureInstanceKHR), 0);
+
+    mVRDev->BindScratchAdressToBuildInfo(mTLASScratchBuffer.DevAddress, mTLASBuildInfo);
+    mVRDev->BuildTLAS(mTLASBuildInfo, mInstanceBuffer, 1, cmd);
+    mVRDev->AddAccelerationBuildBarrier(cmd);
+}
+
+void DynamicBLAS::DestroyRetiredBLAS()
+{
+    // two frames later the render fence of the last frame that used the old BLAS has been waited on
+    if (mHasRetired && mFrameCount >= mRetiredFrame + 2)
+    {
+        mVRDev->DestroyBLAS(mRetiredBLAS);
+        mHasRetired = false;
+    }
+}
+
 void DynamicBLAS::CreateRTPipeline()
 {
 
@@ -263,8 +411,27 @@ void DynamicBLAS::Update(vk::CommandBuffer renderCmd)
 {
     renderCmd.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
 
+    DestroyRetiredBLAS();
+
+    // the timestamps of this frame index are from two frames ago
+    uint32_t frameIndex = mRTRenderCmdIndex;
+    mGPUTimer.BeginFrame(renderCmd, frameIndex);
+    double buildMs = mGPUTimer.GetMilliseconds(frameIndex, BLASTimestamp::BuildStart, BLASTimestamp::BuildEnd);
+    if (buildMs > 0.0)
+    {
+        mBuildPolicy.RecordBuildTime(mBLASPolicyID, buildMs);
+        mBuildPolicy.RecordTraceTime(mGPUTimer.GetMilliseconds(frameIndex, BLASTimestamp::BuildEnd, BLASTimestamp::TraceEnd));
+    }
+
+    mGPUTimer.WriteTimestamp(renderCmd, frameIndex, BLASTimestamp::BuildStart, vk::PipelineStageFlagBits::eTopOfPipe);
     UpdateBLAS(renderCmd);
 
+    // [POI]
+    // Once per window the policy looks at how often the BLAS changed, if its class changes it is recreated with the new flags
+    if (mBuildPolicy.EndFrame(mReclassified))
+        RecreateBLAS(renderCmd);
+    mGPUTimer.WriteTimestamp(renderCmd, frameIndex, BLASTimestamp::BuildEnd, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR);
+
     mVRDev->BindDescriptorBuffer({mResourceDescBuffer}, renderCmd);
     mVRDev->BindDescriptorSet(mPipelineLayout, 0, 0, 0, renderCmd);
 
@@ -276,6 +443,7 @@ void DynamicBLAS::Update(vk::CommandBuffer renderCmd)
         renderCmd);
 
     mVRDev->DispatchRays(mRTPipeline, mSBTBuffer, mRenderWidth, mRenderHeight, 1, renderCmd);
+    mGPUTimer.WriteTimestamp(renderCmd, frameIndex, BLASTimestamp::TraceEnd, vk::PipelineStageFlagBits::eRayTracingShaderKHR);
 
     // Helper function in Application Class to blit the image to the swapchain image
     BlitImage(renderCmd);
@@ -294,6 +462,10 @@ void DynamicBLAS::Stop()
     auto _ = mDevice.waitForFences(mRenderFence, VK_TRUE, UINT64_MAX);
 
     mVRDev->DestroyBuffer(mUpdateScratchBuffer);
+    mVRDev->DestroyBuffer(mBuildScratchBuffer);
+    mVRDev->DestroyBuffer(mTLASScratchBuffer);
+    mVRDev->DestroyBuffer(mInstanceBuffer);
+    mGPUTimer.Destroy();
 
     // destroy all the resources we created
     mVRDev->DestroySBTBuffer(mSBTBuffer);
@@ -304,9 +476,11 @@ void DynamicBLAS::Stop()
     mDevice.destroyDescriptorSetLayout(mResourceDescriptorLayout);
     mVRDev->DestroyBuffer(mResourceDescBuffer.Buffer);
 
-    mVRDev->DestroyBuffer(mVertexBuffer);
+    mDeformer.Destroy();
     mVRDev->DestroyBuffer(mIndexBuffer);
     mVRDev->DestroyBLAS(mBLASHandle);
+    if (mHasRetired)
+        mVRDev->DestroyBLAS(mRetiredBLAS);
     mVRDev->DestroyTLAS(mTLASHandle);
 }
 
@@ -3,6 +3,7 @@
 #include "Application.h"
 #include "FileRead.h"
 #include "ShaderCompiler.h"
+#include "InstanceBuffer.h"
 
 class DynamicTLAS : public Application
 {
@@ -16,8 +17,11 @@ public:
     void CreateRTPipeline();
     void UpdateDescriptorSet();
 
-    void UpdateTLAS();
-    void UpdateInstances();
+    void UpdateTLAS(vk::CommandBuffer renderCmd);
+    void UpdateInstances(uint32_t frameIndex);
+
+    // prints how much instance data was uploaded, once per second
+    void ReportUploadStats();
 
 public:
     ShaderCompiler mShaderCompiler;
@@ -29,7 +33,12 @@ public:
 
     std::vector<vr::DescriptorItem> mResourceBindings;
     vk::DescriptorSetLayout mResourceDescriptorLayout;
-    vr::DescriptorBuffer mResourceDescBuffer;
+
+    // [POI]
+    // One descriptor buffer per frame in flight, each one points to the TLAS of its frame
+    // the TLASes are rebuilt in place, so the descriptors are written once and never touched again
+    std::vector<vr::DescriptorBuffer> mResourceDescBuffers;
+    vk::DeviceAddress mBoundTLASAddress = 0; // the TLAS descriptor points to this, set before updating a descriptor buffer
 
     vk::Pipeline mRTPipeline = nullptr;
     vk::PipelineLayout mPipelineLayout = nullptr;
@@ -37,11 +46,24 @@ public:
     vr::BLASHandle mBLASHandle;
 
     //[POI]
-    vr::TLASHandle mTLASHandle;
-    vr::TLASBuildInfo mTLASBuildInfo;                                // save the build info so we can update the TLAS
-    std::vector<vk::AccelerationStructureInstanceKHR> mInstanceData; // Keep the instance data in the cpu
-    vr::AllocatedBuffer mInstanceBuffer;                             // for the TLAS
-    vr::AllocatedBuffer mScratchBuffer;                              // for the TLAS so we don't have to create a new one every frame and can reuse it
+    // Everything the TLAS build of a frame touches, there is one for every frame in flight
+    // so the TLAS of the next frame can be built on the compute queue while the current frame is still tracing its own TLAS
+    struct FrameTLAS
+    {
+        vr::TLASHandle TLASHandle;
+        vr::TLASBuildInfo TLASBuildInfo;     // save the build info so we can rebuild the TLAS in place
+        vr::AllocatedBuffer ScratchBuffer;  // for the TLAS, created once for the max instance count and reused every frame
+    };
+    std::vector<FrameTLAS> mFrameTLAS;
+
+    // [POI]
+    // Keeps the instance data in the cpu and a persistently mapped instance buffer for every frame in flight
+    // only the instances that changed are copied to the buffer of the frame being recorded
+    InstanceBufferManager mInstances;
+
+    InstanceUploadStats mUploadStats = {}; // accumulated over a second
+    uint32_t mUploadFrames = 0;
+    double mLastReportTime = 0.0;
 };
 
 void DynamicTLAS::Start()
@@ -98,18 +120,35 @@ void DynamicTLAS::CreateAS()
     mBLASHandle = blasHandle;
 
     // [POI]
-    // create a TLAS now, we will build / update it in the UpdateTLAS(...) function
-    // We could build it here, but to simplify the code we will build it in the UpdateTLAS(...) function
+    // create a TLAS for every frame in flight now, we will build them in the UpdateTLAS(...) function
+    // We could build them here, but to simplify the code we will build them in the UpdateTLAS(...) function
     // The TLAS has to be valid before dispatching rays though, but our UpdateTLAS(...) function will be called before the first ray dispatch
+    // The sizes of the TLAS and scratch buffers are queried for MaxInstanceCount, so every later build fits into them
     vr::TLASCreateInfo tlasCreateInfo = {};
     tlasCreateInfo.Flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
     tlasCreateInfo.MaxInstanceCount = 5; // Max number of instances in the TLAS, when building the TLAS num of instances may be lower
 
-    std::tie(mTLASHandle, mTLASBuildInfo) = mVRDev->CreateTLAS(tlasCreateInfo);
+    mInstances.Create(mVRDev, 5, static_cast<uint32_t>(mRTRenderCmd.size())); // 5 instances
+    mInstances.Resize(5);
 
-    // create a buffer for the instance data
-    mInstanceData = std::vector<vk::AccelerationStructureInstanceKHR>(5); // 5 instances
-    mInstanceBuffer = mVRDev->CreateInstanceBuffer(5);                    // 5 instances
+    // everything but the transforms stays the same, so it is only written once
+    for (uint32_t i = 0; i < mInstances.GetInstanceCount(); i++)
+    {
+        mInstances.SetInstance(i, vk::AccelerationStructureInstanceKHR()
+                                      .setInstanceCustomIndex(0)
+                                      .setMask(0xFF)
+                                      .setInstanceShaderBindingTableRecordOffset(0)
+                                      .setFlags(vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable)
+                                      .setAccelerationStructureReference(mBLASHandle.Buffer.DevAddress));
+    }
+
+    mFrameTLAS.resize(mRTRenderCmd.size());
+    for (uint32_t i = 0; i < mFrameTLAS.size(); i++)
+    {
+        auto& frame = mFrameTLAS[i];
+        std::tie(frame.TLASHandle, frame.TLASBuildInfo) = mVRDev->CreateTLAS(tlasCreateInfo);
+        frame.ScratchBuffer = mVRDev->CreateScratchBufferFromBuildInfo(frame.TLASBuildInfo); // also binds the scratch address to the build info
+    }
 
     auto buildCmd = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(mGraphicsPool, vk::CommandBufferLevel::ePrimary, 1))[0];
 
@@ -136,12 +175,12 @@ void DynamicTLAS::CreateAS()
     mDevice.freeCommandBuffers(mGraphicsPool, buildCmd);
 }
 
-void DynamicTLAS::UpdateInstances()
+void DynamicTLAS::UpdateInstances(uint32_t frameIndex)
 {
     float x = 0.0f, z = 0.0f;
     float time = glfwGetTime();
 
-    for (int i = 0; i < mInstanceData.size(); i++)
+    for (uint32_t i = 0; i < mInstances.GetInstanceCount(); i++)
     {
         // cool animation for the instances
         x = cosf(time + i) + i;
@@ -152,78 +191,86 @@ void DynamicTLAS::UpdateInstances()
                                           0.0f, 1.0f, 0.0f, 0.0,
                                           0.0f, 0.0f, 1.0f, z};
 
-        // copy the matrix data
-
-        mInstanceData[i] = vk::AccelerationStructureInstanceKHR()
-                               .setTransform(transform)
-                               .setInstanceCustomIndex(0)
-                               .setMask(0xFF)
-                               .setInstanceShaderBindingTableRecordOffset(0)
-                               .setFlags(vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable)
-                               .setAccelerationStructureReference(mBLASHandle.Buffer.DevAddress);
+        // only the transform changes, it marks the instance dirty for every frame's buffer
+        mInstances.SetTransform(i, transform);
     }
 
-    mVRDev->UpdateBuffer(mInstanceBuffer, mInstanceData.data(), sizeof(vk::AccelerationStructureInstanceKHR) * mInstanceData.size());
-}
-
-void DynamicTLAS::UpdateTLAS()
-{
-    UpdateInstances();
-    auto buildCmd = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(mGraphicsPool, vk::CommandBufferLevel::ePrimary, 1))[0];
-    buildCmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
-
     // [POI]
-    // Update the TLAS
-    // We have to update the TLAS every frame, because the instance data has changed
-    // We give the function the TLAS handle and the TLAS build info, and get new handles and build infos back
-    // there is a bool to specify if we want destruction of the old TLAS, we set it to true, because we don't need the old TLAS anymore
-    // we would have to keep it if we wanted to update the TLAS while the old one is still in use, and then after the frame finishes, we would have to destroy the old TLAS
-    // and update the descriptor set to point to the new TLAS.
-    // Keep in mind that the UpdateTLAS(...) creates a new TLAS, so it is not actually an update, but a rebuild, Vulray doesn't offer TLAS updates, but rebuilds
-    // This is because the TLAS degrades over time, so it is better to rebuild it every frame and the build time is negligible in real time applications
-    // NVIDIA best practices: https://developer.nvidia.com/blog/rtx-best-practices/
-    std::tie(mTLASHandle, mTLASBuildInfo) = mVRDev->UpdateTLAS(mTLASHandle, mTLASBuildInfo, true);
-
-    // if the new build scratch size is greater than the old one, we have to create a new scratch buffer
-    // NOTE: When updating a TLAS Vulray actually recreates it, so we have to use buildScratchSize instead of updateScratchSize
-    if (mTLASBuildInfo.BuildSizes.buildScratchSize > mScratchBuffer.Size)
-    {
-        if (mScratchBuffer.Size > 0) // if not null
-            mVRDev->DestroyBuffer(mScratchBuffer);
+    // The instance buffer of this frame was last read by the build two frames ago, which has finished
+    // so the dirty instances can be copied to its mapped memory directly, there is no map / unmap or full copy every frame
+    mInstances.Flush(frameIndex);
 
-        mScratchBuffer = mVRDev->CreateScratchBufferFromBuildInfo(mTLASBuildInfo);
-    }
+    ReportUploadStats();
+}
 
-    mVRDev->BuildTLAS(mTLASBuildInfo, mInstanceBuffer, mInstanceData.size(), buildCmd);
+void DynamicTLAS::ReportUploadStats()
+{
+    auto& stats = mInstances.GetLastStats();
+    mUploadStats.BytesCopied += stats.BytesCopied;
+    mUploadStats.RangesCopied += stats.RangesCopied;
+    mUploadStats.InstancesCopied += stats.InstancesCopied;
+    mUploadStats.FlushTimeMs += stats.FlushTimeMs;
+    mUploadFrames++;
+
+    double now = glfwGetTime();
+    if (now - mLastReportTime < 1.0)
+        return;
+
+    double seconds = now - mLastReportTime;
+    double flushSeconds = mUploadStats.FlushTimeMs / 1000.0;
+
+    std::cout << "Instance uploads: " << mUploadStats.InstancesCopied / mUploadFrames << " instances in "
+              << mUploadStats.RangesCopied / mUploadFrames << " ranges per frame, "
+              << mUploadStats.BytesCopied / (1024.0 * 1024.0) / seconds << " MB/s, "
+              << mUploadStats.FlushTimeMs / mUploadFrames << " ms per flush";
+    if (flushSeconds > 0.0)
+        std::cout << " (" << mUploadStats.BytesCopied / (1024.0 * 1024.0 * 1024.0) / flushSeconds << " GB/s while copying)";
+    std::cout << std::endl;
+
+    mUploadStats = {};
+    mUploadFrames = 0;
+    mLastReportTime = now;
+}
 
-    mVRDev->AddAccelerationBuildBarrier(buildCmd);
+void DynamicTLAS::UpdateTLAS(vk::CommandBuffer renderCmd)
+{
+    // All the resources of this frame were last used two frames ago
+    // the render fence of that frame has been waited on, and it waited for its own TLAS build, so they can be reused
+    uint32_t frameIndex = mRTRenderCmdIndex;
+    auto& frame = mFrameTLAS[frameIndex];
 
-    buildCmd.end();
+    UpdateInstances(frameIndex);
 
-    // submit the command buffer and wait for it to finish
-    // ideally semaphores should be used here, but for simplicity we will just wait for the command buffer to finish
-    auto submitInfo = vk::SubmitInfo()
-                          .setCommandBufferCount(1)
-                          .setPCommandBuffers(&buildCmd);
+    // [POI]
+    // Get the command buffer to record the build into, it is a command buffer of the async compute queue if the device has one
+    // otherwise the build is recorded into the render command buffer itself, either way nothing is allocated or waited on here
+    auto buildCmd = BeginASBuild(renderCmd);
 
-    mQueues.GraphicsQueue.submit(submitInfo, nullptr);
+    // [POI]
+    // Rebuild the TLAS of this frame in place
+    // We have to rebuild the TLAS every frame, because the instance data has changed
+    // The TLAS, scratch buffer and build info stay the same, only the instance data is new, so BuildTLAS(...) writes over the old TLAS
+    // which was traced two frames ago and isn't in use anymore. The TLAS of the other frame may still be in use, but we don't touch it.
+    // This is cheaper than UpdateTLAS(...), which creates a new TLAS every time, and the descriptors of the frames never have to change
+    // A TLAS degrades over time when refitted, so it is better to rebuild it every frame and the build time is negligible in real time applications
+    // NVIDIA best practices: https://developer.nvidia.com/blog/rtx-best-practices/
+    mVRDev->BuildTLAS(frame.TLASBuildInfo, mInstances.GetBuffer(frameIndex), mInstances.GetInstanceCount(), buildCmd);
 
-    mDevice.waitIdle();
+    // [POI]
+    // If the build runs on a compute queue family, the TLAS has to be handed over to the graphics queue family
+    ReleaseASBuffer(buildCmd, frame.TLASHandle.Buffer);
 
-    // Update the descriptor, if we had used a semaphores, we would have to wait for the build to finish before updating the descriptor
-    // and make sure the descriptor is not used by the GPU at the same time
-    mVRDev->UpdateDescriptorBuffer(mResourceDescBuffer,
-                                   mResourceBindings[0], // the first binding is the TLAS
-                                   0,                    // index of pResources in the binding
-                                   vr::DescriptorBufferType::Resource,
-                                   0); // index of the set in the buffer
+    // [POI]
+    // With an async compute queue, this submits the build and signals a timeline semaphore that the submit of this frame waits on
+    // Otherwise it records a barrier between the build and the DispatchRays(...) in the render command buffer
+    EndASBuild(buildCmd, renderCmd);
 }
 
 void DynamicTLAS::CreateRTPipeline()
 {
 
     mResourceBindings = {
-        vr::DescriptorItem(0, vk::DescriptorType::eAccelerationStructureKHR, vk::ShaderStageFlagBits::eRaygenKHR, 1, &mTLASHandle.Buffer.DevAddress),
+        vr::DescriptorItem(0, vk::DescriptorType::eAccelerationStructureKHR, vk::ShaderStageFlagBits::eRaygenKHR, 1, &mBoundTLASAddress),
         vr::DescriptorItem(1, vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eRaygenKHR, 1, &mUniformBuffer),
         vr::DescriptorItem(2, vk::DescriptorType::eStorageImage, vk::ShaderStageFlagBits::eRaygenKHR, 1, &mOutputImage)};
 
@@ -260,7 +307,8 @@ void DynamicTLAS::CreateRTPipeline()
 
     mSBTBuffer = mVRDev->CreateSBT(mRTPipeline, sbtInfo);
 
-    mResourceDescBuffer = mVRDev->CreateDescriptorBuffer(mResourceDescriptorLayout, mResourceBindings, vr::DescriptorBufferType::Resource);
+    for (uint32_t i = 0; i < mRTRenderCmd.size(); i++)
+        mResourceDescBuffers.push_back(mVRDev->CreateDescriptorBuffer(mResourceDescriptorLayout, mResourceBindings, vr::DescriptorBufferType::Resource));
 
     mDevice.destroyShaderModule(shaderModule.Module);
 }
@@ -270,16 +318,21 @@ void DynamicTLAS::UpdateDescriptorSet()
 
     mCamera.Position = glm::vec3(0.0f, 0.0f, 5.0f);
 
-    mVRDev->UpdateDescriptorBuffer(mResourceDescBuffer, mResourceBindings, vr::DescriptorBufferType::Resource);
+    for (uint32_t i = 0; i < mResourceDescBuffers.size(); i++)
+    {
+        mBoundTLASAddress = mFrameTLAS[i].TLASHandle.Buffer.DevAddress;
+        mVRDev->UpdateDescriptorBuffer(mResourceDescBuffers[i], mResourceBindings, vr::DescriptorBufferType::Resource);
+    }
 }
 
 void DynamicTLAS::Update(vk::CommandBuffer renderCmd)
 {
     renderCmd.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
 
-    UpdateTLAS();
+    UpdateTLAS(renderCmd);
 
-    mVRDev->BindDescriptorBuffer({mResourceDescBuffer}, renderCmd);
+    // bind the descriptor buffer of this frame
+    mVRDev->BindDescriptorBuffer({mResourceDescBuffers[mRTRenderCmdIndex]}, renderCmd);
     mVRDev->BindDescriptorSet(mPipelineLayout, 0, 0, 0, renderCmd);
 
     mVRDev->TransitionImageLayout(
@@ -307,8 +360,14 @@ void DynamicTLAS::Stop()
 {
     auto _ = mDevice.waitForFences(mRenderFence, VK_TRUE, UINT64_MAX);
 
-    mVRDev->DestroyBuffer(mScratchBuffer);
-    mVRDev->DestroyBuffer(mInstanceBuffer);
+    // the TLAS builds are waited on by the render submits, so they are finished as well
+    for (auto& frame : mFrameTLAS)
+    {
+        mVRDev->DestroyBuffer(frame.ScratchBuffer);
+        mVRDev->DestroyTLAS(frame.TLASHandle);
+    }
+
+    mInstances.Destroy();
 
     // destroy all the resources we created
     mVRDev->DestroySBTBuffer(mSBTBuffer);
@@ -317,12 +376,12 @@ void DynamicTLAS::Stop()
     mDevice.destroyPipelineLayout(mPipelineLayout);
 
     mDevice.destroyDescriptorSetLayout(mResourceDescriptorLayout);
-    mVRDev->DestroyBuffer(mResourceDescBuffer.Buffer);
+    for (auto& descBuffer : mResourceDescBuffers)
+        mVRDev->DestroyBuffer(descBuffer.Buffer);
 
     mVRDev->DestroyBuffer(mVertexBuffer);
     mVRDev->DestroyBuffer(mIndexBuffer);
     mVRDev->DestroyBLAS(mBLASHandle);
-    mVRDev->DestroyTLAS(mTLASHandle);
 }
 
 int main()
@@ -0,0 +1,877 @@
+#include "Vulray/Vulray.h"
+#include "Common.h"
+#include "Application.h"
+#include "FileRead.h"
+#include "ShaderCompiler.h"
+#include "MeshLoader.h"
+#include "GPUMaterial.h"
+#include "Helpers.h"
+#include "InstanceBuffer.h"
+#include "ParallelFor.h"
+#include "GPUTimer.h"
+#include "SIMD.h"
+#include "Culling.h"
+#include "InstanceGenerator.h"
+#include "MeshLOD.h"
+
+#include <algorithm>
+
+
+// This sample is about how far a TLAS scales, it rebuilds a TLAS with up to a million instances every frame
+// and prints where the time goes: generating the transforms on the CPU, uploading them and building the TLAS on the GPU
+// Usage: InstanceStress [instance count = 100000] [fraction of moving instances = 0.01] [cull distance = 0, off] [frustum culling = 0]
+//                       [generate instances on the GPU = 0] [LOD distance = 0, off]
+// With a LOD distance every instance uses a simplified BLAS once it is further away than that, hold L to use full detail everywhere
+
+// timestamps written by the GPU timer every frame
+enum StressTimestamp : uint32_t
+{
+    GenerateStart = 0,
+    BuildStart = 1,
+    BuildEnd = 2,
+    TraceEnd = 3,
+    TimestampCount = 4
+};
+
+// level 0 and the 3 simplified levels of LODSettings
+constexpr uint32_t MaxLODLevels = 4;
+
+class InstanceStress : public Application
+{
+public:
+    InstanceStress(uint32_t instanceCount, float movingFraction, const CullSettings& cullSettings, bool gpuInstances, float lodDistance);
+
+    virtual void Start() override;
+    virtual void Update(vk::CommandBuffer renderCmd) override;
+    virtual void Stop() override;
+
+    // functions to break up the start function
+    void CreateAS();
+    void CreateInstances();
+    void CreateGPUInstances();
+    void CreateRTPipeline();
+    void UpdateDescriptorSet();
+
+    // writes the transforms of the moving instances for the given range of mMoving* arrays
+    void GenerateTransforms(uint32_t begin, uint32_t end, float time);
+
+    // picks the BLAS level of detail of every instance from its distance to the camera
+    void SelectLODs();
+
+    void UpdateInstances(uint32_t frameIndex);
+
+    void ReportStats(uint32_t frameIndex);
+
+public:
+    MeshLoader mMeshLoader;
+
+    ShaderCompiler mShaderCompiler;
+
+    std::vector<vr::AllocatedBuffer> mVertexBuffers;
+    std::vector<vr::AllocatedBuffer> mIndexBuffers;
+    vr::AllocatedBuffer mTransformBuffer;
+    vr::AllocatedBuffer mMaterialBuffer;
+    vr::AllocatedBuffer mGeometryBuffer;
+
+    std::vector<vr::DescriptorItem> mResourceBindings;
+    vk::DescriptorSetLayout mResourceDescriptorLayout;
+    std::vector<vr::DescriptorBuffer> mResourceDescBuffers; // one for every frame in flight, each points to its TLAS
+    vk::DeviceAddress mBoundTLASAddress = 0;
+
+    vr::SBTBuffer mSBTBuffer;
+
+    vk::Pipeline mRTPipeline = nullptr;
+    vk::PipelineLayout mPipelineLayout = nullptr;
+
+    std::vector<vr::BLASHandle> mBLASHandles; // the BLAS of mesh m at LOD level l is mBLASHandles[l * mMeshCount + m]
+    std::vector<uint32_t> mInstanceIDs; // material offset of every BLAS
+    std::vector<AABB> mBLASBounds;      // bounds of every BLAS, from the mesh it was built from
+    uint32_t mMeshCount = 0;            // meshes in the scene, without the LOD levels
+
+    // same as the DynamicTLAS sample, every frame in flight has a TLAS that is rebuilt in place
+    struct FrameTLAS
+    {
+        vr::TLASHandle TLASHandle;
+        vr::TLASBuildInfo TLASBuildInfo;
+        vr::AllocatedBuffer ScratchBuffer;
+    };
+    std::vector<FrameTLAS> mFrameTLAS;
+
+    InstanceBufferManager mInstances;
+
+    uint32_t mInstanceCount = 0;
+    float mMovingFraction = 0.0f;
+
+    // [POI]
+    // The moving instances are stored as structure of arrays, so 4 of them can be animated at once with SSE
+    // The arrays are padded to a multiple of 4, the padding is never written to the instances
+    std::vector<uint32_t> mMovingIndices;
+    std::vector<float> mMovingX;
+    std::vector<float> mMovingY;
+    std::vector<float> mMovingZ;
+    std::vector<float> mMovingPhase;
+    uint32_t mMovingCount = 0;
+
+    ParallelFor mWorkers;
+    GPUTimer mGPUTimer;
+
+    // [POI]
+    // Optional culling, only the visible instances are copied to the instance buffer and built into the TLAS
+    InstanceCuller mCuller;
+    std::vector<uint32_t> mInstanceBLAS;    // index of the BLAS / bounds of every instance
+    std::vector<uint32_t> mVisibleInstances; // written by the culler every frame
+
+    // [POI]
+    // With GPU instances a compute shader animates, culls and writes the instances, the CPU only records a dispatch
+    bool mGPUInstances = false;
+    InstanceGenerator mInstanceGen;
+
+    // [POI]
+    // Optional LODs, every mesh is simplified and gets a BLAS per level, instances switch the BLAS they reference
+    // by distance, level l is used up to mLODDistance * 2^l, the last level beyond that
+    float mLODDistance = 0.0f;
+    uint32_t mLODLevelCount = 1;
+    std::vector<uint8_t> mInstanceLOD; // current level of every instance
+    std::vector<uint8_t> mLODChanged;  // written in parallel, the dirty ranges are marked afterwards
+
+    // accumulated over a second and printed by ReportStats(...)
+    struct Stats
+    {
+        double GenerationMs = 0.0;
+        double GPUGenerationMs = 0.0;
+        double CullMs = 0.0;
+        double LODMs = 0.0;
+        uint64_t LODInstances[MaxLODLevels] = {};
+        uint64_t VisibleInstances = 0;
+        double FlushMs = 0.0;
+        uint64_t BytesUploaded = 0;
+        double BuildMs = 0.0;
+        double TraceMs = 0.0;
+        uint32_t GPUFrames = 0;
+        uint32_t Frames = 0;
+    } mStats;
+    double mLastReportTime = 0.0;
+};
+
+InstanceStress::InstanceStress(uint32_t instanceCount, float movingFraction, const CullSettings& cullSettings, bool gpuInstances, float lodDistance)
+    : mInstanceCount(instanceCount), mMovingFraction(movingFraction), mGPUInstances(gpuInstances)
+{
+    // the compute shader doesn't know about the levels, they are picked on the CPU
+    mLODDistance = gpuInstances ? 0.0f : lodDistance;
+    if (gpuInstances && lodDistance > 0.0f)
+        std::cout << "InstanceStress: LODs are selected on the CPU, the LOD distance is ignored with GPU instances" << std::endl;
+
+    mCuller.Settings = cullSettings;
+}
+
+void InstanceStress::Start()
+{
+    // defined in the base application class, creates an output image to render to and a camera uniform buffer
+    CreateBaseResources();
+
+    CreateAS();
+    if (mGPUInstances)
+        CreateGPUInstances();
+    else
+        CreateInstances();
+
+    CreateRTPipeline();
+    UpdateDescriptorSet();
+
+    mGPUTimer.Create(mDevice, mPhysicalDevice, StressTimestamp::TimestampCount, static_cast<uint32_t>(mRTRenderCmd.size()));
+
+    std::cout << "InstanceStress: " << mInstanceCount << " instances, " << mMovingCount << " moving, "
+              << mWorkers.GetThreadCount() << " threads"
+#ifdef SAMPLES_SSE
+              << ", SSE"
+#endif
+              << (mGPUInstances ? ", instances generated on the GPU" : "")
+              << (mLODLevelCount > 1 ? ", " + std::to_string(mLODLevelCount) + " LOD levels" : "")
+              << std::endl;
+}
+
+void InstanceStress::CreateAS()
+{
+    mMeshLoader = MeshLoader();
+    auto scene = mMeshLoader.LoadGLBMesh("Assets/monkey.glb");
+    mASStats.SceneName = "Assets/monkey.glb";
+
+    mMeshCount = static_cast<uint32_t>(scene.Meshes.size());
+    if (mLODDistance > 0.0f)
+    {
+        SimpleTimer lodTimer;
+        lodTimer.Start();
+        mLODLevelCount = MeshLOD::GenerateLevels(scene, LODSettings{}, &mWorkers);
+        std::cout << "InstanceStress: generated " << mLODLevelCount - 1 << " LOD levels in "
+                  << lodTimer.Endd(TimerAccuracy::MilliSec) << " ms" << std::endl;
+    }
+
+    // Helper function defined in Base/Helpers.h
+    // generated scenes can be larger than a single buffer, they are split into several vertex and index buffers
+    SceneBufferSizes sizes;
+    CalculateBufferSizes(scene, sizes, GetMaxGeometryBufferSize(mPhysicalDevice));
+
+    SceneBufferTargets targets;
+    for (size_t i = 0; i < sizes.VertexBuffers.size(); i++)
+    {
+        auto &vertexBuffer = mVertexBuffers.emplace_back(mVRDev->CreateBuffer(
+            sizes.VertexBuffers[i],
+            vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer,
+            VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT));
+        auto &indexBuffer = mIndexBuffers.emplace_back(mVRDev->CreateBuffer(
+            sizes.IndexBuffers[i],
+            vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer,
+            VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT));
+
+        targets.VertexData.push_back((Vertex *)mVRDev->MapBuffer(vertexBuffer));
+        targets.IndexData.push_back((uint32_t *)mVRDev->MapBuffer(indexBuffer));
+        targets.VertexAddresses.push_back(vertexBuffer.DevAddress);
+        targets.IndexAddresses.push_back(indexBuffer.DevAddress);
+    }
+
+    // the generated geometries share a handful of materials, the shaders index the deduplicated table
+    MaterialTable materials = BuildMaterialTable(scene);
+    mMaterialBuffer = mVRDev->CreateBuffer(
+        materials.Materials.size() * sizeof(GPUMaterial),
+        vk::BufferUsageFlagBits::eStorageBuffer,
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+    mVRDev->UpdateBuffer(mMaterialBuffer, materials.Materials.data(), materials.Materials.size() * sizeof(GPUMaterial));
+    mGeometryBuffer = mVRDev->CreateBuffer(
+        sizes.GeometryBuffer,
+        vk::BufferUsageFlagBits::eStorageBuffer,
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+    mTransformBuffer = mVRDev->CreateBuffer(
+        sizes.TransformBuffer,
+        vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer,
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+
+    std::vector<vr::BLASCreateInfo> blasCreateInfos;
+
+    targets.TransformData = (char *)mVRDev->MapBuffer(mTransformBuffer);
+    targets.GeometryData = (GPUGeometry *)mVRDev->MapBuffer(mGeometryBuffer);
+    targets.TransformAddress = mTransformBuffer.DevAddress;
+
+    CopySceneToBuffers(scene, sizes, targets, materials,
+                       mInstanceIDs, blasCreateInfos, vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace, &mWorkers);
+
+    // one BLAS per mesh and level, the mesh bounds already include the mesh transform the BLAS is built with
+    // the simplified levels keep the bounds of the full mesh, they can only be smaller
+    for (auto &mesh : scene.Meshes)
+        mBLASBounds.push_back(mesh.Bounds);
+
+    for (size_t i = 0; i < mVertexBuffers.size(); i++)
+    {
+        mVRDev->UnmapBuffer(mVertexBuffers[i]);
+        mVRDev->UnmapBuffer(mIndexBuffers[i]);
+    }
+    mVRDev->UnmapBuffer(mTransformBuffer);
+    mVRDev->UnmapBuffer(mGeometryBuffer);
+
+    std::vector<vr::BLASBuildInfo> buildInfos;
+    mBLASHandles.reserve(blasCreateInfos.size());
+    buildInfos.reserve(blasCreateInfos.size());
+    for (auto &info : blasCreateInfos)
+    {
+        auto &blas = mBLASHandles.emplace_back(vr::BLASHandle{});
+        auto &buildInfo = buildInfos.emplace_back(vr::BLASBuildInfo{});
+        std::tie(blas, buildInfo) = mVRDev->CreateBLAS(info);
+    }
+
+    // [POI]
+    // The TLASes are rebuilt every frame, with this many instances the build time matters more than a slightly faster trace
+    vr::TLASCreateInfo tlasCreateInfo = {};
+    tlasCreateInfo.Flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild;
+    tlasCreateInfo.MaxInstanceCount = mInstanceCount;
+
+    mFrameTLAS.resize(mRTRenderCmd.size());
+    for (auto &frame : mFrameTLAS)
+    {
+        std::tie(frame.TLASHandle, frame.TLASBuildInfo) = mVRDev->CreateTLAS(tlasCreateInfo);
+        frame.ScratchBuffer = mVRDev->CreateScratchBufferFromBuildInfo(frame.TLASBuildInfo);
+    }
+
+    // the TLASes are built every frame, their build times are in the stats printed by the sample, not in the report
+    std::vector<uint32_t> blasStatsIds;
+    for (uint32_t i = 0; i < blasCreateInfos.size(); i++)
+        blasStatsIds.push_back(mASStats.AddBLAS("Mesh " + std::to_string(i % mMeshCount) + " LOD " + std::to_string(i / mMeshCount),
+                                                blasCreateInfos[i], buildInfos[i]));
+
+    // the memory every level would need if all instances used it, level 0 is what the sample uses without LODs
+    for (uint32_t level = 1; level < mLODLevelCount; level++)
+    {
+        vk::DeviceSize fullSize = 0, levelSize = 0;
+        uint64_t fullTriangles = 0, levelTriangles = 0;
+        for (uint32_t m = 0; m < mMeshCount; m++)
+        {
+            uint32_t index = level * mMeshCount + m;
+            fullSize += buildInfos[m].BuildSizes.accelerationStructureSize;
+            levelSize += buildInfos[index].BuildSizes.accelerationStructureSize;
+            for (auto &geom : blasCreateInfos[m].Geometries)
+                fullTriangles += geom.PrimitiveCount;
+            for (auto &geom : blasCreateInfos[index].Geometries)
+                levelTriangles += geom.PrimitiveCount;
+        }
+        std::cout << "LOD " << level << ": " << levelTriangles << " triangles, " << levelSize / 1024.0 << " KB of BLAS, "
+                  << 100.0 * levelSize / std::max<vk::DeviceSize>(fullSize, 1) << "% of the " << fullSize / 1024.0 << " KB of LOD 0"
+                  << std::endl;
+    }
+    for (uint32_t i = 0; i < mFrameTLAS.size(); i++)
+        mASStats.AddTLAS("Frame TLAS " + std::to_string(i), mInstanceCount, mFrameTLAS[i].TLASBuildInfo);
+
+    auto BLASscratchBuffer = mVRDev->CreateScratchBufferFromBuildInfos(buildInfos);
+
+    auto buildCmd = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(mGraphicsPool, vk::CommandBufferLevel::ePrimary, 1))[0];
+
+    buildCmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+
+    uint32_t timedBuild = mASStats.BeginBuild(buildCmd, blasStatsIds);
+    mVRDev->BuildBLAS(buildInfos, buildCmd);
+    mASStats.EndBuild(buildCmd, timedBuild);
+
+    buildCmd.end();
+
+    auto submitInfo = vk::SubmitInfo()
+                          .setCommandBufferCount(1)
+                          .setPCommandBuffers(&buildCmd);
+
+    mQueues.GraphicsQueue.submit(submitInfo, nullptr);
+
+    mDevice.waitIdle();
+
+    mVRDev->DestroyBuffer(BLASscratchBuffer);
+
+    mDevice.freeCommandBuffers(mGraphicsPool, buildCmd);
+}
+
+void InstanceStress::CreateInstances()
+{
+    mInstances.Create(mVRDev, mInstanceCount, static_cast<uint32_t>(mRTRenderCmd.size()));
+    mInstances.Resize(mInstanceCount);
+
+    // lay the instances out on a square grid on the XZ plane
+    uint32_t side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(mInstanceCount))));
+    float spacing = 3.0f;
+    float halfExtent = side * spacing * 0.5f;
+
+    // every n-th instance moves, so the dirty ranges are spread over the whole instance buffer like in a real scene
+    mMovingCount = static_cast<uint32_t>(mInstanceCount * mMovingFraction);
+    uint32_t stride = mMovingCount > 0 ? mInstanceCount / mMovingCount : 0;
+    uint32_t paddedCount = (mMovingCount + 3) & ~3u;
+
+    mMovingIndices.resize(paddedCount, 0);
+    mMovingX.resize(paddedCount, 0.0f);
+    mMovingY.resize(paddedCount, 0.0f);
+    mMovingZ.resize(paddedCount, 0.0f);
+    mMovingPhase.resize(paddedCount, 0.0f);
+
+    auto *instances = mInstances.GetInstances();
+    mInstanceBLAS.resize(mInstanceCount);
+    mInstanceLOD.resize(mInstanceCount, 0);
+    mLODChanged.resize(mInstanceCount, 0);
+
+    // the static instances are written once, in parallel as well, because with a million instances it takes a while
+    mWorkers.Run(mInstanceCount, 16384, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            float x = (i % side) * spacing - halfExtent;
+            float z = (i / side) * spacing - halfExtent;
+            uint32_t blas = i % mMeshCount;
+            mInstanceBLAS[i] = blas;
+
+            instances[i] = vk::AccelerationStructureInstanceKHR()
+                               .setInstanceCustomIndex(mInstanceIDs[blas])
+                               .setMask(0xFF)
+                               .setInstanceShaderBindingTableRecordOffset(0)
+                               .setFlags(vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable)
+                               .setAccelerationStructureReference(mBLASHandles[blas].Buffer.DevAddress);
+
+            VkTransformMatrixKHR transform = {
+                1.0f, 0.0f, 0.0f, x,
+                0.0f, 1.0f, 0.0f, 0.0f,
+                0.0f, 0.0f, 1.0f, z};
+            instances[i].setTransform(transform);
+        }
+    });
+    mInstances.MarkDirty(0, mInstanceCount);
+
+    for (uint32_t i = 0; i < mMovingCount; i++)
+    {
+        uint32_t index = i * stride;
+        mMovingIndices[i] = index;
+        mMovingX[i] = (index % side) * spacing - halfExtent;
+        mMovingY[i] = 0.0f;
+        mMovingZ[i] = (index / side) * spacing - halfExtent;
+        mMovingPhase[i] = static_cast<float>(index % 628) * 0.01f;
+    }
+
+    mCamera.Position = glm::vec3(0.0f, 5.0f, halfExtent + 10.0f);
+    mCamera.FarPlane = halfExtent * 4.0f;
+    mCamera.Speed = 50.0f;
+}
+
+void InstanceStress::CreateGPUInstances()
+{
+    // same grid and the same moving instances as CreateInstances(), but only the compact sources are stored
+    uint32_t side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(mInstanceCount))));
+    float spacing = 3.0f;
+    float halfExtent = side * spacing * 0.5f;
+
+    mMovingCount = static_cast<uint32_t>(mInstanceCount * mMovingFraction);
+    uint32_t stride = mMovingCount > 0 ? mInstanceCount / mMovingCount : 0;
+
+    std::vector<GPUInstanceSource> sources(mInstanceCount);
+    mWorkers.Run(mInstanceCount, 16384, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            uint32_t blas = i % mMeshCount;
+            bool moving = stride > 0 && i % stride == 0 && i / stride < mMovingCount;
+
+            auto &source = sources[i];
+            source.Position = glm::vec3((i % side) * spacing - halfExtent, 0.0f, (i / side) * spacing - halfExtent);
+            source.Phase = moving ? static_cast<float>(i % 628) * 0.01f : -1.0f;
+            source.BLASIndex = blas;
+            source.CustomIndex = mInstanceIDs[blas];
+            source.Mask = 0xFF;
+            source.Flags = static_cast<uint32_t>(VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR);
+        }
+    });
+
+    auto uploadCmd = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(mGraphicsPool, vk::CommandBufferLevel::ePrimary, 1))[0];
+    uploadCmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+
+    mInstanceGen.Create(mVRDev, mDevice, mShaderCompiler, sources, mBLASHandles, mBLASBounds,
+                        static_cast<uint32_t>(mRTRenderCmd.size()), uploadCmd);
+
+    uploadCmd.end();
+
+    auto submitInfo = vk::SubmitInfo()
+                          .setCommandBufferCount(1)
+                          .setPCommandBuffers(&uploadCmd);
+
+    mQueues.GraphicsQueue.submit(submitInfo, nullptr);
+
+    mDevice.waitIdle();
+
+    mInstanceGen.FinishUpload();
+
+    mDevice.freeCommandBuffers(mGraphicsPool, uploadCmd);
+
+    mCamera.Position = glm::vec3(0.0f, 5.0f, halfExtent + 10.0f);
+    mCamera.FarPlane = halfExtent * 4.0f;
+    mCamera.Speed = 50.0f;
+}
+
+#ifdef SAMPLES_SSE
+// sine of 4 angles at once, accurate to about 0.001 which is plenty for an animation
+static inline __m128 SinSSE(__m128 x)
+{
+    const __m128 invTwoPi = _mm_set1_ps(0.159154943f);
+    const __m128 twoPi = _mm_set1_ps(6.283185307f);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+    // wrap to [-pi, pi]
+    __m128 k = _mm_cvtepi32_ps(_mm_cvtps_epi32(_mm_mul_ps(x, invTwoPi)));
+    x = _mm_sub_ps(x, _mm_mul_ps(k, twoPi));
+
+    // parabola through the sine, refined once
+    const __m128 B = _mm_set1_ps(1.273239545f);  // 4 / pi
+    const __m128 C = _mm_set1_ps(-0.405284735f); // -4 / pi^2
+    const __m128 P = _mm_set1_ps(0.225f);
+
+    __m128 y = _mm_add_ps(_mm_mul_ps(B, x), _mm_mul_ps(_mm_mul_ps(C, x), _mm_and_ps(x, absMask)));
+    y = _mm_add_ps(_mm_mul_ps(P, _mm_sub_ps(_mm_mul_ps(y, _mm_and_ps(y, absMask)), y)), y);
+    return y;
+}
+#endif
+
+void InstanceStress::GenerateTransforms(uint32_t begin, uint32_t end, float time)
+{
+    auto *instances = mInstances.GetInstances();
+
+    // every instance spins around its Y axis and bobs up and down
+    // row 0: ( cos, 0, sin, x)
+    // row 1: (   0, 1,   0, y)
+    // row 2: (-sin, 0, cos, z)
+#ifdef SAMPLES_SSE
+    // [POI]
+    // 4 instances are animated at once, the 4 rows of a matrix component are transposed
+    // so every register holds one row of the VkTransformMatrixKHR of one instance and is stored directly
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 halfPi = _mm_set1_ps(1.570796327f);
+    const __m128 timeV = _mm_set1_ps(time);
+    const __m128 bobTime = _mm_set1_ps(time * 2.0f);
+    const __m128 bobHeight = _mm_set1_ps(0.5f);
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+
+    for (uint32_t i = begin; i < end; i += 4)
+    {
+        __m128 phase = _mm_loadu_ps(&mMovingPhase[i]);
+        __m128 angle = _mm_add_ps(timeV, phase);
+
+        __m128 s = SinSSE(angle);
+        __m128 c = SinSSE(_mm_add_ps(angle, halfPi));
+        __m128 negS = _mm_xor_ps(s, signMask);
+
+        __m128 x = _mm_loadu_ps(&mMovingX[i]);
+        __m128 y = _mm_add_ps(_mm_loadu_ps(&mMovingY[i]), _mm_mul_ps(SinSSE(_mm_add_ps(bobTime, phase)), bobHeight));
+        __m128 z = _mm_loadu_ps(&mMovingZ[i]);
+
+        __m128 r0a = c, r0b = zero, r0c = s, r0d = x;
+        __m128 r1a = zero, r1b = one, r1c = zero, r1d = y;
+        __m128 r2a = negS, r2b = zero, r2c = c, r2d = z;
+        _MM_TRANSPOSE4_PS(r0a, r0b, r0c, r0d);
+        _MM_TRANSPOSE4_PS(r1a, r1b, r1c, r1d);
+        _MM_TRANSPOSE4_PS(r2a, r2b, r2c, r2d);
+
+        __m128 rows[4][3] = {{r0a, r1a, r2a}, {r0b, r1b, r2b}, {r0c, r1c, r2c}, {r0d, r1d, r2d}};
+
+        uint32_t lanes = std::min(4u, mMovingCount - i);
+        for (uint32_t lane = 0; lane < lanes; lane++)
+        {
+            float *matrix = reinterpret_cast<float *>(&instances[mMovingIndices[i + lane]].transform);
+            _mm_storeu_ps(matrix + 0, rows[lane][0]);
+            _mm_storeu_ps(matrix + 4, rows[lane][1]);
+            _mm_storeu_ps(matrix + 8, rows[lane][2]);
+        }
+    }
+#else
+    for (uint32_t i = begin; i < std::min(end, mMovingCount); i++)
+    {
+        float angle = time + mMovingPhase[i];
+        float s = sinf(angle);
+        float c = cosf(angle);
+        float y = mMovingY[i] + sinf(time * 2.0f + mMovingPhase[i]) * 0.5f;
+
+        VkTransformMatrixKHR transform = {
+            c, 0.0f, s, mMovingX[i],
+            0.0f, 1.0f, 0.0f, y,
+            -s, 0.0f, c, mMovingZ[i]};
+        instances[mMovingIndices[i]].setTransform(transform);
+    }
+#endif
+}
+
+void InstanceStress::SelectLODs()
+{
+    auto *instances = mInstances.GetInstances();
+    glm::vec3 cameraPosition = mCamera.Position;
+
+    // holding L shows the scene at full detail, to compare the trace time against
+    bool fullDetail = glfwGetKey(mWindow, GLFW_KEY_L) == GLFW_PRESS;
+
+    mWorkers.Run(mInstanceCount, 16384, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            auto &transform = instances[i].transform.matrix;
+            const AABB &bounds = mBLASBounds[mInstanceBLAS[i]];
+            glm::vec3 center = glm::vec3(transform[0][3], transform[1][3], transform[2][3]) + (bounds.Min + bounds.Max) * 0.5f;
+            float distance = glm::distance(center, cameraPosition);
+
+            uint32_t level = 0;
+            float limit = mLODDistance;
+            while (!fullDetail && level + 1 < mLODLevelCount && distance > limit)
+            {
+                level++;
+                limit *= 2.0f;
+            }
+
+            if (level == mInstanceLOD[i])
+                continue;
+
+            mInstanceLOD[i] = static_cast<uint8_t>(level);
+            mLODChanged[i] = 1;
+            // every level has geometry records of its own, InstanceID() + GeometryIndex() has to find the ones of the new level
+            uint32_t blas = level * mMeshCount + mInstanceBLAS[i];
+            instances[i].setInstanceCustomIndex(mInstanceIDs[blas]);
+            instances[i].setAccelerationStructureReference(mBLASHandles[blas].Buffer.DevAddress);
+        }
+    });
+
+    // only the instances that switched level are uploaded again
+    for (uint32_t i = 0; i < mInstanceCount; i++)
+    {
+        if (mLODChanged[i])
+        {
+            mInstances.MarkDirty(i, 1);
+            mLODChanged[i] = 0;
+        }
+        mStats.LODInstances[mInstanceLOD[i]]++;
+    }
+}
+
+void InstanceStress::UpdateInstances(uint32_t frameIndex)
+{
+    SimpleTimer timer;
+    timer.Start();
+
+    float time = static_cast<float>(glfwGetTime());
+
+    // [POI]
+    // The transforms are generated on all threads, chunks are a multiple of 4 so every SSE batch stays in one chunk
+    mWorkers.Run(mMovingCount, 4096, [&](uint32_t begin, uint32_t end) { GenerateTransforms(begin, end, time); }, 4);
+
+    // marking is cheap compared to generating, and the dirty ranges aren't thread safe
+    for (uint32_t i = 0; i < mMovingCount; i++)
+        mInstances.MarkDirty(mMovingIndices[i], 1);
+
+    mStats.GenerationMs += timer.Endd(TimerAccuracy::MilliSec);
+
+    if (mLODLevelCount > 1)
+    {
+        timer.Start();
+        SelectLODs();
+        mStats.LODMs += timer.Endd(TimerAccuracy::MilliSec);
+    }
+
+    if (mCuller.IsEnabled())
+    {
+        timer.Start();
+        mCuller.Update(mCamera);
+        mCuller.Cull(mInstances.GetInstances(), mInstanceBLAS.data(), mBLASBounds.data(), mInstanceCount, mVisibleInstances, &mWorkers);
+        mStats.CullMs += timer.Endd(TimerAccuracy::MilliSec);
+
+        // only the visible instances go into the instance buffer of this frame
+        mInstances.FlushCompacted(frameIndex, mVisibleInstances);
+    }
+    else
+    {
+        mInstances.Flush(frameIndex);
+    }
+    mStats.VisibleInstances += mInstances.GetBuiltCount(frameIndex);
+
+    auto &upload = mInstances.GetLastStats();
+    mStats.FlushMs += upload.FlushTimeMs;
+    mStats.BytesUploaded += upload.BytesCopied;
+}
+
+void InstanceStress::CreateRTPipeline()
+{
+    mResourceBindings = {
+        vr::DescriptorItem(0, vk::DescriptorType::eAccelerationStructureKHR, vk::ShaderStageFlagBits::eRaygenKHR, 1, &mBoundTLASAddress),
+        vr::DescriptorItem(1, vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eRaygenKHR, 1, &mUniformBuffer),
+        vr::DescriptorItem(2, vk::DescriptorType::eStorageImage, vk::ShaderStageFlagBits::eRaygenKHR, 1, &mOutputImage),
+        vr::DescriptorItem(3, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eClosestHitKHR, 1, &mMaterialBuffer),
+        vr::DescriptorItem(4, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eClosestHitKHR, 1, &mGeometryBuffer)};
+
+    mResourceDescriptorLayout = mVRDev->CreateDescriptorSetLayout(mResourceBindings);
+
+    mPipelineLayout = mVRDev->CreatePipelineLayout(mResourceDescriptorLayout);
+
+    auto spv = mShaderCompiler.CompileSPIRVFromFile("Shaders/ColorfulGeometry/ColorfulGeometry.hlsl");
+    auto shaderModule = mVRDev->CreateShaderFromSPV(spv);
+
+    vr::PipelineSettings pipelineSettings = {};
+    pipelineSettings.PipelineLayout = mPipelineLayout;
+    pipelineSettings.MaxRecursionDepth = 1;
+    pipelineSettings.MaxPayloadSize = sizeof(glm::vec3);
+    pipelineSettings.MaxHitAttributeSize = sizeof(glm::vec2);
+
+    vr::RayTracingShaderCollection shaderCollection = {};
+
+    shaderCollection.RayGenShaders.push_back(shaderModule);
+    shaderCollection.RayGenShaders.back().EntryPoint = "rgen";
+
+    shaderCollection.MissShaders.push_back(shaderModule);
+    shaderCollection.MissShaders.back().EntryPoint = "miss";
+
+    vr::HitGroup hitGroup = {};
+    hitGroup.ClosestHitShader = shaderModule;
+    hitGroup.ClosestHitShader.EntryPoint = "chit";
+    shaderCollection.HitGroups.push_back(hitGroup);
+
+    auto [pipeline, sbtInfo] = mVRDev->CreateRayTracingPipeline(shaderCollection, pipelineSettings);
+    mRTPipeline = pipeline;
+
+    mSBTBuffer = mVRDev->CreateSBT(mRTPipeline, sbtInfo);
+
+    for (uint32_t i = 0; i < mRTRenderCmd.size(); i++)
+        mResourceDescBuffers.push_back(mVRDev->CreateDescriptorBuffer(mResourceDescriptorLayout, mResourceBindings, vr::DescriptorBufferType::Resource));
+
+    mDevice.destroyShaderModule(shaderModule.Module);
+}
+
+void InstanceStress::UpdateDescriptorSet()
+{
+    for (uint32_t i = 0; i < mResourceDescBuffers.size(); i++)
+    {
+        mBoundTLASAddress = mFrameTLAS[i].TLASHandle.Buffer.DevAddress;
+        mVRDev->UpdateDescriptorBuffer(mResourceDescBuffers[i], mResourceBindings, vr::DescriptorBufferType::Resource);
+    }
+}
+
+void InstanceStress::ReportStats(uint32_t frameIndex)
+{
+    // the timestamps of this frame index are from two frames ago
+    double gpuGenerationMs = mGPUTimer.GetMilliseconds(frameIndex, StressTimestamp::GenerateStart, StressTimestamp::BuildStart);
+    double buildMs = mGPUTimer.GetMilliseconds(frameIndex, StressTimestamp::BuildStart, StressTimestamp::BuildEnd);
+    double traceMs = mGPUTimer.GetMilliseconds(frameIndex, StressTimestamp::BuildEnd, StressTimestamp::TraceEnd);
+    if (buildMs > 0.0)
+    {
+        mStats.GPUGenerationMs += gpuGenerationMs;
+        mStats.BuildMs += buildMs;
+        mStats.TraceMs += traceMs;
+        mStats.GPUFrames++;
+    }
+    mStats.Frames++;
+
+    double now = glfwGetTime();
+    if (now - mLastReportTime < 1.0)
+        return;
+
+    double frames = mStats.Frames;
+    double gpuFrames = std::max(mStats.GPUFrames, 1u);
+    double uploadSeconds = mStats.FlushMs / 1000.0;
+    double avgBuildMs = mStats.BuildMs / gpuFrames;
+
+    // the GPU path writes the visible count of every finished frame, the last one is good enough for the report
+    double visible = mGPUInstances ? mInstanceGen.GetVisibleCount(frameIndex) : mStats.VisibleInstances / frames;
+
+    std::cout << "frame " << (now - mLastReportTime) * 1000.0 / frames << " ms | ";
+    if (mGPUInstances)
+        std::cout << "GPU generate + cull " << mStats.GPUGenerationMs / gpuFrames << " ms, " << visible << " visible | ";
+    else
+        std::cout << "generate " << mStats.GenerationMs / frames << " ms | "
+                  << "cull " << mStats.CullMs / frames << " ms, " << visible << " visible | ";
+    if (mLODLevelCount > 1)
+    {
+        std::cout << "LOD select " << mStats.LODMs / frames << " ms, instances per level";
+        for (uint32_t level = 0; level < mLODLevelCount; level++)
+            std::cout << (level == 0 ? " " : "/") << static_cast<uint64_t>(mStats.LODInstances[level] / frames);
+        std::cout << " | ";
+    }
+    std::cout << "upload " << mStats.BytesUploaded / frames / 1024.0 << " KB in " << mStats.FlushMs / frames << " ms";
+    if (uploadSeconds > 0.0)
+        std::cout << " (" << mStats.BytesUploaded / (1024.0 * 1024.0 * 1024.0) / uploadSeconds << " GB/s)";
+    std::cout << " | TLAS build " << avgBuildMs << " ms";
+    if (avgBuildMs > 0.0)
+        std::cout << " (" << visible / (avgBuildMs * 1000.0) << " M instances/s)";
+    std::cout << " | trace " << mStats.TraceMs / gpuFrames << " ms" << std::endl;
+
+    mStats = {};
+    mLastReportTime = now;
+}
+
+void InstanceStress::Update(vk::CommandBuffer renderCmd)
+{
+    uint32_t frameIndex = mRTRenderCmdIndex;
+    auto &frame = mFrameTLAS[frameIndex];
+
+    renderCmd.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+
+    // reads the timestamps of the last use of this frame index before they are reset
+    mGPUTimer.BeginFrame(renderCmd, frameIndex);
+    ReportStats(frameIndex);
+
+    mGPUTimer.WriteTimestamp(renderCmd, frameIndex, StressTimestamp::GenerateStart, vk::PipelineStageFlagBits::eTopOfPipe);
+    if (mGPUInstances)
+    {
+        if (mCuller.IsEnabled())
+            mCuller.Update(mCamera);
+        mInstanceGen.Generate(renderCmd, frameIndex, static_cast<float>(glfwGetTime()), &mCuller);
+    }
+    else
+    {
+        UpdateInstances(frameIndex);
+    }
+
+    // culled GPU instances are inactive, they stay in the build but the builder skips them
+    const vr::AllocatedBuffer &instanceBuffer = mGPUInstances ? mInstanceGen.GetBuffer(frameIndex) : mInstances.GetBuffer(frameIndex);
+    uint32_t buildCount = mGPUInstances ? mInstanceGen.GetInstanceCount() : mInstances.GetBuiltCount(frameIndex);
+
+    // [POI]
+    // The build is recorded into the render command buffer, even if there is an async compute queue,
+    // so the timestamps measure the build alone and not the time it waits for the other queue
+    mGPUTimer.WriteTimestamp(renderCmd, frameIndex, StressTimestamp::BuildStart, vk::PipelineStageFlagBits::eComputeShader);
+    mVRDev->BuildTLAS(frame.TLASBuildInfo, instanceBuffer, buildCount, renderCmd);
+    mGPUTimer.WriteTimestamp(renderCmd, frameIndex, StressTimestamp::BuildEnd, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR);
+
+    AddASBuildToTraceBarrier(renderCmd);
+
+    mVRDev->BindDescriptorBuffer({mResourceDescBuffers[frameIndex]}, renderCmd);
+    mVRDev->BindDescriptorSet(mPipelineLayout, 0, 0, 0, renderCmd);
+
+    mVRDev->TransitionImageLayout(
+        mOutputImageBuffer.Image,
+        vk::ImageLayout::eUndefined,
+        vk::ImageLayout::eGeneral,
+        vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1),
+        renderCmd);
+
+    mVRDev->DispatchRays(mRTPipeline, mSBTBuffer, mRenderWidth, mRenderHeight, 1, renderCmd);
+    mGPUTimer.WriteTimestamp(renderCmd, frameIndex, StressTimestamp::TraceEnd, vk::PipelineStageFlagBits::eRayTracingShaderKHR);
+
+    // Helper function in Application Class to blit the image to the swapchain image
+    BlitImage(renderCmd);
+
+    renderCmd.end();
+
+    WaitForRendering();
+
+    Present(renderCmd);
+
+    UpdateCamera();
+}
+
+void InstanceStress::Stop()
+{
+    auto _ = mDevice.waitForFences(mRenderFence, VK_TRUE, UINT64_MAX);
+
+    for (auto &frame : mFrameTLAS)
+    {
+        mVRDev->DestroyBuffer(frame.ScratchBuffer);
+        mVRDev->DestroyTLAS(frame.TLASHandle);
+    }
+    mInstances.Destroy();
+    if (mGPUInstances)
+        mInstanceGen.Destroy();
+    mGPUTimer.Destroy();
+
+    mVRDev->DestroySBTBuffer(mSBTBuffer);
+
+    mDevice.destroyPipeline(mRTPipeline);
+    mDevice.destroyPipelineLayout(mPipelineLayout);
+
+    mDevice.destroyDescriptorSetLayout(mResourceDescriptorLayout);
+    for (auto &descBuffer : mResourceDescBuffers)
+        mVRDev->DestroyBuffer(descBuffer.Buffer);
+
+    for (auto &buffer : mVertexBuffers)
+        mVRDev->DestroyBuffer(buffer);
+    for (auto &buffer : mIndexBuffers)
+        mVRDev->DestroyBuffer(buffer);
+    mVRDev->DestroyBuffer(mTransformBuffer);
+    mVRDev->DestroyBuffer(mMaterialBuffer);
+    mVRDev->DestroyBuffer(mGeometryBuffer);
+
+    for (auto &blas : mBLASHandles)
+        mVRDev->DestroyBLAS(blas);
+}
+
+int main(int argc, char **argv)
+{
+    // the TLAS and instance buffers are sized for the instance count, a million is the most this sample goes up to
+    uint32_t instanceCount = argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 100000;
+    float movingFraction = argc > 2 ? std::strtof(argv[2], nullptr) : 0.01f;
+
+    instanceCount = std::clamp(instanceCount, 1u, 1000000u);
+    movingFraction = std::clamp(movingFraction, 0.0f, 1.0f);
+
+    // culling is off by default, the sample traces primary rays only, so frustum culling doesn't change the image
+    CullSettings cullSettings = {};
+    cullSettings.MaxDistance = argc > 3 ? std::max(std::strtof(argv[3], nullptr), 0.0f) : 0.0f;
+    cullSettings.FrustumCulling = argc > 4 && std::strtoul(argv[4], nullptr, 10) != 0;
+
+    bool gpuInstances = argc > 5 && std::strtoul(argv[5], nullptr, 10) != 0;
+
+    // the grid spacing is 3 units, so a LOD distance of about 50 keeps a few hundred instances at full detail
+    float lodDistance = argc > 6 ? std::max(std::strtof(argv[6], nullptr), 0.0f) : 0.0f;
+
+    Application *app = new InstanceStress(instanceCount, movingFraction, cullSettings, gpuInstances, lodDistance);
+
+    app->Start();
+    app->Run();
+    app->Stop();
+
+    delete app;
+}
@@ -5,16 +5,23 @@
 #include "ShaderCompiler.h"
 #include "MeshLoader.h"
 #include "GPUMaterial.h"
+#include "SceneUploader.h"
+#include "SlicedBLASBuilder.h"
+#include "AssetWatcher.h"
 
 class MeshMaterials : public Application
 {
 public:
+    MeshMaterials(float buildBudgetMs, BufferPlacement placement) : mBuildBudgetMs(buildBudgetMs), mPlacement(placement) {}
+
     virtual void Start() override;
     virtual void Update(vk::CommandBuffer renderCmd) override;
     virtual void Stop() override;
 
     // functions to break up the start function
     void CreateAS();
+    void FinishStreaming();
+    void ReloadScene(Scene scene);
     void CreateRTPipeline();
     void UpdateDescriptorSet();
 
@@ -23,23 +30,37 @@ public:
 
     ShaderCompiler mShaderCompiler;
 
-    vr::AllocatedBuffer mVertexBuffer;
-    vr::AllocatedBuffer mIndexBuffer;
-    vr::AllocatedBuffer mTransformBuffer;
+    SceneUploader mSceneUploader;
 
     std::vector<vr::DescriptorItem> mResourceBindings;
     vk::DescriptorSetLayout mResourceDescriptorLayout;
     vr::DescriptorBuffer mResourceDescBuffer;
 
-    vr::AllocatedBuffer mMaterialBuffer;
+    vr::AllocatedBuffer mMaterialBuffer; // owned by mSceneUploader
+    vr::AllocatedBuffer mGeometryBuffer; // owned by mSceneUploader
 
     vr::SBTBuffer mSBTBuffer; // contains the shader records for the SBT
 
     vk::Pipeline mRTPipeline = nullptr;
     vk::PipelineLayout mPipelineLayout = nullptr;
 
-    std::vector<vr::BLASHandle> mBLASHandles;
-    vr::TLASHandle mTLASHandle;
+    vr::TLASHandle mTLASHandle; // owned by mSceneUploader
+
+    // GPU time per frame for the initial BLAS builds, 0 builds all of them before the first frame
+    float mBuildBudgetMs = 0.0f;
+    SlicedBLASBuilder mSlicedBuilder;
+    std::vector<uint32_t> mSliceBuilt;
+    bool mStreaming = false;        // true until the last slice has been compacted
+    uint64_t mLastSliceFrame = 0;   // frame that recorded the last slice
+    uint32_t mSliceCount = 0;       // frames that recorded a slice, printed when the streaming finishes
+
+    BufferPlacement mPlacement = BufferPlacement::Auto;
+
+    glm::mat3x4 mEditedTransform = glm::mat3x4(1.0f); // transform of the first mesh, moved by the live edit
+
+    std::string mScenePath = "Assets/cornell_box.glb";
+    SceneUploadSettings mUploadSettings = {};
+    AssetWatcher mAssetWatcher; // loads the scene again when the file is saved
 };
 
 void MeshMaterials::Start()
@@ -57,201 +78,97 @@ void MeshMaterials::CreateAS()
 {
     mMeshLoader = MeshLoader();
     // Get the scene info from the glb file
-    auto scene = mMeshLoader.LoadGLBMesh("Assets/cornell_box.glb");
+    auto scene = mMeshLoader.LoadGLBMesh(mScenePath);
+    mASStats.SceneName = mScenePath;
 
     // Set the camera position to the center of the scene
     if (scene.Cameras.size() > 0)
         mCamera = scene.Cameras[0];
     mCamera.Speed = 25.0f;
 
-    auto &geometries = scene.Geometries;
-
-    uint32_t vertBufferSize = 0;
-    uint32_t idxBufferSize = 0;
-    uint32_t transBufferSize = 0;
-    uint32_t matBufferSize = 0;
-
-    // calculate the size required for the buffers
-    for (auto &mesh : scene.Meshes)
+    // [POI]
+    // The buffers, BLASes and the TLAS are created by the scene uploader, see Base/SceneUploader.h
+    // The geometry records, which point to the materials, are stored like this
+    // The instance ID for the TLAS is n Meshes + n Geometries
+    // if Mesh at index 0 has 2 geometries, the instance ID for the first geometry is 0 and the second Mesh is 2, because there
+    // are 2 geometry records before the second mesh, because Mesh 0 has 2 geometries.
+    // Similarly, if Mesh at index 1 has 3 geometries, the next Mesh Instance ID is 2(Geometries) + 3(Geometries) = 5
+    SceneUploadSettings settings = {};
+    settings.Placement = mPlacement;
+    settings.Compact = true;
+    settings.UseCache = true;
+    settings.DeferBuilds = mBuildBudgetMs > 0.0f;
+    settings.FramesInFlight = static_cast<uint32_t>(mRTRenderCmd.size());
+    settings.InstanceFlags = vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable;
+    settings.Stats = &mASStats;
+    settings.HotReload = true;
+    mUploadSettings = settings;
+
+    // the live edit in Update(...) moves the first mesh from where it was loaded
+    if (!scene.Meshes.empty())
+        mEditedTransform = scene.Meshes[0].Transform;
+
+    mSceneUploader.Create(mVRDev, mDevice, mPhysicalDevice, mQueues, mGraphicsPool);
+    mSceneUploader.Upload(std::move(scene), settings);
+
+    // the uploader owns them, these are the handles the descriptors point to
+    mTLASHandle = mSceneUploader.GetTLAS();
+    mMaterialBuffer = mSceneUploader.GetMaterialBuffer();
+    mGeometryBuffer = mSceneUploader.GetGeometryBuffer();
+
+    auto &blasToBuild = mSceneUploader.GetDeferredBLAS();
+    if (!blasToBuild.empty())
     {
-        for (auto &geomRef : mesh.GeometryReferences)
-        {
-            vertBufferSize += geometries[geomRef].Vertices.size() * sizeof(Vertex);
-            idxBufferSize += geometries[geomRef].Indices.size() * sizeof(uint32_t);
-            matBufferSize += sizeof(GPUMaterial);
-        }
-        transBufferSize += sizeof(vk::TransformMatrixKHR);
-    }
-
-    // Store all the primitives in a single buffer, it is efficient to do so
-    mVertexBuffer = mVRDev->CreateBuffer(
-        vertBufferSize,
-        vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer,
-        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
-
-    mIndexBuffer = mVRDev->CreateBuffer(
-        idxBufferSize,
-        vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer,
-        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
-    mMaterialBuffer = mVRDev->CreateBuffer(
-        matBufferSize,
-        vk::BufferUsageFlagBits::eStorageBuffer,
-        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
-    // Create a buffer to store the transform for the BLAS
-    mTransformBuffer = mVRDev->CreateBuffer(
-        transBufferSize,
-        vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer,
-        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
-
-    // Create info struct for the BLAS
-    vr::BLASCreateInfo blasCreateInfo = {};
-    std::vector<vr::BLASCreateInfo> blasCreateInfos;
-
-    // Store the instanceID for each mesh so that we can use it to index into the material buffer
-    std::vector<uint32_t> instanceIDs;
-
-    // Copy the vertex and index data into the buffers
-    uint32_t vertOffset = 0;
-    uint32_t idxOffset = 0;
-    uint32_t transOffset = 0;
-    uint32_t matOffset = 0;
-
-    Vertex *vertData = (Vertex *)mVRDev->MapBuffer(mVertexBuffer);
-    uint32_t *idxData = (uint32_t *)mVRDev->MapBuffer(mIndexBuffer);
-    char *transData = (char *)mVRDev->MapBuffer(mTransformBuffer);
-    char *matData = (char *)mVRDev->MapBuffer(mMaterialBuffer);
-
-    for (auto &mesh : scene.Meshes)
-    {
-        auto &blasinfo = blasCreateInfos.emplace_back(vr::BLASCreateInfo{});
-        blasinfo.Flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
         // [POI]
-        // The materials are stored like this
-        // The instance ID for the TLAS is n Meshes + n Geometries
-        // if Mesh at index 0 has 2 geometries, the instance ID for the first geometry is 0 and the second Mesh is 2, because there
-        // are 2 materials before the second mesh, because Mesh 0 has 2 geometries.
-        // Similarly, if Mesh at index 1 has 3 geometries, the next Mesh Instance ID is 2(Geometries) + 3(Geometries) = 5
-        // This is the calculation for the instance ID
-        instanceIDs.push_back(matOffset / sizeof(GPUMaterial)); // store the instanceID for the mesh
-
-        for (auto &geomRef : mesh.GeometryReferences)
-        {
-            auto &geom = geometries[geomRef];
-            vr::GeometryData geomData = {};
-            geomData.VertexFormat = vk::Format::eR32G32B32Sfloat;
-            geomData.Stride = sizeof(Vertex);
-            geomData.IndexFormat = vk::IndexType::eUint32;
-            geomData.PrimitiveCount = geom.Indices.size() / 3;
-            geomData.DataAddresses.VertexDevAddress = mVertexBuffer.DevAddress + vertOffset * sizeof(Vertex);
-            geomData.DataAddresses.IndexDevAddress = mIndexBuffer.DevAddress + idxOffset * sizeof(uint32_t);
-            geomData.DataAddresses.TransformDevAddress = mTransformBuffer.DevAddress + transOffset;
-            blasinfo.Geometries.push_back(geomData);
-
-            GPUMaterial mat = {}; // create a material for the geometry this material will be copied into the material buffer
-            mat.BaseColor = geom.Material.BaseColorFactor;
-            mat.Roughness = geom.Material.RoughnessFactor;
-            mat.Metallic = geom.Material.MetallicFactor;
-            mat.VertBufferOffset = vertOffset;
-            mat.IndexBufferOffset = idxOffset;
-
-            memcpy(vertData + vertOffset, geom.Vertices.data(), geom.Vertices.size() * sizeof(Vertex));
-            memcpy(idxData + idxOffset, geom.Indices.data(), geom.Indices.size() * sizeof(uint32_t));
-            memcpy(matData + matOffset, &mat, sizeof(GPUMaterial));
-
-            vertOffset += geom.Vertices.size();
-            idxOffset += geom.Indices.size();
-            matOffset += sizeof(GPUMaterial); // material for each geometry
-        }
-
-        memcpy(transData + transOffset, &mesh.Transform, sizeof(vk::TransformMatrixKHR));
-        transOffset += sizeof(vk::TransformMatrixKHR);
+        // The BLASes that weren't in the cache are built by the first frames, a few milliseconds of GPU time per frame
+        // the TLAS starts out with the cached BLASes only and is rebuilt whenever a slice finishes more of them
+        mSlicedBuilder.Create(mVRDev, mDevice, mPhysicalDevice, &mSceneUploader.GetBLASPool(), static_cast<uint32_t>(mRTRenderCmd.size()), mBuildBudgetMs);
+        mSlicedBuilder.Enqueue(blasToBuild);
+        mStreaming = true;
     }
 
-    mVRDev->UnmapBuffer(mVertexBuffer);
-    mVRDev->UnmapBuffer(mIndexBuffer);
-    mVRDev->UnmapBuffer(mTransformBuffer);
-    mVRDev->UnmapBuffer(mMaterialBuffer);
-
-    // Create the BLASes, one BLAS for each mesh in the scene
-    // create build info for the BLASSes
-    std::vector<vr::BLASBuildInfo> buildInfos;
-
-    mBLASHandles.reserve(blasCreateInfos.size());
-    buildInfos.reserve(blasCreateInfos.size());
-
-    for (auto &info : blasCreateInfos)
-    {
-        auto &blas = mBLASHandles.emplace_back(vr::BLASHandle{});
-        auto &buildInfo = buildInfos.emplace_back(vr::BLASBuildInfo{});
-        std::tie(blas, buildInfo) = mVRDev->CreateBLAS(info);
-    }
-
-    vr::TLASCreateInfo tlasCreateInfo = {};
-    tlasCreateInfo.Flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
-    tlasCreateInfo.MaxInstanceCount = mBLASHandles.size();
-
-    auto [tlasHandle, tlasBuildInfo] = mVRDev->CreateTLAS(tlasCreateInfo);
-
-    mTLASHandle = tlasHandle;
-
-    auto InstanceBuffer = mVRDev->CreateInstanceBuffer(mBLASHandles.size());
-
-    std::vector<vk::AccelerationStructureInstanceKHR> instances;
-
-    // Create as many instances as there are BLASes
-    for (uint32_t i = 0; i < mBLASHandles.size(); i++)
-    {
-        auto inst = vk::AccelerationStructureInstanceKHR()
-                        .setInstanceCustomIndex(instanceIDs[i]) // set the instance ID
-                        .setAccelerationStructureReference(mBLASHandles[i].Buffer.DevAddress)
-                        .setFlags(vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable)
-                        .setMask(0xFF)
-                        .setInstanceShaderBindingTableRecordOffset(0);
-
-        // set the transform matrix to identity
-        inst.transform = {
-            1.0f, 0.0f, 0.0f, 0.0f,
-            0.0f, 1.0f, 0.0f, 0.0f,
-            0.0f, 0.0f, 1.0f, 0.0f};
-
-        instances.push_back(inst);
-    }
-
-    mVRDev->UpdateBuffer(InstanceBuffer, instances.data(), sizeof(vk::AccelerationStructureInstanceKHR) * instances.size());
-
-    // create the scratch buffers
-    auto BLASscratchBuffer = mVRDev->CreateScratchBufferFromBuildInfos(buildInfos);
-    auto TLASScratchBuffer = mVRDev->CreateScratchBufferFromBuildInfo(tlasBuildInfo);
-
-    auto buildCmd = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(mGraphicsPool, vk::CommandBufferLevel::ePrimary, 1))[0];
-
-    buildCmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
-
-    // build the AS
-
-    mVRDev->BuildBLAS(buildInfos, buildCmd);
+    mAssetWatcher.Start(mScenePath);
+}
 
-    mVRDev->AddAccelerationBuildBarrier(buildCmd);
+void MeshMaterials::FinishStreaming()
+{
+    // [POI]
+    // The last slice has finished, the BLASes are stored in the cache and compacted like at startup without sliced builds
+    // this blocks once, the compaction moves the BLASes, so the TLAS is rebuilt with their new addresses before the next frame
+    mDevice.waitIdle();
 
-    mVRDev->BuildTLAS(tlasBuildInfo, InstanceBuffer, instances.size(), buildCmd);
+    std::cout << "Built " << mSlicedBuilder.GetBuiltCount() << " BLASes in " << mSliceCount << " slices, last measured slice "
+              << mSlicedBuilder.GetLastSliceMs() << " ms" << std::endl;
+    mSlicedBuilder.Destroy();
 
-    buildCmd.end();
+    mSceneUploader.FinishDeferredBuilds();
 
-    // submit the command buffer and wait for it to finish
-    auto submitInfo = vk::SubmitInfo()
-                          .setCommandBufferCount(1)
-                          .setPCommandBuffers(&buildCmd);
+    mASStats.WriteJSON();
 
-    mQueues.GraphicsQueue.submit(submitInfo, nullptr);
+    mStreaming = false;
+}
 
+void MeshMaterials::ReloadScene(Scene scene)
+{
+    // [POI]
+    // Meshes, geometries or materials were added or removed, the buffers and the TLAS don't fit the scene anymore,
+    // so the scene the watcher loaded is uploaded again like at startup, this waits for the frames in flight once
     mDevice.waitIdle();
 
-    mVRDev->DestroyBuffer(BLASscratchBuffer);
-    mVRDev->DestroyBuffer(TLASScratchBuffer);
+    SceneUploadSettings settings = mUploadSettings;
+    settings.DeferBuilds = false;
+    settings.Stats = nullptr; // the stats are of the scene at startup
 
-    mVRDev->DestroyBuffer(InstanceBuffer);
+    if (!scene.Meshes.empty())
+        mEditedTransform = scene.Meshes[0].Transform;
 
-    mDevice.freeCommandBuffers(mGraphicsPool, buildCmd);
+    mSceneUploader.Destroy();
+    mSceneUploader.Upload(std::move(scene), settings);
+
+    mTLASHandle = mSceneUploader.GetTLAS();
+    mMaterialBuffer = mSceneUploader.GetMaterialBuffer();
+    mGeometryBuffer = mSceneUploader.GetGeometryBuffer();
+    UpdateDescriptorSet();
 }
 
 void MeshMaterials::CreateRTPipeline()
@@ -260,7 +177,8 @@ void MeshMaterials::CreateRTPipeline()
         vr::DescriptorItem(0, vk::DescriptorType::eAccelerationStructureKHR, vk::ShaderStageFlagBits::eRaygenKHR, 1, &mTLASHandle.Buffer.DevAddress),
         vr::DescriptorItem(1, vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eRaygenKHR, 1, &mUniformBuffer),
         vr::DescriptorItem(2, vk::DescriptorType::eStorageImage, vk::ShaderStageFlagBits::eRaygenKHR, 1, &mOutputImage),
-        vr::DescriptorItem(3, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eClosestHitKHR, 1, &mMaterialBuffer)};
+        vr::DescriptorItem(3, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eClosestHitKHR, 1, &mMaterialBuffer),
+        vr::DescriptorItem(4, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eClosestHitKHR, 1, &mGeometryBuffer)};
 
     mResourceDescriptorLayout = mVRDev->CreateDescriptorSetLayout(mResourceBindings);
 
@@ -305,9 +223,53 @@ void MeshMaterials::UpdateDescriptorSet()
 
 void MeshMaterials::Update(vk::CommandBuffer renderCmd)
 {
+    // two frames after the last slice was recorded every BLAS has been built
+    if (mStreaming && mSlicedBuilder.IsDone() && mFrameCount >= mLastSliceFrame + 2)
+        FinishStreaming();
+
     // begin the command buffer
     renderCmd.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
 
+    // [POI]
+    // Live edits: hold M to change the color of the first material, hold T to move the first mesh up,
+    // only the changed material / transform is copied and only the affected BLAS and the TLAS are rebuilt
+    if (glfwGetKey(mWindow, GLFW_KEY_M) == GLFW_PRESS)
+    {
+        GPUMaterial material = mSceneUploader.GetMaterial(0);
+        float t = static_cast<float>(GetElapsedSeconds());
+        material.BaseColor = glm::vec3(0.5f) + 0.5f * glm::cos(glm::vec3(t, t + 2.0f, t + 4.0f));
+        mSceneUploader.SetMaterial(0, material);
+    }
+    if (glfwGetKey(mWindow, GLFW_KEY_T) == GLFW_PRESS)
+    {
+        mEditedTransform[1].w += 0.01f; // row major, the y translation
+        mSceneUploader.SetMeshTransform(0, mEditedTransform);
+    }
+
+    // [POI]
+    // Hot reload: save the GLB file while the sample runs, the watcher thread loads it and only the meshes whose geometry changed
+    // are uploaded and get new BLASes, the TLAS is rebuilt in place by RecordUpdates(...) like after a live edit
+    Scene reloaded;
+    if (!mStreaming && mAssetWatcher.TakeReloadedScene(reloaded) && !mSceneUploader.Reload(reloaded, renderCmd))
+        ReloadScene(std::move(reloaded));
+
+    if (mSceneUploader.RecordUpdates(renderCmd, mRTRenderCmdIndex))
+        AddASBuildToTraceBarrier(renderCmd);
+
+    if (mStreaming && !mSlicedBuilder.IsDone())
+    {
+        // [POI]
+        // Build the next slice of BLASes and put them into the TLAS right away, the barrier after the slice orders the builds
+        mSlicedBuilder.RecordFrame(renderCmd, mRTRenderCmdIndex, mSliceBuilt);
+        mSceneUploader.SetBLASReady(mSliceBuilt);
+
+        mSceneUploader.BuildTLAS(renderCmd, mRTRenderCmdIndex);
+        AddASBuildToTraceBarrier(renderCmd);
+
+        mLastSliceFrame = mFrameCount;
+        mSliceCount++;
+    }
+
     mVRDev->BindDescriptorBuffer({mResourceDescBuffer}, renderCmd);
 
     mVRDev->BindDescriptorSet(mPipelineLayout, 0, 0, 0, renderCmd);
@@ -340,6 +302,8 @@ void MeshMaterials::Stop()
     auto _ = mDevice.waitForFences(mRenderFence, VK_TRUE, UINT64_MAX);
 
     // destroy all the resources we created
+    mAssetWatcher.Stop();
+
     mVRDev->DestroySBTBuffer(mSBTBuffer);
 
     mDevice.destroyPipeline(mRTPipeline);
@@ -348,23 +312,24 @@ void MeshMaterials::Stop()
     mDevice.destroyDescriptorSetLayout(mResourceDescriptorLayout);
     mVRDev->DestroyBuffer(mResourceDescBuffer.Buffer);
 
-    mVRDev->DestroyBuffer(mVertexBuffer);
-    mVRDev->DestroyBuffer(mIndexBuffer);
-    mVRDev->DestroyBuffer(mTransformBuffer);
-    mVRDev->DestroyBuffer(mMaterialBuffer);
+    if (mStreaming)
+        mSlicedBuilder.Destroy();
 
-    for (auto &blas : mBLASHandles)
-        mVRDev->DestroyBLAS(blas);
-
-    mVRDev->DestroyTLAS(mTLASHandle);
+    mSceneUploader.Destroy();
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    // with a budget in milliseconds the BLASes that aren't cached are built over the first frames, eg. MeshMaterials 2
+    float buildBudgetMs = argc > 1 ? std::max(std::strtof(argv[1], nullptr), 0.0f) : 0.0f;
+
+    // auto, host, staged or direct, where the geometry buffers are placed, see Base/BufferUploader.h
+    BufferPlacement placement = BufferUploader::ParsePlacement(argc > 2 ? argv[2] : nullptr);
+
     // Create the application, start it, run it and stop it, boierplate code, eg initialising vulkan, glfw, etc
     // that is the same for every application is handled by the Application class
     // it can be found in the Base folder
-    Application *app = new MeshMaterials();
+    Application *app = new MeshMaterials(buildBudgetMs, placement);
 
     app->Start();
     app->Run();
@@ -5,13 +5,26 @@
 #include "ShaderCompiler.h"
 #include "MeshLoader.h"
 #include "GPUMaterial.h"
-#include "Helpers.h"
+#include "SceneUploader.h"
+#include "GPUTimer.h"
 
 // This sample isn't much about the c++ code, but more about the shaders
+// Usage: Shading [buffer placement: auto, host, staged or direct = auto], prints the GPU trace time every second
+// to compare how fast the closest hit shaders read the geometry from the different memory
+
+// timestamps written by the GPU timer every frame
+enum TraceTimestamp : uint32_t
+{
+    TraceStart = 0,
+    TraceEnd = 1,
+    TimestampCount = 2
+};
 
 class Shading : public Application
 {
 public:
+    Shading(BufferPlacement placement, SceneInstancing instancing) : mPlacement(placement), mInstancing(instancing) {}
+
     virtual void Start() override;
     virtual void Update(vk::CommandBuffer renderCmd) override;
     virtual void Stop() override;
@@ -28,15 +41,14 @@ public:
 
     ShaderCompiler mShaderCompiler;
 
-    vr::AllocatedBuffer mVertexBuffer;
-    vr::AllocatedBuffer mIndexBuffer;
-    vr::AllocatedBuffer mTransformBuffer;
+    SceneUploader mSceneUploader;
 
     std::vector<vr::DescriptorItem> mResourceBindings;
     vk::DescriptorSetLayout mResourceDescriptorLayout;
     vr::DescriptorBuffer mResourceDescBuffer;
 
-    vr::AllocatedBuffer mMaterialBuffer;
+    vr::AllocatedBuffer mMaterialBuffer; // owned by mSceneUploader
+    vr::AllocatedBuffer mGeometryBuffer; // owned by mSceneUploader
 
     vr::AllocatedImage mAccumulationImageBuffer;
     vr::AccessibleImage mAccumulationImage;
@@ -46,8 +58,15 @@ public:
     vk::Pipeline mRTPipeline = nullptr;
     vk::PipelineLayout mPipelineLayout = nullptr;
 
-    std::vector<vr::BLASHandle> mBLASHandles;
-    vr::TLASHandle mTLASHandle;
+    vr::TLASHandle mTLASHandle; // owned by mSceneUploader
+
+    BufferPlacement mPlacement = BufferPlacement::Auto;
+    SceneInstancing mInstancing = SceneInstancing::PerMesh;
+
+    GPUTimer mGPUTimer;
+    double mTraceMs = 0.0; // accumulated over a second
+    uint32_t mTraceFrames = 0;
+    double mLastReportTime = 0.0;
 };
 
 void Shading::Start()
@@ -60,6 +79,8 @@ void Shading::Start()
 
     CreateRTPipeline();
     UpdateDescriptorSet();
+
+    mGPUTimer.Create(mDevice, mPhysicalDevice, TraceTimestamp::TimestampCount, static_cast<uint32_t>(mRTRenderCmd.size()));
 }
 
 void Shading::CreateAS()
@@ -67,6 +88,7 @@ void Shading::CreateAS()
     mMeshLoader = MeshLoader();
     // Get the scene info from the glb file
     auto scene = mMeshLoader.LoadGLBMesh("Assets/room.glb");
+    mASStats.SceneName = "Assets/room.glb";
 
     // Set the camera position to the center of the scene
     if (scene.Cameras.size() > 0)
@@ -74,148 +96,24 @@ void Shading::CreateAS()
     mCamera.Speed = 1.0f;
     mCamera.Sensitivity = 25000.0f;
 
-    auto &geometries = scene.Geometries;
-
-    uint32_t vertBufferSize = 0;
-    uint32_t idxBufferSize = 0;
-    uint32_t transBufferSize = 0;
-    uint32_t matBufferSize = 0;
-
-    // calculate the size required for the buffers
-    // Helper function defined in Base/Helpers.h
-    // writes to the parameters passed in
-    CalculateBufferSizes(scene, vertBufferSize, idxBufferSize, transBufferSize, matBufferSize);
-
-    // Store all the primitives in a single buffer, it is efficient to do so
-    mVertexBuffer = mVRDev->CreateBuffer(
-        vertBufferSize,
-        vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer,
-        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
-
-    mIndexBuffer = mVRDev->CreateBuffer(
-        idxBufferSize,
-        vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer,
-        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
-    mMaterialBuffer = mVRDev->CreateBuffer(
-        matBufferSize,
-        vk::BufferUsageFlagBits::eStorageBuffer,
-        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
-    // Create a buffer to store the transform for the BLAS
-    mTransformBuffer = mVRDev->CreateBuffer(
-        transBufferSize,
-        vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eStorageBuffer,
-        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
-
-    // Create info struct for the BLAS
-    std::vector<vr::BLASCreateInfo> blasCreateInfos;
-
-    // Store the instanceID for each mesh so that we can use it to index into the material buffer
-    std::vector<uint32_t> instanceIDs;
-
-    // Copy the vertex and index data into the buffers
-    uint32_t vertOffset = 0;
-    uint32_t idxOffset = 0;
-    uint32_t transOffset = 0;
-    uint32_t matOffset = 0;
-
-    Vertex *vertData = (Vertex *)mVRDev->MapBuffer(mVertexBuffer);
-    uint32_t *idxData = (uint32_t *)mVRDev->MapBuffer(mIndexBuffer);
-    char *transData = (char *)mVRDev->MapBuffer(mTransformBuffer);
-    char *matData = (char *)mVRDev->MapBuffer(mMaterialBuffer);
-
+    // [POI]
+    // The buffers, BLASes and the TLAS are created by the scene uploader, see Base/SceneUploader.h
     // If the scene is too dark/bright, you can adjust the emissive multiplier here
-    float EmissiveMultiplier = 100.0f;
-
-    // Helper function defined in Base/Helpers.h to copy the scene data into the buffers
-    CopySceneToBuffers(scene, vertData, idxData, transData, matData,
-                       mVertexBuffer.DevAddress, mIndexBuffer.DevAddress, mTransformBuffer.DevAddress,
-                       instanceIDs, blasCreateInfos, EmissiveMultiplier, vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace);
-
-    mVRDev->UnmapBuffer(mVertexBuffer);
-    mVRDev->UnmapBuffer(mIndexBuffer);
-    mVRDev->UnmapBuffer(mTransformBuffer);
-    mVRDev->UnmapBuffer(mMaterialBuffer);
-
-    // Create the BLASes, one BLAS for each mesh in the scene
-    // create build info for the BLASSes
-    std::vector<vr::BLASBuildInfo> buildInfos;
-
-    mBLASHandles.reserve(blasCreateInfos.size());
-    buildInfos.reserve(blasCreateInfos.size());
-
-    for (auto &info : blasCreateInfos)
-    {
-        auto &blas = mBLASHandles.emplace_back(vr::BLASHandle{});
-        auto &buildInfo = buildInfos.emplace_back(vr::BLASBuildInfo{});
-        std::tie(blas, buildInfo) = mVRDev->CreateBLAS(info);
-    }
-
-    vr::TLASCreateInfo tlasCreateInfo = {};
-    tlasCreateInfo.Flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
-    tlasCreateInfo.MaxInstanceCount = mBLASHandles.size();
-
-    auto [tlasHandle, tlasBuildInfo] = mVRDev->CreateTLAS(tlasCreateInfo);
-
-    mTLASHandle = tlasHandle;
-
-    auto InstanceBuffer = mVRDev->CreateInstanceBuffer(mBLASHandles.size());
-
-    std::vector<vk::AccelerationStructureInstanceKHR> instances;
-
-    // Create as many instances as there are BLASes
-    for (uint32_t i = 0; i < mBLASHandles.size(); i++)
-    {
-        auto inst = vk::AccelerationStructureInstanceKHR()
-                        .setInstanceCustomIndex(instanceIDs[i]) // set the instance ID
-                        .setAccelerationStructureReference(mBLASHandles[i].Buffer.DevAddress)
-                        .setFlags(vk::GeometryInstanceFlagBitsKHR::eTriangleFlipFacing)
-                        .setMask(0xFF)
-                        .setInstanceShaderBindingTableRecordOffset(0);
-
-        // set the transform matrix to identity
-        inst.transform = {
-            1.0f, 0.0f, 0.0f, 0.0f,
-            0.0f, 1.0f, 0.0f, 0.0f,
-            0.0f, 0.0f, 1.0f, 0.0f};
-
-        instances.push_back(inst);
-    }
-
-    mVRDev->UpdateBuffer(InstanceBuffer, instances.data(), sizeof(vk::AccelerationStructureInstanceKHR) * instances.size());
-
-    // create the scratch buffers
-    auto BLASscratchBuffer = mVRDev->CreateScratchBufferFromBuildInfos(buildInfos);
-    auto TLASScratchBuffer = mVRDev->CreateScratchBufferFromBuildInfo(tlasBuildInfo);
-
-    auto buildCmd = mDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo(mGraphicsPool, vk::CommandBufferLevel::ePrimary, 1))[0];
-
-    buildCmd.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
-
-    // build the AS
-
-    mVRDev->BuildBLAS(buildInfos, buildCmd);
-
-    mVRDev->AddAccelerationBuildBarrier(buildCmd);
-
-    mVRDev->BuildTLAS(tlasBuildInfo, InstanceBuffer, instances.size(), buildCmd);
-
-    buildCmd.end();
-
-    // submit the command buffer and wait for it to finish
-    auto submitInfo = vk::SubmitInfo()
-                          .setCommandBufferCount(1)
-                          .setPCommandBuffers(&buildCmd);
-
-    mQueues.GraphicsQueue.submit(submitInfo, nullptr);
-
-    mDevice.waitIdle();
-
-    mVRDev->DestroyBuffer(BLASscratchBuffer);
-    mVRDev->DestroyBuffer(TLASScratchBuffer);
-
-    mVRDev->DestroyBuffer(InstanceBuffer);
-
-    mDevice.freeCommandBuffers(mGraphicsPool, buildCmd);
+    SceneUploadSettings settings = {};
+    settings.Placement = mPlacement;
+    settings.Instancing = mInstancing;
+    settings.EmissiveMultiplier = 100.0f;
+    settings.InstanceFlags = vk::GeometryInstanceFlagBitsKHR::eTriangleFlipFacing;
+    settings.Stats = &mASStats;
+    settings.UseCache = true;
+
+    mSceneUploader.Create(mVRDev, mDevice, mPhysicalDevice, mQueues, mGraphicsPool);
+    mSceneUploader.Upload(std::move(scene), settings);
+
+    // the uploader owns them, these are the handles the descriptors point to
+    mTLASHandle = mSceneUploader.GetTLAS();
+    mMaterialBuffer = mSceneUploader.GetMaterialBuffer();
+    mGeometryBuffer = mSceneUploader.GetGeometryBuffer();
 }
 
 void Shading::CreateAccumulationImage()
@@ -252,8 +150,7 @@ void Shading::CreateRTPipeline()
         vr::DescriptorItem(1, vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eClosestHitKHR, 1, &mUniformBuffer),
         vr::DescriptorItem(2, vk::DescriptorType::eStorageImage, vk::ShaderStageFlagBits::eRaygenKHR, 1, &mOutputImage),
         vr::DescriptorItem(3, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eClosestHitKHR, 1, &mMaterialBuffer),
-        vr::DescriptorItem(4, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eClosestHitKHR, 1, &mVertexBuffer),
-        vr::DescriptorItem(5, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eClosestHitKHR, 1, &mIndexBuffer),
+        vr::DescriptorItem(4, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eClosestHitKHR, 1, &mGeometryBuffer),
         vr::DescriptorItem(6, vk::DescriptorType::eStorageImage, vk::ShaderStageFlagBits::eRaygenKHR, 1, &mAccumulationImage),
     };
 
@@ -300,9 +197,30 @@ void Shading::UpdateDescriptorSet()
 
 void Shading::Update(vk::CommandBuffer renderCmd)
 {
+    uint32_t frameIndex = mRTRenderCmdIndex;
+
     // begin the command buffer
     renderCmd.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
 
+    // the timestamps of this frame index are from two frames ago
+    mGPUTimer.BeginFrame(renderCmd, frameIndex);
+    double traceMs = mGPUTimer.GetMilliseconds(frameIndex, TraceTimestamp::TraceStart, TraceTimestamp::TraceEnd);
+    if (traceMs > 0.0)
+    {
+        mTraceMs += traceMs;
+        mTraceFrames++;
+    }
+
+    double now = glfwGetTime();
+    if (now - mLastReportTime >= 1.0 && mTraceFrames > 0)
+    {
+        std::cout << "trace " << mTraceMs / mTraceFrames << " ms, " << BufferUploader::GetPlacementName(mPlacement) << " buffers, "
+                  << mSceneUploader.GetInstanceCount() << " instances" << std::endl;
+        mTraceMs = 0.0;
+        mTraceFrames = 0;
+        mLastReportTime = now;
+    }
+
     mVRDev->BindDescriptorBuffer({mResourceDescBuffer}, renderCmd);
 
     mVRDev->BindDescriptorSet(mPipelineLayout, 0, 0, 0, renderCmd);
@@ -316,7 +234,9 @@ void Shading::Update(vk::CommandBuffer renderCmd)
 
     renderCmd.bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, mRTPipeline);
 
+    mGPUTimer.WriteTimestamp(renderCmd, frameIndex, TraceTimestamp::TraceStart, vk::PipelineStageFlagBits::eTopOfPipe);
     mVRDev->DispatchRays(mRTPipeline, mSBTBuffer, mRenderWidth, mRenderHeight, 1, renderCmd);
+    mGPUTimer.WriteTimestamp(renderCmd, frameIndex, TraceTimestamp::TraceEnd, vk::PipelineStageFlagBits::eRayTracingShaderKHR);
 
     BlitImage(renderCmd);
 
@@ -334,6 +254,7 @@ void Shading::Stop()
     auto _ = mDevice.waitForFences(mRenderFence, VK_TRUE, UINT64_MAX);
 
     // destroy all the resources we created
+    mGPUTimer.Destroy();
     mVRDev->DestroySBTBuffer(mSBTBuffer);
 
     mDevice.destroyPipeline(mRTPipeline);
@@ -345,23 +266,21 @@ void Shading::Stop()
     mDevice.destroyImageView(mAccumulationImage.View);
     mVRDev->DestroyImage(mAccumulationImageBuffer);
 
-    mVRDev->DestroyBuffer(mVertexBuffer);
-    mVRDev->DestroyBuffer(mIndexBuffer);
-    mVRDev->DestroyBuffer(mTransformBuffer);
-    mVRDev->DestroyBuffer(mMaterialBuffer);
-
-    for (auto &blas : mBLASHandles)
-        mVRDev->DestroyBLAS(blas);
-
-    mVRDev->DestroyTLAS(mTLASHandle);
+    mSceneUploader.Destroy();
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    // auto places the geometry in device local memory, host is how the sample placed it before, to compare the trace time
+    BufferPlacement placement = BufferUploader::ParsePlacement(argc > 1 ? argv[1] : nullptr);
+
+    // grouped merges the small meshes into shared BLASes, compare the trace time and instance count with mesh
+    SceneInstancing instancing = SceneUploader::ParseInstancing(argc > 2 ? argv[2] : nullptr);
+
     // Create the application, start it, run it and stop it, boierplate code, eg initialising vulkan, glfw, etc
     // that is the same for every application is handled by the Application class
     // it can be found in the Base folder
-    Application *app = new Shading();
+    Application *app = new Shading(placement, instancing);
 
     app->Start();
     app->Run();
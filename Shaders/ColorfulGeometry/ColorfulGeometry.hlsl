@@ -13,6 +13,7 @@
 };
 [[vk::binding(2, 0)]] RWTexture2D<float4> image;
 [[vk::binding(3, 0)]] RWStructuredBuffer<GPUMaterial> materials;
+[[vk::binding(4, 0)]] StructuredBuffer<GPUGeometry> geometries;
 
 
 struct Payload
@@ -44,18 +45,19 @@ void rgen()
 [shader("closesthit")]
 void chit(inout Payload p, in BuiltInTriangleIntersectionAttributes attribs)
 {
-	// Get the material index from the geometry index
+	// Get the index of the geometry record from the geometry index
 	// IndexID() is the index that we set when creating the TLAS instance
 	// GeometryIndex() is the index of the geometry in the BLAS
 	// For the Materials Sample the V-shaped geometry is the first geometry in the BLAS
-	// and InstanceID() was set to 0, so the material index is 0 + 0 = 0
+	// and InstanceID() was set to 0, so the geometry record index is 0 + 0 = 0
 	// Visual representation of the Material buffer:
 	
 
 
-	uint matIndex = InstanceID() + GeometryIndex();
+	// the geometry record holds the index of the material, geometries with the same material share it
+	uint geomIndex = InstanceID() + GeometryIndex();
 
-	GPUMaterial mat = materials[matIndex];
+	GPUMaterial mat = materials[geometries[geomIndex].MaterialIndex];
 
   	p.hitValue = mat.BaseColor;
 
@@ -11,6 +11,7 @@ struct Vertex // has to match the layout alignment in c++ code
     float4 Position;
     float4 Normal;
 };
+#define VERTEX_STRIDE 32 // size of Vertex in bytes, the normal is 16 bytes after the position
 
 struct GPUMaterial // has to be aligned to 16 bytes
 {
@@ -18,30 +19,30 @@ struct GPUMaterial // has to be aligned to 16 bytes
     float Metallic;
     float3 Emissive;
     float Roughness;
-    uint VertBufferStart;
-    uint IndexBufferStart;
     MaterialType Type;
     float Padding;
+    float2 Padding2;
 };
 
-float3 GetVertex(in StructuredBuffer<Vertex> vertBuffer,
-    in StructuredBuffer<uint> idxBuffer, 
-    in uint vertBufferStart,
-    in uint indexBufferStart,
-    in uint index)
+struct GPUGeometry // has to match the layout in c++ code
 {
-    uint idx = idxBuffer[indexBufferStart + index];
-	return vertBuffer[vertBufferStart + idx].Position.xyz;
+    uint64_t VertexAddress; // device address of the first vertex of the geometry
+    uint64_t IndexAddress; // device address of the first index of the geometry
+    uint MaterialIndex; // index into the material table
+    uint Padding;
+};
+
+// The vertices and indices are read through their device addresses, the geometry of a scene can be split into several buffers
+float3 GetVertex(in GPUGeometry geom, in uint index)
+{
+    uint idx = vk::RawBufferLoad<uint>(geom.IndexAddress + index * 4);
+	return vk::RawBufferLoad<float4>(geom.VertexAddress + uint64_t(idx) * VERTEX_STRIDE).xyz;
 }
 
-float3 GetNormal(in StructuredBuffer<Vertex> vertBuffer,
-    in StructuredBuffer<uint> idxBuffer, 
-    in uint vertBufferStart,
-    in uint indexBufferStart,
-    in uint index)
+float3 GetNormal(in GPUGeometry geom, in uint index)
 {
-    uint idx = idxBuffer[indexBufferStart + index];
-	return vertBuffer[vertBufferStart + idx].Normal.xyz;
+    uint idx = vk::RawBufferLoad<uint>(geom.IndexAddress + index * 4);
+	return vk::RawBufferLoad<float4>(geom.VertexAddress + uint64_t(idx) * VERTEX_STRIDE + 16).xyz;
 }
 
 float3 InterpolateTriangle(float3 vertexAttribute[3], in float2 barycentrics)
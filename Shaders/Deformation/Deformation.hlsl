@@ -0,0 +1,82 @@
+// Compute shader that deforms vertices with morph targets and linear blend skinning
+// The deformed vertices are written to a buffer that is used as the vertex input of a BLAS build / update
+// All buffers are accessed through their device addresses, so no descriptors are needed
+
+#define VERTEX_STRIDE 32 // sizeof(Vertex) in c++ code, position and normal are padded to float4
+#define SKIN_VERTEX_STRIDE 32 // sizeof(SkinVertex) in c++ code
+#define JOINT_STRIDE 48 // float3x4, row major like VkTransformMatrixKHR
+
+struct PushConstants // has to match the layout in Deformer.cpp
+{
+	uint64_t RestVertices;  // Vertex[VertexCount]
+	uint64_t SkinVertices;  // SkinVertex[VertexCount]
+	uint64_t MorphDeltas;   // Vertex[TargetCount * VertexCount]
+	uint64_t MorphWeights;  // float[TargetCount]
+	uint64_t JointMatrices; // float3x4[JointCount]
+	uint64_t OutVertices;   // Vertex[VertexCount]
+	uint VertexCount;
+	uint TargetCount;
+	uint JointCount;
+	uint Padding;
+};
+
+[[vk::push_constant]] PushConstants pc;
+
+float3x4 LoadJoint(uint joint)
+{
+	uint64_t address = pc.JointMatrices + joint * JOINT_STRIDE;
+	return float3x4(
+		vk::RawBufferLoad<float4>(address),
+		vk::RawBufferLoad<float4>(address + 16),
+		vk::RawBufferLoad<float4>(address + 32));
+}
+
+[numthreads(64, 1, 1)]
+void main(uint3 id : SV_DispatchThreadID)
+{
+	uint v = id.x;
+	if (v >= pc.VertexCount)
+		return;
+
+	uint64_t vertexAddress = uint64_t(v) * VERTEX_STRIDE;
+
+	float3 position = vk::RawBufferLoad<float4>(pc.RestVertices + vertexAddress).xyz;
+	float3 normal = vk::RawBufferLoad<float4>(pc.RestVertices + vertexAddress + 16).xyz;
+
+	// [POI]
+	// Morph targets are defined in the bind pose, so they are applied before skinning
+	for (uint t = 0; t < pc.TargetCount; t++)
+	{
+		float weight = vk::RawBufferLoad<float>(pc.MorphWeights + t * 4);
+		if (weight == 0.0)
+			continue;
+
+		uint64_t deltaAddress = pc.MorphDeltas + uint64_t(t * pc.VertexCount + v) * VERTEX_STRIDE;
+		position += weight * vk::RawBufferLoad<float4>(deltaAddress).xyz;
+		normal += weight * vk::RawBufferLoad<float4>(deltaAddress + 16).xyz;
+	}
+
+	// [POI]
+	// Linear blend skinning, the joint matrices already contain the inverse bind matrices
+	if (pc.JointCount > 0)
+	{
+		uint64_t skinAddress = pc.SkinVertices + uint64_t(v) * SKIN_VERTEX_STRIDE;
+		uint4 joints = vk::RawBufferLoad<uint4>(skinAddress);
+		float4 weights = vk::RawBufferLoad<float4>(skinAddress + 16);
+
+		float3x4 skinMatrix = weights.x * LoadJoint(joints.x) +
+							  weights.y * LoadJoint(joints.y) +
+							  weights.z * LoadJoint(joints.z) +
+							  weights.w * LoadJoint(joints.w);
+
+		position = mul(skinMatrix, float4(position, 1.0));
+		// assumes no non uniform scaling in the joints, otherwise the inverse transpose would be needed
+		normal = mul(skinMatrix, float4(normal, 0.0));
+	}
+
+	if (any(normal))
+		normal = normalize(normal);
+
+	vk::RawBufferStore<float4>(pc.OutVertices + vertexAddress, float4(position, 0.0));
+	vk::RawBufferStore<float4>(pc.OutVertices + vertexAddress + 16, float4(normal, 0.0));
+}
@@ -0,0 +1,126 @@
+// Compute shader that writes the TLAS instances of a frame from compact per instance data
+// The instances are animated and culled here, so the CPU doesn't touch them after the upload
+// All buffers are accessed through their device addresses, so no descriptors are needed
+
+#define SOURCE_STRIDE 32 // sizeof(GPUInstanceSource) in c++ code
+#define BLAS_STRIDE 48 // sizeof(GPUBLASEntry) in c++ code
+#define INSTANCE_STRIDE 64 // sizeof(VkAccelerationStructureInstanceKHR)
+
+struct PushConstants // has to match the layout in InstanceGenerator.cpp
+{
+	uint64_t Sources;      // GPUInstanceSource[InstanceCount]
+	uint64_t BLASes;       // GPUBLASEntry[], address and bounds of every BLAS
+	uint64_t OutInstances; // VkAccelerationStructureInstanceKHR[InstanceCount]
+	uint64_t VisibleCounts; // uint[group count], visible instances of every group
+	uint InstanceCount;
+	float Time;
+	float MaxDistance;
+	float FrustumMargin;
+	float3 CameraPosition;
+	uint FrustumCulling;
+	float4 Planes[4];
+};
+
+[[vk::push_constant]] PushConstants pc;
+
+groupshared uint gsVisibleCount;
+
+// same test as InstanceCuller::IsVisible(...) in c++ code
+bool IsVisible(float3 center, float3 extents)
+{
+	if (pc.MaxDistance > 0.0)
+	{
+		float3 closest = clamp(pc.CameraPosition, center - extents, center + extents);
+		float3 toBox = closest - pc.CameraPosition;
+		if (dot(toBox, toBox) > pc.MaxDistance * pc.MaxDistance)
+			return false;
+	}
+
+	if (pc.FrustumCulling != 0)
+	{
+		for (uint i = 0; i < 4; i++)
+		{
+			float distance = dot(pc.Planes[i].xyz, center) + pc.Planes[i].w;
+			float radius = dot(abs(pc.Planes[i].xyz), extents);
+			if (distance + radius < -pc.FrustumMargin)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+// writes instance i, returns true if it is visible
+bool WriteInstance(uint i)
+{
+	uint64_t sourceAddress = pc.Sources + uint64_t(i) * SOURCE_STRIDE;
+	float4 positionPhase = vk::RawBufferLoad<float4>(sourceAddress);
+	uint4 data = vk::RawBufferLoad<uint4>(sourceAddress + 16); // BLASIndex, CustomIndex, Mask, Flags
+
+	// [POI]
+	// Same animation as the CPU path of the InstanceStress sample, spin around the Y axis and bob up and down
+	float3x4 transform = float3x4(
+		1.0, 0.0, 0.0, positionPhase.x,
+		0.0, 1.0, 0.0, positionPhase.y,
+		0.0, 0.0, 1.0, positionPhase.z);
+
+	if (positionPhase.w >= 0.0)
+	{
+		float s, c;
+		sincos(pc.Time + positionPhase.w, s, c);
+		transform[0].xz = float2(c, s);
+		transform[2].xz = float2(-s, c);
+		transform[1].w += sin(pc.Time * 2.0 + positionPhase.w) * 0.5;
+	}
+
+	uint64_t blasAddress = pc.BLASes + uint64_t(data.x) * BLAS_STRIDE;
+	uint64_t blasReference = vk::RawBufferLoad<uint64_t>(blasAddress);
+
+	if (pc.MaxDistance > 0.0 || pc.FrustumCulling != 0)
+	{
+		float3 blasMin = vk::RawBufferLoad<float4>(blasAddress + 16).xyz;
+		float3 blasMax = vk::RawBufferLoad<float4>(blasAddress + 32).xyz;
+
+		// transform the box by its center and extents, the absolute matrix gives the extents of the transformed box
+		float3 localCenter = (blasMin + blasMax) * 0.5;
+		float3 localExtents = (blasMax - blasMin) * 0.5;
+		float3x3 rotation = (float3x3)transform;
+		float3 center = mul(rotation, localCenter) + float3(transform[0].w, transform[1].w, transform[2].w);
+		float3 extents = mul(abs(rotation), localExtents);
+
+		// [POI]
+		// An instance with a null acceleration structure reference is inactive, the build skips it
+		// so culled instances cost almost nothing without compacting the buffer or reading a count back to the CPU
+		if (!IsVisible(center, extents))
+			blasReference = 0;
+	}
+
+	uint64_t instanceAddress = pc.OutInstances + uint64_t(i) * INSTANCE_STRIDE;
+	vk::RawBufferStore<float4>(instanceAddress, transform[0]);
+	vk::RawBufferStore<float4>(instanceAddress + 16, transform[1]);
+	vk::RawBufferStore<float4>(instanceAddress + 32, transform[2]);
+	// 24 bit custom index and 8 bit mask, 24 bit SBT record offset and 8 bit flags
+	vk::RawBufferStore<uint2>(instanceAddress + 48, uint2((data.y & 0xFFFFFF) | (data.z << 24), data.w << 24));
+	vk::RawBufferStore<uint64_t>(instanceAddress + 56, blasReference);
+
+	return blasReference != 0;
+}
+
+[numthreads(64, 1, 1)]
+void main(uint3 id : SV_DispatchThreadID, uint3 groupID : SV_GroupID, uint localIndex : SV_GroupIndex)
+{
+	if (localIndex == 0)
+		gsVisibleCount = 0;
+	GroupMemoryBarrierWithGroupSync();
+
+	if (id.x < pc.InstanceCount && WriteInstance(id.x))
+	{
+		uint ignored;
+		InterlockedAdd(gsVisibleCount, 1, ignored);
+	}
+	GroupMemoryBarrierWithGroupSync();
+
+	// buffer device addresses don't support atomics, so every group writes its own count and the CPU adds them up
+	if (localIndex == 0)
+		vk::RawBufferStore<uint>(pc.VisibleCounts + groupID.x * 4, gsVisibleCount);
+}
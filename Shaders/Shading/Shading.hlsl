@@ -16,8 +16,7 @@
 };
 [[vk::binding(2, 0)]] RWTexture2D<float4> image;
 [[vk::binding(3, 0)]] StructuredBuffer<GPUMaterial> materials;
-[[vk::binding(4, 0)]] StructuredBuffer<Vertex> VertexBuffer;
-[[vk::binding(5, 0)]] StructuredBuffer<uint> IndexBuffer;
+[[vk::binding(4, 0)]] StructuredBuffer<GPUGeometry> geometries;
 [[vk::binding(6, 0)]] RWTexture2D<float4> accumulationImage;
 
 struct HitInfo
@@ -115,12 +114,14 @@ void rgen()
 void chit(inout Payload p, in BuiltInTriangleIntersectionAttributes attribs)
 {
 
-	GPUMaterial mat = materials[InstanceID() + GeometryIndex()];
+	// the instance ID is the index of the first geometry of the BLAS, the materials are shared by the geometries
+	GPUGeometry geom = geometries[InstanceID() + GeometryIndex()];
+	GPUMaterial mat = materials[geom.MaterialIndex];
 
 	float3 normals[3] = {
-		GetNormal(VertexBuffer, IndexBuffer, mat.VertBufferStart, mat.IndexBufferStart, PrimitiveIndex() * 3 + 0),
-		GetNormal(VertexBuffer, IndexBuffer, mat.VertBufferStart, mat.IndexBufferStart, PrimitiveIndex() * 3 + 1),
-		GetNormal(VertexBuffer, IndexBuffer, mat.VertBufferStart, mat.IndexBufferStart, PrimitiveIndex() * 3 + 2)
+		GetNormal(geom, PrimitiveIndex() * 3 + 0),
+		GetNormal(geom, PrimitiveIndex() * 3 + 1),
+		GetNormal(geom, PrimitiveIndex() * 3 + 2)
 	};
 
 	float3 v = WorldRayDirection();